@@ -6,7 +6,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -21,6 +24,9 @@
 #include "v8config.h"     // NOLINT(build/include_directory)
 #include <JavaScriptCore/JavaScript.h>
 
+//JSScriptRefPrivate.h里的类型，只在能用私有接口的平台上有值
+typedef struct OpaqueJSScript* JSScriptRef;
+
 #define JS_TAG_EXTERNAL (JS_TAG_FLOAT64 + 1)
 
 #define V8_MAJOR_VERSION 8
@@ -43,6 +49,14 @@ class FunctionCallbackInfo;
 class String;
 class TryCatch;
 class Script;
+class Module;
+struct ModuleSourceRecord;
+struct StartupSnapshot;
+class ContextPool;
+struct ContextPoolEntry;
+class ObjectTemplate;
+struct ObjectTemplateClass;
+class ExtensionConfiguration;
 class Message;
 class Value;
 class Primitive;
@@ -66,9 +80,12 @@ public:
 
 class V8_EXPORT V8 {
 public:
+    //之后用默认CreateParams创建的isolate都从这个blob恢复context，blob的内存由调用方保证一直有效
     V8_INLINE static void SetSnapshotDataBlob(StartupData* startup_blob) {
-        //Do nothing
+        snapshot_blob_ = startup_blob;
     }
+    
+    static StartupData* snapshot_blob_;
 
     V8_INLINE static void InitializePlatform(Platform* platform) {
         //Do nothing
@@ -111,14 +128,20 @@ public:
 
 Value* AllocValue_(Isolate * isolate);
 
-void IncRef_(Isolate * isolate, JSValueRef val);
+Value* AllocValue_(Isolate * isolate, JSValueRef val);
 
-void DecRef_(Isolate * isolate, JSValueRef val);
+void IncRef_(Isolate * isolate, Value* val);
 
-void SetGlobal_(Isolate * isolate, Value * des, Value* src);
+void DecRef_(Isolate * isolate, Value* val);
+
+Value* SetGlobal_(Isolate * isolate, Value* src);
+
+void DisposeGlobal_(Isolate * isolate, Value* val);
 
 void * GetUserData_(Isolate * isolate, JSValueRef val);
 
+bool MakeWeak_(Isolate * isolate, Value* val, void* parameter, void* callback);
+
 Value *EscapeValue_(Value* val, EscapableHandleScope* scope);
 
 template <class T>
@@ -185,27 +208,34 @@ public:
     }
     
     V8_INLINE Local<T> Clone(Isolate * isolate) const {
-        T* ret = static_cast<T*>(AllocValue_(isolate));
-        ret->value_ = val_->value_;
+        T* ret = static_cast<T*>(AllocValue_(isolate, val_->value_));
         return Local<T>(ret);
         //return *this;
     }
     
     V8_INLINE void IncRef(Isolate * isolate) {
-        IncRef_(isolate, val_->value_);
+        IncRef_(isolate, val_);
     }
     
     V8_INLINE void * GetUserData(Isolate * isolate) {
         return GetUserData_(isolate, val_->value_);
     }
     
+    V8_INLINE bool MakeWeak(Isolate * isolate, void* parameter, void* callback) {
+        return MakeWeak_(isolate, val_, parameter, callback);
+    }
+    
     V8_INLINE void DecRef(Isolate * isolate) {
-        DecRef_(isolate, val_->value_);
+        DecRef_(isolate, val_);
+    }
+    
+    //把值搬到isolate的global句柄表里，val_此后指向表中的槽位
+    V8_INLINE void SetGlobal(Isolate * isolate) {
+        val_ = static_cast<T*>(SetGlobal_(isolate, val_));
     }
     
-    V8_INLINE void SetGlobal(Isolate * isolate, Value *val) {
-        SetGlobal_(isolate, val, val_);
-        val_ = static_cast<T*>(val);
+    V8_INLINE void DisposeGlobal(Isolate * isolate) {
+        DisposeGlobal_(isolate, val_);
     }
     
     V8_INLINE Local<T> Escape(EscapableHandleScope* scope) {
@@ -220,42 +250,76 @@ public:
     T* val_;
 };
 
+//Context、Script、Template、Message等非js值对象的句柄，对象继承自Data，
+//使用侵入式的引用计数。isolate是单线程的，所以计数不需要原子操作
 template <class T>
 class LocalSharedPtrImpl {
 public:
     template <class S>
-    V8_INLINE LocalSharedPtrImpl(Local<S> that) {
+    V8_INLINE LocalSharedPtrImpl(Local<S> that) : val_(that.val_) {
         static_assert(std::is_base_of<T, S>::value, "type check");
-        val_ = that.val_;
+        Retain();
     }
     
-    V8_INLINE LocalSharedPtrImpl(){}
+    V8_INLINE LocalSharedPtrImpl() : val_(nullptr) {}
     
-    V8_INLINE LocalSharedPtrImpl(const Local<T> &that) {
-        val_ = that.val_;
+    V8_INLINE LocalSharedPtrImpl(const LocalSharedPtrImpl<T> &that) : val_(that.val_) {
+        Retain();
+    }
+    
+    V8_INLINE LocalSharedPtrImpl(const Local<T> &that) : val_(that.val_) {
+        Retain();
     }
 
     explicit V8_INLINE LocalSharedPtrImpl(T* that) :val_(that) {
+        Retain();
     }
-
-    V8_INLINE LocalSharedPtrImpl<T>& operator=(const Local<T>& that) {
+    
+    V8_INLINE ~LocalSharedPtrImpl() {
+        Release();
+    }
+    
+    V8_INLINE LocalSharedPtrImpl<T>& operator=(const LocalSharedPtrImpl<T>& that) {
+        //先加后减，自赋值时也是安全的
+        T* old = val_;
         val_ = that.val_;
+        Retain();
+        if (old) {
+            old->Release_();
+        }
         return *this;
     }
 
+    V8_INLINE LocalSharedPtrImpl<T>& operator=(const Local<T>& that) {
+        return operator=(static_cast<const LocalSharedPtrImpl<T>&>(that));
+    }
+
     V8_INLINE bool IsEmpty() const { return val_ == nullptr; }
 
-    V8_INLINE T* operator->() const { return val_.get(); }
+    V8_INLINE T* operator->() const { return val_; }
 
-    V8_INLINE T* operator*() const { return val_.get(); }
+    V8_INLINE T* operator*() const { return val_; }
     
     template <class S> V8_INLINE static Local<T> Cast(Local<S> that) {
-        Local<T> result;
-        result.val_ = std::dynamic_pointer_cast<T>(that.val_);
-        return result;
+#ifdef V8_ENABLE_CHECKS
+        V8::Check(that.IsEmpty() || dynamic_cast<T*>(*that) != nullptr, "LocalSharedPtrImpl::Cast, type mismatch");
+#endif
+        return Local<T>(static_cast<T*>(*that));
+    }
+    
+    V8_INLINE void Retain() {
+        if (val_) {
+            val_->AddRef_();
+        }
+    }
+    
+    V8_INLINE void Release() {
+        if (val_) {
+            val_->Release_();
+        }
     }
 
-    std::shared_ptr<T> val_;
+    T* val_;
     
     V8_INLINE bool SupportWeak() { return false; }
     
@@ -263,9 +327,13 @@ public:
     
     V8_INLINE void * GetUserData(Isolate * isolate) { return nullptr; }
     
+    V8_INLINE bool MakeWeak(Isolate * isolate, void* parameter, void* callback) { return false; }
+    
     V8_INLINE void DecRef(Isolate * isolate) { }
     
-    V8_INLINE void SetGlobal(Isolate * isolate, Value *val) { }
+    V8_INLINE void SetGlobal(Isolate * isolate) { }
+    
+    V8_INLINE void DisposeGlobal(Isolate * isolate) { }
     
     V8_INLINE static Local<T> New(Isolate* isolate, const PersistentBase<T>& that) {
         return that.Get(isolate);
@@ -296,6 +364,16 @@ public:
     explicit V8_INLINE Local(Script* that) : LocalSharedPtrImpl(that) {}
 };
 
+template <>
+class Local<Module> : public LocalSharedPtrImpl<Module> {
+public:
+    V8_INLINE Local() : LocalSharedPtrImpl(){}
+    
+    V8_INLINE Local(const Local<Module> &that) : LocalSharedPtrImpl(that) { }
+    
+    explicit V8_INLINE Local(Module* that) : LocalSharedPtrImpl(that) {}
+};
+
 template <>
 class Local<Data> : public LocalSharedPtrImpl<Data> {
 public:
@@ -478,16 +556,37 @@ using Handle = Local<T>;
 class V8_EXPORT Data {
 public:
     virtual ~Data() {}
+    
+    V8_INLINE void AddRef_() {
+        ++ref_count_;
+    }
+    
+    V8_INLINE void Release_() {
+        if (--ref_count_ == 0) {
+            delete this;
+        }
+    }
+    
+    int ref_count_ = 0;
     // private:
     //  Data();
 };
 
-typedef void (*WeakCallback)(void* data);
+template <typename T>
+class WeakCallbackInfo;
+
+//弱回调按WeakCallbackInfo<void>保存和调用，WeakCallbackInfo<T>的内存布局和它一致
+typedef void (*WeakCallback)(const WeakCallbackInfo<void>& data);
 
 typedef struct ObjectUserData {
     int32_t len_;
     WeakCallback callback_;
     void* parameter_;
+    Isolate* isolate_;
+    //指向该对象唯一的弱global槽位，对象被回收时由finalizer清空
+    Value* weak_handle_;
+    //创建该对象的template，class上的accessor通过它找到回调
+    ObjectTemplate* template_;
     void* ptrs_[1];
 } ObjectUserData;
 
@@ -575,6 +674,11 @@ public:
     Value() = delete;
 private:
     ValueKind getKind() const;
+    
+    //返回分类码(ValueKind + 1)，detail为false时对象可能只解析到Isolate::kKindAnyObject
+    uint8_t Classify_(bool detail) const;
+    
+    bool IsKind_(ValueKind kind) const;
 };
 
 class V8_EXPORT Object : public Value {
@@ -740,14 +844,82 @@ private:
 
 typedef void (*PromiseRejectCallback)(PromiseRejectMessage message);
 
+class V8_EXPORT GlobalHandleStatistics {
+public:
+    size_t total_slots() { return total_slots_; }
+    size_t used_slots() { return used_slots_; }
+    size_t weak_slots() { return weak_slots_; }
+    size_t created_count() { return created_count_; }
+    size_t disposed_count() { return disposed_count_; }
+    size_t pending_weak_callbacks() { return pending_weak_callbacks_; }
+
+    size_t total_slots_ = 0;
+    size_t used_slots_ = 0;
+    size_t weak_slots_ = 0;
+    size_t created_count_ = 0;
+    size_t disposed_count_ = 0;
+    size_t pending_weak_callbacks_ = 0;
+};
+
+class V8_EXPORT InternTableStatistics {
+public:
+    size_t entries() { return entries_; }
+    size_t capacity() { return capacity_; }
+    size_t hits() { return hits_; }
+    size_t misses() { return misses_; }
+    size_t rejected() { return rejected_; }
+    size_t memory_bytes() { return memory_bytes_; }
+
+    size_t entries_ = 0;
+    size_t capacity_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t rejected_ = 0;
+    size_t memory_bytes_ = 0;
+};
+
+class V8_EXPORT ClassCacheStatistics {
+public:
+    size_t global_classes() { return global_classes_; }
+    size_t external_classes() { return external_classes_; }
+    size_t function_classes() { return function_classes_; }
+    size_t template_classes() { return template_classes_; }
+    size_t created_count() { return created_count_; }
+    size_t hits() { return hits_; }
+
+    size_t global_classes_ = 0;
+    size_t external_classes_ = 0;
+    size_t function_classes_ = 0;
+    size_t template_classes_ = 0;
+    size_t created_count_ = 0;
+    size_t hits_ = 0;
+};
+
+class V8_EXPORT PrototypeStatistics {
+public:
+    size_t prototypes() { return prototypes_; }
+    size_t methods() { return methods_; }
+    size_t properties() { return properties_; }
+    //jsc拿不到堆上对象的实际大小，按每个对象、每个属性的固定值估算，只适合比较共享前后的量级
+    size_t estimated_memory_bytes() { return estimated_memory_bytes_; }
+
+    size_t prototypes_ = 0;
+    size_t methods_ = 0;
+    size_t properties_ = 0;
+    size_t estimated_memory_bytes_ = 0;
+};
+
 class V8_EXPORT Isolate {
 public:
     static Isolate* current_;
     
     struct CreateParams {
         CreateParams()
-            : array_buffer_allocator(nullptr) {}
+            : array_buffer_allocator(nullptr),
+              snapshot_blob(nullptr) {}
         ArrayBuffer::Allocator* array_buffer_allocator;
+        //为空时使用V8::SetSnapshotDataBlob设置的blob
+        StartupData* snapshot_blob;
     };
 
     class V8_EXPORT Scope {
@@ -770,7 +942,9 @@ public:
     };
 
     V8_INLINE static Isolate* New(const CreateParams& params) {
-        return new Isolate();
+        Isolate* isolate = new Isolate();
+        isolate->LoadSnapshot_(params.snapshot_blob ? params.snapshot_blob : V8::snapshot_blob_);
+        return isolate;
     }
     
     V8_INLINE static Isolate* New(void* external_runtime) {
@@ -787,13 +961,25 @@ public:
     
     void LowMemoryNotification();
     
+    enum GarbageCollectionType {
+        kFullGarbageCollection,
+        kMinorGarbageCollection
+    };
+    
+    //同步做一次完整gc，不派发弱回调(由下一个安全点或DispatchWeakCallbacks派发)，只用于测试
+    void RequestGarbageCollectionForTesting(GarbageCollectionType type);
+    
     Local<Value> ThrowException(Local<Value> exception);
     
     void SetPromiseRejectCallback(PromiseRejectCallback callback);
     
-    void handleException();
+    //有TryCatch时交给它，否则打印到std::cerr
+    void handleException(JSValueRef exception);
 
     JSContextGroupRef virtualMachine_ = nullptr;
+
+    //isolate自己持有的context，用于创建handle块的根数组以及字面量，不依赖于用户是否进入了某个Context
+    JSGlobalContextRef isolate_context_ = nullptr;
     
     bool is_external_runtime_;
     
@@ -801,6 +987,10 @@ public:
 
     Local<Context> current_context_;
 
+    //current_context_->context_的裸指针缓存，由Context::Scope维护，没有进入任何Context时指向isolate_context_，
+    //热路径上用它避免拷贝Local<Context>
+    JSContextRef current_js_context_ = nullptr;
+
     Isolate();
     
     Isolate(void* external_runtime);
@@ -808,13 +998,296 @@ public:
     ~Isolate();
     
     TryCatch *currentTryCatch_ = nullptr;
-    
-    std::vector<JSValueRef*> values_;
-    
+
+    //HandleScope的槽位按块分配，块内bump pointer，块地址稳定，Local指针不会失效
+    static const int kHandleBlockBits = 10;
+
+    static const int kHandleBlockSize = 1 << kHandleBlockBits;
+
+    std::vector<JSValueRef*> handle_blocks_;
+
+    //堆上的值分批作为gc根：最近分配的值先暂存在当前HandleScope里(在栈上，由jsc的保守栈扫描负责)，
+    //攒满kHandleRootBatch个后整批做成一个js数组挂到被protect的handle_root_上，每批只有两次api调用
+    static const int kHandleRootBatch = 64;
+
+    JSObjectRef handle_root_ = nullptr;
+
+    //handle_root_里每一批第一个值的分配位置，单调递增，scope退出时从尾部整段释放
+    std::vector<int> handle_root_batches_;
+
+    JSStringRef length_string_ = nullptr;
+
+    JSStringRef prototype_string_ = nullptr;
+
+    JSStringRef constructor_string_ = nullptr;
+
+    JSValueRef* handle_next_ = nullptr;
+
+    JSValueRef* handle_limit_ = nullptr;
+
+    //值分类的缓存，每个handle块一个字节数组，和槽位一一对应，存ValueKind + 1，0表示未解析。
+    //只缓存当前块内的槽位，槽位在Alloc_时清零，所以缓存的生命周期不会超过HandleScope
+    static const uint8_t kKindUnknown = 0;
+
+    //已经确定是对象，但还没有区分Function/Date/Array等
+    static const uint8_t kKindAnyObject = 0xff;
+
+    std::vector<uint8_t*> handle_kind_blocks_;
+
+    uint8_t* handle_kinds_ = nullptr;
+
+    //Global/Persistent句柄表：槽位按块分配地址稳定，空闲槽位串成free list，
+    //所有强引用槽位按index挂在同一个被protect的js数组上
+    struct GlobalSlot {
+        JSValueRef value_;
+        int index_;
+        int next_free_;
+        bool weak_;
+        //弱引用的对象的ObjectUserData。对象被回收后value_变成undefined，但回调还在队列里时这里仍然指向它，
+        //Reset时通过它取消回调
+        ObjectUserData* object_udata_;
+        //被Global持有，不在free list上
+        bool in_use_;
+        //isolate销毁时还没Reset的槽位指向所在块剩下的槽位数，块留到最后一个槽位Reset时再释放
+        int* orphans_;
+    };
+
+    static const int kGlobalBlockBits = 8;
+
+    static const int kGlobalBlockSize = 1 << kGlobalBlockBits;
+
+    std::vector<GlobalSlot*> global_blocks_;
+
+    int global_free_list_ = -1;
+
+    JSObjectRef global_handle_root_ = nullptr;
+
+    size_t global_handle_created_ = 0;
+
+    size_t global_handle_disposed_ = 0;
+
+    size_t global_handle_weak_ = 0;
+
+    Value* NewGlobalHandle(JSValueRef val);
+
+    bool MakeWeakGlobalHandle(Value* handle, void* parameter, WeakCallback callback);
+
+    void RootGlobalHandle(Value* handle);
+
+    void UnrootGlobalHandle(Value* handle);
+
+    void DisposeGlobalHandle(Value* handle);
+
+    //isolate已经销毁之后Reset/析构Global：不访问isolate，只释放槽位
+    static void ReleaseOrphanGlobalHandle(Value* handle);
+
+    void GetGlobalHandleStatistics(GlobalHandleStatistics* stats);
+
+    //属性名的intern表：utf8名字 -> 常驻的JSStringRef以及对应的(被protect的)js字符串值，
+    //开放寻址，装载超过一半时翻倍。同一个isolate里相同名字的JSStringRef指针唯一，可以直接比较。
+    //表项不淘汰(模板等地方直接借用表里的JSStringRef)，kInternalized的字符串到kInternTableLimit后不再入表
+    static const size_t kInternTableLimit = 16 * 1024;
+
+    struct InternEntry {
+        char* key_;
+        uint32_t hash_;
+        uint32_t len_;
+        JSStringRef name_;
+        JSValueRef value_;
+    };
+
+    //js字符串值 -> JSStringRef的反查表，key是kInternalized创建出来的值，Object::Get/Set用它跳过字符串转换
+    struct InternValueEntry {
+        JSValueRef value_;
+        JSStringRef name_;
+        //指向InternEntry::key_，'\0'结尾
+        const char* key_;
+        uint32_t len_;
+    };
+
+    std::vector<InternEntry> intern_entries_;
+
+    std::vector<InternValueEntry> intern_values_;
+
+    size_t intern_count_ = 0;
+
+    size_t intern_key_bytes_ = 0;
+
+    size_t intern_hits_ = 0;
+
+    size_t intern_misses_ = 0;
+
+    size_t intern_rejected_ = 0;
+
+    //表满并且limited时返回nullptr
+    const InternEntry* Intern_(const char* data, size_t len, bool limited);
+
+    void GrowInternTable_();
+
+    //返回的JSStringRef由isolate持有，调用方不需要release
+    V8_INLINE JSStringRef InternString(const char* data, size_t len) {
+        return Intern_(data, len, false)->name_;
+    }
+
+    V8_INLINE JSValueRef InternStringValue(const char* data, size_t len) {
+        return Intern_(data, len, false)->value_;
+    }
+
+    //val不是intern表里的字符串时返回nullptr
+    const InternValueEntry* FindInternedValue(JSValueRef val);
+
+    V8_INLINE JSStringRef GetInternedName(JSValueRef val) {
+        const InternValueEntry* entry = FindInternedValue(val);
+        return entry ? entry->name_ : nullptr;
+    }
+
+    void GetInternTableStatistics(InternTableStatistics* stats);
+
+    //jsc不会通知字符串被回收，直接引用的内存只能活到isolate销毁。所以只有足够大(拷贝代价明显，比如mmap的bundle)
+    //并且总量没超过上限的才不拷贝，其余的拷贝一份后立即释放
+    static const size_t kExternalNoCopyMinBytes = 64 * 1024;
+
+    static const size_t kExternalNoCopyLimitBytes = 64 * 1024 * 1024;
+
+    size_t external_string_bytes_ = 0;
+
+    //返回true时jsc可以直接引用这bytes字节，调用方把它交给isolate持有
+    bool ReserveExternalString_(size_t bytes);
+
+    //jsc直接引用其内存的外部字符串(String::ExternalStringResourceBase*)，isolate销毁时Dispose
+    std::vector<void*> external_string_resources_;
+
+    //jsc直接引用的utf16缓冲区，isolate销毁时free
+    std::vector<JSChar*> external_string_buffers_;
+
+    //ScriptCompiler的代码缓存目录，空表示不落盘
+    std::string code_cache_dir_;
+
+    //本isolate里已经通过语法检查的源码(内容hash)，超过上限时随便淘汰一个，最多是多做一次语法检查
+    static const size_t kValidatedScriptLimit = 4096;
+
+    std::set<uint64_t> validated_scripts_;
+
+    void AddValidatedScript_(uint64_t hash);
+
+    //ScriptCompiler编译好的JSScriptRef，key是(resource name, 源码hash)，同一个isolate里再编译同样的源码时直接复用，
+    //不再解析。超过kCompiledScriptLimit时淘汰最久没用的。只在有JSScriptRef接口的平台上使用
+    struct CompiledScriptEntry {
+        JSScriptRef script_;
+        uint64_t length_;
+        uint64_t last_use_;
+    };
+
+    static const size_t kCompiledScriptLimit = 64;
+
+    std::map<std::pair<std::string, uint64_t>, CompiledScriptEntry> compiled_scripts_;
+
+    uint64_t compiled_script_clock_ = 0;
+
+    //返回的JSScriptRef由缓存持有，调用方要自己retain
+    JSScriptRef FindCompiledScript_(const std::pair<std::string, uint64_t>& key, uint64_t length);
+
+    void AddCompiledScript_(const std::pair<std::string, uint64_t>& key, uint64_t length, JSScriptRef script);
+
+    //编译过的module按(resource name, 源码hash)缓存并持有一个引用，同一个isolate的所有context共用，isolate销毁时释放
+    std::map<std::pair<std::string, uint64_t>, Module*> module_cache_;
+
+    //从磁盘加载的module，规范化的路径 -> module_cache_里的module
+    std::map<std::string, Module*> module_files_;
+
+    //PrefetchModuleGraph在worker线程上准备好、还没有被编译的module
+    std::map<std::string, ModuleSourceRecord*> prefetched_modules_;
+
+    //Context析构时调用，清理按context保存的状态
+    void ContextDisposed_(Context* context);
+
+    //活着的ContextPool个数，有池时编译脚本要检查顶层的let/const/class
+    size_t context_pools_ = 0;
+
+    //从blob解析出的启动快照，所有新建的Context都从它恢复；没有blob或者blob无效时为nullptr
+    StartupSnapshot* snapshot_ = nullptr;
+
+    void LoadSnapshot_(const StartupData* blob);
+
+    //带ObjectUserData的对象都用这个class创建，jsc回收时通过finalize通知到isolate
+    JSClassRef object_class_ = nullptr;
+
+    //所有Context的global共用
+    JSClassRef global_class_ = nullptr;
+
+    //External的包装对象，private data就是指针本身
+    JSClassRef external_class_ = nullptr;
+
+    //FunctionTemplate生成的函数，private data是FunctionTemplate*，调用时直接转到template的callback
+    JSClassRef function_class_ = nullptr;
+
+    //PrototypeTemplate上accessor的getter/setter函数，private data是编译好的表项，由prototype template持有
+    JSClassRef accessor_getter_class_ = nullptr;
+    JSClassRef accessor_setter_class_ = nullptr;
+
+    //创建过函数的FunctionTemplate，函数对象只保存裸指针，由isolate持有引用直到销毁。
+    //函数可能被脚本一直引用，handle全部释放后template也不能提前释放，代价是template只增不减
+    std::vector<FunctionTemplate*> function_templates_;
+
+    //实例class上带accessor的ObjectTemplate，实例只保存裸指针，由isolate持有引用直到销毁
+    std::vector<ObjectTemplate*> accessor_templates_;
+
+    //template生成的class，key是ObjectTemplate(实例的class)或者它的ObjectTemplateClass(global的class)，
+    //template析构或者isolate销毁时释放
+    std::map<const void*, JSClassRef> template_classes_;
+
+    size_t classes_created_ = 0;
+
+    size_t class_cache_hits_ = 0;
+
+    //没有缓存时返回nullptr，命中计入class_cache_hits_
+    JSClassRef FindTemplateClass_(const void* key);
+
+    //没有缓存时用definition创建
+    JSClassRef GetTemplateClass_(const void* key, const JSClassDefinition& definition);
+
+    void ReleaseTemplateClass_(const void* key);
+
+    void GetClassCacheStatistics(ClassCacheStatistics* stats);
+
+    //finalizer运行在gc过程中，不能直接回调embedder，先排队，在安全点批量派发
+    std::vector<ObjectUserData*> pending_weak_callbacks_;
+
+    std::vector<ObjectUserData*> weak_callback_batch_;
+
+    bool dispatching_weak_callbacks_ = false;
+
+    static void FinalizeObject_(JSObjectRef object);
+
+    //ObjectUserData按容量(1、2、4...32个internal field)分档复用，空闲块通过parameter_串成链表，
+    //在finalizer里归还也不需要分配内存
+    static const int kObjectUserDataSizeClasses = 6;
+
+    static const int kObjectUserDataPoolLimit = 4096;
+
+    ObjectUserData* object_udata_pool_[kObjectUserDataSizeClasses] = {};
+
+    int object_udata_pool_size_[kObjectUserDataSizeClasses] = {};
+
+    ObjectUserData* NewObjectUserData(int internal_field_count);
+
+    void FreeObjectUserData(ObjectUserData* object_udata);
+
+    ObjectUserData* GetObjectUserData(JSValueRef val);
+
+    //在HandleScope退出、Context::Scope退出时自动调用，embedder也可以在帧末等时机主动调用
+    V8_INLINE void DispatchWeakCallbacks() {
+        if (V8_UNLIKELY(!pending_weak_callbacks_.empty())) {
+            DispatchWeakCallbacks_();
+        }
+    }
+
+    void DispatchWeakCallbacks_();
+
     JSValueRef literal_values_[kEmptyStringIndex + 1];
-    
+
     int value_alloc_pos_ = 0;
-    
+
     JSValueRef exception_;
     
     HandleScope *currentHandleScope = nullptr;
@@ -835,12 +1308,63 @@ public:
         return static_cast<F*>(Alloc_());
     }
     
-    Value* Alloc_();
-    
+    template<class F> F* Alloc(JSValueRef val) {
+        return static_cast<F*>(Alloc_(val));
+    }
+
+    V8_INLINE Value* Alloc_() {
+        if (V8_UNLIKELY(handle_next_ == handle_limit_)) {
+            NewHandleBlock_();
+        }
+        handle_kinds_[value_alloc_pos_ & (kHandleBlockSize - 1)] = kKindUnknown;
+        ++value_alloc_pos_;
+        *handle_next_ = literal_values_[kUndefinedValueIndex];
+        return reinterpret_cast<Value*>(handle_next_++);
+    }
+
+    //分配并写入值，堆上的值同时交给RootHandle_，保证在HandleScope存活期间不被jsc回收
+    V8_INLINE Value* Alloc_(JSValueRef val) {
+        Value* ret = Alloc_();
+        ret->value_ = val;
+        if (IsHeapValue_(val)) {
+            RootHandle_(value_alloc_pos_ - 1, val);
+        }
+        return ret;
+    }
+
+    V8_INLINE static bool IsHeapValue_(JSValueRef val) {
+#if UINTPTR_MAX == 0xffffffffffffffffull
+        //JSVALUE64下数字、布尔、null、undefined都是立即数（高16位非0或者带OtherTag），只有cell需要根
+        return val != nullptr && (reinterpret_cast<uintptr_t>(val) & 0xffff000000000002ull) == 0;
+#else
+        //JSVALUE32_64下所有JSValueRef都是堆上的JSAPIValueWrapper
+        return val != nullptr;
+#endif
+    }
+
+    V8_INLINE void RootHandle_(int pos, JSValueRef val);
+
+    void RootHandleBatch_(int pos, const JSValueRef* values, int count);
+
+    //val在当前handle块内已分配的范围里时返回它的分类缓存，否则返回nullptr
+    V8_INLINE uint8_t* KindCacheSlot_(const Value* val) {
+        uintptr_t pos = reinterpret_cast<uintptr_t>(val);
+        uintptr_t next = reinterpret_cast<uintptr_t>(handle_next_);
+        uintptr_t base = next - (value_alloc_pos_ & (kHandleBlockSize - 1)) * sizeof(JSValueRef);
+        if (pos < base || pos >= next) {
+            return nullptr;
+        }
+        return handle_kinds_ + (pos - base) / sizeof(JSValueRef);
+    }
+
+    void NewHandleBlock_();
+
     V8_INLINE int GetAllocPos() {
         return value_alloc_pos_;
     }
-    
+
+    void RestoreAllocPos(int pos);
+
     void ForeachAllocValue(int start, int end, std::function<void(JSValueRef*, int)>);
     
     V8_INLINE void Escape(Value* val) {
@@ -878,7 +1402,7 @@ V8_INLINE Local<Boolean> False(Isolate* isolate) {
     return Local<Boolean>(reinterpret_cast<Boolean*>(&isolate->literal_values_[kFalseValueIndex]));
 }
 
-class V8_EXPORT Context : Data {
+class V8_EXPORT Context : public Data {
 public:
     V8_INLINE static Local<Context> New(Isolate* isolate) {
         return Local<Context>(new Context(isolate));
@@ -887,18 +1411,27 @@ public:
     V8_INLINE static Local<Context> New(Isolate* isolate, void* external_context) {
         return Local<Context>(new Context(isolate, external_context));
     }
+    
+    //global_template编译成global的class，绑定在创建时就已经存在，不需要逐个Set。extensions不支持，忽略
+    static Local<Context> New(Isolate* isolate, ExtensionConfiguration* extensions,
+                              Local<ObjectTemplate> global_template);
 
     Local<Object> Global();
 
     V8_INLINE Isolate* GetIsolate() { return isolate_; }
 
+    //FunctionTemplate在这个context里生成的共享prototype，个数是准确的，内存是估算值
+    void GetPrototypeStatistics(PrototypeStatistics* stats);
+
     class Scope {
     public:
         explicit V8_INLINE Scope(Local<Context> context) {
             isolate_ = context->GetIsolate();
             if (*(context) != *(isolate_->current_context_)) {
                 prev_context_ = isolate_->current_context_;
+                prev_js_context_ = isolate_->current_js_context_;
                 isolate_->current_context_ = context;
+                isolate_->current_js_context_ = context->context_;
                 enter_new_ = true;
             } else {
                 enter_new_ = false;
@@ -911,6 +1444,8 @@ public:
 //                    JS_ExecutePendingJob(isolate_->runtime_, &ctx);
 //                }
                 isolate_->current_context_ = prev_context_;
+                isolate_->current_js_context_ = prev_js_context_;
+                isolate_->DispatchWeakCallbacks();
             }
         }
 
@@ -918,8 +1453,23 @@ public:
         bool enter_new_;
         Isolate* isolate_;
         Local<Context> prev_context_;
+        JSContextRef prev_js_context_;
     };
 
+    //SnapshotCreator::AddData保存的数据，每个index在每个context里只能取一次
+    template <class T>
+    V8_INLINE MaybeLocal<T> GetDataFromSnapshotOnce(size_t index) {
+        Value* val = GetDataFromSnapshotOnce_(index);
+        if (val == nullptr) {
+            return MaybeLocal<T>();
+        }
+        return MaybeLocal<T>(Local<T>(static_cast<T*>(val)));
+    }
+    
+    Value* GetDataFromSnapshotOnce_(size_t index);
+    
+    void RestoreSnapshot_();
+
     ~Context();
 
     Isolate* const isolate_;
@@ -931,31 +1481,133 @@ public:
     JSContextGroupRef virtualMachine_ = nullptr;
     
     bool is_external_context_;
+    
+    std::vector<bool> snapshot_data_taken_;
+    
+    //由ContextPool创建时记录安装绑定后的global，用来在Checkin时重置
+    ContextPoolEntry* pool_entry_ = nullptr;
+    
+    //创建global时用的template，持有一个引用
+    ObjectTemplate* global_template_ = nullptr;
+    
+    //global_template_里field的值，按ObjectTemplateClass的下标，第一次访问时才创建，被protect
+    std::vector<JSValueRef> template_values_;
+    
+    enum TemplateValueState : uint8_t {
+        kTemplateValueUnset,
+        kTemplateValueSet,
+        kTemplateValueDeleted
+    };
+    
+    std::vector<uint8_t> template_value_states_;
+    
+    //FunctionTemplate生成的函数用它做原型，这样才有call/apply/bind
+    JSObjectRef function_prototype_ = nullptr;
+    
+    JSObjectRef FunctionPrototype_();
+    
+    //在prototype上定义getter/setter属性的函数，第一次创建带accessor的prototype时取得，被protect
+    JSObjectRef define_accessor_ = nullptr;
+    
+    //FunctionTemplate::GetFunction在这个context里创建的函数，按FunctionTemplate::function_index_索引，被protect，context析构时释放。
+    //只扩到用过的最大下标
+    std::vector<JSValueRef> function_cache_;
 
+    //FunctionTemplate的prototype对象，和function_cache_同样索引，同一个class的实例都以它为原型，被protect
+    std::vector<JSValueRef> prototype_cache_;
+
+    Context(Isolate* isolate, void* external_context, ObjectTemplate* global_template);
+    
     Context(Isolate* isolate, void* external_context);
     
     Context(Isolate* isolate);
 };
 
+//预先创建好并安装了绑定的context，Checkout是O(1)。
+//Checkin时重置的只有global对象自己的属性：删掉新增的(包括不可枚举的)，被删除、改写的绑定和内置对象按原来的值和attributes恢复。
+//Checkout之后没有通过Script::Run、Function::Call、Function::NewInstance、Module::Evaluate、Global()用过的context直接放回，是O(1)；
+//用过的调用一次重置函数，和global的属性个数成正比。执行过顶层let/const/class的脚本时global的词法作用域清不掉，
+//这个context被丢弃，换一个新建的放回池里。
+//不会重置的：内置对象内部的修改(比如Array.prototype上新增的方法)、FunctionTemplate/ObjectTemplate在这个context里
+//缓存的函数和prototype上的修改、eval里的顶层声明。池要在isolate之前销毁
+class V8_EXPORT ContextPool {
+public:
+    //每个新建的context调用一次，用来安装绑定，调用时已经进入这个context
+    typedef void (*InitializeCallback)(Local<Context> context, void* data);
+    
+    ContextPool(Isolate* isolate, size_t size, InitializeCallback initialize = nullptr, void* data = nullptr);
+    
+    ~ContextPool();
+    
+    //池空时新建一个
+    Local<Context> Checkout();
+    
+    //池已满时不再保留，context随最后一个引用释放
+    void Checkin(Local<Context> context);
+    
+    V8_INLINE size_t IdleCount() const {
+        return idle_.size();
+    }
+    
+    // Disallow copying and assigning.
+    ContextPool(const ContextPool&) = delete;
+    void operator=(const ContextPool&) = delete;
+    
+    Context* NewContext_();
+    
+    //重置不了时返回false
+    bool ResetContext_(Context* context);
+    
+    Isolate* const isolate_;
+    
+    size_t size_;
+    
+    InitializeCallback initialize_;
+    
+    void* data_;
+    
+    //空闲的context，各持有一个引用
+    std::vector<Context*> idle_;
+    
+    //所有还活着的context的记录，包括已经Checkout的
+    std::vector<ContextPoolEntry*> entries_;
+};
+
 V8_INLINE Value* AllocValue_(Isolate * isolate) {
     return isolate->Alloc_();
 }
 
-V8_INLINE void IncRef_(Isolate * isolate, JSValueRef val) {
-//    JS_DupValueRT(isolate->runtime_, val);
+V8_INLINE Value* AllocValue_(Isolate * isolate, JSValueRef val) {
+    return isolate->Alloc_(val);
 }
 
-V8_INLINE void DecRef_(Isolate * isolate, JSValueRef val) {
-//    JS_FreeValueRT(isolate->runtime_, val);
+V8_INLINE void IncRef_(Isolate * isolate, Value* val) {
+    isolate->RootGlobalHandle(val);
 }
 
+V8_INLINE void DecRef_(Isolate * isolate, Value* val) {
+    isolate->UnrootGlobalHandle(val);
+}
 
-V8_INLINE void SetGlobal_(Isolate * isolate, Value * des, Value* src) {
-    des->value_ = src ->value_;
+V8_INLINE Value* SetGlobal_(Isolate * isolate, Value* src) {
+    return isolate->NewGlobalHandle(src->value_);
+}
+
+V8_INLINE void DisposeGlobal_(Isolate * isolate, Value* val) {
+    //先看槽位：isolate销毁后isolate指针已经悬空
+    if (V8_UNLIKELY(reinterpret_cast<Isolate::GlobalSlot*>(val)->orphans_ != nullptr)) {
+        Isolate::ReleaseOrphanGlobalHandle(val);
+        return;
+    }
+    isolate->DisposeGlobalHandle(val);
 }
 
 V8_INLINE void * GetUserData_(Isolate * isolate, JSValueRef val) {
-//    return JS_GetOpaque(val, isolate->class_id_);
+    return isolate->GetObjectUserData(val);
+}
+
+V8_INLINE bool MakeWeak_(Isolate * isolate, Value* val, void* parameter, void* callback) {
+    return isolate->MakeWeakGlobalHandle(val, parameter, reinterpret_cast<WeakCallback>(callback));
 }
 
 template <typename T>
@@ -963,16 +1615,16 @@ class WeakCallbackInfo {
 public:
     typedef void (*Callback)(const WeakCallbackInfo<T>& data);
     
-    V8_INLINE Isolate* GetIsolate() const { return Isolate::current_;}
+    V8_INLINE Isolate* GetIsolate() const { return object_udata_->isolate_; }
     
-    V8_INLINE T* GetParameter() const { return reinterpret_cast<T*>(object_udata_.parameter_); }
+    V8_INLINE T* GetParameter() const { return reinterpret_cast<T*>(object_udata_->parameter_); }
     
     V8_INLINE void* GetInternalField(int index) const {
-        V8::Check(index >= 0 && index < object_udata_.len_, "InternalField out of range!");
-        return object_udata_.ptrs_[index];
+        V8::Check(index >= 0 && index < object_udata_->len_, "InternalField out of range!");
+        return object_udata_->ptrs_[index];
     }
     
-    ObjectUserData object_udata_;
+    ObjectUserData* object_udata_;
 };
 
 enum class WeakCallbackType { kParameter, kInternalFields, kFinalizer };
@@ -984,19 +1636,14 @@ public:
                            typename WeakCallbackInfo<P>::Callback callback,
                            WeakCallbackType type) {
         if (!weak_ && val_.SupportWeak()) {
-            weak_ = true;
-            ObjectUserData* object_udata = reinterpret_cast<ObjectUserData*>(val_.GetUserData(isolate_));
-            if (object_udata) {
-                object_udata->callback_ = reinterpret_cast<WeakCallback>(callback);
-                object_udata->parameter_ = parameter;
-            }
-            val_.DecRef(isolate_);
+            //只有带ObjectUserData的对象能收到回收通知，其他对象继续保持强引用，避免槽位悬空
+            weak_ = val_.MakeWeak(isolate_, parameter, reinterpret_cast<void*>(callback));
         }
     }
     
     V8_INLINE void Reset() {
-        if (!weak_ && val_.SupportWeak()) {
-            val_.DecRef(isolate_);
+        if (!val_.IsEmpty()) {
+            val_.DisposeGlobal(isolate_);
         }
         isolate_ = nullptr;
         val_ = Local<T>();
@@ -1009,9 +1656,9 @@ public:
         Reset();
         isolate_ = isolate;
         val_ = other;
-        val_.SetGlobal(isolate, reinterpret_cast<Value*>(&store_));
-        if (!val_.IsEmpty() && val_.SupportWeak()) {
-            val_.IncRef(isolate_);
+        if (!val_.IsEmpty()) {
+            //新分配的槽位默认就是强引用
+            val_.SetGlobal(isolate);
         }
         weak_ = false;
     }
@@ -1019,12 +1666,9 @@ public:
     Isolate* isolate_ = nullptr;
     Local<T> val_;
     bool weak_ = false;
-    JSValueRef store_;
     
     V8_INLINE Local<T> Get(Isolate* isolate) const {
-        Local<T> ret = val_.Clone(isolate);
-        ret.IncRef(isolate);
-        return ret;
+        return val_.Clone(isolate);
     }
     
     V8_INLINE bool IsEmpty() const {
@@ -1048,14 +1692,13 @@ public:
     }
     
     V8_INLINE Global(Global&& other) {
-        if (!other.IsEmpty()) {
-            this->isolate_ = other.isolate_;
-            this->val_ = other.val_;
-            this->weak_ = other.weak_;
-            this->val_.SetGlobal(this->isolate_, reinterpret_cast<Value*>(&this->store_));
-        }
+        //槽位地址是稳定的，直接转移所有权
+        this->isolate_ = other.isolate_;
+        this->val_ = other.val_;
+        this->weak_ = other.weak_;
         
-        other.weak_ = true;
+        other.val_ = Local<T>();
+        other.weak_ = false;
         other.isolate_ = nullptr;
     }
     
@@ -1068,9 +1711,9 @@ public:
               this->isolate_ = rhs.isolate_;
               this->val_ = rhs.val_;
               this->weak_ = rhs.weak_;
-              this->val_.SetGlobal(this->isolate_, reinterpret_cast<Value*>(&(this->store_)));
               
-              rhs.weak_ = true;
+              rhs.val_ = Local<S>();
+              rhs.weak_ = false;
               rhs.isolate_ = nullptr;
           }
         }
@@ -1196,6 +1839,52 @@ public:
     static V8_WARN_UNUSED_RESULT MaybeLocal<String> NewFromUtf8(
         Isolate* isolate, const char* data, NewStringType type = NewStringType::kNormal, int length = -1);
 
+    class V8_EXPORT ExternalStringResourceBase {
+    public:
+        virtual ~ExternalStringResourceBase() {}
+        
+        virtual bool IsCacheable() const { return true; }
+        
+        // Disallow copying and assigning.
+        ExternalStringResourceBase(const ExternalStringResourceBase&) = delete;
+        void operator=(const ExternalStringResourceBase&) = delete;
+        
+    protected:
+        ExternalStringResourceBase() {}
+        
+        //one byte的resource在展开成utf16之后立即Dispose。jsc不会通知字符串被回收，
+        //two byte的resource只有很大时才被jsc直接引用、在isolate销毁时Dispose，一般拷贝之后立即Dispose
+        virtual void Dispose() { delete this; }
+        
+        friend class String;
+        friend class Isolate;
+    };
+    
+    class V8_EXPORT ExternalStringResource : public ExternalStringResourceBase {
+    public:
+        virtual ~ExternalStringResource() {}
+        
+        virtual const uint16_t* data() const = 0;
+        
+        virtual size_t length() const = 0;
+    };
+    
+    class V8_EXPORT ExternalOneByteStringResource : public ExternalStringResourceBase {
+    public:
+        virtual ~ExternalOneByteStringResource() {}
+        
+        //latin1
+        virtual const char* data() const = 0;
+        
+        virtual size_t length() const = 0;
+    };
+    
+    static V8_WARN_UNUSED_RESULT MaybeLocal<String> NewExternalTwoByte(
+        Isolate* isolate, ExternalStringResource* resource);
+    
+    static V8_WARN_UNUSED_RESULT MaybeLocal<String> NewExternalOneByte(
+        Isolate* isolate, ExternalOneByteStringResource* resource);
+
 
     class V8_EXPORT Utf8Value {
     public:
@@ -1203,18 +1892,24 @@ public:
         
         ~Utf8Value();
         
-        //char* operator*() { return data_; }
-        const char* operator*() const { return data_.data(); }
-        int length() const { return len_; }
+        char* operator*() { return data_; }
+        const char* operator*() const { return data_; }
+        int length() const { return (int)len_; }
 
         // Disallow copying and assigning.
         Utf8Value(const Utf8Value&) = delete;
         void operator=(const Utf8Value&) = delete;
         
     private:
-        std::string data_;
-        size_t len_;
-        JSContextRef context_ = nullptr;
+        //属性名、日志tag之类的短字符串直接放在栈上，超过的才分配
+        static const size_t kInlineBufferSize = 64;
+        
+        char* Reserve(size_t len);
+        
+        //转换失败时为nullptr
+        char* data_ = nullptr;
+        size_t len_ = 0;
+        char inline_buffer_[kInlineBufferSize];
     };
 
 private:
@@ -1261,7 +1956,8 @@ public:
                              Local<FunctionTemplate> setter = Local<FunctionTemplate>(),
                              PropertyAttribute attribute = None);
     
-    std::map<std::string, Local<Data>> fields_;
+    //key都是isolate intern表里的JSStringRef，按注册顺序保存
+    std::vector<std::pair<JSStringRef, Local<Data>>> fields_;
     
     class AccessorPropertyInfo {
     public:
@@ -1270,7 +1966,7 @@ public:
         PropertyAttribute attribute_;
     };
     
-    std::map<std::string, AccessorPropertyInfo> accessor_property_infos_;
+    std::vector<std::pair<JSStringRef, AccessorPropertyInfo>> accessor_property_infos_;
     
     void InitPropertys(Local<Context> context, JSValueRef obj);
 };
@@ -1290,6 +1986,9 @@ typedef void (*AccessorNameSetterCallback)(Local<Name> property, Local<Value> va
 
 class V8_EXPORT ObjectTemplate : public Template {
 public:
+    static Local<ObjectTemplate> New(Isolate* isolate,
+                                     Local<FunctionTemplate> constructor = Local<FunctionTemplate>());
+    
     void SetInternalFieldCount(int value);
     
     int internal_field_count_ = 0;
@@ -1299,8 +1998,6 @@ public:
                      Local<Value> data = Local<Value>(), AccessControl settings = DEFAULT,
                      PropertyAttribute attribute = None);
     
-    void InitAccessors(Local<Context> context, JSValueRef obj);
-    
     struct AccessorInfo {
         AccessorNameGetterCallback getter_;
         AccessorNameSetterCallback setter_;
@@ -1309,7 +2006,38 @@ public:
         PropertyAttribute attribute_;
     };
     
-    std::map<std::string, AccessorInfo> accessor_infos_;
+    std::vector<std::pair<JSStringRef, AccessorInfo>> accessor_infos_;
+    
+    V8_WARN_UNUSED_RESULT MaybeLocal<Object> NewInstance(Local<Context> context);
+    
+    Isolate* isolate_ = nullptr;
+    
+    //fields_和accessor_infos_编译成的静态属性表，第一次用作global template时生成，之后template不应再修改
+    ObjectTemplateClass* class_info_ = nullptr;
+    
+    JSClassRef GlobalClass_(Isolate* isolate);
+    
+    //实例对象的class，父class是Isolate::object_class_，缓存在isolate上。
+    //accessor_infos_和accessor_property_infos_编译进这个class的静态属性表，所有实例共用。
+    //constructor_通过Inherit有父类时，父类实例template的accessor、field和internal field数也合并进来
+    JSClassRef instance_class_ = nullptr;
+    
+    JSClassRef InstanceClass_(Isolate* isolate);
+    
+    //实例的原型取自这个FunctionTemplate生成的函数，不持有引用(FunctionTemplate持有instance template)
+    FunctionTemplate* constructor_ = nullptr;
+    
+    //ObjectTemplate::New传入的constructor，由这个template持有
+    Local<FunctionTemplate> constructor_template_;
+    
+    //proto为nullptr时使用constructor_的prototype
+    JSObjectRef NewInstance_(Context* context, JSObjectRef proto);
+    
+    //作为PrototypeTemplate时创建context里的prototype对象：accessor定义成prototype自己的getter/setter属性，
+    //通过实例访问时this是实例，从实例上赋值也会调到setter
+    JSObjectRef NewPrototype_(Context* context, JSObjectRef parent);
+    
+    ~ObjectTemplate();
 };
 
 typedef void (*FunctionCallback)(const FunctionCallbackInfo<Value>& info);
@@ -1344,13 +2072,19 @@ public:
     
     CFunctionData cfunction_data_;
     
-    Isolate* isolate_;
+    Isolate* isolate_ = nullptr;
+    
+    bool retained_by_isolate_ = false;
+    
+    //在Isolate::function_templates_里的下标，同时也是Context::function_cache_的下标，第一次GetFunction时分配
+    size_t function_index_ = 0;
     
     Local<ObjectTemplate> instance_template_;
     Local<ObjectTemplate> prototype_template_;
     Local<FunctionTemplate> parent_;
     
-    std::map<Context*, JSValueRef> context_to_funtion_;
+    //context里这个template的prototype对象：PrototypeTemplate的实例，原型链接到parent_的prototype
+    JSObjectRef PrototypeObject_(Context* context);
     
     ~FunctionTemplate();
 };
@@ -1432,7 +2166,7 @@ public:
     int argc_;
     JSValueRef *argv_;
     JSValueRef value_;
-    JSContextRef* context_;
+    JSContextRef context_;
     JSValueRef this_;
     Isolate * isolate_;
     JSValueRef data_;
@@ -1466,7 +2200,7 @@ public:
     }
     
     Isolate * isolate_;
-    JSContextRef* context_;
+    JSContextRef context_;
     JSValueRef data_;
     JSValueRef value_;
     JSValueRef this_;
@@ -1512,6 +2246,11 @@ public:
     Isolate* isolate_;
     HandleScope* prev_scope_;
     
+    //还没有挂到isolate根上的堆值，第一个的分配位置是root_pending_pos_
+    JSValueRef root_pending_[Isolate::kHandleRootBatch];
+    int root_pending_count_ = 0;
+    int root_pending_pos_ = 0;
+    
     std::set<JSValueRef*> escapes_;
     
     JSValueRef scope_value_;
@@ -1535,13 +2274,29 @@ public:
     }
 };
 
+V8_INLINE void Isolate::RootHandle_(int pos, JSValueRef val) {
+    HandleScope* scope = currentHandleScope;
+    if (V8_UNLIKELY(scope == nullptr)) {
+        RootHandleBatch_(pos, &val, 1);
+        return;
+    }
+    if (scope->root_pending_count_ == 0) {
+        scope->root_pending_pos_ = pos;
+    }
+    scope->root_pending_[scope->root_pending_count_++] = val;
+    if (V8_UNLIKELY(scope->root_pending_count_ == kHandleRootBatch)) {
+        RootHandleBatch_(scope->root_pending_pos_, scope->root_pending_, kHandleRootBatch);
+        scope->root_pending_count_ = 0;
+    }
+}
+
 V8_INLINE Value *EscapeValue_(Value* val, EscapableHandleScope* scope) {
     scope->Escape_(reinterpret_cast<JSValueRef*>(val));
     scope->prev_scope_->scope_value_ = val->value_;
     return reinterpret_cast<Value*>(&scope->prev_scope_->scope_value_);
 }
 
-class V8_EXPORT Script : Data {
+class V8_EXPORT Script : public Data {
 public:
     static V8_WARN_UNUSED_RESULT MaybeLocal<Script> Compile(
         Local<Context> context, Local<String> source,
@@ -1550,18 +2305,345 @@ public:
     V8_WARN_UNUSED_RESULT MaybeLocal<Value> Run(Local<Context> context);
     
     ~Script();
+    
+    //接管source和resource_name的引用，check_syntax为false时认为已经验证过。
+    //compiled不为空时直接复用这个JSScriptRef，不再解析
+    static MaybeLocal<Script> Compile_(Local<Context> context, JSStringRef source,
+                                       JSStringRef resource_name, bool check_syntax,
+                                       JSScriptRef compiled = nullptr);
+    
+    //返回的JSStringRef由调用方release
+    static JSStringRef GetSourceString_(Local<Context> context, Local<String> source);
+    
+    static JSStringRef GetResourceName_(Local<Context> context, const ScriptOrigin* origin);
 private:
-    Local<String> source_;
-    MaybeLocal<String> resource_name_;
+    //Compile时取出并持有源码和文件名的JSStringRef，语法检查也在Compile里做完，Run只剩执行。
+    //有JSScriptRef接口时Compile解析一次得到script_，之后不再需要source_
+    JSStringRef source_ = nullptr;
+    JSStringRef resource_name_ = nullptr;
+    JSScriptRef script_ = nullptr;
+    //有顶层的let/const/class，在ContextPool的context里执行过之后这个context就不能重置
+    bool top_level_lexical_ = true;
+
+    friend class ScriptCompiler;
 };
 
-class V8_EXPORT Message : Data {
+//jsc的C API没有module loader，module的源码被改写成一个generator函数：模块体里对import名字的每次引用
+//都改写成读取依赖namespace上的属性，export变成namespace上的getter，两边都是live binding。实例化时执行到yield，定义好所有导出，求值时执行模块体。
+//改写和语法检查的结果和context无关，同一个isolate里的多个context共用一个Module，各自有一份实例。
+//不支持顶层await和动态import()
+class V8_EXPORT Module : public Data {
+public:
+    enum Status {
+        kUninstantiated,
+        kInstantiating,
+        kInstantiated,
+        kEvaluating,
+        kEvaluated,
+        kErrored
+    };
+    
+    typedef MaybeLocal<Module> (*ResolveCallback)(Local<Context> context, Local<String> specifier,
+                                                 Local<Module> referrer);
+    
+    //GetStatus、GetModuleNamespace、GetException针对isolate当前的context
+    Status GetStatus() const;
+    
+    int GetModuleRequestsLength() const;
+    
+    Local<String> GetModuleRequest(int i) const;
+    
+    int GetIdentityHash() const;
+    
+    //依赖的解析结果记在这个context的实例上，同一个context里callback对每个(referrer, specifier)只调用一次
+    V8_WARN_UNUSED_RESULT Maybe<bool> InstantiateModule(Local<Context> context, ResolveCallback callback);
+    
+    V8_WARN_UNUSED_RESULT MaybeLocal<Value> Evaluate(Local<Context> context);
+    
+    Local<Value> GetModuleNamespace();
+    
+    Local<Value> GetException() const;
+    
+    explicit Module(Isolate* isolate) : isolate_(isolate) {}
+    
+    ~Module();
+    
+    struct Instance {
+        Status status_ = kUninstantiated;
+        //导出都是这个对象上的getter
+        JSObjectRef namespace_ = nullptr;
+        //实例化后停在yield处的generator，求值后释放
+        JSObjectRef generator_ = nullptr;
+        JSValueRef exception_ = nullptr;
+        //requests_[i]在这个context里解析出的module，由isolate的module_cache_持有
+        std::vector<Module*> resolved_;
+    };
+    
+    V8_INLINE Instance* FindInstance_(Context* context) const {
+        auto it = instances_.find(context);
+        return it == instances_.end() ? nullptr : const_cast<Instance*>(&it->second);
+    }
+    
+    void DisposeInstance_(Context* context);
+    
+    bool Resolve_(Local<Context> context, ResolveCallback callback, std::vector<Module*>* order);
+    
+    bool Link_(Local<Context> context);
+    
+    bool Evaluate_(Local<Context> context);
+    
+    void SetError_(Instance* instance, JSContextRef ctx, JSValueRef exception);
+    
+    Isolate* isolate_;
+    
+    std::string url_;
+    
+    //改写后的源码，求值得到generator函数
+    JSStringRef wrapper_source_ = nullptr;
+    
+    JSStringRef resource_name_ = nullptr;
+    
+    std::vector<std::string> requests_;
+    
+    std::map<Context*, Instance> instances_;
+};
+
+class V8_EXPORT ScriptCompiler {
+public:
+    //jsc的C API不提供字节码缓存，CachedData和磁盘缓存里只记录源码的内容hash，
+    //表示这份源码已经通过了语法检查，consume命中时跳过JSCheckScriptSyntax。
+    //同一个isolate里重复编译的源码由isolate缓存的JSScriptRef直接复用(见Isolate::compiled_scripts_)
+    struct CachedData {
+        enum BufferPolicy {
+            BufferNotOwned,
+            BufferOwned
+        };
+        
+        CachedData()
+            : data(nullptr),
+              length(0),
+              rejected(false),
+              buffer_policy(BufferNotOwned) {}
+        
+        CachedData(const uint8_t* data, int length,
+                   BufferPolicy buffer_policy = BufferNotOwned)
+            : data(data),
+              length(length),
+              rejected(false),
+              buffer_policy(buffer_policy) {}
+        
+        ~CachedData() {
+            if (buffer_policy == BufferOwned) {
+                delete[] data;
+            }
+        }
+        
+        const uint8_t* data;
+        int length;
+        bool rejected;
+        BufferPolicy buffer_policy;
+        
+        // Prevent copying.
+        CachedData(const CachedData&) = delete;
+        CachedData& operator=(const CachedData&) = delete;
+    };
+    
+    class Source {
+    public:
+        V8_INLINE Source(Local<String> source_string, const ScriptOrigin& origin,
+                         CachedData* cached_data = nullptr)
+            : source_string(source_string),
+              resource_name(origin.ResourceName()),
+              cached_data(cached_data) {}
+        
+        V8_INLINE explicit Source(Local<String> source_string,
+                                  CachedData* cached_data = nullptr)
+            : source_string(source_string),
+              cached_data(cached_data) {}
+        
+        V8_INLINE ~Source() {
+            delete cached_data;
+        }
+        
+        V8_INLINE const CachedData* GetCachedData() const {
+            return cached_data;
+        }
+        
+        // Prevent copying.
+        Source(const Source&) = delete;
+        Source& operator=(const Source&) = delete;
+        
+        Local<String> source_string;
+        Local<Value> resource_name;
+        
+        //kConsumeCodeCache时由调用方传入，kProduceCodeCache时由Compile填入，Source析构时释放
+        CachedData* cached_data;
+    };
+    
+    enum CompileOptions {
+        kNoCompileOptions = 0,
+        kProduceCodeCache,
+        kConsumeCodeCache,
+        kEagerCompile
+    };
+    
+    class V8_EXPORT ExternalSourceStream {
+    public:
+        virtual ~ExternalSourceStream() {}
+        
+        //返回0表示数据已经读完，*src用new[]分配，所有权交给调用方
+        virtual size_t GetMoreData(const uint8_t** src) = 0;
+    };
+    
+    class V8_EXPORT StreamedSource {
+    public:
+        enum Encoding { ONE_BYTE, TWO_BYTE, UTF8, WINDOWS_1252 };
+        
+        StreamedSource(std::unique_ptr<ExternalSourceStream> source_stream, Encoding encoding)
+            : source_stream_(std::move(source_stream)), encoding_(encoding) {}
+        
+        ~StreamedSource() {
+            free(chars_);
+        }
+        
+        // Prevent copying.
+        StreamedSource(const StreamedSource&) = delete;
+        StreamedSource& operator=(const StreamedSource&) = delete;
+        
+        std::unique_ptr<ExternalSourceStream> source_stream_;
+        Encoding encoding_;
+        
+        enum State { kNotStarted, kRunning, kDone };
+        
+        //只有把state_从kNotStarted改成kRunning的线程执行task，Compile等到kDone之后才读下面的结果
+        std::atomic<int> state_{kNotStarted};
+        std::mutex mutex_;
+        std::condition_variable done_;
+        
+        //以下由ScriptStreamingTask::Run在后台线程填入，Compile在isolate线程读取
+        JSChar* chars_ = nullptr;
+        size_t length_ = 0;
+        size_t capacity_ = 0;
+        uint64_t hash_ = 0;
+        bool syntax_ok_ = false;
+        
+        //语法错误的信息，在Compile时转成isolate里的SyntaxError
+        std::string error_message_;
+        int error_line_ = -1;
+        int error_column_ = -1;
+    };
+    
+    //Run可以在任意线程执行：解码、算hash、查缓存，未命中时在独立的vm里做语法检查
+    class V8_EXPORT ScriptStreamingTask {
+    public:
+        ScriptStreamingTask(StreamedSource* source, const std::string& code_cache_dir)
+            : source_(source), code_cache_dir_(code_cache_dir) {}
+        
+        void Run();
+        
+        StreamedSource* source_;
+        
+        //拷贝一份，后台线程不读isolate上的状态
+        std::string code_cache_dir_;
+    };
+    
+    static V8_WARN_UNUSED_RESULT MaybeLocal<Script> Compile(
+        Local<Context> context, Source* source,
+        CompileOptions options = kNoCompileOptions);
+    
+    //返回的task由调用方持有并负责delete
+    static ScriptStreamingTask* StartStreaming(Isolate* isolate, StreamedSource* source);
+    
+    //task没有开始时在这里同步执行，正在别的线程执行时等它完成。full_source_string可以为空，源码以解码结果为准
+    static V8_WARN_UNUSED_RESULT MaybeLocal<Script> Compile(
+        Local<Context> context, StreamedSource* source,
+        Local<String> full_source_string, const ScriptOrigin& origin);
+    
+    //设置后Compile会按源码内容hash在该目录下读写缓存文件，传nullptr关闭
+    static void SetCodeCacheDirectory(Isolate* isolate, const char* directory);
+    
+    //相同resource name和内容的module只编译一次。CompileOptions对module不起作用，语法检查的结果走SetCodeCacheDirectory的磁盘缓存
+    static V8_WARN_UNUSED_RESULT MaybeLocal<Module> CompileModule(
+        Isolate* isolate, Source* source,
+        CompileOptions options = kNoCompileOptions);
+    
+    //按路径加载module(utf8)，优先使用PrefetchModuleGraph的结果
+    static V8_WARN_UNUSED_RESULT MaybeLocal<Module> CompileModuleFromDisk(Isolate* isolate, const char* path);
+    
+    //可以直接作为InstantiateModule的callback：相对路径按referrer的resource name解析后从磁盘加载
+    static MaybeLocal<Module> ResolveModuleFromDisk(Local<Context> context, Local<String> specifier,
+                                                    Local<Module> referrer);
+    
+    //从entry_path开始并行预取整个依赖图(只跟随./ ../ /开头的说明符)：读文件、解码、改写、语法检查都在worker线程上完成。
+    //thread_count为0时使用硬件线程数，调用线程也参与，返回预取到的module数
+    static int PrefetchModuleGraph(Isolate* isolate, const char* entry_path, int thread_count = 0);
+};
+
+//jsc不能序列化堆，快照由两部分组成：
+//1. 需要重放的脚本(函数、类等无法序列化的定义)，isolate加载blob时只解析一次，每个新context直接执行
+//2. 数据：默认context的global上由启动脚本新增的纯数据(按JSON序列化)，以及AddData的值
+//只用来产生数据的脚本以replay = false执行，恢复时不再执行，这部分启动开销被省掉
+class V8_EXPORT SnapshotCreator {
+public:
+    //blob里没有编译后的代码，两种方式没有区别
+    enum class FunctionCodeHandling { kClear, kKeep };
+    
+    //existing_blob里重放的脚本和恢复的global会带到新的blob里
+    explicit SnapshotCreator(const intptr_t* external_references = nullptr,
+                             StartupData* existing_blob = nullptr);
+    
+    ~SnapshotCreator();
+    
+    V8_INLINE Isolate* GetIsolate() {
+        return isolate_;
+    }
+    
+    void SetDefaultContext(Local<Context> context);
+    
+    //编译执行脚本。replay为true时记录到blob里，每个新context重放一次；
+    //为false时脚本只在这里执行，它在global上新增的属性按JSON存进blob，新context直接恢复，不再执行。
+    //新增的值不是纯数据(函数、类实例、循环引用等)，或者脚本有顶层let/const/class时失败并抛出异常
+    MaybeLocal<Value> RunScript(Local<Context> context, Local<String> source,
+                                ScriptOrigin* origin = nullptr, bool replay = true);
+    
+    //值在调用时按JSON序列化，返回Context::GetDataFromSnapshotOnce用的index
+    size_t AddData(Local<Context> context, Local<Value> object);
+    
+    //返回的data用new[]分配，由调用方释放
+    StartupData CreateBlob(FunctionCodeHandling function_code_handling);
+    
+    // Disallow copying and assigning.
+    SnapshotCreator(const SnapshotCreator&) = delete;
+    void operator=(const SnapshotCreator&) = delete;
+    
+    Isolate* isolate_;
+    
+    Local<Context> default_context_;
+    
+    //(resource name, 源码)，utf8
+    std::vector<std::pair<std::string, std::string>> scripts_;
+    
+    //replay为false的脚本新增的global
+    struct Global {
+        std::string name_;
+        //JSON，空表示undefined
+        std::string json_;
+        //在第几个重放的脚本之前恢复，和生成时的执行顺序一致。之后的脚本对它的修改只靠重放，不会重复
+        uint32_t position_;
+    };
+    std::vector<Global> globals_;
+    
+    //JSON
+    std::vector<std::string> data_;
+};
+
+class V8_EXPORT Message : public Data {
 public:
     V8_INLINE Local<Value> GetScriptResourceName() const {
         return String::NewFromUtf8(Isolate::current_, resource_name_.data(), NewStringType::kNormal, resource_name_.length()).ToLocalChecked();
     }
     
-    //TODO: quickjs未提供该信息?
+    //取自jsc Error对象的line属性，拿不到时为-1
     V8_INLINE V8_WARN_UNUSED_RESULT Maybe<int> GetLineNumber(Local<Context> context) const {
         return Maybe<int>(line_number_);
     }
@@ -1571,17 +2653,20 @@ public:
     }
     
     V8_INLINE int GetStartColumn() const {
-        return 0;
+        return start_column_;
     }
     
+    //jsc只给出错误开始的位置
     V8_INLINE int GetEndColumn() const {
-        return 0;
+        return start_column_ + 1;
     }
     
     
     std::string resource_name_;
     
     int line_number_ = 0;
+    
+    int start_column_ = 0;
 };
 
 class V8_EXPORT TryCatch {
@@ -1596,8 +2681,11 @@ public:
     
     Local<v8::Message> Message() const;
     
-    void handleException();
+    void Reset();
+    
+    void handleException(JSValueRef exception);
     
+    //没有捕获到异常时为nullptr，捕获到的值被protect直到Reset或析构
     JSValueRef catched_;
     
     Isolate* isolate_;
@@ -1615,8 +2703,7 @@ void ReturnValue<T>::Set(const Local<S> handle) {
     if (V8_UNLIKELY(handle.IsEmpty())) {
         SetUndefined();
     } else {
-        //如果向js返回了一个数据，这个数据应该Escape
-        isolate_->Escape(*handle);
+        //pvalue_指向栈上的CallbackInfo，由jsc的保守栈扫描负责，不需要再分配句柄
         *pvalue_ = handle->value_;
     }
 }
@@ -1624,8 +2711,7 @@ void ReturnValue<T>::Set(const Local<S> handle) {
 template<typename T>
 void ReturnValue<T>::Set(double i) {
     static_assert(std::is_base_of<T, Number>::value, "type check");
-    *pvalue_ = JS_NewFloat64_(context_, i);
-    
+    *pvalue_ = JSValueMakeNumber(context_, i);
 }
 
 template<typename T>
@@ -1643,23 +2729,25 @@ void ReturnValue<T>::Set(uint32_t i) {
 template<typename T>
 void ReturnValue<T>::Set(bool value) {
     static_assert(std::is_base_of<T, Boolean>::value, "type check");
-    if (value) {
-        *pvalue_ = JSValueMakeBoolean(context_, true);
-    } else {
-        *pvalue_ = JSValueMakeBoolean(context_, false);
-    }
+    *pvalue_ = isolate_->literal_values_[value ? kTrueValueIndex : kFalseValueIndex];
 }
 
 template<typename T>
 void ReturnValue<T>::SetNull() {
     static_assert(std::is_base_of<T, Primitive>::value, "type check");
-    *pvalue_ = JSValueMakeNull(context_);
+    *pvalue_ = isolate_->literal_values_[kNullValueIndex];
 }
 
 template<typename T>
 void ReturnValue<T>::SetUndefined() {
     static_assert(std::is_base_of<T, Primitive>::value, "type check");
-    *pvalue_ = JSValueMakeUndefine(context_);
+    *pvalue_ = isolate_->literal_values_[kUndefinedValueIndex];
+}
+
+template<typename T>
+void ReturnValue<T>::SetEmptyString() {
+    static_assert(std::is_base_of<T, String>::value, "type check");
+    *pvalue_ = isolate_->literal_values_[kEmptyStringIndex];
 }
 
 template <typename T>
@@ -1,6 +1,38 @@
 #include "v8.h"
 #include<cstring>
+#include <cmath>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define V8_UTF8_USE_SSE2 1
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define V8_UTF8_USE_AVX2 1
+#endif
+
+#if defined(PLATFORM_MAC) && !defined(V8_JSC_NO_PRIVATE_API)
+//JSStringRefPrivate.h里的接口，系统的JavaScriptCore有导出但没有公开头文件
+extern "C" JSStringRef JSStringCreateWithCharactersNoCopy(const JSChar* chars, size_t numChars);
+#define V8_JSC_USE_NOCOPY_STRING 1
+//JSScriptRefPrivate.h：脚本解析一次，之后可以在同一个group的任意context里直接执行，JSScriptRef在v8.h里声明
+extern "C" JSScriptRef JSScriptCreateFromString(JSContextGroupRef contextGroup, JSStringRef url, int startingLineNumber,
+                                                JSStringRef source, JSStringRef* errorMessage, int* errorLine);
+extern "C" JSValueRef JSScriptEvaluate(JSContextRef ctx, JSScriptRef script, JSValueRef thisValue, JSValueRef* exception);
+extern "C" void JSScriptRetain(JSScriptRef script);
+extern "C" void JSScriptRelease(JSScriptRef script);
+#define V8_JSC_USE_SCRIPT_REF 1
+//JSContextRefPrivate.h：JSGarbageCollect只是提示，这个接口会立即做一次完整gc
+extern "C" void JSSynchronousGarbageCollectForDebugging(JSContextRef ctx);
+#define V8_JSC_USE_SYNC_GC 1
+#endif
 
 
 namespace v8 {
@@ -17,7 +49,7 @@ namespace v8 {
 
 Maybe<uint32_t> Value::Uint32Value(Local<Context> context) const {
     JSValueRef exception = nullptr;
-    double d = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &exception);
+    double d = JSValueToNumber(Isolate::current_->current_js_context_, value_, &exception);
     if (exception) {
         return Maybe<uint32_t>();
     }
@@ -28,7 +60,7 @@ Maybe<uint32_t> Value::Uint32Value(Local<Context> context) const {
     
 Maybe<int32_t> Value::Int32Value(Local<Context> context) const {
     JSValueRef exception = nullptr;
-    double d = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &exception);
+    double d = JSValueToNumber(Isolate::current_->current_js_context_, value_, &exception);
     if (exception) {
         return Maybe<int32_t>();
     }
@@ -37,107 +69,361 @@ Maybe<int32_t> Value::Int32Value(Local<Context> context) const {
     }
 }
 
-ValueKind Value::getKind() const {
-    if (value_ == nullptr) {
-        return ValueKind::kNull;
-    }
-
-    JSContextRef ctx = Isolate::current_->current_context_->context_;
-    JSType type = JSValueGetType(ctx, value_);
-
-    if (type == JSType::kJSTypeUndefined || type == JSType::kJSTypeNull) {
-        return ValueKind::kNull;
-    } else if (type == JSType::kJSTypeString) {
-        return ValueKind::kString;
-    } else if (type == JSType::kJSTypeNumber) {
-        return ValueKind::kNumber;
-    } else if (type == JSType::kJSTypeBoolean) {
-        return ValueKind::kBoolean;
-    } else if (type == JSType::kJSTypeSymbol) {
-        return ValueKind::kSymbol;
-    } else if (JSValueIsDate(ctx, value_)) {
-        return ValueKind::kDate;
-    } else if (JSValueIsArray(ctx, value_)) {
-        return ValueKind::kArray;
-    } else if (IsArrayBuffer()) {
-        return ValueKind::kByteBuffer;
-    } else if (JSValueIsObject(ctx, value_)) {
-        auto obj = JSValueToObject( ctx, value_, NULL);
+static V8_INLINE uint8_t EncodeKind(ValueKind kind) {
+    return static_cast<uint8_t>(kind) + 1;
+}
+
+static V8_INLINE bool IsObjectKind(ValueKind kind) {
+    return kind == ValueKind::kObject || kind == ValueKind::kDate || kind == ValueKind::kFunction
+        || kind == ValueKind::kArray || kind == ValueKind::kByteBuffer;
+}
+
+//JSVALUE64下立即数的编码是固定的(数字高16位非0，null/undefined/true/false是几个常量)，
+//不需要调用jsc就能分类；JSVALUE32_64下所有值都是堆上的包装对象，只能交给jsc
+static V8_INLINE bool ClassifyImmediate(JSValueRef val, ValueKind* kind) {
+    if (val == nullptr) {
+        *kind = ValueKind::kNull;
+        return true;
+    }
+#if UINTPTR_MAX == 0xffffffffffffffffull
+    uintptr_t bits = reinterpret_cast<uintptr_t>(val);
+    if (bits & 0xffff000000000000ull) {
+        *kind = ValueKind::kNumber;
+        return true;
+    }
+    switch (bits) {
+        case 0x02:
+            *kind = ValueKind::kNull;
+            return true;
+        case 0x0a:
+            *kind = ValueKind::kUndefined;
+            return true;
+        case 0x06:
+        case 0x07:
+            *kind = ValueKind::kBoolean;
+            return true;
+        default:
+            break;
+    }
+#endif
+    return false;
+}
+
+//一次JSValueGetType解析出所有原始类型，对象返回kKindAnyObject
+static uint8_t ClassifyType(JSContextRef ctx, JSValueRef val) {
+    switch (JSValueGetType(ctx, val)) {
+        case kJSTypeUndefined:
+            return EncodeKind(ValueKind::kUndefined);
+        case kJSTypeNull:
+            return EncodeKind(ValueKind::kNull);
+        case kJSTypeBoolean:
+            return EncodeKind(ValueKind::kBoolean);
+        case kJSTypeNumber:
+            return EncodeKind(ValueKind::kNumber);
+        case kJSTypeString:
+            return EncodeKind(ValueKind::kString);
+        case kJSTypeSymbol:
+            return EncodeKind(ValueKind::kSymbol);
+        case kJSTypeObject:
+            return Isolate::kKindAnyObject;
+        default:
+            return EncodeKind(ValueKind::kUnsupported);
+    }
+}
+
+//对象类型之间互斥，按常见程度排序
+static ValueKind ClassifyObject(JSContextRef ctx, JSValueRef val) {
+    //对象的JSValueRef就是JSObjectRef，不需要再JSValueToObject
+    JSObjectRef obj = const_cast<JSObjectRef>(val);
     if (JSObjectIsFunction(ctx, obj)) {
         return ValueKind::kFunction;
+    } else if (JSValueIsArray(ctx, val)) {
+        return ValueKind::kArray;
+    } else if (JSValueIsDate(ctx, val)) {
+        return ValueKind::kDate;
+    } else if (JSValueGetTypedArrayType(ctx, val, nullptr) == kJSTypedArrayTypeArrayBuffer) {
+        return ValueKind::kByteBuffer;
     }
-        return ValueKind::kObject;
-    } else {
-        return ValueKind::kUnsupported;
+    return ValueKind::kObject;
+}
+
+//不能缓存时，只用一次(最多两次)jsc调用回答单个IsX
+static bool ProbeKind(JSContextRef ctx, JSValueRef val, ValueKind kind) {
+    switch (kind) {
+        case ValueKind::kUndefined:
+            return JSValueIsUndefined(ctx, val);
+        case ValueKind::kNull:
+            return JSValueIsNull(ctx, val);
+        case ValueKind::kString:
+            return JSValueIsString(ctx, val);
+        case ValueKind::kNumber:
+            return JSValueIsNumber(ctx, val);
+        case ValueKind::kBoolean:
+            return JSValueIsBoolean(ctx, val);
+        case ValueKind::kSymbol:
+            return JSValueIsSymbol(ctx, val);
+        case ValueKind::kDate:
+            return JSValueIsDate(ctx, val);
+        case ValueKind::kArray:
+            return JSValueIsArray(ctx, val);
+        case ValueKind::kFunction:
+            return JSValueIsObject(ctx, val) && JSObjectIsFunction(ctx, const_cast<JSObjectRef>(val));
+        case ValueKind::kByteBuffer:
+            return JSValueGetTypedArrayType(ctx, val, nullptr) == kJSTypedArrayTypeArrayBuffer;
+        default:
+            return JSValueIsObject(ctx, val) && ClassifyObject(ctx, val) == kind;
     }
 }
 
-bool Value::IsArrayBuffer() const {
-    if (value_ == nullptr) return false;
+uint8_t Value::Classify_(bool detail) const {
+    ValueKind kind;
+    if (ClassifyImmediate(value_, &kind)) {
+        return EncodeKind(kind);
+    }
+    Isolate* isolate = Isolate::current_;
+    JSContextRef ctx = isolate->current_js_context_;
+    uint8_t* cache = isolate->KindCacheSlot_(this);
+    uint8_t code = cache ? *cache : Isolate::kKindUnknown;
+    if (code == Isolate::kKindUnknown) {
+        code = ClassifyType(ctx, value_);
+    }
+    if (code == Isolate::kKindAnyObject && detail) {
+        code = EncodeKind(ClassifyObject(ctx, value_));
+    }
+    if (cache) {
+        *cache = code;
+    }
+    return code;
+}
 
-    JSValueRef exception = nullptr;
-    JSContextRef context = Isolate::current_->current_context_->context_;
+bool Value::IsKind_(ValueKind kind) const {
+    ValueKind immediate;
+    if (ClassifyImmediate(value_, &immediate)) {
+        return immediate == kind;
+    }
+    Isolate* isolate = Isolate::current_;
+    if (isolate->KindCacheSlot_(this) == nullptr) {
+        return ProbeKind(isolate->current_js_context_, value_, kind);
+    }
+    //缓存里没有就整体解析一次，同一个参数后续的IsX都不再调用jsc
+    return Classify_(IsObjectKind(kind)) == EncodeKind(kind);
+}
 
-    bool ret = JSValueGetTypedArrayType(context, value_, &exception) != kJSTypedArrayTypeNone;
-    if (ret || exception) return false;
+ValueKind Value::getKind() const {
+    return static_cast<ValueKind>(Classify_(true) - 1);
+}
 
-    // check is DataView
-    if (JSValueIsObject(context, value_)) {
-        auto ptr = JSObjectGetTypedArrayBytesPtr(context, JSValueToObject( context, value_, &exception),
-                                             &exception);
-        return ptr != nullptr && !exception;
-    }
-    return false;
+bool Value::IsArrayBuffer() const {
+    return IsKind_(ValueKind::kByteBuffer);
 }
     
 bool Value::IsUndefined() const {
-    return getKind() == ValueKind::kUndefined;
+    return IsKind_(ValueKind::kUndefined);
 }
 
 bool Value::IsNull() const {
-    return getKind() == ValueKind::kNull;
+    return IsKind_(ValueKind::kNull);
 }
 
 bool Value::IsNullOrUndefined() const {
-    ValueKind kind = getKind();
-    return kind == ValueKind::kNull || kind == ValueKind::kUndefined;
+    uint8_t code = Classify_(false);
+    return code == EncodeKind(ValueKind::kNull) || code == EncodeKind(ValueKind::kUndefined);
 }
 
 bool Value::IsString() const {
-    return getKind() == ValueKind::kString;
+    return IsKind_(ValueKind::kString);
 }
 
 bool Value::IsSymbol() const {
-    return  getKind() == ValueKind::kSymbol;
+    return IsKind_(ValueKind::kSymbol);
 }
 
 Isolate* Promise::GetIsolate() {
     return Isolate::current_;
 }
 
+static JSValueRef CallFunctionTemplate(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                       size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception);
+
+static JSObjectRef ConstructFunctionTemplate(JSContextRef ctx, JSObjectRef constructor,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception);
+
+static JSValueRef CallTemplateAccessorGetter(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception);
+
+static JSValueRef CallTemplateAccessorSetter(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception);
+
 Isolate::Isolate() : Isolate(nullptr) {
 }
 
 Isolate::Isolate(void* external_runtime) : current_context_(nullptr) {
     is_external_runtime_ = external_runtime != nullptr;
-    //todo rhythm
-//    literal_values_[kUndefinedValueIndex] = JSValueMakeUndefined(Isolate::current_->current_context_->context_);
-//    literal_values_[kNullValueIndex] = JSValueMakeNull(Isolate::current_->current_context_->context_);
-//    literal_values_[kTrueValueIndex] = JSValueMakeBoolean(Isolate::current_->current_context_->context_, true);
-//    literal_values_[kFalseValueIndex] = JSValueMakeBoolean(Isolate::current_->current_context_->context_, false);
-//    literal_values_[kEmptyStringIndex] = JSValueMakeUndefined(Isolate::current_->current_context_->context_);
     
     virtualMachine_ = JSContextGroupCreate();
+    isolate_context_ = JSGlobalContextCreateInGroup(virtualMachine_, nullptr);
     
-    //todo rhythm
-//    exception_ = JSValueMakeUndefined(Isolate::current_->current_context_->context_);
+    literal_values_[kUndefinedValueIndex] = JSValueMakeUndefined(isolate_context_);
+    literal_values_[kNullValueIndex] = JSValueMakeNull(isolate_context_);
+    literal_values_[kTrueValueIndex] = JSValueMakeBoolean(isolate_context_, true);
+    literal_values_[kFalseValueIndex] = JSValueMakeBoolean(isolate_context_, false);
+    JSStringRef empty = JSStringCreateWithUTF8CString("");
+    literal_values_[kEmptyStringIndex] = JSValueMakeString(isolate_context_, empty);
+    JSStringRelease(empty);
+    JSValueProtect(isolate_context_, literal_values_[kEmptyStringIndex]);
+    
+    length_string_ = JSStringCreateWithUTF8CString("length");
+    prototype_string_ = JSStringCreateWithUTF8CString("prototype");
+    constructor_string_ = JSStringCreateWithUTF8CString("constructor");
+    
+    global_handle_root_ = JSObjectMakeArray(isolate_context_, 0, nullptr, nullptr);
+    JSValueProtect(isolate_context_, global_handle_root_);
+    
+    handle_root_ = JSObjectMakeArray(isolate_context_, 0, nullptr, nullptr);
+    JSValueProtect(isolate_context_, handle_root_);
+    
+    JSClassDefinition object_def = kJSClassDefinitionEmpty;
+    object_def.className = "NativeObject";
+    object_def.finalize = FinalizeObject_;
+    object_class_ = JSClassCreate(&object_def);
+    
+    JSClassDefinition global_def = kJSClassDefinitionEmpty;
+    global_def.className = "JscEngine";
+    global_class_ = JSClassCreate(&global_def);
+    
+    JSClassDefinition external_def = kJSClassDefinitionEmpty;
+    external_def.className = "External";
+    external_class_ = JSClassCreate(&external_def);
+    
+    JSClassDefinition function_def = kJSClassDefinitionEmpty;
+    function_def.className = "Function";
+    function_def.callAsFunction = CallFunctionTemplate;
+    function_def.callAsConstructor = ConstructFunctionTemplate;
+    function_class_ = JSClassCreate(&function_def);
+    
+    JSClassDefinition accessor_def = kJSClassDefinitionEmpty;
+    accessor_def.className = "Function";
+    accessor_def.callAsFunction = CallTemplateAccessorGetter;
+    accessor_getter_class_ = JSClassCreate(&accessor_def);
+    accessor_def.callAsFunction = CallTemplateAccessorSetter;
+    accessor_setter_class_ = JSClassCreate(&accessor_def);
+    classes_created_ = 6;
+    
+    exception_ = literal_values_[kUndefinedValueIndex];
+    
+    current_js_context_ = isolate_context_;
 };
 
+static void DeleteModuleRecord(ModuleSourceRecord* record);
+
+static void DeleteStartupSnapshot(StartupSnapshot* snapshot);
+
 Isolate::~Isolate() {
-    for (size_t i = 0; i < values_.size(); i++) {
-        delete values_[i];
+    for (auto it = module_cache_.begin(); it != module_cache_.end(); ++it) {
+        it->second->Release_();
+    }
+    module_cache_.clear();
+    module_files_.clear();
+#ifdef V8_JSC_USE_SCRIPT_REF
+    for (auto it = compiled_scripts_.begin(); it != compiled_scripts_.end(); ++it) {
+        JSScriptRelease(it->second.script_);
+    }
+#endif
+    compiled_scripts_.clear();
+    for (auto it = prefetched_modules_.begin(); it != prefetched_modules_.end(); ++it) {
+        DeleteModuleRecord(it->second);
+    }
+    prefetched_modules_.clear();
+    for (size_t i = 0; i < function_templates_.size(); i++) {
+        function_templates_[i]->Release_();
+    }
+    function_templates_.clear();
+    for (size_t i = 0; i < accessor_templates_.size(); i++) {
+        accessor_templates_[i]->Release_();
+    }
+    accessor_templates_.clear();
+    if (snapshot_) {
+        DeleteStartupSnapshot(snapshot_);
+        snapshot_ = nullptr;
+    }
+    JSClassRelease(object_class_);
+    JSClassRelease(global_class_);
+    JSClassRelease(external_class_);
+    JSClassRelease(function_class_);
+    JSClassRelease(accessor_getter_class_);
+    JSClassRelease(accessor_setter_class_);
+    for (auto it = template_classes_.begin(); it != template_classes_.end(); ++it) {
+        JSClassRelease(it->second);
+    }
+    template_classes_.clear();
+    for (size_t i = 0; i < handle_blocks_.size(); i++) {
+        delete[] handle_blocks_[i];
+        delete[] handle_kind_blocks_[i];
+    }
+    handle_blocks_.clear();
+    handle_kind_blocks_.clear();
+    JSValueUnprotect(isolate_context_, handle_root_);
+    handle_root_batches_.clear();
+    JSValueUnprotect(isolate_context_, global_handle_root_);
+    for (size_t i = 0; i < intern_entries_.size(); i++) {
+        InternEntry& entry = intern_entries_[i];
+        if (entry.key_) {
+            JSValueUnprotect(isolate_context_, entry.value_);
+            JSStringRelease(entry.name_);
+            free(entry.key_);
+        }
+    }
+    intern_entries_.clear();
+    intern_values_.clear();
+    JSValueUnprotect(isolate_context_, literal_values_[kEmptyStringIndex]);
+    JSStringRelease(length_string_);
+    JSStringRelease(prototype_string_);
+    JSStringRelease(constructor_string_);
+    JSGlobalContextRelease(isolate_context_);
+    JSContextGroupRelease(virtualMachine_);
+    //vm释放时剩下的对象也会被finalize，之前和这期间排队的弱回调都不再派发；
+    //finalizer会写弱引用的槽位，槽位要等到这之后才能释放
+    for (size_t i = 0; i < pending_weak_callbacks_.size(); i++) {
+        FreeObjectUserData(pending_weak_callbacks_[i]);
+    }
+    pending_weak_callbacks_.clear();
+    for (size_t i = 0; i < global_blocks_.size(); i++) {
+        GlobalSlot* block = global_blocks_[i];
+        int live = 0;
+        for (int j = 0; j < kGlobalBlockSize; j++) {
+            live += block[j].in_use_ ? 1 : 0;
+        }
+        if (live == 0) {
+            delete[] block;
+            continue;
+        }
+        //embedder还持有的Global之后才Reset或析构，由最后一个释放整块
+        int* orphans = new int(live);
+        for (int j = 0; j < kGlobalBlockSize; j++) {
+            if (block[j].in_use_) {
+                block[j].orphans_ = orphans;
+            }
+        }
+    }
+    global_blocks_.clear();
+    //vm已经释放，不会再有字符串引用外部内存
+    for (size_t i = 0; i < external_string_resources_.size(); i++) {
+        static_cast<String::ExternalStringResourceBase*>(external_string_resources_[i])->Dispose();
+    }
+    external_string_resources_.clear();
+    for (size_t i = 0; i < external_string_buffers_.size(); i++) {
+        free(external_string_buffers_[i]);
+    }
+    external_string_buffers_.clear();
+    //vm释放时被回收的对象已经把ObjectUserData还回池里
+    for (int i = 0; i < kObjectUserDataSizeClasses; i++) {
+        while (object_udata_pool_[i]) {
+            ObjectUserData* next = static_cast<ObjectUserData*>(object_udata_pool_[i]->parameter_);
+            free(object_udata_pool_[i]);
+            object_udata_pool_[i] = next;
+        }
+        object_udata_pool_size_[i] = 0;
     }
-    values_.clear();
     //todo rhythm
 //    JS_FreeValueRT(runtime_, literal_values_[kEmptyStringIndex]);
 //    if (!is_external_runtime_) {
@@ -145,19 +431,407 @@ Isolate::~Isolate() {
 //    }
 };
 
-Value* Isolate::Alloc_() {
-    if (value_alloc_pos_ == (int)values_.size()) {
-        JSValueRef* node = new JSValueRef();
-        values_.push_back(node);
+void Isolate::NewHandleBlock_() {
+    //只有在块边界上才会进来，value_alloc_pos_正好是下一个块的起始位置
+    size_t block = value_alloc_pos_ >> kHandleBlockBits;
+    if (block == handle_blocks_.size()) {
+        handle_blocks_.push_back(new JSValueRef[kHandleBlockSize]);
+        handle_kind_blocks_.push_back(new uint8_t[kHandleBlockSize]);
     }
-    auto ret = reinterpret_cast<Value*>(values_[value_alloc_pos_++]);
-    return ret;
+    handle_next_ = handle_blocks_[block];
+    handle_limit_ = handle_next_ + kHandleBlockSize;
+    handle_kinds_ = handle_kind_blocks_[block];
+}
+
+void Isolate::RootHandleBatch_(int pos, const JSValueRef* values, int count) {
+    //values在栈上，JSObjectMakeArray期间触发gc也能被扫描到
+    JSObjectRef batch = JSObjectMakeArray(isolate_context_, count, values, nullptr);
+    JSObjectSetPropertyAtIndex(isolate_context_, handle_root_, (unsigned)handle_root_batches_.size(), batch, nullptr);
+    handle_root_batches_.push_back(pos);
+}
+
+void Isolate::RestoreAllocPos(int pos) {
+    size_t keep = handle_root_batches_.size();
+    while (keep > 0 && handle_root_batches_[keep - 1] >= pos) {
+        keep--;
+    }
+    if (keep < handle_root_batches_.size()) {
+        //截断根数组，一次性释放退出的scope里所有批次
+        JSObjectSetProperty(isolate_context_, handle_root_, length_string_,
+                            JSValueMakeNumber(isolate_context_, (double)keep), kJSPropertyAttributeNone, nullptr);
+        handle_root_batches_.resize(keep);
+    }
+    value_alloc_pos_ = pos;
+    size_t block = pos >> kHandleBlockBits;
+    if (block < handle_blocks_.size()) {
+        handle_next_ = handle_blocks_[block] + (pos & (kHandleBlockSize - 1));
+        handle_limit_ = handle_blocks_[block] + kHandleBlockSize;
+        handle_kinds_ = handle_kind_blocks_[block];
+    } else {
+        //下次Alloc_时再通过NewHandleBlock_取块
+        handle_next_ = nullptr;
+        handle_limit_ = nullptr;
+    }
+}
+
+Value* Isolate::NewGlobalHandle(JSValueRef val) {
+    if (global_free_list_ < 0) {
+        //free list用完了，新开一个块并把整块串进free list
+        int base = (int)global_blocks_.size() << kGlobalBlockBits;
+        GlobalSlot* block = new GlobalSlot[kGlobalBlockSize];
+        for (int i = 0; i < kGlobalBlockSize; i++) {
+            block[i].value_ = literal_values_[kUndefinedValueIndex];
+            block[i].index_ = base + i;
+            block[i].next_free_ = i + 1 < kGlobalBlockSize ? base + i + 1 : -1;
+            block[i].object_udata_ = nullptr;
+            block[i].in_use_ = false;
+            block[i].orphans_ = nullptr;
+        }
+        global_blocks_.push_back(block);
+        global_free_list_ = base;
+    }
+    GlobalSlot* slot = global_blocks_[global_free_list_ >> kGlobalBlockBits] + (global_free_list_ & (kGlobalBlockSize - 1));
+    global_free_list_ = slot->next_free_;
+    slot->next_free_ = -1;
+    slot->weak_ = false;
+    slot->object_udata_ = nullptr;
+    slot->in_use_ = true;
+    slot->value_ = val;
+    ++global_handle_created_;
+    Value* handle = reinterpret_cast<Value*>(slot);
+    RootGlobalHandle(handle);
+    return handle;
+}
+
+void Isolate::RootGlobalHandle(Value* handle) {
+    GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(handle);
+    if (IsHeapValue_(slot->value_)) {
+        JSObjectSetPropertyAtIndex(isolate_context_, global_handle_root_, slot->index_, slot->value_, nullptr);
+    }
+}
+
+void Isolate::UnrootGlobalHandle(Value* handle) {
+    GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(handle);
+    if (IsHeapValue_(slot->value_)) {
+        JSObjectSetPropertyAtIndex(isolate_context_, global_handle_root_, slot->index_, literal_values_[kUndefinedValueIndex], nullptr);
+    }
+}
+
+bool Isolate::MakeWeakGlobalHandle(Value* handle, void* parameter, WeakCallback callback) {
+    GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(handle);
+    ObjectUserData* object_udata = GetObjectUserData(slot->value_);
+    if (!object_udata || (object_udata->weak_handle_ && object_udata->weak_handle_ != handle)) {
+        return false;
+    }
+    object_udata->callback_ = callback;
+    object_udata->parameter_ = parameter;
+    object_udata->weak_handle_ = handle;
+    UnrootGlobalHandle(handle);
+    slot->weak_ = true;
+    slot->object_udata_ = object_udata;
+    ++global_handle_weak_;
+    return true;
+}
+
+void Isolate::DisposeGlobalHandle(Value* handle) {
+    GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(handle);
+    if (slot->weak_) {
+        //对象还活着，或者已经被回收但回调还在队列里，都在这里取消回调；回调已经派发过的话object_udata_为空
+        ObjectUserData* object_udata = slot->object_udata_;
+        if (object_udata) {
+            object_udata->callback_ = nullptr;
+            object_udata->parameter_ = nullptr;
+            object_udata->weak_handle_ = nullptr;
+            slot->object_udata_ = nullptr;
+        }
+        slot->weak_ = false;
+        --global_handle_weak_;
+    } else {
+        UnrootGlobalHandle(handle);
+    }
+    slot->value_ = literal_values_[kUndefinedValueIndex];
+    slot->in_use_ = false;
+    slot->next_free_ = global_free_list_;
+    global_free_list_ = slot->index_;
+    ++global_handle_disposed_;
+}
+
+void Isolate::ReleaseOrphanGlobalHandle(Value* handle) {
+    GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(handle);
+    GlobalSlot* block = slot - (slot->index_ & (kGlobalBlockSize - 1));
+    int* orphans = slot->orphans_;
+    slot->orphans_ = nullptr;
+    slot->in_use_ = false;
+    if (--*orphans == 0) {
+        delete orphans;
+        delete[] block;
+    }
+}
+
+void Isolate::GetGlobalHandleStatistics(GlobalHandleStatistics* stats) {
+    stats->total_slots_ = global_blocks_.size() * kGlobalBlockSize;
+    stats->used_slots_ = global_handle_created_ - global_handle_disposed_;
+    stats->created_count_ = global_handle_created_;
+    stats->disposed_count_ = global_handle_disposed_;
+    stats->weak_slots_ = global_handle_weak_;
+    stats->pending_weak_callbacks_ = pending_weak_callbacks_.size();
+}
+
+//短字符串转换成utf16时用栈上的缓冲区
+static const size_t kStackCharBufferSize = 256;
+
+static JSStringRef CreateJSStringFromUtf8(const char* data, size_t len);
+
+static V8_INLINE uint32_t HashInternKey(const char* data, size_t len) {
+    //FNV-1a，属性名都很短
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+static V8_INLINE size_t HashInternValue(JSValueRef val) {
+    uintptr_t bits = reinterpret_cast<uintptr_t>(val);
+    return static_cast<size_t>(bits ^ (bits >> 9));
+}
+
+static void InsertInternValue(std::vector<Isolate::InternValueEntry>& values, const Isolate::InternEntry& entry) {
+    size_t mask = values.size() - 1;
+    size_t i = HashInternValue(entry.value_) & mask;
+    while (values[i].value_) {
+        i = (i + 1) & mask;
+    }
+    values[i].value_ = entry.value_;
+    values[i].name_ = entry.name_;
+    values[i].key_ = entry.key_;
+    values[i].len_ = entry.len_;
+}
+
+void Isolate::GrowInternTable_() {
+    size_t capacity = intern_entries_.empty() ? 256 : intern_entries_.size() * 2;
+    std::vector<InternEntry> entries(capacity, InternEntry{nullptr, 0, 0, nullptr, nullptr});
+    std::vector<InternValueEntry> values(capacity, InternValueEntry{nullptr, nullptr, nullptr, 0});
+    for (size_t i = 0; i < intern_entries_.size(); i++) {
+        const InternEntry& entry = intern_entries_[i];
+        if (entry.key_) {
+            size_t j = entry.hash_ & (capacity - 1);
+            while (entries[j].key_) {
+                j = (j + 1) & (capacity - 1);
+            }
+            entries[j] = entry;
+            InsertInternValue(values, entry);
+        }
+    }
+    intern_entries_.swap(entries);
+    intern_values_.swap(values);
+}
+
+const Isolate::InternEntry* Isolate::Intern_(const char* data, size_t len, bool limited) {
+    if ((intern_count_ + 1) * 2 > intern_entries_.size()) {
+        GrowInternTable_();
+    }
+    uint32_t hash = HashInternKey(data, len);
+    size_t mask = intern_entries_.size() - 1;
+    size_t i = hash & mask;
+    while (intern_entries_[i].key_) {
+        const InternEntry& entry = intern_entries_[i];
+        if (entry.hash_ == hash && entry.len_ == len && memcmp(entry.key_, data, len) == 0) {
+            ++intern_hits_;
+            return &entry;
+        }
+        i = (i + 1) & mask;
+    }
+    
+    if (limited && intern_count_ >= kInternTableLimit) {
+        ++intern_rejected_;
+        return nullptr;
+    }
+    ++intern_misses_;
+    InternEntry& entry = intern_entries_[i];
+    entry.key_ = static_cast<char*>(malloc(len + 1));
+    memcpy(entry.key_, data, len);
+    entry.key_[len] = '\0';
+    entry.hash_ = hash;
+    entry.len_ = (uint32_t)len;
+    //key里有'\0'时不能走c字符串的接口，否则名字会被截断
+    entry.name_ = memchr(data, '\0', len) ? CreateJSStringFromUtf8(data, len) : JSStringCreateWithUTF8CString(entry.key_);
+    entry.value_ = JSValueMakeString(isolate_context_, entry.name_);
+    JSValueProtect(isolate_context_, entry.value_);
+    InsertInternValue(intern_values_, entry);
+    ++intern_count_;
+    intern_key_bytes_ += len + 1;
+    return &entry;
+}
+
+const Isolate::InternValueEntry* Isolate::FindInternedValue(JSValueRef val) {
+    if (intern_values_.empty() || !IsHeapValue_(val)) {
+        return nullptr;
+    }
+    size_t mask = intern_values_.size() - 1;
+    size_t i = HashInternValue(val) & mask;
+    while (intern_values_[i].value_) {
+        if (intern_values_[i].value_ == val) {
+            return &intern_values_[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return nullptr;
+}
+
+void Isolate::GetInternTableStatistics(InternTableStatistics* stats) {
+    stats->entries_ = intern_count_;
+    stats->capacity_ = intern_entries_.size();
+    stats->hits_ = intern_hits_;
+    stats->misses_ = intern_misses_;
+    stats->rejected_ = intern_rejected_;
+    //jsc侧字符串的大小拿不到，按utf16长度估算
+    stats->memory_bytes_ = intern_entries_.size() * (sizeof(InternEntry) + sizeof(InternValueEntry))
+        + intern_key_bytes_ * (1 + sizeof(JSChar));
+}
+
+JSClassRef Isolate::FindTemplateClass_(const void* key) {
+    auto it = template_classes_.find(key);
+    if (it == template_classes_.end()) {
+        return nullptr;
+    }
+    class_cache_hits_++;
+    return it->second;
+}
+
+JSClassRef Isolate::GetTemplateClass_(const void* key, const JSClassDefinition& definition) {
+    JSClassRef cls = FindTemplateClass_(key);
+    if (cls) {
+        return cls;
+    }
+    cls = JSClassCreate(&definition);
+    template_classes_[key] = cls;
+    classes_created_++;
+    return cls;
+}
+
+void Isolate::ReleaseTemplateClass_(const void* key) {
+    //已经创建的对象自己持有class的引用
+    auto it = template_classes_.find(key);
+    if (it != template_classes_.end()) {
+        JSClassRelease(it->second);
+        template_classes_.erase(it);
+    }
+}
+
+void Isolate::GetClassCacheStatistics(ClassCacheStatistics* stats) {
+    stats->global_classes_ = global_class_ ? 1 : 0;
+    stats->external_classes_ = external_class_ ? 1 : 0;
+    stats->function_classes_ = function_class_ ? 1 : 0;
+    stats->template_classes_ = template_classes_.size();
+    stats->created_count_ = classes_created_;
+    stats->hits_ = class_cache_hits_;
+}
+
+//超过32个internal field的不进池，返回-1
+static V8_INLINE int ObjectUserDataSizeClass(int len) {
+    int size_class = 0;
+    while ((1 << size_class) < len) {
+        size_class++;
+    }
+    return size_class < Isolate::kObjectUserDataSizeClasses ? size_class : -1;
+}
+
+static V8_INLINE size_t ObjectUserDataSize(int capacity) {
+    return sizeof(ObjectUserData) + sizeof(void*) * (std::max(capacity, 1) - 1);
+}
+
+ObjectUserData* Isolate::NewObjectUserData(int internal_field_count) {
+    int len = std::max(internal_field_count, 0);
+    int size_class = ObjectUserDataSizeClass(len);
+    ObjectUserData* object_udata;
+    if (size_class >= 0 && object_udata_pool_[size_class]) {
+        object_udata = object_udata_pool_[size_class];
+        object_udata_pool_[size_class] = static_cast<ObjectUserData*>(object_udata->parameter_);
+        object_udata_pool_size_[size_class]--;
+        memset(object_udata, 0, ObjectUserDataSize(1 << size_class));
+    } else {
+        object_udata = static_cast<ObjectUserData*>(calloc(1, ObjectUserDataSize(size_class >= 0 ? (1 << size_class) : len)));
+    }
+    object_udata->len_ = len;
+    object_udata->isolate_ = this;
+    return object_udata;
+}
+
+void Isolate::FreeObjectUserData(ObjectUserData* object_udata) {
+    int size_class = ObjectUserDataSizeClass(object_udata->len_);
+    if (size_class < 0 || object_udata_pool_size_[size_class] >= kObjectUserDataPoolLimit) {
+        free(object_udata);
+        return;
+    }
+    object_udata->parameter_ = object_udata_pool_[size_class];
+    object_udata_pool_[size_class] = object_udata;
+    object_udata_pool_size_[size_class]++;
+}
+
+ObjectUserData* Isolate::GetObjectUserData(JSValueRef val) {
+    if (!IsHeapValue_(val) || !JSValueIsObjectOfClass(isolate_context_, val, object_class_)) {
+        return nullptr;
+    }
+    return static_cast<ObjectUserData*>(JSObjectGetPrivate(const_cast<JSObjectRef>(val)));
+}
+
+void Isolate::FinalizeObject_(JSObjectRef object) {
+    //gc过程中调用：只做内存操作，不回调embedder
+    ObjectUserData* object_udata = static_cast<ObjectUserData*>(JSObjectGetPrivate(object));
+    if (!object_udata) {
+        return;
+    }
+    JSObjectSetPrivate(object, nullptr);
+    Isolate* isolate = object_udata->isolate_;
+    if (object_udata->weak_handle_) {
+        //有回调时保留槽位和ObjectUserData之间的关联，派发前Reset还能取消回调
+        GlobalSlot* slot = reinterpret_cast<GlobalSlot*>(object_udata->weak_handle_);
+        slot->value_ = isolate->literal_values_[kUndefinedValueIndex];
+        if (!object_udata->callback_) {
+            slot->object_udata_ = nullptr;
+            object_udata->weak_handle_ = nullptr;
+        }
+    }
+    if (object_udata->callback_) {
+        isolate->pending_weak_callbacks_.push_back(object_udata);
+    } else {
+        isolate->FreeObjectUserData(object_udata);
+    }
+}
+
+void Isolate::DispatchWeakCallbacks_() {
+    if (dispatching_weak_callbacks_) {
+        return;
+    }
+    dispatching_weak_callbacks_ = true;
+    //回调里可能触发新的gc，新排队的在下一轮处理
+    while (!pending_weak_callbacks_.empty()) {
+        weak_callback_batch_.swap(pending_weak_callbacks_);
+        for (size_t i = 0; i < weak_callback_batch_.size(); i++) {
+            ObjectUserData* object_udata = weak_callback_batch_[i];
+            if (object_udata->weak_handle_) {
+                //回调里通常会Reset这个句柄，先断开关联
+                reinterpret_cast<GlobalSlot*>(object_udata->weak_handle_)->object_udata_ = nullptr;
+                object_udata->weak_handle_ = nullptr;
+            }
+            //排队之后句柄被Reset的，回调已经被取消
+            if (object_udata->callback_) {
+                WeakCallbackInfo<void> info;
+                info.object_udata_ = object_udata;
+                object_udata->callback_(info);
+            }
+            FreeObjectUserData(object_udata);
+        }
+        weak_callback_batch_.clear();
+    }
+    dispatching_weak_callbacks_ = false;
 }
 
 void Isolate::ForeachAllocValue(int start, int end, std::function<void(JSValueRef*, int)> callback) {
     for (int i = std::min(end, value_alloc_pos_) ; i > std::max(0, start); i--) {
         int idx = i - 1;
-        JSValueRef * to_free = values_[idx];
+        JSValueRef * to_free = handle_blocks_[idx >> kHandleBlockBits] + (idx & (kHandleBlockSize - 1));
         callback(to_free, idx);
     }
 }
@@ -169,43 +843,48 @@ void Isolate::Escape(JSValueRef* val) {
 
 Isolate* Isolate::current_ = nullptr;
 
-void Isolate::handleException() {
+StartupData* V8::snapshot_blob_ = nullptr;
+
+struct ErrorLocation {
+    //异常toString的结果
+    std::string text_;
+    //Error对象的message属性
+    std::string message_;
+    std::string resource_name_;
+    int line_ = -1;
+    int column_ = -1;
+};
+
+static void GetErrorLocation(JSContextRef ctx, JSValueRef exception, ErrorLocation* location);
+
+void Isolate::handleException(JSValueRef exception) {
     if (currentTryCatch_) {
-        currentTryCatch_->handleException();
+        currentTryCatch_->handleException(exception);
         return;
     }
     
-    //todo rhythm
-//    JSValue ex = JS_GetException(current_context_->context_);
-//
-//    if (!JS_IsUndefined(ex) && !JS_IsNull(ex)) {
-//        JSValue fileNameVal = JS_GetProperty(current_context_->context_, ex, JS_ATOM_fileName);
-//        JSValue lineNumVal = JS_GetProperty(current_context_->context_, ex, JS_ATOM_lineNumber);
-//
-//        auto msg = JS_ToCString(current_context_->context_, ex);
-//        auto fileName = JS_ToCString(current_context_->context_, fileNameVal);
-//        auto lineNum = JS_ToCString(current_context_->context_, lineNumVal);
-//        if (JS_IsUndefined(fileNameVal)) {
-//            std::cerr << "Uncaught " << msg << std::endl;
-//        }
-//        else {
-//            std::cerr << fileName << ":" << lineNum << ": Uncaught " << msg << std::endl;
-//        }
-//
-//        JS_FreeCString(current_context_->context_, lineNum);
-//        JS_FreeCString(current_context_->context_, fileName);
-//        JS_FreeCString(current_context_->context_, msg);
-//
-//        JS_FreeValue(current_context_->context_, lineNumVal);
-//        JS_FreeValue(current_context_->context_, fileNameVal);
-//
-//        JS_FreeValue(current_context_->context_, ex);
-//    }
+    ErrorLocation location;
+    GetErrorLocation(current_js_context_, exception, &location);
+    if (location.resource_name_.empty()) {
+        std::cerr << "Uncaught " << location.text_ << std::endl;
+    }
+    else {
+        std::cerr << location.resource_name_ << ":" << location.line_ << ": Uncaught " << location.text_ << std::endl;
+    }
 }
 
 void Isolate::LowMemoryNotification() {
     Scope isolate_scope(this);
-    JSGarbageCollect(this->current_context_->context_);
+    JSGarbageCollect(isolate_context_);
+    DispatchWeakCallbacks();
+}
+
+void Isolate::RequestGarbageCollectionForTesting(GarbageCollectionType type) {
+#if V8_JSC_USE_SYNC_GC
+    JSSynchronousGarbageCollectForDebugging(isolate_context_);
+#else
+    JSGarbageCollect(isolate_context_);
+#endif
 }
 
 Local<Value> Isolate::ThrowException(Local<Value> exception) {
@@ -228,7 +907,7 @@ Local<Value> Exception::Error(Local<String> message) {
     Isolate *isolate = Isolate::current_;
     Value* val = isolate->Alloc<Value>();
     //todo rhythm
-//    JSContext* ctx = isolate->current_context_->context_;
+//    JSContext* ctx = isolate->current_js_context_;
 //    val->value_ = JS_NewError(ctx);
 //    JS_DefinePropertyValue(ctx, val->value_, JS_ATOM_message, JS_NewString(ctx, *String::Utf8Value(isolate, message)),
 //                           JS_PROP_WRITABLE | JS_PROP_CONFIGURABLE);
@@ -248,46 +927,42 @@ void HandleScope::Escape_(JSValueRef* val) {
 }
 
 void HandleScope::Exit() {
-    //todo rhythm
-//    if(prev_pos_ < isolate_->value_alloc_pos_) {
-//        //std::cout << "---------------- start HandleScope::Exit -------------------" << std::endl;
-//        //std::cout << prev_pos_ << "," << isolate_->value_alloc_pos_ << std::endl;
-//        isolate_->ForeachAllocValue(prev_pos_, isolate_->value_alloc_pos_, [this](JSValue* val, int idx){
-//            if (JS_VALUE_HAS_REF_COUNT(*val)) {
-//                if (this->escapes_.find(val) == this->escapes_.end()) { //not excaped
-//                    //std::cout << "free val type:" << JS_VALUE_GET_TAG(*val) << "," << val << ", idx:" << idx << std::endl;
-//                    JS_FreeValueRT(isolate_->runtime_, *val);
-//                //} else {
-//                    //std::cout << "escaped val type:" << JS_VALUE_GET_TAG(*val) << "," << val << std::endl;
-//                }
-//            }
-//        });
-//        isolate_->value_alloc_pos_ = prev_pos_;
-//        //std::cout << "---------------- end HandleScope::Exit -------------------" << std::endl;
-//    }
-//
-//    if (JS_VALUE_HAS_REF_COUNT(scope_value_)) {
-//        if (this->escapes_.find(&scope_value_) == this->escapes_.end()) { //not excaped
-//            JS_FreeValueRT(isolate_->runtime_, scope_value_);
-//        }
-//    }
+    //被Escape的值已经拷贝到上层scope的scope_value_里（在栈上，由jsc的保守栈扫描负责），这里整段释放即可，
+    //root_pending_里还没有成批的值随scope一起失效
+    if (prev_pos_ < isolate_->GetAllocPos()) {
+        isolate_->RestoreAllocPos(prev_pos_);
+    }
+    isolate_->DispatchWeakCallbacks();
 }
 
 bool Value::IsFunction() const {
-    return getKind() == ValueKind::kFunction;
+    return IsKind_(ValueKind::kFunction);
 }
 
 bool Value::IsDate() const {
-    return getKind() == ValueKind::kDate;
+    return IsKind_(ValueKind::kDate);
 }
 
 bool Value::IsArrayBufferView() const {
-    //todo rhythm
-    return false;
+    ValueKind kind;
+    if (ClassifyImmediate(value_, &kind)) {
+        return false;
+    }
+    JSTypedArrayType type = JSValueGetTypedArrayType(Isolate::current_->current_js_context_, value_, nullptr);
+    return type != kJSTypedArrayTypeNone && type != kJSTypedArrayTypeArrayBuffer;
 }
 
 bool Value::IsObject() const {
-    return JSValueIsObject(Isolate::current_->current_context_->context_, value_);
+    ValueKind kind;
+    if (ClassifyImmediate(value_, &kind)) {
+        return false;
+    }
+    Isolate* isolate = Isolate::current_;
+    if (isolate->KindCacheSlot_(this) == nullptr) {
+        return JSValueIsObject(isolate->current_js_context_, value_);
+    }
+    uint8_t code = Classify_(false);
+    return code == Isolate::kKindAnyObject || IsObjectKind(static_cast<ValueKind>(code - 1));
 }
 
 bool Value::IsBigInt() const {
@@ -296,11 +971,11 @@ bool Value::IsBigInt() const {
 }
 
 bool Value::IsBoolean() const {
-    return getKind() == ValueKind::kBoolean;
+    return IsKind_(ValueKind::kBoolean);
 }
 
 bool Value::IsNumber() const {
-    return getKind() == ValueKind::kNumber;
+    return IsKind_(ValueKind::kNumber);
 }
 
 bool Value::IsExternal() const {
@@ -309,7 +984,11 @@ bool Value::IsExternal() const {
 }
 
 bool Value::IsInt32() const {
-    return getKind() == ValueKind::kNumber;
+    if (!IsKind_(ValueKind::kNumber)) {
+        return false;
+    }
+    double d = JSValueToNumber(Isolate::current_->current_js_context_, value_, nullptr);
+    return d == static_cast<int32_t>(d) && !(d == 0 && std::signbit(d));
 }
 
 MaybeLocal<BigInt> Value::ToBigInt(Local<Context> context) const {
@@ -326,7 +1005,7 @@ MaybeLocal<Number> Value::ToNumber(Local<Context> context) const {
     }
     else {
         JSValueRef exception = nullptr;
-        double d = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &exception);
+        double d = JSValueToNumber(Isolate::current_->current_js_context_, value_, &exception);
         if (exception) {
             return MaybeLocal<Number>();
         }
@@ -349,7 +1028,7 @@ MaybeLocal<Integer> Value::ToInteger(Local<Context> context) const {
 }
 
 bool Value::BooleanValue(Isolate* isolate) const {
-    return JSValueToBoolean(isolate->current_context_->context_, value_);
+    return JSValueToBoolean(isolate->current_js_context_, value_);
 }
 
 bool Value::IsRegExp() const {
@@ -363,9 +1042,9 @@ MaybeLocal<String> Value::ToString(Local<Context> context) const {
         return MaybeLocal<String>(Local<String>(static_cast<String*>(const_cast<Value*>(this))));
     } else {
         //由HandleScope跟踪回收
-        String * str = context->GetIsolate()->Alloc<String>();
         JSStringRef stringRef = JSStringCreateWithUTF8CString("");
-        str->value_ = JSValueMakeString(context->context_, stringRef);
+        String * str = context->GetIsolate()->Alloc<String>(JSValueMakeString(context->context_, stringRef));
+        JSStringRelease(stringRef);
         return MaybeLocal<String>(Local<String>(str));
     }
     
@@ -386,499 +1065,4313 @@ V8_WARN_UNUSED_RESULT Maybe<double> Value::NumberValue(Local<Context> context) c
 MaybeLocal<String> String::NewFromUtf8(
     Isolate* isolate, const char* data,
     NewStringType type, int length) {
-    String *str = isolate->Alloc<String>();
     //printf("NewFromUtf8:%p\n", str);
-    size_t len = length > 0 ? length : strlen(data);
-    JSStringRef stringRef = JSStringCreateWithUTF8CString(data);
-    str->value_ = JSValueMakeString(isolate->current_context_->context_, stringRef);
+    if (data == nullptr) {
+        return MaybeLocal<String>();
+    }
+    size_t len = length >= 0 ? length : strlen(data);
+    if (type == NewStringType::kInternalized) {
+        //intern表里的值是protect的，不依赖HandleScope；表满了就按普通字符串创建
+        const Isolate::InternEntry* entry = isolate->Intern_(data, len, true);
+        if (entry) {
+            return Local<String>(isolate->Alloc<String>(entry->value_));
+        }
+    }
+    
+    //jsc的c字符串接口只接受'\0'结尾的utf8，带长度时自己解码成utf16
+    JSStringRef stringRef = length >= 0 ? CreateJSStringFromUtf8(data, len) : JSStringCreateWithUTF8CString(data);
+    String *str = isolate->Alloc<String>(JSValueMakeString(isolate->current_js_context_, stringRef));
+    JSStringRelease(stringRef);
     return Local<String>(str);
 }
 
-Local<String> String::Empty(Isolate* isolate) {
-    JSValueRef value = isolate->literal_values_[kEmptyStringIndex];
-    JSType type = JSValueGetType(isolate->current_context_->context_, value);
-    if ( type == kJSTypeUndefined || type == kJSTypeNull) {
-        isolate->literal_values_[kEmptyStringIndex] = JSValueMakeString(isolate->current_context_->context_, JSStringCreateWithUTF8CString(""));
-    }
-    return Local<String>(reinterpret_cast<String*>(&isolate->literal_values_[kEmptyStringIndex]));
+static V8_INLINE Local<String> NewStringFromCharacters(Isolate* isolate, const JSChar* chars, size_t length, bool no_copy) {
+#if V8_JSC_USE_NOCOPY_STRING
+    JSStringRef stringRef = no_copy ? JSStringCreateWithCharactersNoCopy(chars, length) : JSStringCreateWithCharacters(chars, length);
+#else
+    JSStringRef stringRef = JSStringCreateWithCharacters(chars, length);
+#endif
+    String* str = isolate->Alloc<String>(JSValueMakeString(isolate->current_js_context_, stringRef));
+    JSStringRelease(stringRef);
+    return Local<String>(str);
 }
 
-int String::Utf8Length(Isolate* isolate) const {
-    JSValueRef exception;
-    JSStringRef stringRef = JSValueToStringCopy(isolate->current_context_->context_, value_, &exception);
-    size_t len = JSStringGetLength(stringRef);
-    
-    return (int)len;
+bool Isolate::ReserveExternalString_(size_t bytes) {
+    if (bytes < kExternalNoCopyMinBytes || external_string_bytes_ + bytes > kExternalNoCopyLimitBytes) {
+        return false;
+    }
+    external_string_bytes_ += bytes;
+    return true;
 }
 
-int String::WriteUtf8(Isolate* isolate, char* buffer) const {
-    //todo rhythm
-//    size_t len;
-//    const char* p = JS_ToCStringLen(isolate->current_context_->context_, &len, value_);
-//
-//    memcpy(buffer, p, len);
-//
-//    JS_FreeCString(isolate->current_context_->context_, p);
-//    return (int)len;
-    return 0;
+static void WidenLatin1(const char* src, size_t length, JSChar* dst) {
+    size_t i = 0;
+#if V8_UTF8_USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+#endif
+    for (; i < length; i++) {
+        dst[i] = static_cast<uint8_t>(src[i]);
+    }
 }
 
-//！！如果一个Local<String>用到这个接口了，就不能再传入JS
-MaybeLocal<Script> Script::Compile(
-    Local<Context> context, Local<String> source,
-    ScriptOrigin* origin) {
-    Script* script = new Script();
-    script->source_ = source;
-    if (origin) {
-        script->resource_name_ = MaybeLocal<String>(Local<String>::Cast(origin->resource_name_));
+MaybeLocal<String> String::NewExternalTwoByte(
+    Isolate* isolate, ExternalStringResource* resource) {
+    if (resource == nullptr) {
+        return MaybeLocal<String>();
     }
-    return MaybeLocal<Script>(Local<Script>(script));
+    const JSChar* chars = reinterpret_cast<const JSChar*>(resource->data());
+#if V8_JSC_USE_NOCOPY_STRING
+    if (isolate->ReserveExternalString_(resource->length() * sizeof(JSChar))) {
+        //jsc直接引用resource的内存(比如mmap的文件)，resource要活到isolate销毁
+        Local<String> ret = NewStringFromCharacters(isolate, chars, resource->length(), true);
+        isolate->external_string_resources_.push_back(resource);
+        return ret;
+    }
+#endif
+    Local<String> ret = NewStringFromCharacters(isolate, chars, resource->length(), false);
+    resource->Dispose();
+    return ret;
 }
 
-static V8_INLINE MaybeLocal<Value> ProcessResult(Isolate *isolate, JSValueRef ret) {
-    Value* val = nullptr;
-    //脚本执行的返回值由HandleScope接管，这可能有需要GC的对象
-    val = isolate->Alloc<Value>();
-    val->value_ = ret;
-    return MaybeLocal<Value>(Local<Value>(val));
+MaybeLocal<String> String::NewExternalOneByte(
+    Isolate* isolate, ExternalOneByteStringResource* resource) {
+    if (resource == nullptr) {
+        return MaybeLocal<String>();
+    }
+    //jsc的C API只接受utf16，latin1只在这里展开一次，原始数据随即可以释放
+    size_t length = resource->length();
+    JSChar stack_buffer[kStackCharBufferSize];
+    JSChar* chars = length <= kStackCharBufferSize ? stack_buffer : static_cast<JSChar*>(malloc(sizeof(JSChar) * length));
+    WidenLatin1(resource->data(), length, chars);
+    resource->Dispose();
+#if V8_JSC_USE_NOCOPY_STRING
+    if (chars != stack_buffer && isolate->ReserveExternalString_(length * sizeof(JSChar))) {
+        //展开的结果直接交给jsc，省掉一次拷贝
+        isolate->external_string_buffers_.push_back(chars);
+        return NewStringFromCharacters(isolate, chars, length, true);
+    }
+#endif
+    Local<String> ret = NewStringFromCharacters(isolate, chars, length, false);
+    if (chars != stack_buffer) {
+        free(chars);
+    }
+    return ret;
 }
 
-MaybeLocal<Value> Script::Run(Local<Context> context) {
-    auto isolate = context->GetIsolate();
-
-    JSValueRef jscException = nullptr;
-    String::Utf8Value source(isolate, source_);
-    const char *filename = resource_name_.IsEmpty() ? "eval" : *String::Utf8Value(isolate, resource_name_.ToLocalChecked());
-    auto ret = JSEvaluateScript(context->context_, JSStringCreateWithUTF8CString(*source), JSContextGetGlobalObject(context->context_), JSStringCreateWithUTF8CString(filename), 0, &jscException);
+Local<String> String::Empty(Isolate* isolate) {
+    return Local<String>(reinterpret_cast<String*>(&isolate->literal_values_[kEmptyStringIndex]));
+}
 
-    return ProcessResult(isolate, ret);
+//utf16 -> utf8：直接读JSStringGetCharactersPtr，先精确算出长度再一次性写入，
+//不走JSStringGetUTF8CString（按3倍长度预分配、再拷贝一次）。
+//ascii的块用SSE2/AVX2整块判断和打包，含非ascii字符的块走标量
+static V8_INLINE int PopCount32(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(x);
+#else
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    return (int)((((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
 }
 
-Script::~Script() {
-    //JS_FreeValue(context_->context_, source_->value_);
-    //if (!resource_name_.IsEmpty()) {
-    //    JS_FreeValue(context_->context_, resource_name_.ToLocalChecked()->value_);
-    //}
+static V8_INLINE bool IsSurrogatePair(const JSChar* chars, size_t length, size_t i) {
+    return chars[i] >= 0xD800 && chars[i] <= 0xDBFF && i + 1 < length && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF;
+}
+
+//落单的代理项按U+FFFD输出，和代理项本身一样是3个字节
+static V8_INLINE size_t Utf8CharLength(const JSChar* chars, size_t length, size_t& i) {
+    JSChar c = chars[i];
+    if (c < 0x80) {
+        i += 1;
+        return 1;
+    } else if (c < 0x800) {
+        i += 1;
+        return 2;
+    } else if (IsSurrogatePair(chars, length, i)) {
+        i += 2;
+        return 4;
+    }
+    i += 1;
+    return 3;
+}
+
+static V8_INLINE char* WriteUtf8Char(const JSChar* chars, size_t length, size_t& i, char* out) {
+    uint32_t c = chars[i];
+    if (c < 0x80) {
+        *out++ = (char)c;
+        i += 1;
+        return out;
+    } else if (c < 0x800) {
+        *out++ = (char)(0xC0 | (c >> 6));
+        *out++ = (char)(0x80 | (c & 0x3F));
+        i += 1;
+        return out;
+    } else if (IsSurrogatePair(chars, length, i)) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (chars[i + 1] - 0xDC00);
+        *out++ = (char)(0xF0 | (c >> 18));
+        *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (c & 0x3F));
+        i += 2;
+        return out;
+    }
+    if (c >= 0xD800 && c <= 0xDFFF) {
+        c = 0xFFFD;
+    }
+    *out++ = (char)(0xE0 | (c >> 12));
+    *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+    *out++ = (char)(0x80 | (c & 0x3F));
+    i += 1;
+    return out;
+}
+
+static size_t Utf16ToUtf8Length(const JSChar* chars, size_t length) {
+    size_t i = 0;
+    size_t ret = 0;
+#if V8_UTF8_USE_AVX2
+    const __m256i surrogate_mask256 = _mm256_set1_epi16((short)0xF800);
+    const __m256i surrogate_tag256 = _mm256_set1_epi16((short)0xD800);
+    const __m256i max_ascii256 = _mm256_set1_epi16(0x7F);
+    const __m256i max_two_bytes256 = _mm256_set1_epi16(0x7FF);
+    const __m256i zero256 = _mm256_setzero_si256();
+    while (i + 16 <= length) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chars + i));
+        __m256i surrogate = _mm256_cmpeq_epi16(_mm256_and_si256(v, surrogate_mask256), surrogate_tag256);
+        if (!_mm256_testz_si256(surrogate, surrogate)) {
+            //代理对可能跨块，按标量处理到块尾
+            size_t end = i + 16;
+            while (i < end) {
+                ret += Utf8CharLength(chars, length, i);
+            }
+            continue;
+        }
+        //每个字符在movemask里占2位：ascii算1字节，非ascii加1，>=0x800再加1
+        uint32_t ascii = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(v, max_ascii256), zero256));
+        uint32_t two_bytes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(v, max_two_bytes256), zero256));
+        ret += 16 + (16 - PopCount32(ascii) / 2) + (16 - PopCount32(two_bytes) / 2);
+        i += 16;
+    }
+#endif
+#if V8_UTF8_USE_SSE2
+    const __m128i surrogate_mask = _mm_set1_epi16((short)0xF800);
+    const __m128i surrogate_tag = _mm_set1_epi16((short)0xD800);
+    const __m128i max_ascii = _mm_set1_epi16(0x7F);
+    const __m128i max_two_bytes = _mm_set1_epi16(0x7FF);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 8 <= length) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate_tag))) {
+            size_t end = i + 8;
+            while (i < end) {
+                ret += Utf8CharLength(chars, length, i);
+            }
+            continue;
+        }
+        uint32_t ascii = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(v, max_ascii), zero));
+        uint32_t two_bytes = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(v, max_two_bytes), zero));
+        ret += 8 + (8 - PopCount32(ascii) / 2) + (8 - PopCount32(two_bytes) / 2);
+        i += 8;
+    }
+#endif
+    while (i < length) {
+        ret += Utf8CharLength(chars, length, i);
+    }
+    return ret;
+}
+
+//out至少要有Utf16ToUtf8Length个字节，不写结尾的'\0'，返回写入的字节数
+static size_t Utf16ToUtf8(const JSChar* chars, size_t length, char* out) {
+    char* start = out;
+    size_t i = 0;
+#if V8_UTF8_USE_AVX2
+    const __m256i non_ascii256 = _mm256_set1_epi16((short)0xFF80);
+    while (i + 32 <= length) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chars + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chars + i + 16));
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), non_ascii256)) {
+            //packus按128位lane交错，需要再按64位重排一次
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+            out += 32;
+            i += 32;
+            continue;
+        }
+        size_t end = i + 32;
+        while (i < end) {
+            out = WriteUtf8Char(chars, length, i, out);
+        }
+    }
+#endif
+#if V8_UTF8_USE_SSE2
+    const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= length) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i + 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(a, b), non_ascii), zero)) == 0xFFFF) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(a, b));
+            out += 16;
+            i += 16;
+            continue;
+        }
+        size_t end = i + 16;
+        while (i < end) {
+            out = WriteUtf8Char(chars, length, i, out);
+        }
+    }
+#endif
+    while (i < length) {
+        out = WriteUtf8Char(chars, length, i, out);
+    }
+    return out - start;
+}
+
+static std::string JSStringToUtf8(JSStringRef str) {
+    const JSChar* chars = JSStringGetCharactersPtr(str);
+    size_t length = JSStringGetLength(str);
+    std::string ret(Utf16ToUtf8Length(chars, length), '\0');
+    Utf16ToUtf8(chars, length, &ret[0]);
+    return ret;
+}
+
+static JSValueRef GetErrorProperty(JSContextRef ctx, JSObjectRef error, const char* name) {
+    //只在出错时走到，不用intern表，后台线程的临时vm里也可以调用
+    JSStringRef name_string = JSStringCreateWithUTF8CString(name);
+    JSValueRef ret = JSObjectGetProperty(ctx, error, name_string, nullptr);
+    JSStringRelease(name_string);
+    return ret;
+}
+
+static std::string GetErrorString(JSContextRef ctx, JSValueRef val) {
+    std::string ret;
+    JSStringRef str = val ? JSValueToStringCopy(ctx, val, nullptr) : nullptr;
+    if (str) {
+        ret = JSStringToUtf8(str);
+        JSStringRelease(str);
+    }
+    return ret;
+}
+
+//jsc的Error对象上有line、column(都从1开始)和sourceURL属性
+static void GetErrorLocation(JSContextRef ctx, JSValueRef exception, ErrorLocation* location) {
+    location->text_ = GetErrorString(ctx, exception);
+    if (!JSValueIsObject(ctx, exception)) {
+        location->message_ = location->text_;
+        return;
+    }
+    JSObjectRef error = const_cast<JSObjectRef>(exception);
+    JSValueRef message = GetErrorProperty(ctx, error, "message");
+    location->message_ = message && JSValueIsString(ctx, message) ? GetErrorString(ctx, message) : location->text_;
+    JSValueRef line = GetErrorProperty(ctx, error, "line");
+    if (line && JSValueIsNumber(ctx, line)) {
+        location->line_ = (int)JSValueToNumber(ctx, line, nullptr);
+    }
+    JSValueRef column = GetErrorProperty(ctx, error, "column");
+    if (column && JSValueIsNumber(ctx, column)) {
+        location->column_ = (int)JSValueToNumber(ctx, column, nullptr);
+    }
+    JSValueRef url = GetErrorProperty(ctx, error, "sourceURL");
+    if (url && JSValueIsString(ctx, url)) {
+        location->resource_name_ = GetErrorString(ctx, url);
+    }
+}
+
+int String::Utf8Length(Isolate* isolate) const {
+    const Isolate::InternValueEntry* interned = isolate->FindInternedValue(value_);
+    if (interned) {
+        return (int)interned->len_;
+    }
+    JSStringRef stringRef = JSValueToStringCopy(isolate->current_js_context_, value_, nullptr);
+    if (stringRef == nullptr) {
+        return 0;
+    }
+    size_t len = Utf16ToUtf8Length(JSStringGetCharactersPtr(stringRef), JSStringGetLength(stringRef));
+    JSStringRelease(stringRef);
+    return (int)len;
+}
+
+int String::WriteUtf8(Isolate* isolate, char* buffer) const {
+    //和v8一样写入结尾的'\0'，返回值包含'\0'，buffer至少要有Utf8Length() + 1个字节
+    const Isolate::InternValueEntry* interned = isolate->FindInternedValue(value_);
+    if (interned) {
+        memcpy(buffer, interned->key_, interned->len_ + 1);
+        return (int)interned->len_ + 1;
+    }
+    JSStringRef stringRef = JSValueToStringCopy(isolate->current_js_context_, value_, nullptr);
+    if (stringRef == nullptr) {
+        buffer[0] = '\0';
+        return 1;
+    }
+    size_t len = Utf16ToUtf8(JSStringGetCharactersPtr(stringRef), JSStringGetLength(stringRef), buffer);
+    buffer[len] = '\0';
+    JSStringRelease(stringRef);
+    return (int)len + 1;
+}
+
+//返回的JSStringRef由调用方release，intern过的字符串直接复用表里的
+static JSStringRef RetainJSString(Isolate* isolate, JSContextRef ctx, JSValueRef val) {
+    JSStringRef interned = isolate->GetInternedName(val);
+    if (interned) {
+        return JSStringRetain(interned);
+    }
+    return JSValueToStringCopy(ctx, val, nullptr);
+}
+
+JSStringRef Script::GetSourceString_(Local<Context> context, Local<String> source) {
+    return RetainJSString(context->GetIsolate(), context->context_, source->value_);
+}
+
+JSStringRef Script::GetResourceName_(Local<Context> context, const ScriptOrigin* origin) {
+    Isolate* isolate = context->GetIsolate();
+    JSStringRef resource_name = nullptr;
+    if (origin && !origin->resource_name_.IsEmpty()) {
+        resource_name = RetainJSString(isolate, context->context_, origin->resource_name_->value_);
+    }
+    if (resource_name == nullptr) {
+        resource_name = JSStringRetain(isolate->InternString("eval", 4));
+    }
+    return resource_name;
+}
+
+static void ThrowSyntaxError(Isolate* isolate, JSContextRef ctx, const std::string& message,
+                             int line, int column, JSStringRef resource_name);
+
+static bool FindTopLevelLexicalDeclaration(JSStringRef source, std::string* name);
+
+static void MarkContextDirty(Context* context, bool lexical);
+
+MaybeLocal<Script> Script::Compile_(Local<Context> context, JSStringRef source,
+                                    JSStringRef resource_name, bool check_syntax,
+                                    JSScriptRef compiled) {
+    Script* script = new Script();
+    //有ContextPool时才需要知道，没有检查过的脚本按有顶层声明处理
+    script->top_level_lexical_ = context->GetIsolate()->context_pools_ == 0 || FindTopLevelLexicalDeclaration(source, nullptr);
+#ifdef V8_JSC_USE_SCRIPT_REF
+    if (compiled) {
+        JSScriptRetain(compiled);
+        script->script_ = compiled;
+        script->resource_name_ = resource_name;
+        JSStringRelease(source);
+        return MaybeLocal<Script>(Local<Script>(script));
+    }
+    //这次解析同时就是语法检查，Run的时候直接执行，不再解析源码
+    JSStringRef error_message = nullptr;
+    int error_line = 0;
+    script->script_ = JSScriptCreateFromString(context->GetIsolate()->virtualMachine_, resource_name, 1, source,
+                                               &error_message, &error_line);
+    if (script->script_ == nullptr) {
+        std::string message = error_message ? JSStringToUtf8(error_message) : "SyntaxError";
+        if (error_message) {
+            JSStringRelease(error_message);
+        }
+        if (check_syntax) {
+            ThrowSyntaxError(context->GetIsolate(), context->context_, message, error_line, -1, resource_name);
+            JSStringRelease(source);
+            JSStringRelease(resource_name);
+            delete script;
+            return MaybeLocal<Script>();
+        }
+        //已经验证过的脚本不会走到这里，退回到Run时JSEvaluateScript
+        script->source_ = source;
+    } else {
+        JSStringRelease(source);
+    }
+#else
+    //公开接口没有解析一次、多次执行的办法，只能先检查语法，Run时再由jsc解析
+    JSValueRef exception = nullptr;
+    if (check_syntax && !JSCheckScriptSyntax(context->context_, source, resource_name, 1, &exception)) {
+        JSStringRelease(source);
+        JSStringRelease(resource_name);
+        delete script;
+        //SyntaxError带有出错的行列，交给TryCatch
+        context->GetIsolate()->handleException(exception);
+        return MaybeLocal<Script>();
+    }
+    script->source_ = source;
+#endif
+    script->resource_name_ = resource_name;
+    return MaybeLocal<Script>(Local<Script>(script));
+}
+
+MaybeLocal<Script> Script::Compile(
+    Local<Context> context, Local<String> source,
+    ScriptOrigin* origin) {
+    JSStringRef source_string = GetSourceString_(context, source);
+    if (source_string == nullptr) {
+        return MaybeLocal<Script>();
+    }
+    return Compile_(context, source_string, GetResourceName_(context, origin), true);
+}
+
+//CachedData和缓存文件的内容：magic、格式版本、源码的utf16长度和内容hash
+struct CodeCacheHeader {
+    uint32_t magic_;
+    uint32_t version_;
+    uint64_t length_;
+    uint64_t hash_;
+};
+
+static const uint32_t kCodeCacheMagic = 0x4343534a;
+
+static const uint32_t kCodeCacheVersion = 1;
+
+static uint64_t HashScriptSource(const JSChar* chars, size_t length) {
+    //8字节一组做乘法混合，几MB的bundle也只是一次顺序扫描
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(chars);
+    size_t size = length * sizeof(JSChar);
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (size * 0xBF58476D1CE4E5B9ull);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t k;
+        memcpy(&k, p + i, 8);
+        k *= 0xBF58476D1CE4E5B9ull;
+        k ^= k >> 31;
+        h = (h ^ k) * 0x94D049BB133111EBull;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, size - i);
+    h = (h ^ (tail * 0xBF58476D1CE4E5B9ull)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 32);
+}
+
+static bool MatchCodeCache(const uint8_t* data, size_t size, const CodeCacheHeader& expect) {
+    if (data == nullptr || size != sizeof(CodeCacheHeader)) {
+        return false;
+    }
+    CodeCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    return header.magic_ == expect.magic_ && header.version_ == expect.version_
+        && header.length_ == expect.length_ && header.hash_ == expect.hash_;
+}
+
+static std::string CodeCachePath(const std::string& directory, uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.jsccache", (unsigned long long)hash);
+    return directory + name;
+}
+
+static bool ReadCodeCacheFile(const std::string& path, const CodeCacheHeader& expect) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint8_t data[sizeof(CodeCacheHeader) + 1];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    return MatchCodeCache(data, size, expect);
+}
+
+static void WriteCodeCacheFile(const std::string& path, const CodeCacheHeader& header) {
+    //先写临时文件再rename，别的进程不会读到写了一半的文件
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+    }
+}
+
+void Isolate::AddValidatedScript_(uint64_t hash) {
+    if (validated_scripts_.size() >= kValidatedScriptLimit && !validated_scripts_.count(hash)) {
+        validated_scripts_.erase(validated_scripts_.begin());
+    }
+    validated_scripts_.insert(hash);
+}
+
+#ifdef V8_JSC_USE_SCRIPT_REF
+JSScriptRef Isolate::FindCompiledScript_(const std::pair<std::string, uint64_t>& key, uint64_t length) {
+    auto it = compiled_scripts_.find(key);
+    if (it == compiled_scripts_.end() || it->second.length_ != length) {
+        return nullptr;
+    }
+    it->second.last_use_ = ++compiled_script_clock_;
+    return it->second.script_;
+}
+
+void Isolate::AddCompiledScript_(const std::pair<std::string, uint64_t>& key, uint64_t length, JSScriptRef script) {
+    auto it = compiled_scripts_.find(key);
+    if (it != compiled_scripts_.end()) {
+        JSScriptRelease(it->second.script_);
+        compiled_scripts_.erase(it);
+    } else if (compiled_scripts_.size() >= kCompiledScriptLimit) {
+        auto oldest = compiled_scripts_.begin();
+        for (auto i = compiled_scripts_.begin(); i != compiled_scripts_.end(); ++i) {
+            if (i->second.last_use_ < oldest->second.last_use_) {
+                oldest = i;
+            }
+        }
+        JSScriptRelease(oldest->second.script_);
+        compiled_scripts_.erase(oldest);
+    }
+    JSScriptRetain(script);
+    compiled_scripts_[key] = CompiledScriptEntry{script, length, ++compiled_script_clock_};
+}
+#endif
+
+MaybeLocal<Script> ScriptCompiler::Compile(
+    Local<Context> context, Source* source,
+    CompileOptions options) {
+    Isolate* isolate = context->GetIsolate();
+    JSStringRef source_string = Script::GetSourceString_(context, source->source_string);
+    if (source_string == nullptr) {
+        return MaybeLocal<Script>();
+    }
+    ScriptOrigin origin(source->resource_name);
+    JSStringRef resource_name = Script::GetResourceName_(context, &origin);
+    bool use_disk = !isolate->code_cache_dir_.empty();
+    
+    CodeCacheHeader header;
+    header.magic_ = kCodeCacheMagic;
+    header.version_ = kCodeCacheVersion;
+    header.length_ = JSStringGetLength(source_string);
+    header.hash_ = HashScriptSource(JSStringGetCharactersPtr(source_string), (size_t)header.length_);
+    
+    JSScriptRef compiled = nullptr;
+#ifdef V8_JSC_USE_SCRIPT_REF
+    std::pair<std::string, uint64_t> key(JSStringToUtf8(resource_name), header.hash_);
+    compiled = isolate->FindCompiledScript_(key, header.length_);
+#endif
+    
+    bool validated = compiled != nullptr;
+    if (options == kConsumeCodeCache && source->cached_data) {
+        bool matched = MatchCodeCache(source->cached_data->data, (size_t)std::max(source->cached_data->length, 0), header);
+        source->cached_data->rejected = !matched;
+        validated = validated || matched;
+    }
+    if (!validated) {
+        validated = isolate->validated_scripts_.count(header.hash_) > 0;
+    }
+    bool checked = !validated;
+    if (!validated && use_disk) {
+        validated = ReadCodeCacheFile(CodeCachePath(isolate->code_cache_dir_, header.hash_), header);
+        checked = !validated;
+    }
+    
+    MaybeLocal<Script> ret = Script::Compile_(context, source_string, resource_name, checked, compiled);
+    if (ret.IsEmpty()) {
+        return ret;
+    }
+    isolate->AddValidatedScript_(header.hash_);
+#ifdef V8_JSC_USE_SCRIPT_REF
+    Script* script = *ret.ToLocalChecked();
+    if (compiled == nullptr && script->script_) {
+        isolate->AddCompiledScript_(key, header.length_, script->script_);
+    }
+#endif
+    if (checked && use_disk) {
+        WriteCodeCacheFile(CodeCachePath(isolate->code_cache_dir_, header.hash_), header);
+    }
+    if (options == kProduceCodeCache) {
+        uint8_t* data = new uint8_t[sizeof(header)];
+        memcpy(data, &header, sizeof(header));
+        delete source->cached_data;
+        source->cached_data = new CachedData(data, sizeof(header), CachedData::BufferOwned);
+    }
+    return ret;
+}
+
+static V8_INLINE CodeCacheHeader MakeCodeCacheHeader(const JSChar* chars, size_t length) {
+    CodeCacheHeader header;
+    header.magic_ = kCodeCacheMagic;
+    header.version_ = kCodeCacheVersion;
+    header.length_ = length;
+    header.hash_ = HashScriptSource(chars, length);
+    return header;
+}
+
+static JSChar* ReserveChars(ScriptCompiler::StreamedSource* source, size_t count) {
+    if (source->length_ + count > source->capacity_) {
+        size_t capacity = std::max(source->capacity_ * 2, source->length_ + count);
+        source->chars_ = static_cast<JSChar*>(realloc(source->chars_, capacity * sizeof(JSChar)));
+        source->capacity_ = capacity;
+    }
+    return source->chars_ + source->length_;
+}
+
+//windows-1252在0x80~0x9F和latin1不同
+static const JSChar kWindows1252Table[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+//utf8解码到dst，dst至少要有size个单元，n返回写入的单元数。返回消费的字节数：
+//last为false时，末尾不完整的序列留给下一块。非法序列输出U+FFFD
+static size_t DecodeUtf8(const uint8_t* src, size_t size, bool last, JSChar* dst, size_t& n) {
+    n = 0;
+    size_t i = 0;
+    while (i < size) {
+#if V8_UTF8_USE_SSE2
+        if (i + 16 <= size) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            if (_mm_movemask_epi8(v) == 0) {
+                const __m128i zero = _mm_setzero_si128();
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n), _mm_unpacklo_epi8(v, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n + 8), _mm_unpackhi_epi8(v, zero));
+                i += 16;
+                n += 16;
+                continue;
+            }
+        }
+#endif
+        uint8_t c = src[i];
+        if (c < 0x80) {
+            dst[n++] = c;
+            i++;
+            continue;
+        }
+        size_t need;
+        uint32_t cp;
+        uint32_t min;
+        if ((c & 0xE0) == 0xC0) {
+            need = 1;
+            cp = c & 0x1F;
+            min = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            need = 2;
+            cp = c & 0x0F;
+            min = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            need = 3;
+            cp = c & 0x07;
+            min = 0x10000;
+        } else {
+            dst[n++] = 0xFFFD;
+            i++;
+            continue;
+        }
+        if (i + need >= size && !last) {
+            break;
+        }
+        size_t k = 1;
+        for (; k <= need && i + k < size && (src[i + k] & 0xC0) == 0x80; k++) {
+            cp = (cp << 6) | (src[i + k] & 0x3F);
+        }
+        if (k <= need || cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+            dst[n++] = 0xFFFD;
+            i += k;
+            continue;
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            dst[n++] = (JSChar)(0xD800 + (cp >> 10));
+            dst[n++] = (JSChar)(0xDC00 + (cp & 0x3FF));
+        } else {
+            dst[n++] = (JSChar)cp;
+        }
+        i += need + 1;
+    }
+    return i;
+}
+
+static size_t DecodeUtf8Chunk(const uint8_t* src, size_t size, bool last, ScriptCompiler::StreamedSource* source) {
+    //utf16的单元数不会超过utf8的字节数
+    JSChar* dst = ReserveChars(source, size);
+    size_t n = 0;
+    size_t i = DecodeUtf8(src, size, last, dst, n);
+    source->length_ += n;
+    return i;
+}
+
+//data不要求'\0'结尾，中间可以有'\0'
+static JSStringRef CreateJSStringFromUtf8(const char* data, size_t len) {
+    JSChar stack_buffer[kStackCharBufferSize];
+    JSChar* chars = len <= kStackCharBufferSize ? stack_buffer : static_cast<JSChar*>(malloc(len * sizeof(JSChar)));
+    size_t n = 0;
+    DecodeUtf8(reinterpret_cast<const uint8_t*>(data), len, true, chars, n);
+    JSStringRef ret = JSStringCreateWithCharacters(chars, n);
+    if (chars != stack_buffer) {
+        free(chars);
+    }
+    return ret;
+}
+
+//返回消费的字节数，未消费的部分(utf8不完整的序列、two byte的半个字符)由调用方拼到下一块前面
+static size_t DecodeSourceChunk(const uint8_t* src, size_t size, bool last, ScriptCompiler::StreamedSource* source) {
+    switch (source->encoding_) {
+        case ScriptCompiler::StreamedSource::UTF8:
+            return DecodeUtf8Chunk(src, size, last, source);
+        case ScriptCompiler::StreamedSource::TWO_BYTE: {
+            size_t count = size / sizeof(JSChar);
+            memcpy(ReserveChars(source, count), src, count * sizeof(JSChar));
+            source->length_ += count;
+            return count * sizeof(JSChar);
+        }
+        default: {
+            JSChar* dst = ReserveChars(source, size);
+            WidenLatin1(reinterpret_cast<const char*>(src), size, dst);
+            if (source->encoding_ == ScriptCompiler::StreamedSource::WINDOWS_1252) {
+                for (size_t i = 0; i < size; i++) {
+                    if (dst[i] >= 0x80 && dst[i] < 0xA0) {
+                        dst[i] = kWindows1252Table[dst[i] - 0x80];
+                    }
+                }
+            }
+            source->length_ += size;
+            return size;
+        }
+    }
+}
+
+void ScriptCompiler::ScriptStreamingTask::Run() {
+    StreamedSource* source = source_;
+    int expected = StreamedSource::kNotStarted;
+    if (!source->state_.compare_exchange_strong(expected, StreamedSource::kRunning)) {
+        return;
+    }
+    //解码和io交替进行，每来一块就解一块
+    std::vector<uint8_t> carry;
+    for (;;) {
+        const uint8_t* chunk = nullptr;
+        size_t size = source->source_stream_->GetMoreData(&chunk);
+        if (size == 0) {
+            delete[] chunk;
+            break;
+        }
+        if (carry.empty()) {
+            size_t used = DecodeSourceChunk(chunk, size, false, source);
+            carry.assign(chunk + used, chunk + size);
+        } else {
+            carry.insert(carry.end(), chunk, chunk + size);
+            size_t used = DecodeSourceChunk(carry.data(), carry.size(), false, source);
+            carry.erase(carry.begin(), carry.begin() + used);
+        }
+        delete[] chunk;
+    }
+    if (!carry.empty()) {
+        if (source->encoding_ == StreamedSource::TWO_BYTE) {
+            //剩下半个字符
+            *ReserveChars(source, 1) = 0xFFFD;
+            source->length_++;
+        } else {
+            DecodeSourceChunk(carry.data(), carry.size(), true, source);
+        }
+    }
+    
+    CodeCacheHeader header = MakeCodeCacheHeader(source->chars_, source->length_);
+    source->hash_ = header.hash_;
+    if (!code_cache_dir_.empty() && ReadCodeCacheFile(CodeCachePath(code_cache_dir_, header.hash_), header)) {
+        source->syntax_ok_ = true;
+    } else {
+        //语法检查和isolate的vm无关，用一个临时的vm，不阻塞isolate线程
+        JSContextGroupRef group = JSContextGroupCreate();
+        JSGlobalContextRef context = JSGlobalContextCreateInGroup(group, nullptr);
+#if V8_JSC_USE_NOCOPY_STRING
+        JSStringRef script = JSStringCreateWithCharactersNoCopy(source->chars_, source->length_);
+#else
+        JSStringRef script = JSStringCreateWithCharacters(source->chars_, source->length_);
+#endif
+        JSValueRef exception = nullptr;
+        source->syntax_ok_ = JSCheckScriptSyntax(context, script, nullptr, 1, &exception);
+        if (!source->syntax_ok_ && exception) {
+            //临时vm里的值带不出去，只记下信息
+            ErrorLocation location;
+            GetErrorLocation(context, exception, &location);
+            source->error_message_ = location.message_;
+            source->error_line_ = location.line_;
+            source->error_column_ = location.column_;
+        }
+        JSStringRelease(script);
+        JSGlobalContextRelease(context);
+        JSContextGroupRelease(group);
+        if (source->syntax_ok_ && !code_cache_dir_.empty()) {
+            WriteCodeCacheFile(CodeCachePath(code_cache_dir_, header.hash_), header);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(source->mutex_);
+        source->state_ = StreamedSource::kDone;
+    }
+    source->done_.notify_all();
+}
+
+ScriptCompiler::ScriptStreamingTask* ScriptCompiler::StartStreaming(Isolate* isolate, StreamedSource* source) {
+    return new ScriptStreamingTask(source, isolate->code_cache_dir_);
+}
+
+static void SetErrorProperty(JSContextRef ctx, JSObjectRef error, const char* name, JSValueRef value) {
+    JSStringRef name_string = JSStringCreateWithUTF8CString(name);
+    JSObjectSetProperty(ctx, error, name_string, value, kJSPropertyAttributeDontEnum, nullptr);
+    JSStringRelease(name_string);
+}
+
+static JSObjectRef NewError(JSContextRef ctx, const char* constructor_name, const std::string& message) {
+    JSStringRef message_string = JSStringCreateWithUTF8CString(message.c_str());
+    JSValueRef args[] = {JSValueMakeString(ctx, message_string)};
+    JSStringRelease(message_string);
+    JSValueRef constructor = GetErrorProperty(ctx, JSContextGetGlobalObject(ctx), constructor_name);
+    JSObjectRef error = nullptr;
+    if (constructor && JSValueIsObject(ctx, constructor)) {
+        error = JSObjectCallAsConstructor(ctx, const_cast<JSObjectRef>(constructor), 1, args, nullptr);
+    }
+    if (error == nullptr) {
+        error = JSObjectMakeError(ctx, 1, args, nullptr);
+    }
+    return error;
+}
+
+//在别的vm里检查出的语法错误在isolate的context里重建成SyntaxError，行列和直接Compile时一致
+static void ThrowSyntaxError(Isolate* isolate, JSContextRef ctx, const std::string& message,
+                             int line, int column, JSStringRef resource_name) {
+    JSObjectRef error = NewError(ctx, "SyntaxError", message);
+    if (line >= 0) {
+        SetErrorProperty(ctx, error, "line", JSValueMakeNumber(ctx, line));
+    }
+    if (column >= 0) {
+        SetErrorProperty(ctx, error, "column", JSValueMakeNumber(ctx, column));
+    }
+    SetErrorProperty(ctx, error, "sourceURL", JSValueMakeString(ctx, resource_name));
+    isolate->handleException(error);
+}
+
+static void ThrowStreamedSyntaxError(Local<Context> context, ScriptCompiler::StreamedSource* source, const ScriptOrigin& origin) {
+    JSStringRef resource_name = Script::GetResourceName_(context, &origin);
+    ThrowSyntaxError(context->GetIsolate(), context->context_, source->error_message_,
+                     source->error_line_, source->error_column_, resource_name);
+    JSStringRelease(resource_name);
+}
+
+MaybeLocal<Script> ScriptCompiler::Compile(
+    Local<Context> context, StreamedSource* source,
+    Local<String> full_source_string, const ScriptOrigin& origin) {
+    Isolate* isolate = context->GetIsolate();
+    //还没开始就在当前线程执行，已经在后台执行就等它完成
+    ScriptStreamingTask(source, isolate->code_cache_dir_).Run();
+    {
+        std::unique_lock<std::mutex> lock(source->mutex_);
+        source->done_.wait(lock, [source] { return source->state_ == StreamedSource::kDone; });
+    }
+    if (!source->syntax_ok_) {
+        ThrowStreamedSyntaxError(context, source, origin);
+        return MaybeLocal<Script>();
+    }
+    isolate->AddValidatedScript_(source->hash_);
+    
+    //脚本里定义的函数在懒编译时还会读源码，源码的生命周期跟不上Script句柄，
+    //只有大的源码在isolate的额度内直接交给jsc引用，由isolate持有到销毁，其余的拷贝，解码结果随StreamedSource释放
+    JSStringRef source_string = nullptr;
+#if V8_JSC_USE_NOCOPY_STRING
+    if (isolate->ReserveExternalString_(source->length_ * sizeof(JSChar))) {
+        source_string = JSStringCreateWithCharactersNoCopy(source->chars_, source->length_);
+        isolate->external_string_buffers_.push_back(source->chars_);
+        source->chars_ = nullptr;
+        source->length_ = 0;
+        source->capacity_ = 0;
+    }
+#endif
+    if (source_string == nullptr) {
+        source_string = JSStringCreateWithCharacters(source->chars_, source->length_);
+    }
+    return Script::Compile_(context, source_string, Script::GetResourceName_(context, &origin), false);
+}
+
+void ScriptCompiler::SetCodeCacheDirectory(Isolate* isolate, const char* directory) {
+    isolate->code_cache_dir_ = directory ? directory : "";
+    while (isolate->code_cache_dir_.size() > 1 && (isolate->code_cache_dir_.back() == '/' || isolate->code_cache_dir_.back() == '\\')) {
+        isolate->code_cache_dir_.pop_back();
+    }
+}
+
+static V8_INLINE MaybeLocal<Value> ProcessResult(Isolate *isolate, JSValueRef ret) {
+    //脚本执行的返回值由HandleScope接管，这可能有需要GC的对象
+    Value* val = isolate->Alloc<Value>(ret);
+    return MaybeLocal<Value>(Local<Value>(val));
+}
+
+MaybeLocal<Value> Script::Run(Local<Context> context) {
+    auto isolate = context->GetIsolate();
+    if (context->pool_entry_) {
+        MarkContextDirty(*context, top_level_lexical_);
+    }
+
+    JSValueRef jscException = nullptr;
+    JSValueRef ret;
+#ifdef V8_JSC_USE_SCRIPT_REF
+    if (script_) {
+        ret = JSScriptEvaluate(context->context_, script_, nullptr, &jscException);
+    } else
+#endif
+    {
+        ret = JSEvaluateScript(context->context_, source_, nullptr, resource_name_, 1, &jscException);
+    }
+    if (jscException) {
+        isolate->handleException(jscException);
+        return MaybeLocal<Value>();
+    }
+
+    return ProcessResult(isolate, ret);
+}
+
+Script::~Script() {
+    if (source_) {
+        JSStringRelease(source_);
+    }
+    JSStringRelease(resource_name_);
+#ifdef V8_JSC_USE_SCRIPT_REF
+    if (script_) {
+        JSScriptRelease(script_);
+    }
+#endif
+}
+
+//module源码的词法扫描，只识别改写import/export需要的token：名字、字符串、标点，其余(数字、正则、模板)归为kModuleTokenOther
+enum ModuleTokenType {
+    kModuleTokenEnd,
+    kModuleTokenName,
+    kModuleTokenString,
+    kModuleTokenPunct,
+    kModuleTokenOther
+};
+
+struct ModuleToken {
+    ModuleTokenType type_;
+    size_t start_;
+    size_t end_;
+    //和上一个token之间有换行
+    bool newline_before_;
+};
+
+static V8_INLINE bool IsModuleNameStart(JSChar c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '$' || c == '_' || c == '\\' || c >= 0x80;
+}
+
+static V8_INLINE bool IsModuleNamePart(JSChar c) {
+    return IsModuleNameStart(c) || (c >= '0' && c <= '9');
+}
+
+static V8_INLINE bool IsModuleLineTerminator(JSChar c) {
+    return c == '\n' || c == '\r' || c == 0x2028 || c == 0x2029;
+}
+
+static V8_INLINE bool IsModuleWhiteSpace(JSChar c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == 0xA0 || c == 0xFEFF || c == 0x1680
+        || (c >= 0x2000 && c <= 0x200A) || c == 0x202F || c == 0x205F || c == 0x3000;
+}
+
+//token之后能不能跟正则：除号只能出现在表达式之后
+static const char* const kModuleRegexKeywords[] = {
+    "return", "typeof", "instanceof", "in", "of", "new", "delete", "void",
+    "throw", "case", "do", "else", "yield", "await"
+};
+
+//这些关键字之后的(...)是语句的条件，)之后是语句，可以跟正则
+static const char* const kModuleConditionKeywords[] = {
+    "if", "while", "for", "with"
+};
+
+//这些关键字之后的{是代码块
+static const char* const kModuleBlockKeywords[] = {
+    "else", "try", "finally", "do"
+};
+
+class ModuleScanner {
+public:
+    ModuleScanner(const JSChar* chars, size_t length) : chars_(chars), length_(length) {}
+
+    V8_INLINE bool Is(const ModuleToken& token, const char* text) const {
+        size_t len = strlen(text);
+        if (token.end_ - token.start_ != len) {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (chars_[token.start_ + i] != (JSChar)text[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    V8_INLINE bool IsPunct(const ModuleToken& token, char c) const {
+        return token.type_ == kModuleTokenPunct && token.end_ - token.start_ == 1 && chars_[token.start_] == (JSChar)c;
+    }
+
+    template <size_t N>
+    V8_INLINE bool IsOneOf(const ModuleToken& token, const char* const (&texts)[N]) const {
+        if (token.type_ != kModuleTokenName) {
+            return false;
+        }
+        for (size_t i = 0; i < N; i++) {
+            if (Is(token, texts[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //=>在扫描时是两个相邻的标点
+    V8_INLINE bool IsArrow(const ModuleToken& token) const {
+        return IsPunct(token, '=') && token.end_ < length_ && chars_[token.end_] == '>';
+    }
+
+    V8_INLINE ModuleToken Peek() const {
+        ModuleScanner copy = *this;
+        return copy.Next();
+    }
+
+    V8_INLINE ModuleToken Next() {
+        ModuleToken token = Scan();
+        prev_ = token;
+        return token;
+    }
+
+    V8_INLINE void SkipTo(size_t pos) {
+        pos_ = pos;
+    }
+
+    V8_INLINE int depth() const {
+        return depth_;
+    }
+
+private:
+    //{开始的是代码块还是对象字面量(或者类体)，决定}之后是语句还是表达式
+    bool BlockStart() const {
+        if (prev_.type_ == kModuleTokenEnd) {
+            return true;
+        }
+        if (prev_.type_ == kModuleTokenName) {
+            return IsOneOf(prev_, kModuleBlockKeywords);
+        }
+        if (prev_.type_ != kModuleTokenPunct || prev_.end_ - prev_.start_ != 1) {
+            return false;
+        }
+        JSChar c = chars_[prev_.start_];
+        //=>之后的函数体
+        return c == ';' || c == '{' || c == '}' || c == ')' || (c == '>' && prev_.start_ > 0 && chars_[prev_.start_ - 1] == '=');
+    }
+
+    ModuleToken Scan() {
+        ModuleToken token;
+        token.newline_before_ = SkipSpace();
+        token.start_ = pos_;
+        if (pos_ >= length_) {
+            token.type_ = kModuleTokenEnd;
+            token.end_ = pos_;
+            return token;
+        }
+        JSChar c = chars_[pos_];
+        if (c == '`') {
+            pos_++;
+            ScanTemplate();
+            token.type_ = kModuleTokenOther;
+        } else if (c == '\'' || c == '"') {
+            ScanString(c);
+            token.type_ = kModuleTokenString;
+            regex_allowed_ = false;
+        } else if (IsModuleNameStart(c)) {
+            while (pos_ < length_ && IsModuleNamePart(chars_[pos_])) {
+                pos_ += chars_[pos_] == '\\' ? 2 : 1;
+            }
+            pos_ = std::min(pos_, length_);
+            token.type_ = kModuleTokenName;
+            token.end_ = pos_;
+            //a.return之类的属性名不是关键字
+            regex_allowed_ = !IsPunct(prev_, '.') && IsOneOf(token, kModuleRegexKeywords);
+            return token;
+        } else if ((c >= '0' && c <= '9') || (c == '.' && pos_ + 1 < length_ && chars_[pos_ + 1] >= '0' && chars_[pos_ + 1] <= '9')) {
+            ScanNumber();
+            token.type_ = kModuleTokenOther;
+            regex_allowed_ = false;
+        } else if (c == '/' && regex_allowed_) {
+            ScanRegExp();
+            token.type_ = kModuleTokenOther;
+            regex_allowed_ = false;
+        } else if (c == '}' && !template_depths_.empty() && template_depths_.back() == depth_ - 1) {
+            //模板字符串里${}的结束，继续扫描模板
+            template_depths_.pop_back();
+            depth_--;
+            pos_++;
+            ScanTemplate();
+            token.type_ = kModuleTokenOther;
+        } else {
+            token.type_ = kModuleTokenPunct;
+            if (c == '.' && pos_ + 2 < length_ && chars_[pos_ + 1] == '.' && chars_[pos_ + 2] == '.') {
+                pos_ += 3;
+            } else {
+                pos_++;
+            }
+            regex_allowed_ = true;
+            if (c == '(' || c == '[' || c == '{') {
+                depth_++;
+                //if (x) /re/和{}之后的/re/是语句开头的正则，(a) / b和({}) / b是除法
+                regex_after_close_.push_back(c == '(' ? IsOneOf(prev_, kModuleConditionKeywords) : c == '{' && BlockStart());
+            } else if (c == ')' || c == ']' || c == '}') {
+                if (depth_ > 0) {
+                    depth_--;
+                }
+                regex_allowed_ = false;
+                if (!regex_after_close_.empty()) {
+                    regex_allowed_ = regex_after_close_.back();
+                    regex_after_close_.pop_back();
+                }
+            }
+        }
+        token.end_ = pos_;
+        return token;
+    }
+
+    bool SkipSpace() {
+        bool newline = false;
+        while (pos_ < length_) {
+            JSChar c = chars_[pos_];
+            if (IsModuleLineTerminator(c)) {
+                newline = true;
+                pos_++;
+            } else if (IsModuleWhiteSpace(c)) {
+                pos_++;
+            } else if (c == '/' && pos_ + 1 < length_ && chars_[pos_ + 1] == '/') {
+                while (pos_ < length_ && !IsModuleLineTerminator(chars_[pos_])) {
+                    pos_++;
+                }
+            } else if (c == '/' && pos_ + 1 < length_ && chars_[pos_ + 1] == '*') {
+                pos_ += 2;
+                while (pos_ < length_ && !(chars_[pos_] == '*' && pos_ + 1 < length_ && chars_[pos_ + 1] == '/')) {
+                    newline = newline || IsModuleLineTerminator(chars_[pos_]);
+                    pos_++;
+                }
+                pos_ = std::min(pos_ + 2, length_);
+            } else {
+                break;
+            }
+        }
+        return newline;
+    }
+
+    void ScanString(JSChar quote) {
+        pos_++;
+        while (pos_ < length_ && chars_[pos_] != quote && !IsModuleLineTerminator(chars_[pos_])) {
+            pos_ += chars_[pos_] == '\\' ? 2 : 1;
+        }
+        pos_ = std::min(pos_ + 1, length_);
+    }
+
+    //从`或者}之后扫到模板结束，或者扫到${进入表达式
+    void ScanTemplate() {
+        while (pos_ < length_) {
+            JSChar c = chars_[pos_];
+            if (c == '\\') {
+                pos_ += 2;
+            } else if (c == '`') {
+                pos_++;
+                regex_allowed_ = false;
+                return;
+            } else if (c == '$' && pos_ + 1 < length_ && chars_[pos_ + 1] == '{') {
+                pos_ += 2;
+                template_depths_.push_back(depth_);
+                depth_++;
+                regex_allowed_ = true;
+                return;
+            } else {
+                pos_++;
+            }
+        }
+        pos_ = length_;
+    }
+
+    void ScanNumber() {
+        bool hex = chars_[pos_] == '0' && pos_ + 1 < length_ && (chars_[pos_ + 1] == 'x' || chars_[pos_ + 1] == 'X');
+        while (pos_ < length_) {
+            JSChar c = chars_[pos_];
+            if (IsModuleNamePart(c) || c == '.') {
+                pos_++;
+            } else if ((c == '+' || c == '-') && !hex && (chars_[pos_ - 1] == 'e' || chars_[pos_ - 1] == 'E')) {
+                pos_++;
+            } else {
+                break;
+            }
+        }
+    }
+
+    void ScanRegExp() {
+        pos_++;
+        bool in_class = false;
+        while (pos_ < length_ && !IsModuleLineTerminator(chars_[pos_])) {
+            JSChar c = chars_[pos_];
+            if (c == '\\') {
+                pos_ += 2;
+                continue;
+            }
+            pos_++;
+            if (c == '[') {
+                in_class = true;
+            } else if (c == ']') {
+                in_class = false;
+            } else if (c == '/' && !in_class) {
+                break;
+            }
+        }
+        while (pos_ < length_ && IsModuleNamePart(chars_[pos_])) {
+            pos_++;
+        }
+        pos_ = std::min(pos_, length_);
+    }
+
+    const JSChar* chars_;
+    size_t length_;
+    size_t pos_ = 0;
+    int depth_ = 0;
+    bool regex_allowed_ = true;
+    ModuleToken prev_ = {kModuleTokenEnd, 0, 0, false};
+    //模板字符串里每个${所在的括号深度
+    std::vector<int> template_depths_;
+    //每个未闭合的括号，闭合之后能不能跟正则
+    std::vector<bool> regex_after_close_;
+};
+
+//脚本顶层的let/const/class声明：在global的词法作用域里，不在global对象上。name可以为nullptr
+static bool FindTopLevelLexicalDeclaration(JSStringRef source, std::string* name) {
+    const JSChar* chars = JSStringGetCharactersPtr(source);
+    ModuleScanner scanner(chars, JSStringGetLength(source));
+    ModuleToken prev = {kModuleTokenEnd, 0, 0, false};
+    for (;;) {
+        ModuleToken token = scanner.Next();
+        if (token.type_ == kModuleTokenEnd) {
+            return false;
+        }
+        bool statement_start = prev.type_ == kModuleTokenEnd || scanner.IsPunct(prev, ';') || scanner.IsPunct(prev, '}');
+        if (statement_start && scanner.depth() == 0 && (scanner.Is(token, "let") || scanner.Is(token, "const") || scanner.Is(token, "class"))) {
+            if (name == nullptr) {
+                return true;
+            }
+            ModuleToken next = scanner.Peek();
+            size_t end = next.type_ == kModuleTokenName ? next.end_ : token.end_;
+            name->resize(Utf16ToUtf8Length(chars + token.start_, end - token.start_));
+            Utf16ToUtf8(chars + token.start_, end - token.start_, &(*name)[0]);
+            return true;
+        }
+        prev = token;
+    }
+}
+
+static void AppendModuleText(std::vector<JSChar>* out, const char* text) {
+    for (; *text; text++) {
+        out->push_back((JSChar)(uint8_t)*text);
+    }
+}
+
+static void AppendModuleText(std::vector<JSChar>* out, const JSChar* chars, size_t start, size_t end) {
+    out->insert(out->end(), chars + start, chars + end);
+}
+
+//字符串字面量的值，module说明符里一般不会有转义，只处理常见的几种
+static std::string DecodeModuleString(const JSChar* chars, const ModuleToken& token) {
+    std::vector<JSChar> value;
+    for (size_t i = token.start_ + 1; i + 1 < token.end_; i++) {
+        JSChar c = chars[i];
+        if (c != '\\') {
+            value.push_back(c);
+            continue;
+        }
+        c = chars[++i];
+        if (c == 'n') {
+            value.push_back('\n');
+        } else if (c == 't') {
+            value.push_back('\t');
+        } else if (c == 'r') {
+            value.push_back('\r');
+        } else if ((c == 'x' || c == 'u') && i + 1 < token.end_ - 1) {
+            bool braced = c == 'u' && chars[i + 1] == '{';
+            size_t digits = c == 'x' ? 2 : 4;
+            size_t j = braced ? i + 2 : i + 1;
+            uint32_t cp = 0;
+            size_t n = 0;
+            for (; j < token.end_ - 1 && (braced ? chars[j] != '}' : n < digits); j++, n++) {
+                JSChar d = chars[j];
+                int v = d >= '0' && d <= '9' ? d - '0' : d >= 'a' && d <= 'f' ? d - 'a' + 10 : d >= 'A' && d <= 'F' ? d - 'A' + 10 : -1;
+                if (v < 0) {
+                    break;
+                }
+                cp = cp * 16 + v;
+            }
+            i = braced ? j : j - 1;
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                value.push_back((JSChar)(0xD800 + (cp >> 10)));
+                value.push_back((JSChar)(0xDC00 + (cp & 0x3FF)));
+            } else {
+                value.push_back((JSChar)cp);
+            }
+        } else if (!IsModuleLineTerminator(c)) {
+            value.push_back(c);
+        }
+    }
+    std::string ret(Utf16ToUtf8Length(value.data(), value.size()), '\0');
+    Utf16ToUtf8(value.data(), value.size(), &ret[0]);
+    return ret;
+}
+
+//module的改写：整个源码包进一个generator，第一次next定义导出的getter(实例化)，第二次next执行模块体(求值)。
+//import改写成读取依赖的namespace对象，导出是namespace上的getter，所以export是live binding，import是执行模块体前的快照
+struct ModuleTransform {
+    ModuleTransform(const JSChar* chars, size_t length, std::vector<std::string>* requests)
+        : chars_(chars), length_(length), scanner_(chars, length), requests_(requests) {}
+
+    struct Edit {
+        size_t start_;
+        size_t end_;
+        std::vector<JSChar> text_;
+    };
+
+    const JSChar* chars_;
+    size_t length_;
+    ModuleScanner scanner_;
+    std::vector<std::string>* requests_;
+    std::vector<Edit> edits_;
+    //yield之前：导出的getter
+    std::vector<JSChar> exports_;
+    //export *放在其它导出之后，不会抢先定义同名的导出
+    std::vector<JSChar> star_exports_;
+    bool has_default_ = false;
+    bool has_star_ = false;
+
+    //import的本地名字和读取它的表达式。模块体里的每次引用都改写成这个表达式，读到的总是依赖当前的值(live binding)，
+    //循环依赖里只有真正读到还没初始化的导出才会抛TDZ错误
+    struct ImportBinding {
+        ModuleToken local_;
+        std::vector<JSChar> access_;
+    };
+    std::vector<ImportBinding> imports_;
+
+    //export {a as b}的本地名字可能是import，扫描完才知道
+    struct LocalExport {
+        ModuleToken name_;
+        ModuleToken local_;
+    };
+    std::vector<LocalExport> local_exports_;
+    size_t body_start_ = 0;
+
+    int AddRequest(const ModuleToken& token) {
+        std::string specifier = DecodeModuleString(chars_, token);
+        for (size_t i = 0; i < requests_->size(); i++) {
+            if ((*requests_)[i] == specifier) {
+                return (int)i;
+            }
+        }
+        requests_->push_back(specifier);
+        return (int)requests_->size() - 1;
+    }
+
+    void AppendDeps(std::vector<JSChar>* out, int request) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "__v8_deps[%d]", request);
+        AppendModuleText(out, buffer);
+    }
+
+    //导出名是名字或者字符串字面量，原样作为属性名的源码
+    void AppendKey(std::vector<JSChar>* out, const ModuleToken& name) {
+        if (name.type_ == kModuleTokenString) {
+            AppendModuleText(out, chars_, name.start_, name.end_);
+        } else {
+            out->push_back('"');
+            AppendModuleText(out, chars_, name.start_, name.end_);
+            out->push_back('"');
+        }
+    }
+
+    void AddExport(const ModuleToken& name, const std::vector<JSChar>& getter) {
+        AppendModuleText(&exports_, "__v8_define(__v8_exports, ");
+        AppendKey(&exports_, name);
+        AppendModuleText(&exports_, ", {enumerable: true, get: () => ");
+        exports_.insert(exports_.end(), getter.begin(), getter.end());
+        AppendModuleText(&exports_, "});");
+    }
+
+    void AddLocalExport(const ModuleToken& name, const ModuleToken& local) {
+        LocalExport local_export;
+        local_export.name_ = name;
+        local_export.local_ = local;
+        local_exports_.push_back(local_export);
+    }
+
+    //local -> __v8_deps[request]<access>
+    void AddImport(const ModuleToken& local, int request, const std::vector<JSChar>& access) {
+        ImportBinding binding;
+        binding.local_ = local;
+        AppendDeps(&binding.access_, request);
+        binding.access_.insert(binding.access_.end(), access.begin(), access.end());
+        imports_.push_back(binding);
+    }
+
+    int FindImport(const ModuleToken& token) const {
+        size_t len = token.end_ - token.start_;
+        for (size_t i = 0; i < imports_.size(); i++) {
+            const ModuleToken& local = imports_[i].local_;
+            if (local.end_ - local.start_ == len && memcmp(chars_ + local.start_, chars_ + token.start_, len * sizeof(JSChar)) == 0) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    void AddImport(const ModuleToken& local, int request, const char* access) {
+        std::vector<JSChar> text;
+        AppendModuleText(&text, access);
+        AddImport(local, request, text);
+    }
+
+    void AppendKeyAccess(std::vector<JSChar>* out, const ModuleToken& name) {
+        out->push_back('[');
+        AppendKey(out, name);
+        out->push_back(']');
+    }
+
+    //删除[start, end)，保留其中的换行，行号不变
+    void Replace(size_t start, size_t end, const char* text) {
+        Edit edit;
+        edit.start_ = start;
+        edit.end_ = end;
+        AppendModuleText(&edit.text_, text);
+        for (size_t i = start; i < end; i++) {
+            if (chars_[i] == '\n' || chars_[i] == 0x2028 || chars_[i] == 0x2029 || (chars_[i] == '\r' && (i + 1 >= end || chars_[i + 1] != '\n'))) {
+                edit.text_.push_back('\n');
+            }
+        }
+        edits_.push_back(edit);
+    }
+
+    //语句末尾可选的分号
+    size_t SkipSemicolon(size_t end) {
+        ModuleToken token = scanner_.Peek();
+        if (scanner_.IsPunct(token, ';')) {
+            return scanner_.Next().end_;
+        }
+        return end;
+    }
+
+    //from之后的说明符，以及可选的with/assert属性
+    bool ParseFrom(int* request, size_t* end) {
+        ModuleToken token = scanner_.Next();
+        if (token.type_ != kModuleTokenName || !scanner_.Is(token, "from")) {
+            return false;
+        }
+        return ParseSpecifier(scanner_.Next(), request, end);
+    }
+
+    bool ParseSpecifier(const ModuleToken& token, int* request, size_t* end) {
+        if (token.type_ != kModuleTokenString) {
+            return false;
+        }
+        *request = AddRequest(token);
+        *end = token.end_;
+        ModuleToken next = scanner_.Peek();
+        if (!next.newline_before_ && next.type_ == kModuleTokenName && (scanner_.Is(next, "with") || scanner_.Is(next, "assert"))) {
+            scanner_.Next();
+            int depth = scanner_.depth();
+            if (!scanner_.IsPunct(scanner_.Next(), '{')) {
+                return false;
+            }
+            ModuleToken t;
+            do {
+                t = scanner_.Next();
+            } while (t.type_ != kModuleTokenEnd && scanner_.depth() > depth);
+            *end = t.end_;
+        }
+        *end = SkipSemicolon(*end);
+        return true;
+    }
+
+    //{a, b as c, "d" as e}，names和locals一一对应
+    bool ParseNamedList(std::vector<ModuleToken>* names, std::vector<ModuleToken>* locals, size_t* end) {
+        for (;;) {
+            ModuleToken token = scanner_.Next();
+            if (scanner_.IsPunct(token, '}')) {
+                *end = token.end_;
+                return true;
+            }
+            if (token.type_ != kModuleTokenName && token.type_ != kModuleTokenString) {
+                return false;
+            }
+            ModuleToken local = token;
+            ModuleToken next = scanner_.Next();
+            if (next.type_ == kModuleTokenName && scanner_.Is(next, "as")) {
+                local = scanner_.Next();
+                if (local.type_ != kModuleTokenName && local.type_ != kModuleTokenString) {
+                    return false;
+                }
+                next = scanner_.Next();
+            }
+            names->push_back(token);
+            locals->push_back(local);
+            if (scanner_.IsPunct(next, '}')) {
+                *end = next.end_;
+                return true;
+            }
+            if (!scanner_.IsPunct(next, ',')) {
+                return false;
+            }
+        }
+    }
+
+    bool ParseImport(const ModuleToken& keyword) {
+        ModuleToken token = scanner_.Next();
+        int request;
+        size_t end;
+        if (token.type_ == kModuleTokenString) {
+            if (!ParseSpecifier(token, &request, &end)) {
+                return false;
+            }
+            Replace(keyword.start_, end, "");
+            return true;
+        }
+        ModuleToken default_local;
+        bool has_default = false;
+        ModuleToken ns_local;
+        bool has_ns = false;
+        std::vector<ModuleToken> names;
+        std::vector<ModuleToken> locals;
+        //import d from 'x'在这里就读到了from
+        bool from_read = false;
+        if (token.type_ == kModuleTokenName) {
+            default_local = token;
+            has_default = true;
+            token = scanner_.Next();
+            from_read = token.type_ == kModuleTokenName && scanner_.Is(token, "from");
+            if (!from_read) {
+                if (!scanner_.IsPunct(token, ',')) {
+                    return false;
+                }
+                token = scanner_.Next();
+            }
+        }
+        if (from_read) {
+            if (!ParseSpecifier(scanner_.Next(), &request, &end)) {
+                return false;
+            }
+        } else {
+            if (scanner_.IsPunct(token, '*')) {
+                ModuleToken as = scanner_.Next();
+                ns_local = scanner_.Next();
+                if (!scanner_.Is(as, "as") || ns_local.type_ != kModuleTokenName) {
+                    return false;
+                }
+                has_ns = true;
+            } else if (!scanner_.IsPunct(token, '{') || !ParseNamedList(&names, &locals, &end)) {
+                return false;
+            }
+            if (!ParseFrom(&request, &end)) {
+                return false;
+            }
+        }
+        if (has_default) {
+            AddImport(default_local, request, "[\"default\"]");
+        }
+        if (has_ns) {
+            AddImport(ns_local, request, "");
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            std::vector<JSChar> access;
+            AppendKeyAccess(&access, names[i]);
+            AddImport(locals[i], request, access);
+        }
+        Replace(keyword.start_, end, "");
+        return true;
+    }
+
+    //初始化表达式：跳到同一层的逗号或者语句结束
+    ModuleToken SkipInitializer(int depth, bool in_pattern) {
+        ModuleToken prev = scanner_.Next();
+        for (;;) {
+            ModuleToken token = scanner_.Peek();
+            if (token.type_ == kModuleTokenEnd) {
+                return token;
+            }
+            if (scanner_.depth() == depth) {
+                if (scanner_.IsPunct(token, ',') || scanner_.IsPunct(token, ';')) {
+                    return token;
+                }
+                if (scanner_.IsPunct(token, ')') || scanner_.IsPunct(token, ']') || scanner_.IsPunct(token, '}')) {
+                    return token;
+                }
+                //自动插入分号：换行之后是一个新的名字或者字面量，上一个token能结束表达式
+                bool prev_ends = prev.type_ != kModuleTokenPunct || scanner_.IsPunct(prev, ')')
+                    || scanner_.IsPunct(prev, ']') || scanner_.IsPunct(prev, '}');
+                if (!in_pattern && token.newline_before_ && prev_ends && token.type_ != kModuleTokenPunct) {
+                    return token;
+                }
+            }
+            prev = scanner_.Next();
+        }
+    }
+
+    //声明里绑定的名字，支持解构
+    bool ParseBinding(std::vector<ModuleToken>* bound) {
+        ModuleToken token = scanner_.Next();
+        if (token.type_ == kModuleTokenName) {
+            bound->push_back(token);
+            return true;
+        }
+        int depth = scanner_.depth();
+        if (scanner_.IsPunct(token, '{')) {
+            for (;;) {
+                ModuleToken key = scanner_.Next();
+                if (scanner_.IsPunct(key, '}')) {
+                    return true;
+                }
+                if (scanner_.Is(key, "...")) {
+                    if (!ParseBinding(bound)) {
+                        return false;
+                    }
+                } else {
+                    if (scanner_.IsPunct(key, '[')) {
+                        ModuleToken t;
+                        do {
+                            t = scanner_.Next();
+                        } while (t.type_ != kModuleTokenEnd && scanner_.depth() > depth);
+                    } else if (key.type_ == kModuleTokenPunct || key.type_ == kModuleTokenEnd) {
+                        return false;
+                    }
+                    ModuleToken next = scanner_.Peek();
+                    if (scanner_.IsPunct(next, ':')) {
+                        scanner_.Next();
+                        if (!ParseBinding(bound)) {
+                            return false;
+                        }
+                    } else if (key.type_ == kModuleTokenName) {
+                        bound->push_back(key);
+                    } else {
+                        return false;
+                    }
+                    if (scanner_.IsPunct(scanner_.Peek(), '=')) {
+                        SkipInitializer(depth, true);
+                    }
+                }
+                ModuleToken next = scanner_.Next();
+                if (scanner_.IsPunct(next, '}')) {
+                    return true;
+                }
+                if (!scanner_.IsPunct(next, ',')) {
+                    return false;
+                }
+            }
+        }
+        if (scanner_.IsPunct(token, '[')) {
+            for (;;) {
+                ModuleToken next = scanner_.Peek();
+                if (scanner_.IsPunct(next, ']')) {
+                    scanner_.Next();
+                    return true;
+                }
+                if (scanner_.IsPunct(next, ',')) {
+                    scanner_.Next();
+                    continue;
+                }
+                if (scanner_.Is(next, "...")) {
+                    scanner_.Next();
+                }
+                if (!ParseBinding(bound)) {
+                    return false;
+                }
+                if (scanner_.IsPunct(scanner_.Peek(), '=')) {
+                    SkipInitializer(depth, true);
+                }
+                next = scanner_.Next();
+                if (scanner_.IsPunct(next, ']')) {
+                    return true;
+                }
+                if (!scanner_.IsPunct(next, ',')) {
+                    return false;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool ParseExport(const ModuleToken& keyword) {
+        ModuleToken token = scanner_.Next();
+        int request;
+        size_t end;
+        if (scanner_.IsPunct(token, '*')) {
+            ModuleToken next = scanner_.Peek();
+            if (next.type_ == kModuleTokenName && scanner_.Is(next, "as")) {
+                scanner_.Next();
+                ModuleToken name = scanner_.Next();
+                if ((name.type_ != kModuleTokenName && name.type_ != kModuleTokenString) || !ParseFrom(&request, &end)) {
+                    return false;
+                }
+                std::vector<JSChar> getter;
+                AppendDeps(&getter, request);
+                AddExport(name, getter);
+            } else {
+                if (!ParseFrom(&request, &end)) {
+                    return false;
+                }
+                AppendModuleText(&star_exports_, "__v8_star(__v8_exports, ");
+                AppendDeps(&star_exports_, request);
+                AppendModuleText(&star_exports_, ");");
+                has_star_ = true;
+            }
+            Replace(keyword.start_, end, "");
+            return true;
+        }
+        if (scanner_.IsPunct(token, '{')) {
+            std::vector<ModuleToken> locals;
+            std::vector<ModuleToken> names;
+            if (!ParseNamedList(&locals, &names, &end)) {
+                return false;
+            }
+            ModuleToken next = scanner_.Peek();
+            bool from = next.type_ == kModuleTokenName && scanner_.Is(next, "from");
+            if (from) {
+                if (!ParseFrom(&request, &end)) {
+                    return false;
+                }
+            } else {
+                end = SkipSemicolon(end);
+            }
+            for (size_t i = 0; i < names.size(); i++) {
+                if (from) {
+                    std::vector<JSChar> getter;
+                    AppendDeps(&getter, request);
+                    AppendKeyAccess(&getter, locals[i]);
+                    AddExport(names[i], getter);
+                } else {
+                    AddLocalExport(names[i], locals[i]);
+                }
+            }
+            Replace(keyword.start_, end, "");
+            return true;
+        }
+        if (token.type_ != kModuleTokenName) {
+            return false;
+        }
+        if (scanner_.Is(token, "default")) {
+            ModuleToken next = scanner_.Peek();
+            ModuleScanner copy = scanner_;
+            ModuleToken name;
+            name.type_ = kModuleTokenEnd;
+            if (next.type_ == kModuleTokenName && scanner_.Is(next, "async")) {
+                copy.Next();
+                next = copy.Peek();
+                if (next.newline_before_ || !copy.Is(next, "function")) {
+                    next.type_ = kModuleTokenEnd;
+                }
+            }
+            if (next.type_ == kModuleTokenName && copy.Is(next, "function")) {
+                copy.Next();
+                if (copy.IsPunct(copy.Peek(), '*')) {
+                    copy.Next();
+                }
+                name = copy.Peek();
+            } else if (next.type_ == kModuleTokenName && copy.Is(next, "class")) {
+                copy.Next();
+                name = copy.Peek();
+                if (copy.Is(name, "extends")) {
+                    name.type_ = kModuleTokenEnd;
+                }
+            }
+            if (name.type_ == kModuleTokenName) {
+                //export default function f() {}：保留声明(函数声明会提升)
+                Replace(keyword.start_, token.end_, "");
+                AppendModuleText(&exports_, "__v8_define(__v8_exports, \"default\", {enumerable: true, get: () => ");
+                AppendModuleText(&exports_, chars_, name.start_, name.end_);
+                AppendModuleText(&exports_, "});");
+            } else {
+                Replace(keyword.start_, token.end_, "__v8_default =");
+                AppendModuleText(&exports_, "var __v8_default; __v8_define(__v8_exports, \"default\", {enumerable: true, get: () => __v8_default});");
+            }
+            has_default_ = true;
+            return true;
+        }
+        std::vector<ModuleToken> bound;
+        if (scanner_.Is(token, "var") || scanner_.Is(token, "let") || scanner_.Is(token, "const")) {
+            int depth = scanner_.depth();
+            for (;;) {
+                if (!ParseBinding(&bound)) {
+                    return false;
+                }
+                ModuleToken next = scanner_.Peek();
+                if (scanner_.IsPunct(next, '=')) {
+                    next = SkipInitializer(depth, false);
+                }
+                if (!scanner_.IsPunct(next, ',')) {
+                    break;
+                }
+                scanner_.Next();
+            }
+        } else {
+            ModuleToken function = token;
+            if (scanner_.Is(token, "async")) {
+                function = scanner_.Next();
+                if (function.newline_before_) {
+                    return false;
+                }
+            }
+            if (!scanner_.Is(function, "function") && !scanner_.Is(function, "class")) {
+                return false;
+            }
+            ModuleToken name = scanner_.Next();
+            if (scanner_.IsPunct(name, '*')) {
+                name = scanner_.Next();
+            }
+            if (name.type_ != kModuleTokenName) {
+                return false;
+            }
+            bound.push_back(name);
+        }
+        //只去掉export关键字，声明留在原处
+        Replace(keyword.start_, keyword.end_, "");
+        for (size_t i = 0; i < bound.size(); i++) {
+            AddLocalExport(bound[i], bound[i]);
+        }
+        return true;
+    }
+
+    //改写import引用时跟踪的括号
+    struct ImportBracket {
+        ImportBracket(JSChar c, size_t start, const ModuleScanner& scanner) : c_(c), start_(start), scanner_(scanner) {}
+
+        JSChar c_;
+        size_t start_;
+        //括号里声明的名字遮住的import，-1表示没有
+        int scope_ = -1;
+        bool object_ = false;
+        bool class_body_ = false;
+        //函数体，var声明在这里
+        bool function_ = false;
+        //(是函数的参数列表
+        bool function_head_ = false;
+        ModuleToken before_ = {kModuleTokenEnd, 0, 0, false};
+        //函数表达式的名字只在函数里面可见
+        ModuleToken function_name_ = {kModuleTokenEnd, 0, 0, false};
+        //括号之后的位置，用来重新解析参数
+        ModuleScanner scanner_;
+    };
+
+    //[start_, end_)里imports_这些import被局部的名字遮住了
+    struct ShadowScope {
+        size_t start_;
+        size_t end_;
+        std::vector<int> imports_;
+    };
+
+    struct ImportUse {
+        ModuleToken token_;
+        int import_;
+        //对象字面量的简写{a}
+        bool shorthand_;
+        //a()改写成(0, __v8_deps[0]["a"])()，this和import的函数一样是undefined
+        bool call_;
+    };
+
+    std::vector<ImportBracket> brackets_;
+    std::vector<ShadowScope> scopes_;
+    //刚闭合的参数列表、for(...)、catch(...)的作用域，等着后面的{或者=>
+    bool pending_ = false;
+    int pending_scope_ = -1;
+    bool pending_function_ = false;
+    int class_depth_ = -1;
+    ModuleToken function_name_ = {kModuleTokenEnd, 0, 0, false};
+
+    void ShadowImport(const ModuleToken& name, size_t start, int* scope) {
+        int import = FindImport(name);
+        if (import < 0) {
+            return;
+        }
+        if (*scope < 0) {
+            ShadowScope shadow;
+            shadow.start_ = start;
+            shadow.end_ = length_;
+            scopes_.push_back(shadow);
+            *scope = (int)scopes_.size() - 1;
+        }
+        scopes_[*scope].imports_.push_back(import);
+    }
+
+    //let/const/class/函数声明所在的代码块，var所在的函数体
+    ImportBracket* ScopeBracket(bool function) {
+        for (size_t i = brackets_.size(); i-- > 0;) {
+            ImportBracket& bracket = brackets_[i];
+            if (function ? bracket.function_ : bracket.c_ == '{' && !bracket.object_ && !bracket.class_body_) {
+                return &bracket;
+            }
+        }
+        return nullptr;
+    }
+
+    //从当前位置开始的表达式(箭头函数体、for循环体)在哪里结束
+    size_t ExpressionEnd() {
+        ModuleScanner saved = scanner_;
+        size_t end = SkipInitializer(scanner_.depth(), false).start_;
+        scanner_ = saved;
+        return end;
+    }
+
+    //let/const/var之后声明的名字
+    void ParseDeclarations(std::vector<ModuleToken>* bound) {
+        ModuleScanner saved = scanner_;
+        int depth = scanner_.depth();
+        while (ParseBinding(bound)) {
+            ModuleToken next = scanner_.Peek();
+            if (scanner_.IsPunct(next, '=')) {
+                next = SkipInitializer(depth, false);
+            }
+            if (!scanner_.IsPunct(next, ',')) {
+                break;
+            }
+            scanner_.Next();
+        }
+        scanner_ = saved;
+    }
+
+    //(a, {b}, ...c)里的参数
+    void ParseParams(const ModuleScanner& start, std::vector<ModuleToken>* bound) {
+        ModuleScanner saved = scanner_;
+        scanner_ = start;
+        int depth = scanner_.depth();
+        while (!scanner_.IsPunct(scanner_.Peek(), ')')) {
+            if (scanner_.Is(scanner_.Peek(), "...")) {
+                scanner_.Next();
+            }
+            if (!ParseBinding(bound)) {
+                break;
+            }
+            if (scanner_.IsPunct(scanner_.Peek(), '=')) {
+                SkipInitializer(depth, true);
+            }
+            if (!scanner_.IsPunct(scanner_.Next(), ',')) {
+                break;
+            }
+        }
+        scanner_ = saved;
+    }
+
+    //{之前是表达式的位置，{开始的是对象字面量
+    bool ObjectStart(const ModuleToken& prev) const {
+        if (prev.type_ == kModuleTokenName) {
+            return scanner_.IsOneOf(prev, kModuleRegexKeywords) && !scanner_.IsOneOf(prev, kModuleBlockKeywords);
+        }
+        if (prev.type_ != kModuleTokenPunct) {
+            return false;
+        }
+        if (scanner_.IsPunct(prev, ':')) {
+            return !brackets_.empty() && brackets_.back().object_;
+        }
+        return !scanner_.IsPunct(prev, ';') && !scanner_.IsPunct(prev, '{') && !scanner_.IsPunct(prev, '}') && !scanner_.IsPunct(prev, ')');
+    }
+
+    //语句的开头：函数声明、标签
+    bool StatementStart(const ModuleToken& prev) const {
+        return prev.type_ == kModuleTokenEnd || scanner_.IsPunct(prev, ';') || scanner_.IsPunct(prev, '{') || scanner_.IsPunct(prev, '}')
+            || scanner_.Is(prev, "export") || scanner_.Is(prev, "default");
+    }
+
+    void OpenBracket(const ModuleToken& token, const ModuleToken (&prev)[3]) {
+        JSChar c = chars_[token.start_];
+        ImportBracket bracket(c, token.start_, scanner_);
+        bool method = !brackets_.empty() && (brackets_.back().object_ || brackets_.back().class_body_);
+        if (c == '(') {
+            bracket.before_ = prev[0];
+            bracket.function_head_ = method || scanner_.Is(prev[0], "function")
+                || (prev[0].type_ == kModuleTokenName && scanner_.Is(prev[1], "function"))
+                || (scanner_.IsPunct(prev[0], '*') && scanner_.Is(prev[1], "function"))
+                || (prev[0].type_ == kModuleTokenName && scanner_.IsPunct(prev[1], '*') && scanner_.Is(prev[2], "function"));
+            if (function_name_.type_ == kModuleTokenName && bracket.function_head_) {
+                bracket.function_name_ = function_name_;
+            }
+            function_name_.type_ = kModuleTokenEnd;
+        } else if (c == '{') {
+            if (pending_) {
+                bracket.scope_ = pending_scope_;
+                bracket.function_ = pending_function_;
+                pending_ = false;
+            } else if (class_depth_ == scanner_.depth() - 1) {
+                bracket.class_body_ = true;
+                class_depth_ = -1;
+            } else {
+                bracket.object_ = ObjectStart(prev[0]);
+            }
+        }
+        brackets_.push_back(bracket);
+    }
+
+    void CloseBracket(const ModuleToken& token) {
+        if (brackets_.empty()) {
+            return;
+        }
+        ImportBracket bracket = brackets_.back();
+        brackets_.pop_back();
+        if (bracket.c_ == '{' && bracket.scope_ >= 0) {
+            scopes_[bracket.scope_].end_ = token.end_;
+        }
+        if (bracket.c_ != '(') {
+            return;
+        }
+        ModuleToken next = scanner_.Peek();
+        bool arrow = scanner_.IsArrow(next);
+        bool body = scanner_.IsPunct(next, '{');
+        if (scanner_.Is(bracket.before_, "for")) {
+            //for (let i ...)：声明在循环体里也可见
+            if (bracket.scope_ >= 0 && body) {
+                pending_ = true;
+                pending_scope_ = bracket.scope_;
+                pending_function_ = false;
+            } else if (bracket.scope_ >= 0) {
+                scopes_[bracket.scope_].end_ = ExpressionEnd();
+            }
+            return;
+        }
+        bool is_catch = scanner_.Is(bracket.before_, "catch");
+        if (!is_catch && !arrow && !(body && bracket.function_head_)) {
+            return;
+        }
+        std::vector<ModuleToken> params;
+        ParseParams(bracket.scanner_, &params);
+        int scope = -1;
+        for (size_t i = 0; i < params.size(); i++) {
+            ShadowImport(params[i], bracket.start_, &scope);
+        }
+        if (bracket.function_name_.type_ == kModuleTokenName) {
+            ShadowImport(bracket.function_name_, bracket.start_, &scope);
+        }
+        pending_ = true;
+        pending_scope_ = scope;
+        pending_function_ = !is_catch;
+    }
+
+    //名字是声明，记到所在的作用域
+    void Declare(const ModuleToken& token, const ModuleToken& prev) {
+        std::vector<ModuleToken> bound;
+        bool function = false;
+        if (scanner_.Is(token, "let") || scanner_.Is(token, "const") || scanner_.Is(token, "var")) {
+            ParseDeclarations(&bound);
+            function = scanner_.Is(token, "var");
+            if (!function && !brackets_.empty() && scanner_.Is(brackets_.back().before_, "for")) {
+                ImportBracket& bracket = brackets_.back();
+                for (size_t i = 0; i < bound.size(); i++) {
+                    ShadowImport(bound[i], bracket.start_, &bracket.scope_);
+                }
+                return;
+            }
+        } else if (scanner_.Is(token, "function") || scanner_.Is(token, "class")) {
+            ModuleScanner copy = scanner_;
+            ModuleToken name = copy.Next();
+            if (copy.IsPunct(name, '*')) {
+                name = copy.Next();
+            }
+            if (scanner_.Is(token, "class")) {
+                class_depth_ = scanner_.depth();
+            }
+            if (name.type_ != kModuleTokenName || copy.Is(name, "extends")) {
+                return;
+            }
+            bool declaration = StatementStart(prev) || (scanner_.Is(prev, "async") && !token.newline_before_);
+            if (!declaration) {
+                if (scanner_.Is(token, "function")) {
+                    function_name_ = name;
+                }
+                return;
+            }
+            bound.push_back(name);
+        } else if (scanner_.IsArrow(scanner_.Peek())) {
+            //a => ...
+            int scope = -1;
+            ShadowImport(token, token.start_, &scope);
+            pending_ = true;
+            pending_scope_ = scope;
+            pending_function_ = true;
+            return;
+        }
+        ImportBracket* bracket = ScopeBracket(function);
+        if (!bracket) {
+            //模块顶层的同名声明本身就是语法错误
+            return;
+        }
+        for (size_t i = 0; i < bound.size(); i++) {
+            ShadowImport(bound[i], bracket->start_, &bracket->scope_);
+        }
+    }
+
+    //名字是不是对import的引用，属性名、方法名、标签之类的不是
+    bool IsImportUse(const ModuleToken& token, const ModuleToken& prev, const ModuleToken& next, bool* shorthand) const {
+        *shorthand = false;
+        if (scanner_.IsPunct(prev, '.') || scanner_.Is(prev, "break") || scanner_.Is(prev, "continue")) {
+            return false;
+        }
+        const ImportBracket* top = brackets_.empty() ? nullptr : &brackets_.back();
+        bool modifier = scanner_.Is(prev, "get") || scanner_.Is(prev, "set") || scanner_.Is(prev, "async")
+            || scanner_.Is(prev, "static") || scanner_.IsPunct(prev, '*');
+        if (top && top->class_body_) {
+            //类体里除了初始化表达式都是成员名
+            bool member_start = scanner_.IsPunct(prev, '{') || scanner_.IsPunct(prev, ';') || scanner_.IsPunct(prev, '}') || modifier
+                || (token.newline_before_ && (prev.type_ != kModuleTokenPunct || scanner_.IsPunct(prev, ')') || scanner_.IsPunct(prev, ']')));
+            return !member_start;
+        }
+        if (top && top->object_) {
+            bool key = scanner_.IsPunct(prev, '{') || scanner_.IsPunct(prev, ',');
+            if ((key || modifier) && (scanner_.IsPunct(next, ':') || scanner_.IsPunct(next, '('))) {
+                return false;
+            }
+            *shorthand = key && (scanner_.IsPunct(next, ',') || scanner_.IsPunct(next, '}') || scanner_.IsPunct(next, '='));
+            return true;
+        }
+        //标签
+        return !(scanner_.IsPunct(next, ':') && StatementStart(prev));
+    }
+
+    //把模块体里对import名字的引用改写成读取依赖的namespace
+    void RewriteImportUses() {
+        if (imports_.empty()) {
+            return;
+        }
+        scanner_ = ModuleScanner(chars_, length_);
+        scanner_.SkipTo(body_start_);
+        std::vector<ImportUse> uses;
+        ModuleToken prev[3] = {{kModuleTokenEnd, 0, 0, false}, {kModuleTokenEnd, 0, 0, false}, {kModuleTokenEnd, 0, 0, false}};
+        for (;;) {
+            ModuleToken token = scanner_.Next();
+            if (token.type_ == kModuleTokenEnd) {
+                break;
+            }
+            if (pending_ && !scanner_.IsPunct(token, '{') && !scanner_.IsArrow(token)) {
+                pending_ = false;
+            }
+            if (token.type_ == kModuleTokenPunct) {
+                if (scanner_.IsPunct(token, '(') || scanner_.IsPunct(token, '[') || scanner_.IsPunct(token, '{')) {
+                    OpenBracket(token, prev);
+                } else if (scanner_.IsPunct(token, ')') || scanner_.IsPunct(token, ']') || scanner_.IsPunct(token, '}')) {
+                    CloseBracket(token);
+                } else if (scanner_.IsArrow(token)) {
+                    token = scanner_.Next();
+                    if (pending_ && !scanner_.IsPunct(scanner_.Peek(), '{')) {
+                        //箭头函数的函数体是表达式
+                        if (pending_scope_ >= 0) {
+                            scopes_[pending_scope_].end_ = ExpressionEnd();
+                        }
+                        pending_ = false;
+                    }
+                }
+            } else if (token.type_ == kModuleTokenName && !scanner_.IsPunct(prev[0], '.')) {
+                Declare(token, prev[0]);
+                int import = FindImport(token);
+                ModuleToken next = scanner_.Peek();
+                bool shorthand;
+                if (import >= 0 && IsImportUse(token, prev[0], next, &shorthand)) {
+                    ImportUse use;
+                    use.token_ = token;
+                    use.import_ = import;
+                    use.shorthand_ = shorthand;
+                    //换行开头的(会和上一行连成调用，这种情况不加(0, )
+                    bool safe = !token.newline_before_ || prev[0].type_ == kModuleTokenEnd || scanner_.IsOneOf(prev[0], kModuleRegexKeywords)
+                        || (prev[0].type_ == kModuleTokenPunct && !scanner_.IsPunct(prev[0], ')') && !scanner_.IsPunct(prev[0], ']') && !scanner_.IsPunct(prev[0], '}'));
+                    use.call_ = scanner_.IsPunct(next, '(') && safe && imports_[import].access_.back() == ']';
+                    uses.push_back(use);
+                }
+            }
+            prev[2] = prev[1];
+            prev[1] = prev[0];
+            prev[0] = token;
+        }
+
+        std::vector<Edit> edits;
+        size_t e = 0;
+        for (size_t i = 0; i < uses.size(); i++) {
+            const ImportUse& use = uses[i];
+            //import/export语句里的名字已经被删掉了
+            while (e < edits_.size() && edits_[e].end_ <= use.token_.start_) {
+                e++;
+            }
+            if (e < edits_.size() && edits_[e].start_ < use.token_.end_) {
+                continue;
+            }
+            bool shadowed = false;
+            for (size_t j = 0; j < scopes_.size() && !shadowed; j++) {
+                const ShadowScope& scope = scopes_[j];
+                shadowed = use.token_.start_ >= scope.start_ && use.token_.start_ < scope.end_
+                    && std::find(scope.imports_.begin(), scope.imports_.end(), use.import_) != scope.imports_.end();
+            }
+            if (shadowed) {
+                continue;
+            }
+            Edit edit;
+            edit.start_ = use.token_.start_;
+            edit.end_ = use.token_.end_;
+            if (use.shorthand_) {
+                AppendModuleText(&edit.text_, chars_, use.token_.start_, use.token_.end_);
+                AppendModuleText(&edit.text_, ": ");
+            }
+            if (use.call_) {
+                AppendModuleText(&edit.text_, "(0, ");
+            }
+            const std::vector<JSChar>& access = imports_[use.import_].access_;
+            edit.text_.insert(edit.text_.end(), access.begin(), access.end());
+            if (use.call_) {
+                AppendModuleText(&edit.text_, ")");
+            }
+            edits.push_back(edit);
+        }
+        edits_.insert(edits_.end(), edits.begin(), edits.end());
+        std::stable_sort(edits_.begin(), edits_.end(), [](const Edit& a, const Edit& b) { return a.start_ < b.start_; });
+    }
+
+    void Run(std::vector<JSChar>* out) {
+        if (length_ >= 2 && chars_[0] == '#' && chars_[1] == '!') {
+            //hashbang注释只允许出现在开头，包进函数之后要去掉
+            size_t end = 2;
+            while (end < length_ && !IsModuleLineTerminator(chars_[end])) {
+                end++;
+            }
+            Replace(0, end, "");
+            scanner_.SkipTo(end);
+            body_start_ = end;
+        }
+        bool after_dot = false;
+        for (;;) {
+            ModuleToken token = scanner_.Next();
+            if (token.type_ == kModuleTokenEnd) {
+                break;
+            }
+            bool declaration = false;
+            if (!after_dot && token.type_ == kModuleTokenName && scanner_.Is(token, "import") && scanner_.IsPunct(scanner_.Peek(), '.')) {
+                ModuleScanner copy = scanner_;
+                copy.Next();
+                ModuleToken meta = copy.Next();
+                if (copy.Is(meta, "meta")) {
+                    scanner_ = copy;
+                    Replace(token.start_, meta.end_, "__v8_meta");
+                    after_dot = false;
+                    continue;
+                }
+            }
+            if (!after_dot && token.type_ == kModuleTokenName && scanner_.depth() == 0) {
+                ModuleScanner copy = scanner_;
+                if (scanner_.Is(token, "import")) {
+                    ModuleToken next = scanner_.Peek();
+                    if (!scanner_.IsPunct(next, '(') && !scanner_.IsPunct(next, '.')) {
+                        declaration = ParseImport(token);
+                    }
+                } else if (scanner_.Is(token, "export")) {
+                    declaration = ParseExport(token);
+                }
+                if (!declaration) {
+                    //不认识的写法原样保留，交给语法检查报错
+                    scanner_ = copy;
+                }
+            }
+            after_dot = !declaration && scanner_.IsPunct(token, '.');
+        }
+        for (size_t i = 0; i < local_exports_.size(); i++) {
+            const LocalExport& local_export = local_exports_[i];
+            int import = FindImport(local_export.local_);
+            if (import >= 0) {
+                AddExport(local_export.name_, imports_[import].access_);
+            } else {
+                AddExport(local_export.name_, std::vector<JSChar>(chars_ + local_export.local_.start_, chars_ + local_export.local_.end_));
+            }
+        }
+        exports_.insert(exports_.end(), star_exports_.begin(), star_exports_.end());
+        RewriteImportUses();
+
+        AppendModuleText(out, "(function () { const __v8_define = Object.defineProperty;");
+        if (has_star_) {
+            AppendModuleText(out, " const __v8_star = (t, s) => { for (const k of Object.keys(s)) { if (k !== \"default\" && !Object.prototype.hasOwnProperty.call(t, k)) __v8_define(t, k, {enumerable: true, get: () => s[k]}); } };");
+        }
+        AppendModuleText(out, " return function* (__v8_deps, __v8_exports, __v8_meta) { \"use strict\"; ");
+        out->insert(out->end(), exports_.begin(), exports_.end());
+        AppendModuleText(out, " yield; ");
+        size_t pos = 0;
+        for (size_t i = 0; i < edits_.size(); i++) {
+            AppendModuleText(out, chars_, pos, edits_[i].start_);
+            out->insert(out->end(), edits_[i].text_.begin(), edits_[i].text_.end());
+            pos = edits_[i].end_;
+        }
+        AppendModuleText(out, chars_, pos, length_);
+        AppendModuleText(out, "\n}; })()");
+    }
+};
+
+//module改写、语法检查的结果，和context无关，可以在worker线程上生成
+struct ModuleSourceRecord {
+    //原始源码的hash，和module_cache_的key一致
+    uint64_t hash_ = 0;
+    std::vector<JSChar> wrapper_;
+    std::vector<std::string> requests_;
+    bool syntax_ok_ = false;
+    std::string error_message_;
+    int error_line_ = -1;
+    int error_column_ = -1;
+};
+
+static void DeleteModuleRecord(ModuleSourceRecord* record) {
+    delete record;
+}
+
+static ModuleSourceRecord* NewModuleRecord(const JSChar* chars, size_t length, JSContextRef ctx,
+                                           const std::string& code_cache_dir, const std::string& url) {
+    ModuleSourceRecord* record = new ModuleSourceRecord();
+    record->hash_ = HashScriptSource(chars, length);
+    ModuleTransform transform(chars, length, &record->requests_);
+    transform.Run(&record->wrapper_);
+
+    CodeCacheHeader header = MakeCodeCacheHeader(record->wrapper_.data(), record->wrapper_.size());
+    if (!code_cache_dir.empty() && ReadCodeCacheFile(CodeCachePath(code_cache_dir, header.hash_), header)) {
+        record->syntax_ok_ = true;
+        return record;
+    }
+    JSStringRef script = JSStringCreateWithCharacters(record->wrapper_.data(), record->wrapper_.size());
+    JSStringRef url_string = JSStringCreateWithUTF8CString(url.c_str());
+    JSValueRef exception = nullptr;
+    record->syntax_ok_ = JSCheckScriptSyntax(ctx, script, url_string, 1, &exception);
+    if (!record->syntax_ok_ && exception) {
+        ErrorLocation location;
+        GetErrorLocation(ctx, exception, &location);
+        record->error_message_ = location.message_;
+        record->error_line_ = location.line_;
+        record->error_column_ = location.column_;
+    }
+    JSStringRelease(url_string);
+    JSStringRelease(script);
+    if (record->syntax_ok_ && !code_cache_dir.empty()) {
+        WriteCodeCacheFile(CodeCachePath(code_cache_dir, header.hash_), header);
+    }
+    return record;
+}
+
+//读文件并按utf8解码，文件打不开时返回nullptr
+static ModuleSourceRecord* LoadModuleRecord(const std::string& path, JSContextRef ctx, const std::string& code_cache_dir) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return nullptr;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buffer[16 * 1024];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+    fclose(file);
+    //借用StreamedSource的缓冲区做解码
+    ScriptCompiler::StreamedSource decoded(nullptr, ScriptCompiler::StreamedSource::UTF8);
+    DecodeSourceChunk(data.data(), data.size(), true, &decoded);
+    const JSChar* chars = decoded.chars_;
+    size_t length = decoded.length_;
+    if (length > 0 && chars[0] == 0xFEFF) {
+        chars++;
+        length--;
+    }
+    return NewModuleRecord(chars, length, ctx, code_cache_dir, path);
+}
+
+static std::string NormalizeModulePath(const std::string& path) {
+    bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\');
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find_first_of("/\\", start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string part = path.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty() && parts.back() != "..") {
+                parts.pop_back();
+            } else if (!absolute) {
+                parts.push_back(part);
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    std::string ret = absolute ? "/" : "";
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (i > 0) {
+            ret += '/';
+        }
+        ret += parts[i];
+    }
+    return ret;
+}
+
+//./ ../开头的按referrer所在目录解析，/开头的是绝对路径，其它(bare specifier)返回空串
+static std::string ResolveModulePath(const std::string& referrer, const std::string& specifier) {
+    if (specifier.compare(0, 1, "/") == 0) {
+        return NormalizeModulePath(specifier);
+    }
+    if (specifier.compare(0, 2, "./") != 0 && specifier.compare(0, 3, "../") != 0) {
+        return "";
+    }
+    size_t slash = referrer.find_last_of("/\\");
+    if (slash == std::string::npos) {
+        return NormalizeModulePath(specifier);
+    }
+    return NormalizeModulePath(referrer.substr(0, slash + 1) + specifier);
+}
+
+//PrefetchModuleGraph的共享状态，worker之间只通过它交换数据
+struct ModulePrefetchQueue {
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::string> pending_;
+    std::set<std::string> seen_;
+    std::map<std::string, ModuleSourceRecord*> loaded_;
+    //正在处理的文件数，pending_为空且没有正在处理的文件时整个图已经读完
+    int active_ = 0;
+    std::string code_cache_dir_;
+};
+
+static void RunModulePrefetchWorker(ModulePrefetchQueue* queue) {
+    //语法检查用worker自己的vm，第一次拿到文件时才创建
+    JSContextGroupRef group = nullptr;
+    JSGlobalContextRef context = nullptr;
+    std::unique_lock<std::mutex> lock(queue->mutex_);
+    for (;;) {
+        queue->cond_.wait(lock, [queue] { return !queue->pending_.empty() || queue->active_ == 0; });
+        if (queue->pending_.empty()) {
+            break;
+        }
+        std::string path = queue->pending_.back();
+        queue->pending_.pop_back();
+        queue->active_++;
+        lock.unlock();
+
+        if (context == nullptr) {
+            group = JSContextGroupCreate();
+            context = JSGlobalContextCreateInGroup(group, nullptr);
+        }
+        ModuleSourceRecord* record = LoadModuleRecord(path, context, queue->code_cache_dir_);
+
+        lock.lock();
+        queue->active_--;
+        if (record) {
+            queue->loaded_[path] = record;
+            for (size_t i = 0; i < record->requests_.size(); i++) {
+                std::string dependency = ResolveModulePath(path, record->requests_[i]);
+                if (!dependency.empty() && queue->seen_.insert(dependency).second) {
+                    queue->pending_.push_back(dependency);
+                }
+            }
+        }
+        queue->cond_.notify_all();
+    }
+    lock.unlock();
+    if (context) {
+        JSGlobalContextRelease(context);
+        JSContextGroupRelease(group);
+    }
+}
+
+int ScriptCompiler::PrefetchModuleGraph(Isolate* isolate, const char* entry_path, int thread_count) {
+    ModulePrefetchQueue queue;
+    queue.code_cache_dir_ = isolate->code_cache_dir_;
+    std::string entry = NormalizeModulePath(entry_path);
+    queue.pending_.push_back(entry);
+    queue.seen_.insert(entry);
+
+    if (thread_count <= 0) {
+        thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    std::vector<std::thread> workers;
+    for (int i = 1; i < thread_count; i++) {
+        workers.push_back(std::thread(RunModulePrefetchWorker, &queue));
+    }
+    RunModulePrefetchWorker(&queue);
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    for (auto it = queue.loaded_.begin(); it != queue.loaded_.end(); ++it) {
+        if (isolate->module_files_.count(it->first)) {
+            delete it->second;
+            continue;
+        }
+        ModuleSourceRecord*& slot = isolate->prefetched_modules_[it->first];
+        delete slot;
+        slot = it->second;
+    }
+    return (int)queue.loaded_.size();
+}
+
+static void ThrowModuleError(Isolate* isolate, const std::string& message) {
+    isolate->handleException(NewError(isolate->current_js_context_, "Error", message));
+}
+
+//接管record，编译成功的module放进isolate的module_cache_
+static MaybeLocal<Module> NewModule(Isolate* isolate, const std::string& url, ModuleSourceRecord* record) {
+    if (!record->syntax_ok_) {
+        JSStringRef resource_name = JSStringCreateWithUTF8CString(url.c_str());
+        ThrowSyntaxError(isolate, isolate->current_js_context_, record->error_message_,
+                         record->error_line_, record->error_column_, resource_name);
+        JSStringRelease(resource_name);
+        delete record;
+        return MaybeLocal<Module>();
+    }
+    Module* module = new Module(isolate);
+    module->url_ = url;
+    module->resource_name_ = JSStringCreateWithUTF8CString(url.c_str());
+    module->wrapper_source_ = JSStringCreateWithCharacters(record->wrapper_.data(), record->wrapper_.size());
+    module->requests_.swap(record->requests_);
+    module->AddRef_();
+    isolate->module_cache_[std::make_pair(url, record->hash_)] = module;
+    delete record;
+    return MaybeLocal<Module>(Local<Module>(module));
+}
+
+MaybeLocal<Module> ScriptCompiler::CompileModule(
+    Isolate* isolate, Source* source,
+    CompileOptions options) {
+    JSContextRef ctx = isolate->current_js_context_;
+    JSStringRef source_string = RetainJSString(isolate, ctx, source->source_string->value_);
+    if (source_string == nullptr) {
+        return MaybeLocal<Module>();
+    }
+    std::string url;
+    if (!source->resource_name.IsEmpty()) {
+        JSStringRef resource_name = RetainJSString(isolate, ctx, source->resource_name->value_);
+        if (resource_name) {
+            url = JSStringToUtf8(resource_name);
+            JSStringRelease(resource_name);
+        }
+    }
+    const JSChar* chars = JSStringGetCharactersPtr(source_string);
+    size_t length = JSStringGetLength(source_string);
+    uint64_t hash = HashScriptSource(chars, length);
+
+    auto cached = isolate->module_cache_.find(std::make_pair(url, hash));
+    if (cached != isolate->module_cache_.end()) {
+        JSStringRelease(source_string);
+        return MaybeLocal<Module>(Local<Module>(cached->second));
+    }
+    ModuleSourceRecord* record = nullptr;
+    auto prefetched = isolate->prefetched_modules_.find(url);
+    if (prefetched != isolate->prefetched_modules_.end() && prefetched->second->hash_ == hash) {
+        record = prefetched->second;
+        isolate->prefetched_modules_.erase(prefetched);
+    } else {
+        record = NewModuleRecord(chars, length, isolate->isolate_context_, isolate->code_cache_dir_, url);
+    }
+    JSStringRelease(source_string);
+    return NewModule(isolate, url, record);
+}
+
+MaybeLocal<Module> ScriptCompiler::CompileModuleFromDisk(Isolate* isolate, const char* path) {
+    std::string url = NormalizeModulePath(path);
+    auto file = isolate->module_files_.find(url);
+    if (file != isolate->module_files_.end()) {
+        return MaybeLocal<Module>(Local<Module>(file->second));
+    }
+    ModuleSourceRecord* record = nullptr;
+    auto prefetched = isolate->prefetched_modules_.find(url);
+    if (prefetched != isolate->prefetched_modules_.end()) {
+        record = prefetched->second;
+        isolate->prefetched_modules_.erase(prefetched);
+    } else {
+        record = LoadModuleRecord(url, isolate->isolate_context_, isolate->code_cache_dir_);
+    }
+    if (record == nullptr) {
+        ThrowModuleError(isolate, "Cannot find module '" + url + "'");
+        return MaybeLocal<Module>();
+    }
+
+    Module* module;
+    auto cached = isolate->module_cache_.find(std::make_pair(url, record->hash_));
+    if (cached != isolate->module_cache_.end()) {
+        module = cached->second;
+        delete record;
+    } else {
+        MaybeLocal<Module> ret = NewModule(isolate, url, record);
+        if (ret.IsEmpty()) {
+            return ret;
+        }
+        module = *ret.ToLocalChecked();
+    }
+    isolate->module_files_[url] = module;
+    return MaybeLocal<Module>(Local<Module>(module));
+}
+
+MaybeLocal<Module> ScriptCompiler::ResolveModuleFromDisk(Local<Context> context, Local<String> specifier,
+                                                         Local<Module> referrer) {
+    Isolate* isolate = context->GetIsolate();
+    String::Utf8Value name(isolate, specifier);
+    std::string path = ResolveModulePath(referrer->url_, std::string(*name, name.length()));
+    if (path.empty()) {
+        ThrowModuleError(isolate, "Cannot resolve module specifier '" + std::string(*name, name.length()) + "'");
+        return MaybeLocal<Module>();
+    }
+    return CompileModuleFromDisk(isolate, path.c_str());
+}
+
+void Isolate::ContextDisposed_(Context* context) {
+    for (auto it = module_cache_.begin(); it != module_cache_.end(); ++it) {
+        it->second->DisposeInstance_(context);
+    }
+}
+
+static void ReleaseModuleInstance(JSContextRef ctx, Module::Instance* instance) {
+    if (instance->namespace_) {
+        JSValueUnprotect(ctx, instance->namespace_);
+    }
+    if (instance->generator_) {
+        JSValueUnprotect(ctx, instance->generator_);
+    }
+    if (instance->exception_) {
+        JSValueUnprotect(ctx, instance->exception_);
+    }
+}
+
+Module::~Module() {
+    for (auto it = instances_.begin(); it != instances_.end(); ++it) {
+        ReleaseModuleInstance(isolate_->isolate_context_, &it->second);
+    }
+    JSStringRelease(wrapper_source_);
+    JSStringRelease(resource_name_);
+}
+
+void Module::DisposeInstance_(Context* context) {
+    auto it = instances_.find(context);
+    if (it != instances_.end()) {
+        ReleaseModuleInstance(isolate_->isolate_context_, &it->second);
+        instances_.erase(it);
+    }
+}
+
+Module::Status Module::GetStatus() const {
+    Instance* instance = FindInstance_(*isolate_->current_context_);
+    return instance ? instance->status_ : kUninstantiated;
+}
+
+int Module::GetModuleRequestsLength() const {
+    return (int)requests_.size();
+}
+
+Local<String> Module::GetModuleRequest(int i) const {
+    V8::Check(i >= 0 && i < (int)requests_.size(), "Module::GetModuleRequest, index out of range");
+    return String::NewFromUtf8(isolate_, requests_[i].data(), NewStringType::kNormal, (int)requests_[i].size()).ToLocalChecked();
+}
+
+int Module::GetIdentityHash() const {
+    uintptr_t p = reinterpret_cast<uintptr_t>(this);
+    return (int)((p >> 4) ^ (p >> 32)) & 0x7fffffff;
+}
+
+Local<Value> Module::GetModuleNamespace() {
+    Instance* instance = FindInstance_(*isolate_->current_context_);
+    V8::Check(instance && instance->status_ != kInstantiating, "Module::GetModuleNamespace, module is not instantiated");
+    return Local<Value>(isolate_->Alloc<Value>(instance->namespace_));
+}
+
+Local<Value> Module::GetException() const {
+    Instance* instance = FindInstance_(*isolate_->current_context_);
+    if (instance == nullptr || instance->status_ != kErrored) {
+        return Local<Value>(isolate_->Undefined());
+    }
+    return Local<Value>(isolate_->Alloc<Value>(instance->exception_));
+}
+
+void Module::SetError_(Instance* instance, JSContextRef ctx, JSValueRef exception) {
+    instance->status_ = kErrored;
+    if (instance->exception_ == nullptr) {
+        JSValueProtect(ctx, exception);
+        instance->exception_ = exception;
+    }
+}
+
+Maybe<bool> Module::InstantiateModule(Local<Context> context, ResolveCallback callback) {
+    std::vector<Module*> order;
+    if (!Resolve_(context, callback, &order)) {
+        //撤销这次新建的实例，之后可以重新实例化
+        for (auto it = isolate_->module_cache_.begin(); it != isolate_->module_cache_.end(); ++it) {
+            Instance* instance = it->second->FindInstance_(*context);
+            if (instance && instance->status_ == kInstantiating) {
+                it->second->DisposeInstance_(*context);
+            }
+        }
+        return Maybe<bool>();
+    }
+    //依赖在前，export * 需要依赖的导出已经定义好
+    for (size_t i = 0; i < order.size(); i++) {
+        if (!order[i]->Link_(context)) {
+            return Maybe<bool>();
+        }
+    }
+    return Maybe<bool>(true);
+}
+
+bool Module::Resolve_(Local<Context> context, ResolveCallback callback, std::vector<Module*>* order) {
+    if (FindInstance_(*context)) {
+        return true;
+    }
+    JSContextRef ctx = context->context_;
+    Instance& instance = instances_[*context];
+    instance.status_ = kInstantiating;
+    instance.namespace_ = JSObjectMake(ctx, nullptr, nullptr);
+    JSValueProtect(ctx, instance.namespace_);
+    instance.resolved_.resize(requests_.size(), nullptr);
+    for (size_t i = 0; i < requests_.size(); i++) {
+        Local<String> specifier = String::NewFromUtf8(isolate_, requests_[i].data(), NewStringType::kNormal, (int)requests_[i].size()).ToLocalChecked();
+        MaybeLocal<Module> resolved = callback(context, specifier, Local<Module>(this));
+        if (resolved.IsEmpty()) {
+            return false;
+        }
+        instance.resolved_[i] = *resolved.ToLocalChecked();
+        if (!instance.resolved_[i]->Resolve_(context, callback, order)) {
+            return false;
+        }
+    }
+    order->push_back(this);
+    return true;
+}
+
+//恢复执行generator，返回抛出的异常
+static JSValueRef ResumeModuleGenerator(Isolate* isolate, JSContextRef ctx, JSObjectRef generator) {
+    JSValueRef exception = nullptr;
+    JSValueRef next = JSObjectGetProperty(ctx, generator, isolate->InternString("next", 4), &exception);
+    if (exception == nullptr) {
+        JSObjectCallAsFunction(ctx, const_cast<JSObjectRef>(next), generator, 0, nullptr, &exception);
+    }
+    return exception;
+}
+
+bool Module::Link_(Local<Context> context) {
+    JSContextRef ctx = context->context_;
+    Instance* instance = FindInstance_(*context);
+    std::vector<JSValueRef> dependencies(instance->resolved_.size());
+    for (size_t i = 0; i < instance->resolved_.size(); i++) {
+        dependencies[i] = instance->resolved_[i]->FindInstance_(*context)->namespace_;
+    }
+
+    JSValueRef exception = nullptr;
+    JSObjectRef generator = nullptr;
+    JSValueRef function = JSEvaluateScript(ctx, wrapper_source_, nullptr, resource_name_, 1, &exception);
+    if (exception == nullptr) {
+        JSObjectRef meta = JSObjectMake(ctx, nullptr, nullptr);
+        JSObjectSetProperty(ctx, meta, isolate_->InternString("url", 3), JSValueMakeString(ctx, resource_name_),
+                            kJSPropertyAttributeNone, nullptr);
+        JSValueRef args[] = {
+            JSObjectMakeArray(ctx, dependencies.size(), dependencies.data(), nullptr),
+            instance->namespace_,
+            meta
+        };
+        JSValueRef ret = JSObjectCallAsFunction(ctx, const_cast<JSObjectRef>(function), nullptr, 3, args, &exception);
+        if (exception == nullptr) {
+            generator = const_cast<JSObjectRef>(ret);
+            exception = ResumeModuleGenerator(isolate_, ctx, generator);
+        }
+    }
+    if (exception) {
+        SetError_(instance, ctx, exception);
+        isolate_->handleException(exception);
+        return false;
+    }
+    JSValueProtect(ctx, generator);
+    instance->generator_ = generator;
+    instance->status_ = kInstantiated;
+    return true;
+}
+
+MaybeLocal<Value> Module::Evaluate(Local<Context> context) {
+    Instance* instance = FindInstance_(*context);
+    V8::Check(instance && instance->status_ != kInstantiating, "Module::Evaluate, module is not instantiated");
+    if (context->pool_entry_) {
+        MarkContextDirty(*context, false);
+    }
+    if (!Evaluate_(context)) {
+        return MaybeLocal<Value>();
+    }
+    return ProcessResult(isolate_, isolate_->literal_values_[kUndefinedValueIndex]);
+}
+
+bool Module::Evaluate_(Local<Context> context) {
+    Instance* instance = FindInstance_(*context);
+    //kEvaluating说明是循环依赖，对方看到的是还没执行完的模块
+    if (instance->status_ == kEvaluating || instance->status_ == kEvaluated) {
+        return true;
+    }
+    if (instance->status_ == kErrored) {
+        isolate_->handleException(instance->exception_);
+        return false;
+    }
+    JSContextRef ctx = context->context_;
+    instance->status_ = kEvaluating;
+    for (size_t i = 0; i < instance->resolved_.size(); i++) {
+        Module* dependency = instance->resolved_[i];
+        if (!dependency->Evaluate_(context)) {
+            //依赖的异常已经报告过
+            SetError_(instance, ctx, dependency->FindInstance_(*context)->exception_);
+            return false;
+        }
+    }
+    JSValueRef exception = ResumeModuleGenerator(isolate_, ctx, instance->generator_);
+    JSValueUnprotect(ctx, instance->generator_);
+    instance->generator_ = nullptr;
+    if (exception) {
+        SetError_(instance, ctx, exception);
+        isolate_->handleException(exception);
+        return false;
+    }
+    instance->status_ = kEvaluated;
+    return true;
 }
 
 Local<External> External::New(Isolate* isolate, void* value) {
-    External* external = isolate->Alloc<External>();
+    JSObjectRef obj = JSObjectMake(isolate->current_js_context_, isolate->external_class_, value);
+    External* external = isolate->Alloc<External>(obj);
+    return Local<External>(external);
+}
+
+void* External::Value() const {
+    return JSObjectGetPrivate(const_cast<JSObjectRef>(value_));
+}
+
+double Number::Value() const {
+    JSValueRef jscException = nullptr;
+    double ret = JSValueToNumber(Isolate::current_->current_js_context_, value_, &jscException);
+    return ret;
+}
+
+Local<Number> Number::New(Isolate* isolate, double value) {
+    Number* ret = isolate->Alloc<Number>(JSValueMakeNumber(isolate->current_js_context_, value));
+    return Local<Number>(ret);
+}
+
+Local<Integer> Integer::New(Isolate* isolate, int32_t value) {
+    Integer* ret = isolate->Alloc<Integer>(JSValueMakeNumber(isolate->current_js_context_, value));
+    return Local<Integer>(ret);
+}
+
+Local<Integer> Integer::NewFromUnsigned(Isolate* isolate, uint32_t value) {
+    Integer* ret = isolate->Alloc<Integer>(JSValueMakeNumber(isolate->current_js_context_, value));
+    return Local<Integer>(ret);
+}
+
+Local<BigInt> BigInt::New(Isolate* isolate, int64_t value) {
+    BigInt* ret = isolate->Alloc<BigInt>(JSValueMakeNumber(isolate->current_js_context_, value));
+    return Local<BigInt>(ret);
+}
+
+Local<BigInt> BigInt::NewFromUnsigned(Isolate* isolate, uint64_t value) {
+    BigInt* ret = isolate->Alloc<BigInt>(JSValueMakeNumber(isolate->current_js_context_, value));
+    return Local<BigInt>(ret);
+}
+
+uint64_t BigInt::Uint64Value(bool* lossless) const {
+    return static_cast<uint64_t>(Int64Value(lossless));
+}
+
+int64_t BigInt::Int64Value(bool* lossless) const {
+    JSValueRef jscException = nullptr;
+    double ret = JSValueToNumber(Isolate::current_->current_js_context_, value_, &jscException);
+    return static_cast<int64_t>(ret);
+}
+
+bool Boolean::Value() const {
+    bool ret = JSValueToBoolean(Isolate::current_->current_js_context_, value_);
+    return ret;
+}
+
+Local<Boolean> Boolean::New(Isolate* isolate, bool value) {
+    Boolean* ret = isolate->Alloc<Boolean>(JSValueMakeBoolean(isolate->current_js_context_, value != 0));
+    return Local<Boolean>(ret);
+}
+
+int64_t Integer::Value() const {
+    JSValueRef jscException = nullptr;
+    double ret = JSValueToNumber(Isolate::current_->current_js_context_, value_, &jscException);
+    return static_cast<int64_t>(ret);
+}
+
+int32_t Int32::Value() const {
+    JSValueRef jscException = nullptr;
+    double ret = JSValueToNumber(Isolate::current_->current_js_context_, value_, &jscException);
+    return static_cast<int32_t>(ret);
+}
+
+char* String::Utf8Value::Reserve(size_t len) {
+    len_ = len;
+    data_ = len < kInlineBufferSize ? inline_buffer_ : new char[len + 1];
+    data_[len] = '\0';
+    return data_;
+}
+
+String::Utf8Value::Utf8Value(Isolate* isolate, Local<v8::Value> obj) {
+    if (obj.IsEmpty()) {
+        return;
+    }
+    //intern过的名字已经有utf8了，不需要经过jsc
+    const Isolate::InternValueEntry* interned = isolate->FindInternedValue(obj->value_);
+    if (interned) {
+        memcpy(Reserve(interned->len_), interned->key_, interned->len_);
+        return;
+    }
+    JSValueRef jscException = nullptr;
+    JSStringRef stringRef = JSValueToStringCopy(isolate->current_js_context_, obj->value_, &jscException);
+    if (stringRef == nullptr) {
+        return;
+    }
+    const JSChar* chars = JSStringGetCharactersPtr(stringRef);
+    size_t length = JSStringGetLength(stringRef);
+    Utf16ToUtf8(chars, length, Reserve(Utf16ToUtf8Length(chars, length)));
+    JSStringRelease(stringRef);
+}
+
+String::Utf8Value::~Utf8Value() {
+    if (data_ != inline_buffer_) {
+        delete[] data_;
+    }
+}
+
+MaybeLocal<Value> Date::New(Local<Context> context, double time) {
     //todo rhythm
-//    JS_INITPTR(external->value_, JS_TAG_EXTERNAL, value);
-    return Local<External>(external);
+    Date *date = context->GetIsolate()->Alloc<Date>();
+//    date->value_ = JS_NewDate(context->context_, time);
+    return MaybeLocal<Value>(Local<Date>(date));
+}
+    
+double Date::ValueOf() const {
+    //todo rhythm
+//    return JS_GetDate(Isolate::current_->current_js_context_, value_);
+    return 0;
+}
+
+void Map::Clear() {
+    //todo rhythm
+//    JS_MapClear(Isolate::current_->GetCurrentContext()->context_, value_);
+}
+
+MaybeLocal<Value> Map::Get(Local<Context> context,
+                           Local<Value> key) {
+    
+    //todo rhythm
+//    JSValue v = JS_MapGet(context->context_, value_, key->value_);
+//    if (JS_IsException(v)) {
+//        return MaybeLocal<Value>();
+//    }
+    Value *val = context->GetIsolate()->Alloc<Value>();
+//    val->value_ = v;
+    return MaybeLocal<Value>(Local<Value>(val));
+}
+
+MaybeLocal<Map> Map::Set(Local<Context> context,
+                         Local<Value> key,
+                         Local<Value> value) {
+    //todo rhythm
+//    JSValue m = JS_MapSet(context->context_, value_, key->value_, value->value_);
+//    if (JS_IsException(m)) {
+//        return MaybeLocal<Map>();
+//    }
+    Map *map = context->GetIsolate()->Alloc<Map>();
+//    map->value_ = m;
+    return MaybeLocal<Map>(Local<Map>(map));
+}
+
+Local<Map> Map::New(Isolate* isolate) {
+    //todo rhythm
+    Map *map = isolate->Alloc<Map>();
+//    map->value_ = JS_NewMap(isolate->current_js_context_);
+    return Local<Map>(map);
+}
+
+static std::vector<uint8_t> dummybuffer;
+
+Local<ArrayBuffer> ArrayBuffer::New(Isolate* isolate, size_t byte_length) {
+    //todo rhythm
+    ArrayBuffer *ab = isolate->Alloc<ArrayBuffer>();
+//    if (dummybuffer.size() < byte_length) dummybuffer.resize(byte_length, 0);
+//    ab->value_ = JS_NewArrayBufferCopy(isolate->current_js_context_, dummybuffer.data(), byte_length);
+    return Local<ArrayBuffer>(ab);
+}
+
+Local<ArrayBuffer> ArrayBuffer::New(Isolate* isolate, void* data, size_t byte_length,
+                                           ArrayBufferCreationMode mode) {
+    //todo rhythm
+    V8::Check(mode == ArrayBufferCreationMode::kExternalized, "only ArrayBufferCreationMode::kExternalized support!");
+    ArrayBuffer *ab = isolate->Alloc<ArrayBuffer>();
+//    ab->value_ = JS_NewArrayBuffer(isolate->current_js_context_, (uint8_t*)data, byte_length, nullptr, nullptr, false);
+    return Local<ArrayBuffer>(ab);
+}
+
+ArrayBuffer::Contents ArrayBuffer::GetContents() {
+    //todo rhythm
+    ArrayBuffer::Contents ret;
+//    ret.data_ = JS_GetArrayBuffer(Isolate::current_->current_js_context_, &ret.byte_length_, value_);
+    return ret;
+}
+
+Local<ArrayBuffer> ArrayBufferView::Buffer() {
+    //todo rhythm
+    Isolate* isolate = Isolate::current_;
+    ArrayBuffer* ab = isolate->Alloc<ArrayBuffer>();
+//    ab->value_ = JS_GetArrayBufferView(isolate->current_js_context_, value_);
+    return Local<ArrayBuffer>(ab);
+}
+    
+size_t ArrayBufferView::ByteOffset() {
+    //todo rhythm
+    size_t byte_offset;
+    size_t byte_length;
+    size_t bytes_per_element;
+//    JS_GetArrayBufferViewInfo(Isolate::current_->current_js_context_, value_, &byte_offset, &byte_length, &bytes_per_element);
+    return byte_offset;
+}
+    
+size_t ArrayBufferView::ByteLength() {
+    //todo rhythm
+    size_t byte_offset;
+    size_t byte_length;
+    size_t bytes_per_element;
+//    JS_GetArrayBufferViewInfo(Isolate::current_->current_js_context_, value_, &byte_offset, &byte_length, &bytes_per_element);
+    return byte_length;
+}
+
+Local<Object> Context::Global() {
+    Isolate* isolate = Isolate::current_;
+    if (pool_entry_) {
+        MarkContextDirty(this, false);
+    }
+    Object *object = isolate->Alloc<Object>(global_);
+    return Local<Object>(object);
+}
+
+static size_t GetTemplateEntryCount(const ObjectTemplateClass* info);
+
+Context::Context(Isolate* isolate) : Context(isolate, nullptr) {
+}
+
+Context::Context(Isolate* isolate, void* external_context) : Context(isolate, external_context, nullptr) {
+}
+
+Context::Context(Isolate* isolate, void* external_context, ObjectTemplate* global_template) :isolate_(isolate) {
+    //todo rhythm
+    is_external_context_ = external_context != nullptr;
+    
+    if (is_external_context_) {
+        context_ = static_cast<JSGlobalContextRef>(external_context);
+    } else if (global_template) {
+        global_template_ = global_template;
+        global_template_->AddRef_();
+        context_ = JSGlobalContextCreateInGroup(isolate->virtualMachine_, global_template->GlobalClass_(isolate));
+        size_t count = GetTemplateEntryCount(global_template->class_info_);
+        template_values_.resize(count, nullptr);
+        template_value_states_.resize(count, kTemplateValueUnset);
+    } else {
+        context_ = JSGlobalContextCreateInGroup(isolate->virtualMachine_, isolate->global_class_);
+        isolate->class_cache_hits_++;
+    }
+    JSObjectSetPrivate(JSContextGetGlobalObject(context_), this);
+    global_ = JSContextGetGlobalObject(context_);
+    
+    //外部传进来的context已经初始化过了
+    if (!is_external_context_ && isolate->snapshot_) {
+        RestoreSnapshot_();
+    }
+}
+
+static void DisposeContextPoolEntry(ContextPoolEntry* entry);
+
+Context::~Context() {
+    isolate_->ContextDisposed_(this);
+    if (pool_entry_) {
+        DisposeContextPoolEntry(pool_entry_);
+        pool_entry_ = nullptr;
+    }
+    for (size_t i = 0; i < template_values_.size(); i++) {
+        if (template_value_states_[i] == kTemplateValueSet) {
+            JSValueUnprotect(context_, template_values_[i]);
+        }
+    }
+    template_values_.clear();
+    template_value_states_.clear();
+    for (size_t i = 0; i < function_cache_.size(); i++) {
+        if (function_cache_[i]) {
+            JSValueUnprotect(context_, function_cache_[i]);
+        }
+    }
+    function_cache_.clear();
+    for (size_t i = 0; i < prototype_cache_.size(); i++) {
+        if (prototype_cache_[i]) {
+            JSValueUnprotect(context_, prototype_cache_[i]);
+        }
+    }
+    prototype_cache_.clear();
+    if (define_accessor_) {
+        JSValueUnprotect(context_, define_accessor_);
+        define_accessor_ = nullptr;
+    }
+    //释放后这个context里创建的包装对象才有机会被回收并触发finalizer
+    if (!is_external_context_) {
+        JSGlobalContextRelease(context_);
+    }
+    if (global_template_) {
+        global_template_->Release_();
+        global_template_ = nullptr;
+    }
+}
+
+JSObjectRef Context::FunctionPrototype_() {
+    if (V8_UNLIKELY(function_prototype_ == nullptr)) {
+        //global上的Function可能被脚本改写，从一个临时函数上取内置的Function.prototype，它和global同生命周期
+        JSObjectRef func = JSObjectMakeFunctionWithCallback(context_, nullptr,
+            [](JSContextRef, JSObjectRef, JSObjectRef, size_t, const JSValueRef[], JSValueRef*) -> JSValueRef { return nullptr; });
+        function_prototype_ = JSValueToObject(context_, JSObjectGetPrototype(context_, func), nullptr);
+    }
+    return function_prototype_;
+}
+
+Local<Context> Context::New(Isolate* isolate, ExtensionConfiguration* extensions,
+                            Local<ObjectTemplate> global_template) {
+    return Local<Context>(new Context(isolate, nullptr, *global_template));
+}
+
+//新建context时记下global所有自己的属性(包括不可枚举的内置对象和安装的绑定)的描述符，
+//返回的函数把global恢复成那时的样子：删掉之后新增的属性(var声明的删不掉，清成undefined)，
+//被删掉、改写的属性按原来的描述符(值和attributes)重新定义。用到的内置函数事先取好，用户改写了也不影响
+static const char kContextPoolResetSource[] =
+    "(function (g) {\n"
+    "    var getNames = Object.getOwnPropertyNames, getDesc = Object.getOwnPropertyDescriptor, define = Object.defineProperty;\n"
+    "    var names = getNames(g), descs = [], known = Object.create(null);\n"
+    "    for (var i = 0; i < names.length; i++) {\n"
+    "        descs[i] = getDesc(g, names[i]);\n"
+    "        known[names[i]] = true;\n"
+    "    }\n"
+    "    return function () {\n"
+    "        var current = getNames(g);\n"
+    "        for (var i = 0; i < current.length; i++) {\n"
+    "            var name = current[i];\n"
+    "            if (known[name] !== true && !delete g[name]) {\n"
+    "                try { g[name] = undefined; } catch (e) {}\n"
+    "            }\n"
+    "        }\n"
+    "        for (var i = 0; i < names.length; i++) {\n"
+    "            var old = descs[i], now = getDesc(g, names[i]);\n"
+    "            if (now && ('value' in old ? now.value === old.value && now.writable === old.writable\n"
+    "                                        : now.get === old.get && now.set === old.set)\n"
+    "                && now.enumerable === old.enumerable && now.configurable === old.configurable) {\n"
+    "                continue;\n"
+    "            }\n"
+    "            try { define(g, names[i], old); } catch (e) {}\n"
+    "        }\n"
+    "    };\n"
+    "})";
+
+struct ContextPoolEntry {
+    ContextPool* pool_;
+    //在pool_->entries_里的位置
+    size_t index_;
+    JSGlobalContextRef context_;
+    //kContextPoolResetSource返回的函数，被protect
+    JSObjectRef reset_;
+    //Checkout之后执行过脚本、调用过函数或者取过Global()
+    bool dirty_;
+    //执行过有顶层let/const/class的脚本，global的词法作用域清不掉，只能换一个新的context
+    bool lexical_;
+};
+
+static void MarkContextDirty(Context* context, bool lexical) {
+    context->pool_entry_->dirty_ = true;
+    context->pool_entry_->lexical_ = context->pool_entry_->lexical_ || lexical;
+}
+
+static void DisposeContextPoolEntry(ContextPoolEntry* entry) {
+    if (entry->pool_) {
+        std::vector<ContextPoolEntry*>& entries = entry->pool_->entries_;
+        entries[entry->index_] = entries.back();
+        entries[entry->index_]->index_ = entry->index_;
+        entries.pop_back();
+    }
+    if (entry->reset_) {
+        JSValueUnprotect(entry->context_, entry->reset_);
+    }
+    delete entry;
+}
+
+ContextPool::ContextPool(Isolate* isolate, size_t size, InitializeCallback initialize, void* data)
+    : isolate_(isolate), size_(size), initialize_(initialize), data_(data) {
+    isolate_->context_pools_++;
+    idle_.reserve(size);
+    for (size_t i = 0; i < size; i++) {
+        idle_.push_back(NewContext_());
+    }
+}
+
+ContextPool::~ContextPool() {
+    //还没Checkin的context和池脱离关系，之后照常释放
+    for (size_t i = 0; i < entries_.size(); i++) {
+        entries_[i]->pool_ = nullptr;
+    }
+    entries_.clear();
+    for (size_t i = 0; i < idle_.size(); i++) {
+        idle_[i]->Release_();
+    }
+    idle_.clear();
+    isolate_->context_pools_--;
+}
+
+Context* ContextPool::NewContext_() {
+    Local<Context> context = Context::New(isolate_);
+    if (initialize_) {
+        HandleScope handle_scope(isolate_);
+        Context::Scope context_scope(context);
+        initialize_(context, data_);
+    }
+    
+    ContextPoolEntry* entry = new ContextPoolEntry();
+    entry->pool_ = this;
+    entry->index_ = entries_.size();
+    entry->context_ = context->context_;
+    entry->reset_ = nullptr;
+    entry->dirty_ = false;
+    entry->lexical_ = false;
+    JSStringRef source = JSStringCreateWithUTF8CString(kContextPoolResetSource);
+    JSValueRef factory = JSEvaluateScript(context->context_, source, nullptr, nullptr, 1, nullptr);
+    JSStringRelease(source);
+    JSValueRef global = context->global_;
+    JSValueRef reset = factory && JSValueIsObject(context->context_, factory)
+        ? JSObjectCallAsFunction(context->context_, JSValueToObject(context->context_, factory, nullptr), nullptr, 1, &global, nullptr)
+        : nullptr;
+    V8::Check(reset && JSValueIsObject(context->context_, reset), "ContextPool, can not create reset function");
+    entry->reset_ = JSValueToObject(context->context_, reset, nullptr);
+    JSValueProtect(context->context_, entry->reset_);
+    entries_.push_back(entry);
+    context->pool_entry_ = entry;
+    
+    Context* ret = *context;
+    ret->AddRef_();
+    return ret;
+}
+
+Local<Context> ContextPool::Checkout() {
+    Context* context;
+    if (idle_.empty()) {
+        context = NewContext_();
+    } else {
+        context = idle_.back();
+        idle_.pop_back();
+    }
+    //池里的引用转给返回的Local
+    Local<Context> ret(context);
+    context->Release_();
+    return ret;
+}
+
+bool ContextPool::ResetContext_(Context* context) {
+    ContextPoolEntry* entry = context->pool_entry_;
+    if (entry->lexical_) {
+        return false;
+    }
+    if (entry->dirty_) {
+        JSValueRef exception = nullptr;
+        JSObjectCallAsFunction(context->context_, entry->reset_, nullptr, 0, nullptr, &exception);
+        if (exception) {
+            return false;
+        }
+        entry->dirty_ = false;
+    }
+    return true;
+}
+
+void ContextPool::Checkin(Local<Context> context) {
+    Context* ctx = *context;
+    V8::Check(ctx->pool_entry_ && ctx->pool_entry_->pool_ == this, "ContextPool::Checkin, context is not from this pool");
+    if (idle_.size() >= size_) {
+        return;
+    }
+    if (!ResetContext_(ctx)) {
+        //重置不了的context随最后一个引用释放，换一个新的放回池里
+        idle_.push_back(NewContext_());
+        return;
+    }
+    ctx->AddRef_();
+    idle_.push_back(ctx);
+}
+
+//blob的格式：header后面依次是scripts(name, 源码)、globals(name, JSON, position)、data(JSON)，
+//每个字符串是uint32长度加utf8内容，position是uint32
+struct SnapshotBlobHeader {
+    uint32_t magic_;
+    uint32_t version_;
+    uint32_t script_count_;
+    uint32_t global_count_;
+    uint32_t data_count_;
+};
+
+static const uint32_t kSnapshotBlobMagic = 0x534e534a;
+
+static const uint32_t kSnapshotBlobVersion = 2;
+
+struct SnapshotBlobContents {
+    std::vector<std::pair<std::string, std::string>> scripts_;
+    std::vector<SnapshotCreator::Global> globals_;
+    std::vector<std::string> data_;
+};
+
+static void WriteSnapshotUint32(std::string* out, uint32_t value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void WriteSnapshotString(std::string* out, const std::string& str) {
+    WriteSnapshotUint32(out, (uint32_t)str.size());
+    out->append(str);
+}
+
+static bool ReadSnapshotUint32(const char** pos, const char* end, uint32_t* value) {
+    if ((size_t)(end - *pos) < sizeof(*value)) {
+        return false;
+    }
+    memcpy(value, *pos, sizeof(*value));
+    *pos += sizeof(*value);
+    return true;
 }
 
-void* External::Value() const {
-    //todo rhythm
-//    return JS_VALUE_GET_PTR(value_);
-    return nullptr;
+static bool ReadSnapshotString(const char** pos, const char* end, std::string* str) {
+    uint32_t length;
+    if (!ReadSnapshotUint32(pos, end, &length) || (size_t)(end - *pos) < length) {
+        return false;
+    }
+    str->assign(*pos, length);
+    *pos += length;
+    return true;
 }
 
-double Number::Value() const {
-    JSValueRef jscException = nullptr;
-    double ret = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &jscException);
-    return ret;
+static std::string SerializeSnapshotBlob(const SnapshotBlobContents& contents) {
+    SnapshotBlobHeader header;
+    header.magic_ = kSnapshotBlobMagic;
+    header.version_ = kSnapshotBlobVersion;
+    header.script_count_ = (uint32_t)contents.scripts_.size();
+    header.global_count_ = (uint32_t)contents.globals_.size();
+    header.data_count_ = (uint32_t)contents.data_.size();
+    std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (size_t i = 0; i < contents.scripts_.size(); i++) {
+        WriteSnapshotString(&out, contents.scripts_[i].first);
+        WriteSnapshotString(&out, contents.scripts_[i].second);
+    }
+    for (size_t i = 0; i < contents.globals_.size(); i++) {
+        WriteSnapshotString(&out, contents.globals_[i].name_);
+        WriteSnapshotString(&out, contents.globals_[i].json_);
+        WriteSnapshotUint32(&out, contents.globals_[i].position_);
+    }
+    for (size_t i = 0; i < contents.data_.size(); i++) {
+        WriteSnapshotString(&out, contents.data_[i]);
+    }
+    return out;
 }
 
-Local<Number> Number::New(Isolate* isolate, double value) {
-    Number* ret = isolate->Alloc<Number>();
-    ret->value_ = JSValueMakeNumber(isolate->GetCurrentContext()->context_, value);
-    return Local<Number>(ret);
+//各平台默认的SnapshotBlobCode是空数组，和其它无效的blob一样当作没有快照
+static bool ParseSnapshotBlob(const StartupData* blob, SnapshotBlobContents* contents) {
+    SnapshotBlobHeader header;
+    if (blob->data == nullptr || blob->raw_size < (int)sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, blob->data, sizeof(header));
+    if (header.magic_ != kSnapshotBlobMagic || header.version_ != kSnapshotBlobVersion) {
+        return false;
+    }
+    const char* pos = blob->data + sizeof(header);
+    const char* end = blob->data + blob->raw_size;
+    contents->scripts_.resize(header.script_count_);
+    for (size_t i = 0; i < contents->scripts_.size(); i++) {
+        if (!ReadSnapshotString(&pos, end, &contents->scripts_[i].first)
+            || !ReadSnapshotString(&pos, end, &contents->scripts_[i].second)) {
+            return false;
+        }
+    }
+    contents->globals_.resize(header.global_count_);
+    for (size_t i = 0; i < contents->globals_.size(); i++) {
+        if (!ReadSnapshotString(&pos, end, &contents->globals_[i].name_)
+            || !ReadSnapshotString(&pos, end, &contents->globals_[i].json_)
+            || !ReadSnapshotUint32(&pos, end, &contents->globals_[i].position_)) {
+            return false;
+        }
+    }
+    contents->data_.resize(header.data_count_);
+    for (size_t i = 0; i < contents->data_.size(); i++) {
+        if (!ReadSnapshotString(&pos, end, &contents->data_[i])) {
+            return false;
+        }
+    }
+    return pos == end;
 }
 
-Local<Integer> Integer::New(Isolate* isolate, int32_t value) {
-    Integer* ret = isolate->Alloc<Integer>();
-    ret->value_ = JSValueMakeNumber(isolate->GetCurrentContext()->context_, value);
-    return Local<Integer>(ret);
+//isolate加载blob后的结果，新建context时只需要设置数据和执行已解析的脚本
+struct StartupSnapshot {
+    struct Script {
+        JSStringRef resource_name_;
+        JSStringRef source_;
+#ifdef V8_JSC_USE_SCRIPT_REF
+        JSScriptRef script_;
+#endif
+    };
+    struct Global {
+        JSStringRef name_;
+        //nullptr表示undefined
+        JSStringRef json_;
+        //在scripts_[position_]之前恢复
+        uint32_t position_;
+    };
+    std::vector<Script> scripts_;
+    //按position_排好序
+    std::vector<Global> globals_;
+    std::vector<JSStringRef> data_;
+};
+
+static void DeleteStartupSnapshot(StartupSnapshot* snapshot) {
+    for (size_t i = 0; i < snapshot->scripts_.size(); i++) {
+#ifdef V8_JSC_USE_SCRIPT_REF
+        JSScriptRelease(snapshot->scripts_[i].script_);
+#endif
+        JSStringRelease(snapshot->scripts_[i].resource_name_);
+        JSStringRelease(snapshot->scripts_[i].source_);
+    }
+    for (size_t i = 0; i < snapshot->globals_.size(); i++) {
+        JSStringRelease(snapshot->globals_[i].name_);
+        if (snapshot->globals_[i].json_) {
+            JSStringRelease(snapshot->globals_[i].json_);
+        }
+    }
+    for (size_t i = 0; i < snapshot->data_.size(); i++) {
+        JSStringRelease(snapshot->data_[i]);
+    }
+    delete snapshot;
 }
 
-Local<Integer> Integer::NewFromUnsigned(Isolate* isolate, uint32_t value) {
-    Integer* ret = isolate->Alloc<Integer>();
-    ret->value_ = JSValueMakeNumber(isolate->GetCurrentContext()->context_, value);
-    return Local<Integer>(ret);
+void Isolate::LoadSnapshot_(const StartupData* blob) {
+    SnapshotBlobContents contents;
+    if (blob == nullptr || !ParseSnapshotBlob(blob, &contents)) {
+        return;
+    }
+    StartupSnapshot* snapshot = new StartupSnapshot();
+    //脚本解析失败被跳过时，globals_的position要跟着调整
+    std::vector<uint32_t> positions(contents.scripts_.size() + 1, 0);
+    for (size_t i = 0; i < contents.scripts_.size(); i++) {
+        positions[i] = (uint32_t)snapshot->scripts_.size();
+        StartupSnapshot::Script script;
+        //源码、名字和数据里都可能有'\0'，按长度解码
+        const std::string& name = contents.scripts_[i].first;
+        const std::string& source = contents.scripts_[i].second;
+        script.resource_name_ = CreateJSStringFromUtf8(name.data(), name.size());
+        script.source_ = CreateJSStringFromUtf8(source.data(), source.size());
+#ifdef V8_JSC_USE_SCRIPT_REF
+        JSStringRef error_message = nullptr;
+        int error_line = 0;
+        script.script_ = JSScriptCreateFromString(virtualMachine_, script.resource_name_, 1, script.source_,
+                                                  &error_message, &error_line);
+        if (script.script_ == nullptr) {
+            //生成blob时执行成功过，只有blob和jsc版本不匹配才会走到
+            std::cerr << contents.scripts_[i].first << ":" << error_line << ": snapshot script "
+                << (error_message ? JSStringToUtf8(error_message) : std::string()) << std::endl;
+            if (error_message) {
+                JSStringRelease(error_message);
+            }
+            JSStringRelease(script.resource_name_);
+            JSStringRelease(script.source_);
+            continue;
+        }
+#endif
+        snapshot->scripts_.push_back(script);
+    }
+    positions[contents.scripts_.size()] = (uint32_t)snapshot->scripts_.size();
+    for (size_t i = 0; i < contents.globals_.size(); i++) {
+        const SnapshotCreator::Global& global = contents.globals_[i];
+        StartupSnapshot::Global restored;
+        restored.name_ = CreateJSStringFromUtf8(global.name_.data(), global.name_.size());
+        restored.json_ = global.json_.empty() ? nullptr : CreateJSStringFromUtf8(global.json_.data(), global.json_.size());
+        restored.position_ = positions[std::min<size_t>(global.position_, contents.scripts_.size())];
+        snapshot->globals_.push_back(restored);
+    }
+    std::stable_sort(snapshot->globals_.begin(), snapshot->globals_.end(),
+                     [](const StartupSnapshot::Global& a, const StartupSnapshot::Global& b) { return a.position_ < b.position_; });
+    for (size_t i = 0; i < contents.data_.size(); i++) {
+        snapshot->data_.push_back(CreateJSStringFromUtf8(contents.data_[i].data(), contents.data_[i].size()));
+    }
+    snapshot_ = snapshot;
 }
 
-Local<BigInt> BigInt::New(Isolate* isolate, int64_t value) {
-    BigInt* ret = isolate->Alloc<BigInt>();
-    ret->value_ = JSValueMakeNumber(isolate->GetCurrentContext()->context_, value);
-    return Local<BigInt>(ret);
+//每个global要么从JSON恢复(生成数据的脚本不再执行)，要么由重放的脚本建立，两者按生成时的顺序交错，
+//重放脚本对数据的修改(比如items.push)只发生一次
+void Context::RestoreSnapshot_() {
+    StartupSnapshot* snapshot = isolate_->snapshot_;
+    size_t global = 0;
+    for (size_t i = 0; i <= snapshot->scripts_.size(); i++) {
+        for (; global < snapshot->globals_.size() && snapshot->globals_[global].position_ <= i; global++) {
+            JSStringRef json = snapshot->globals_[global].json_;
+            JSValueRef value = json ? JSValueMakeFromJSONString(context_, json) : JSValueMakeUndefined(context_);
+            if (value) {
+                JSObjectSetProperty(context_, global_, snapshot->globals_[global].name_, value, kJSPropertyAttributeNone, nullptr);
+            }
+        }
+        if (i == snapshot->scripts_.size()) {
+            break;
+        }
+        JSValueRef exception = nullptr;
+#ifdef V8_JSC_USE_SCRIPT_REF
+        JSScriptEvaluate(context_, snapshot->scripts_[i].script_, nullptr, &exception);
+#else
+        //生成blob时已经检查过语法
+        JSEvaluateScript(context_, snapshot->scripts_[i].source_, nullptr, snapshot->scripts_[i].resource_name_, 1, &exception);
+#endif
+        if (exception) {
+            isolate_->handleException(exception);
+        }
+    }
+    snapshot_data_taken_.assign(snapshot->data_.size(), false);
 }
 
-Local<BigInt> BigInt::NewFromUnsigned(Isolate* isolate, uint64_t value) {
-    BigInt* ret = isolate->Alloc<BigInt>();
-    ret->value_ = JSValueMakeNumber(isolate->GetCurrentContext()->context_, value);
-    return Local<BigInt>(ret);
+Value* Context::GetDataFromSnapshotOnce_(size_t index) {
+    StartupSnapshot* snapshot = isolate_->snapshot_;
+    if (snapshot == nullptr || index >= snapshot_data_taken_.size() || snapshot_data_taken_[index]) {
+        return nullptr;
+    }
+    snapshot_data_taken_[index] = true;
+    JSValueRef value = JSValueMakeFromJSONString(context_, snapshot->data_[index]);
+    return value ? isolate_->Alloc<Value>(value) : nullptr;
 }
 
-uint64_t BigInt::Uint64Value(bool* lossless) const {
-    return static_cast<uint64_t>(Int64Value(lossless));
+SnapshotCreator::SnapshotCreator(const intptr_t* external_references, StartupData* existing_blob) {
+    //没有native函数的序列化，external_references用不上
+    isolate_ = new Isolate();
+    SnapshotBlobContents contents;
+    if (existing_blob && ParseSnapshotBlob(existing_blob, &contents)) {
+        isolate_->LoadSnapshot_(existing_blob);
+        scripts_ = contents.scripts_;
+        globals_ = contents.globals_;
+    }
 }
 
-int64_t BigInt::Int64Value(bool* lossless) const {
-    JSValueRef jscException = nullptr;
-    double ret = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &jscException);
-    return static_cast<int64_t>(ret);
+SnapshotCreator::~SnapshotCreator() {
+    default_context_ = Local<Context>();
+    isolate_->Dispose();
 }
 
-bool Boolean::Value() const {
-    bool ret = JSValueToBoolean(Isolate::current_->current_context_->context_, value_);
-    return ret;
+void SnapshotCreator::SetDefaultContext(Local<Context> context) {
+    default_context_ = context;
 }
 
-Local<Boolean> Boolean::New(Isolate* isolate, bool value) {
-    Boolean* ret = isolate->Alloc<Boolean>();
-    ret->value_ = JSValueMakeBoolean(isolate->GetCurrentContext()->context_, value != 0);
-    return Local<Boolean>(ret);
+size_t SnapshotCreator::AddData(Local<Context> context, Local<Value> object) {
+    JSValueRef exception = nullptr;
+    JSStringRef json = JSValueCreateJSONString(context->context_, object->value_, 0, &exception);
+    V8::Check(json != nullptr, "SnapshotCreator::AddData, value is not JSON serializable");
+    data_.push_back(JSStringToUtf8(json));
+    JSStringRelease(json);
+    return data_.size() - 1;
 }
 
-int64_t Integer::Value() const {
-    JSValueRef jscException = nullptr;
-    bool ret = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &jscException);
+//只有JSON能原样还原的值才能放进blob：有限的数字、字符串、布尔、null，以及由它们组成的普通对象和数组(没有共享引用、访问器、symbol)
+static const char kSnapshotPlainDataChecker[] =
+    "(function (value) {\n"
+    "    var seen = [];\n"
+    "    function plain(v) {\n"
+    "        if (v === null) return true;\n"
+    "        switch (typeof v) {\n"
+    "        case 'string': case 'boolean': return true;\n"
+    "        case 'number': return isFinite(v);\n"
+    "        case 'object': break;\n"
+    "        default: return false;\n"
+    "        }\n"
+    "        if (seen.indexOf(v) >= 0) return false;\n"
+    "        seen.push(v);\n"
+    "        var proto = Object.getPrototypeOf(v);\n"
+    "        var is_array = Array.isArray(v);\n"
+    "        if (proto !== (is_array ? Array.prototype : Object.prototype)) return false;\n"
+    "        if (Object.getOwnPropertySymbols(v).length) return false;\n"
+    "        var names = Object.getOwnPropertyNames(v);\n"
+    "        if (is_array && names.length !== v.length + 1) return false;\n"
+    "        for (var i = 0; i < names.length; i++) {\n"
+    "            if (is_array && names[i] === 'length') continue;\n"
+    "            var desc = Object.getOwnPropertyDescriptor(v, names[i]);\n"
+    "            if (!('value' in desc) || !desc.enumerable || !plain(desc.value)) return false;\n"
+    "        }\n"
+    "        return true;\n"
+    "    }\n"
+    "    return plain(value);\n"
+    "})";
+
+//names_before之外新增的global(内置对象都不可枚举)，全部要能按JSON还原，函数之类的值报错
+static bool CollectSnapshotGlobals(JSContextRef ctx, const std::vector<std::string>& names_before, uint32_t position,
+                                   std::vector<SnapshotCreator::Global>* globals, std::string* error) {
+    JSObjectRef global = JSContextGetGlobalObject(ctx);
+    JSStringRef checker_source = JSStringCreateWithUTF8CString(kSnapshotPlainDataChecker);
+    JSValueRef checker = JSEvaluateScript(ctx, checker_source, nullptr, nullptr, 1, nullptr);
+    JSStringRelease(checker_source);
+    V8::Check(checker && JSValueIsObject(ctx, checker), "SnapshotCreator::RunScript, can not create data checker");
+    JSValueProtect(ctx, checker);
+    
+    bool ok = true;
+    JSPropertyNameArrayRef names = JSObjectCopyPropertyNames(ctx, global);
+    size_t count = JSPropertyNameArrayGetCount(names);
+    for (size_t i = 0; i < count && ok; i++) {
+        JSStringRef name = JSPropertyNameArrayGetNameAtIndex(names, i);
+        SnapshotCreator::Global entry;
+        entry.name_ = JSStringToUtf8(name);
+        entry.position_ = position;
+        if (std::binary_search(names_before.begin(), names_before.end(), entry.name_)) {
+            continue;
+        }
+        JSValueRef value = JSObjectGetProperty(ctx, global, name, nullptr);
+        if (value && !JSValueIsUndefined(ctx, value)) {
+            JSValueRef plain = JSObjectCallAsFunction(ctx, JSValueToObject(ctx, checker, nullptr), nullptr, 1, &value, nullptr);
+            JSStringRef json = (plain && JSValueToBoolean(ctx, plain)) ? JSValueCreateJSONString(ctx, value, 0, nullptr) : nullptr;
+            if (json == nullptr) {
+                *error = "snapshot: global '" + entry.name_ + "' set by a data script is not plain data, move it to a replayed script";
+                ok = false;
+                break;
+            }
+            entry.json_ = JSStringToUtf8(json);
+            JSStringRelease(json);
+        }
+        globals->push_back(entry);
+    }
+    JSPropertyNameArrayRelease(names);
+    JSValueUnprotect(ctx, checker);
+    return ok;
+}
+
+StartupData SnapshotCreator::CreateBlob(FunctionCodeHandling function_code_handling) {
+    V8::Check(!default_context_.IsEmpty(), "SnapshotCreator::CreateBlob, no default context");
+    SnapshotBlobContents contents;
+    contents.scripts_ = scripts_;
+    contents.globals_ = globals_;
+    contents.data_ = data_;
+    
+    std::string bytes = SerializeSnapshotBlob(contents);
+    char* data = new char[bytes.size()];
+    memcpy(data, bytes.data(), bytes.size());
+    StartupData blob;
+    blob.data = data;
+    blob.raw_size = (int)bytes.size();
+    return blob;
+}
+
+static std::vector<std::string> GetGlobalNames(JSContextRef ctx) {
+    std::vector<std::string> ret;
+    JSPropertyNameArrayRef names = JSObjectCopyPropertyNames(ctx, JSContextGetGlobalObject(ctx));
+    size_t count = JSPropertyNameArrayGetCount(names);
+    for (size_t i = 0; i < count; i++) {
+        ret.push_back(JSStringToUtf8(JSPropertyNameArrayGetNameAtIndex(names, i)));
+    }
+    JSPropertyNameArrayRelease(names);
+    std::sort(ret.begin(), ret.end());
     return ret;
 }
 
-int32_t Int32::Value() const {
-    JSValueRef jscException = nullptr;
-    double ret = JSValueToNumber(Isolate::current_->current_context_->context_, value_, &jscException);
-    return static_cast<int32_t>(ret);
+MaybeLocal<Value> SnapshotCreator::RunScript(Local<Context> context, Local<String> source,
+                                             ScriptOrigin* origin, bool replay) {
+    JSContextRef ctx = context->context_;
+    std::vector<std::string> names_before;
+    if (!replay) {
+        JSStringRef source_string = Script::GetSourceString_(context, source);
+        std::string declaration;
+        bool lexical = FindTopLevelLexicalDeclaration(source_string, &declaration);
+        JSStringRelease(source_string);
+        if (lexical) {
+            isolate_->handleException(NewError(ctx, "Error", "snapshot: top level '" + declaration
+                                                   + "' in a data script is not on the global object, use var or move it to a replayed script"));
+            return MaybeLocal<Value>();
+        }
+        names_before = GetGlobalNames(ctx);
+    }
+    Local<Script> script;
+    if (!Script::Compile(context, source, origin).ToLocal(&script)) {
+        return MaybeLocal<Value>();
+    }
+    MaybeLocal<Value> ret = script->Run(context);
+    if (ret.IsEmpty()) {
+        return ret;
+    }
+    if (replay) {
+        JSStringRef resource_name = Script::GetResourceName_(context, origin);
+        scripts_.push_back(std::make_pair(JSStringToUtf8(resource_name), std::string(*String::Utf8Value(isolate_, source))));
+        JSStringRelease(resource_name);
+        return ret;
+    }
+    //新增的global在这时就序列化，之后重放的脚本对它的修改不会进到JSON里
+    std::string error;
+    if (!CollectSnapshotGlobals(ctx, names_before, (uint32_t)scripts_.size(), &globals_, &error)) {
+        isolate_->handleException(NewError(ctx, "Error", error));
+        return MaybeLocal<Value>();
+    }
+    return ret;
 }
 
-String::Utf8Value::Utf8Value(Isolate* isolate, Local<v8::Value> obj) {
-    //todo rhythm
-    JSValueRef jscException = nullptr;
-    auto context = isolate->GetCurrentContext()->context_;
-    JSStringRef stringRef = JSValueToStringCopy(context, obj->value_, &jscException);
-    len_ = JSStringGetMaximumUTF8CStringSize(stringRef);
+//native调用js时的参数，个数少时放在栈上
+struct CallArguments {
+    static const int kStackSize = 8;
+    
+    CallArguments(int argc, Local<Value> argv[]) {
+        argv_ = stack_;
+        if (argc > kStackSize) {
+            heap_.resize(argc);
+            argv_ = heap_.data();
+        }
+        for (int i = 0; i < argc; i++) {
+            argv_[i] = argv[i]->value_;
+        }
+    }
     
-    char * c_data = new char [len_];
-    len_ = JSStringGetUTF8CString(stringRef, c_data, len_);
-    data_ = c_data;
+    JSValueRef stack_[kStackSize];
+    std::vector<JSValueRef> heap_;
+    JSValueRef* argv_;
+};
+
+MaybeLocal<Value> Function::Call(Local<Context> context,
+                             Local<Value> recv, int argc,
+                             Local<Value> argv[]) {
+    Isolate* isolate = context->GetIsolate();
+    JSContextRef ctx = context->context_;
+    if (context->pool_entry_) {
+        MarkContextDirty(*context, false);
+    }
+    CallArguments arguments(argc, argv);
+    //jsc的this只能是对象，undefined和null传nullptr
+    JSObjectRef js_this = nullptr;
+    if (!recv.IsEmpty() && !JSValueIsUndefined(ctx, recv->value_) && !JSValueIsNull(ctx, recv->value_)) {
+        js_this = JSValueToObject(ctx, recv->value_, nullptr);
+    }
+    JSValueRef exception = nullptr;
+    JSValueRef ret = JSObjectCallAsFunction(ctx, const_cast<JSObjectRef>(value_), js_this, argc, arguments.argv_, &exception);
+    if (exception) {
+        isolate->handleException(exception);
+        return MaybeLocal<Value>();
+    }
+    return ProcessResult(isolate, ret);
 }
 
-String::Utf8Value::~Utf8Value() {
+MaybeLocal<Object> Function::NewInstance(Local<Context> context, int argc, Local<Value> argv[]) const {
+    Isolate* isolate = context->GetIsolate();
+    if (context->pool_entry_) {
+        MarkContextDirty(*context, false);
+    }
+    CallArguments arguments(argc, argv);
+    JSValueRef exception = nullptr;
+    JSObjectRef ret = JSObjectCallAsConstructor(context->context_, const_cast<JSObjectRef>(value_), argc, arguments.argv_, &exception);
+    if (exception) {
+        isolate->handleException(exception);
+        return MaybeLocal<Object>();
+    }
+    return MaybeLocal<Object>(Local<Object>(isolate->Alloc<Object>(ret)));
 }
 
-MaybeLocal<Value> Date::New(Local<Context> context, double time) {
-    //todo rhythm
-    Date *date = context->GetIsolate()->Alloc<Date>();
-//    date->value_ = JS_NewDate(context->context_, time);
-    return MaybeLocal<Value>(Local<Date>(date));
+template<class T>
+static void SetTemplateEntry(std::vector<std::pair<JSStringRef, T>>& entries, JSStringRef name, const T& value) {
+    //intern过的名字指针唯一，同名覆盖，保留第一次注册的顺序
+    for (auto& entry : entries) {
+        if (entry.first == name) {
+            entry.second = value;
+            return;
+        }
+    }
+    entries.emplace_back(name, value);
+}
+
+static JSStringRef InternName(Isolate* isolate, Local<Value> name) {
+    JSStringRef ret = isolate->GetInternedName(name->value_);
+    if (ret) {
+        return ret;
+    }
+    String::Utf8Value utf8(isolate, name);
+    return isolate->InternString(*utf8, utf8.length());
+}
+
+void Template::Set(Isolate* isolate, const char* name, Local<Data> value) {
+    SetTemplateEntry(fields_, isolate->InternString(name, strlen(name)), value);
+}
+
+void Template::Set(Local<Name> name, Local<Data> value,
+                   PropertyAttribute attributes) {
+    Isolate* isolate = Isolate::current_;
+    SetTemplateEntry(fields_, InternName(isolate, name), value);
 }
     
-double Date::ValueOf() const {
-    //todo rhythm
-//    return JS_GetDate(Isolate::current_->current_context_->context_, value_);
-    return 0;
+void Template::SetAccessorProperty(Local<Name> name,
+                                         Local<FunctionTemplate> getter,
+                                         Local<FunctionTemplate> setter,
+                                         PropertyAttribute attribute) {
+    Isolate* isolate = Isolate::current_;
+    SetTemplateEntry(accessor_property_infos_, InternName(isolate, name), AccessorPropertyInfo{getter, setter, attribute});
 }
 
-void Map::Clear() {
-    //todo rhythm
-//    JS_MapClear(Isolate::current_->GetCurrentContext()->context_, value_);
+void ObjectTemplate::SetAccessor(Local<Name> name, AccessorNameGetterCallback getter,
+                                 AccessorNameSetterCallback setter,
+                                 Local<Value> data, AccessControl settings,
+                                 PropertyAttribute attribute) {
+    Isolate* isolate = Isolate::current_;
+    isolate_ = isolate;
+    //data在template析构时unprotect
+    JSValueRef js_data = data.IsEmpty() ? isolate->literal_values_[kUndefinedValueIndex] : data->value_;
+    JSValueProtect(isolate->isolate_context_, js_data);
+    JSStringRef key = InternName(isolate, name);
+    for (auto& entry : accessor_infos_) {
+        if (entry.first == key) {
+            JSValueUnprotect(isolate->isolate_context_, entry.second.data_);
+            break;
+        }
+    }
+    SetTemplateEntry(accessor_infos_, key, AccessorInfo{getter, setter, js_data, settings, attribute});
 }
 
-MaybeLocal<Value> Map::Get(Local<Context> context,
-                           Local<Value> key) {
+//ObjectTemplate编译成的静态属性表。JSStaticFunction的回调拿不到自己对应的是哪个template，
+//所以field和accessor都放在staticValues里，get/set时按名字查到这里再分派
+struct ObjectTemplateClass {
+    enum EntryKind {
+        kFunctionField,
+        kObjectField,
+        //ObjectTemplate::SetAccessor
+        kAccessor,
+        //Template::SetAccessorProperty
+        kAccessorProperty
+    };
     
-    //todo rhythm
-//    JSValue v = JS_MapGet(context->context_, value_, key->value_);
-//    if (JS_IsException(v)) {
-//        return MaybeLocal<Value>();
-//    }
-    Value *val = context->GetIsolate()->Alloc<Value>();
-//    val->value_ = v;
-    return MaybeLocal<Value>(Local<Value>(val));
+    struct Entry {
+        EntryKind kind_;
+        //intern表里的名字和对应的js字符串
+        JSStringRef name_;
+        JSValueRef name_value_;
+        //field的template，由ObjectTemplate::fields_持有
+        Data* template_;
+        ObjectTemplate::AccessorInfo accessor_;
+        Template::AccessorPropertyInfo property_;
+    };
+    
+    std::vector<Entry> entries_;
+    
+    //名字的utf16 hash -> entries_的下标，hash冲突时同一个key下有多个
+    std::unordered_multimap<uint64_t, size_t> index_;
+    
+    //实例的internal field数：自己和父类链上实例template里最大的
+    int internal_field_count_;
+    
+    //创建实例时要逐个设置field的template，父类在前，子类同名的field后设置覆盖父类的
+    std::vector<ObjectTemplate*> field_templates_;
+};
+
+static const size_t kTemplateEntryNotFound = static_cast<size_t>(-1);
+
+static V8_INLINE bool IsTemplateAccessor(ObjectTemplateClass::EntryKind kind) {
+    return kind >= ObjectTemplateClass::kAccessor;
 }
 
-MaybeLocal<Map> Map::Set(Local<Context> context,
-                         Local<Value> key,
-                         Local<Value> value) {
-    //todo rhythm
-//    JSValue m = JS_MapSet(context->context_, value_, key->value_, value->value_);
-//    if (JS_IsException(m)) {
-//        return MaybeLocal<Map>();
-//    }
-    Map *map = context->GetIsolate()->Alloc<Map>();
-//    map->value_ = m;
-    return MaybeLocal<Map>(Local<Map>(map));
+static size_t GetTemplateEntryCount(const ObjectTemplateClass* info) {
+    return info->entries_.size();
 }
 
-Local<Map> Map::New(Isolate* isolate) {
-    //todo rhythm
-    Map *map = isolate->Alloc<Map>();
-//    map->value_ = JS_NewMap(isolate->GetCurrentContext()->context_);
-    return Local<Map>(map);
+static size_t FindTemplateEntry(const ObjectTemplateClass* info, JSStringRef name) {
+    //jsc每次回调传进来的都是新建的JSStringRef，只能按内容查
+    auto range = info->index_.equal_range(HashScriptSource(JSStringGetCharactersPtr(name), JSStringGetLength(name)));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (V8_LIKELY(JSStringIsEqual(info->entries_[it->second].name_, name))) {
+            return it->second;
+        }
+    }
+    return kTemplateEntryNotFound;
 }
 
-static std::vector<uint8_t> dummybuffer;
+//native回调里ThrowException设置的异常，交给jsc抛出
+static V8_INLINE bool TakeThrownException(Isolate* isolate, JSValueRef* exception) {
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    if (V8_LIKELY(isolate->exception_ == undefined)) {
+        return false;
+    }
+    *exception = isolate->exception_;
+    isolate->exception_ = undefined;
+    return true;
+}
 
-Local<ArrayBuffer> ArrayBuffer::New(Isolate* isolate, size_t byte_length) {
-    //todo rhythm
-    ArrayBuffer *ab = isolate->Alloc<ArrayBuffer>();
-//    if (dummybuffer.size() < byte_length) dummybuffer.resize(byte_length, 0);
-//    ab->value_ = JS_NewArrayBufferCopy(isolate->current_context_->context_, dummybuffer.data(), byte_length);
-    return Local<ArrayBuffer>(ab);
+static JSValueRef NewTemplateFieldValue(Local<Context> context, ObjectTemplateClass::EntryKind kind, Data* tpl);
+
+//嵌套的ObjectTemplate和NewInstance一样创建，accessor来自class，field在创建时逐个设置
+static JSObjectRef NewTemplateObject(Local<Context> context, ObjectTemplate* tpl) {
+    return tpl->NewInstance_(*context, nullptr);
 }
 
-Local<ArrayBuffer> ArrayBuffer::New(Isolate* isolate, void* data, size_t byte_length,
-                                           ArrayBufferCreationMode mode) {
-    //todo rhythm
-    V8::Check(mode == ArrayBufferCreationMode::kExternalized, "only ArrayBufferCreationMode::kExternalized support!");
-    ArrayBuffer *ab = isolate->Alloc<ArrayBuffer>();
-//    ab->value_ = JS_NewArrayBuffer(isolate->current_context_->context_, (uint8_t*)data, byte_length, nullptr, nullptr, false);
-    return Local<ArrayBuffer>(ab);
+//accessor的get/set：回调直接从编译好的表项里取，global和实例共用
+static JSValueRef CallTemplateGetter(JSContextRef ctx, Isolate* isolate, const ObjectTemplateClass::Entry& entry,
+                                     JSObjectRef object, JSValueRef* exception) {
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    HandleScope handle_scope(isolate);
+    JSValueRef result = undefined;
+    if (entry.kind_ == ObjectTemplateClass::kAccessor) {
+        PropertyCallbackInfo<Value> callbackInfo;
+        callbackInfo.isolate_ = isolate;
+        callbackInfo.context_ = ctx;
+        callbackInfo.data_ = entry.accessor_.data_;
+        callbackInfo.value_ = undefined;
+        callbackInfo.this_ = object;
+        Name* key = reinterpret_cast<Name*>(const_cast<JSValueRef*>(&entry.name_value_));
+        entry.accessor_.getter_(Local<Name>(key), callbackInfo);
+        result = callbackInfo.value_;
+    } else if (!entry.property_.getter_.IsEmpty() && entry.property_.getter_->cfunction_data_.callback_) {
+        //getter是FunctionTemplate，不用创建函数对象，直接调它的callback
+        const FunctionTemplate::CFunctionData& cfunction_data = entry.property_.getter_->cfunction_data_;
+        FunctionCallbackInfo<Value> callbackInfo;
+        callbackInfo.isolate_ = isolate;
+        callbackInfo.argc_ = 0;
+        callbackInfo.argv_ = nullptr;
+        callbackInfo.context_ = ctx;
+        callbackInfo.this_ = object;
+        callbackInfo.data_ = cfunction_data.data_;
+        callbackInfo.value_ = undefined;
+        callbackInfo.isConstructCall = false;
+        cfunction_data.callback_(callbackInfo);
+        result = callbackInfo.value_;
+    }
+    if (TakeThrownException(isolate, exception)) {
+        return nullptr;
+    }
+    return result;
 }
 
-ArrayBuffer::Contents ArrayBuffer::GetContents() {
-    //todo rhythm
-    ArrayBuffer::Contents ret;
-//    ret.data_ = JS_GetArrayBuffer(Isolate::current_->current_context_->context_, &ret.byte_length_, value_);
-    return ret;
+static void CallTemplateSetter(JSContextRef ctx, Isolate* isolate, const ObjectTemplateClass::Entry& entry,
+                               JSObjectRef object, JSValueRef value, JSValueRef* exception) {
+    //没有setter的accessor是ReadOnly，不会走到这里
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    HandleScope handle_scope(isolate);
+    if (entry.kind_ == ObjectTemplateClass::kAccessor) {
+        PropertyCallbackInfo<void> callbackInfo;
+        callbackInfo.isolate_ = isolate;
+        callbackInfo.context_ = ctx;
+        callbackInfo.data_ = entry.accessor_.data_;
+        callbackInfo.value_ = undefined;
+        callbackInfo.this_ = object;
+        Name* key = reinterpret_cast<Name*>(const_cast<JSValueRef*>(&entry.name_value_));
+        Value* val = reinterpret_cast<Value*>(&value);
+        entry.accessor_.setter_(Local<Name>(key), Local<Value>(val), callbackInfo);
+    } else if (entry.property_.setter_->cfunction_data_.callback_) {
+        const FunctionTemplate::CFunctionData& cfunction_data = entry.property_.setter_->cfunction_data_;
+        FunctionCallbackInfo<Value> callbackInfo;
+        callbackInfo.isolate_ = isolate;
+        callbackInfo.argc_ = 1;
+        callbackInfo.argv_ = &value;
+        callbackInfo.context_ = ctx;
+        callbackInfo.this_ = object;
+        callbackInfo.data_ = cfunction_data.data_;
+        callbackInfo.value_ = undefined;
+        callbackInfo.isConstructCall = false;
+        cfunction_data.callback_(callbackInfo);
+    }
+    TakeThrownException(isolate, exception);
 }
 
-Local<ArrayBuffer> ArrayBufferView::Buffer() {
-    //todo rhythm
-    Isolate* isolate = Isolate::current_;
-    ArrayBuffer* ab = isolate->Alloc<ArrayBuffer>();
-//    ab->value_ = JS_GetArrayBufferView(isolate->current_context_->context_, value_);
-    return Local<ArrayBuffer>(ab);
+static JSPropertyAttributes GetTemplateEntryAttributes(const ObjectTemplateClass::Entry& entry) {
+    JSPropertyAttributes attributes = kJSPropertyAttributeNone;
+    if (!IsTemplateAccessor(entry.kind_)) {
+        return attributes;
+    }
+    bool has_setter;
+    PropertyAttribute attribute;
+    if (entry.kind_ == ObjectTemplateClass::kAccessor) {
+        has_setter = entry.accessor_.setter_ != nullptr;
+        attribute = entry.accessor_.attribute_;
+    } else {
+        has_setter = !entry.property_.setter_.IsEmpty();
+        attribute = entry.property_.attribute_;
+    }
+    if ((attribute & ReadOnly) || !has_setter) {
+        attributes |= kJSPropertyAttributeReadOnly;
+    }
+    if (attribute & DontEnum) {
+        attributes |= kJSPropertyAttributeDontEnum;
+    }
+    if (attribute & DontDelete) {
+        attributes |= kJSPropertyAttributeDontDelete;
+    }
+    return attributes;
+}
+
+static JSValueRef NewTemplateFieldValue(Local<Context> context, ObjectTemplateClass::EntryKind kind, Data* tpl) {
+    if (kind == ObjectTemplateClass::kObjectField) {
+        return NewTemplateObject(context, static_cast<ObjectTemplate*>(tpl));
+    }
+    Local<Function> func;
+    if (!static_cast<FunctionTemplate*>(tpl)->GetFunction(context).ToLocal(&func)) {
+        return nullptr;
+    }
+    return func->value_;
+}
+
+void Template::InitPropertys(Local<Context> context, JSValueRef obj) {
+    JSContextRef ctx = context->context_;
+    JSObjectRef object = const_cast<JSObjectRef>(obj);
+    for (size_t i = 0; i < fields_.size(); i++) {
+        Data* field = *fields_[i].second;
+        ObjectTemplateClass::EntryKind kind = dynamic_cast<FunctionTemplate*>(field)
+            ? ObjectTemplateClass::kFunctionField : ObjectTemplateClass::kObjectField;
+        JSValueRef value = NewTemplateFieldValue(context, kind, field);
+        if (value) {
+            JSObjectSetProperty(ctx, object, fields_[i].first, value, kJSPropertyAttributeNone, nullptr);
+        }
+    }
 }
+
+static JSValueRef GetGlobalTemplateProperty(JSContextRef ctx, JSObjectRef object, JSStringRef name, JSValueRef* exception) {
+    Context* context = static_cast<Context*>(JSObjectGetPrivate(object));
+    ObjectTemplateClass* info = context->global_template_->class_info_;
+    size_t index = FindTemplateEntry(info, name);
+    if (index == kTemplateEntryNotFound) {
+        return nullptr;
+    }
+    const ObjectTemplateClass::Entry& entry = info->entries_[index];
+    Isolate* isolate = context->isolate_;
     
-size_t ArrayBufferView::ByteOffset() {
-    //todo rhythm
-    size_t byte_offset;
-    size_t byte_length;
-    size_t bytes_per_element;
-//    JS_GetArrayBufferViewInfo(Isolate::current_->current_context_->context_, value_, &byte_offset, &byte_length, &bytes_per_element);
-    return byte_offset;
+    if (IsTemplateAccessor(entry.kind_)) {
+        return CallTemplateGetter(ctx, isolate, entry, object, exception);
+    }
+    
+    //global上的值从这里读，返回nullptr时jsc继续查global自己的属性(被删除之后)
+    uint8_t state = context->template_value_states_[index];
+    if (state == Context::kTemplateValueDeleted) {
+        return nullptr;
+    }
+    if (state == Context::kTemplateValueUnset) {
+        HandleScope handle_scope(isolate);
+        JSValueRef value = NewTemplateFieldValue(Local<Context>(context), entry.kind_, entry.template_);
+        if (value == nullptr) {
+            TakeThrownException(isolate, exception);
+            return nullptr;
+        }
+        JSValueProtect(ctx, value);
+        context->template_values_[index] = value;
+        context->template_value_states_[index] = Context::kTemplateValueSet;
+    }
+    return context->template_values_[index];
 }
+
+static bool SetGlobalTemplateProperty(JSContextRef ctx, JSObjectRef object, JSStringRef name, JSValueRef value, JSValueRef* exception) {
+    Context* context = static_cast<Context*>(JSObjectGetPrivate(object));
+    ObjectTemplateClass* info = context->global_template_->class_info_;
+    size_t index = FindTemplateEntry(info, name);
+    if (index == kTemplateEntryNotFound) {
+        return false;
+    }
+    const ObjectTemplateClass::Entry& entry = info->entries_[index];
+    Isolate* isolate = context->isolate_;
     
-size_t ArrayBufferView::ByteLength() {
-    //todo rhythm
-    size_t byte_offset;
-    size_t byte_length;
-    size_t bytes_per_element;
-//    JS_GetArrayBufferViewInfo(Isolate::current_->current_context_->context_, value_, &byte_offset, &byte_length, &bytes_per_element);
-    return byte_length;
+    if (IsTemplateAccessor(entry.kind_)) {
+        CallTemplateSetter(ctx, isolate, entry, object, value, exception);
+        return true;
+    }
+    
+    if (context->template_value_states_[index] == Context::kTemplateValueSet) {
+        JSValueUnprotect(ctx, context->template_values_[index]);
+    }
+    JSValueProtect(ctx, value);
+    context->template_values_[index] = value;
+    context->template_value_states_[index] = Context::kTemplateValueSet;
+    return true;
 }
 
-Local<Object> Context::Global() {
-    Isolate* isolate = Isolate::current_;
-    Object *object = isolate->Alloc<Object>();
-    object->value_ = global_;
-    return Local<Object>(object);
+static bool DeleteGlobalTemplateProperty(JSContextRef ctx, JSObjectRef object, JSStringRef name, JSValueRef* exception) {
+    //jsc删除静态属性时不会通知，这里先拦下来。不是template里的名字返回false，jsc按普通属性处理
+    Context* context = static_cast<Context*>(JSObjectGetPrivate(object));
+    ObjectTemplateClass* info = context->global_template_->class_info_;
+    size_t index = FindTemplateEntry(info, name);
+    if (index == kTemplateEntryNotFound || IsTemplateAccessor(info->entries_[index].kind_)) {
+        return false;
+    }
+    if (context->template_value_states_[index] == Context::kTemplateValueSet) {
+        JSValueUnprotect(ctx, context->template_values_[index]);
+    }
+    context->template_values_[index] = nullptr;
+    context->template_value_states_[index] = Context::kTemplateValueDeleted;
+    return true;
 }
 
-Context::Context(Isolate* isolate) : Context(isolate, nullptr) {
+//constructor_的父类链上最近的实例template，没有时返回nullptr
+static ObjectTemplate* ParentInstanceTemplate(ObjectTemplate* tpl) {
+    FunctionTemplate* parent = tpl->constructor_ ? *tpl->constructor_->parent_ : nullptr;
+    for (; parent; parent = *parent->parent_) {
+        if (!parent->instance_template_.IsEmpty()) {
+            return *parent->instance_template_;
+        }
+    }
+    return nullptr;
+}
+
+static ObjectTemplateClass* CompileObjectTemplate(Isolate* isolate, ObjectTemplate* tpl) {
+    ObjectTemplateClass* info = new ObjectTemplateClass();
+    info->internal_field_count_ = 0;
+    auto add_entry = [&](JSStringRef name, ObjectTemplateClass::Entry& entry) {
+        uint64_t hash = HashScriptSource(JSStringGetCharactersPtr(name), JSStringGetLength(name));
+        //同名时先注册的生效，hash相同但名字不同的照常加入
+        auto range = info->index_.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (JSStringIsEqual(info->entries_[it->second].name_, name)) {
+                return;
+            }
+        }
+        std::string utf8 = JSStringToUtf8(name);
+        entry.name_ = name;
+        entry.name_value_ = isolate->InternStringValue(utf8.data(), utf8.size());
+        info->index_.emplace(hash, info->entries_.size());
+        info->entries_.push_back(entry);
+    };
+    //子类在前，同名时子类的生效；父类的实例方法拿到子类实例时，父类的internal field和accessor也都在
+    for (ObjectTemplate* t = tpl; t; t = ParentInstanceTemplate(t)) {
+        for (size_t i = 0; i < t->accessor_infos_.size(); i++) {
+            ObjectTemplateClass::Entry entry = {};
+            entry.kind_ = ObjectTemplateClass::kAccessor;
+            entry.accessor_ = t->accessor_infos_[i].second;
+            add_entry(t->accessor_infos_[i].first, entry);
+        }
+        for (size_t i = 0; i < t->accessor_property_infos_.size(); i++) {
+            ObjectTemplateClass::Entry entry = {};
+            entry.kind_ = ObjectTemplateClass::kAccessorProperty;
+            entry.property_ = t->accessor_property_infos_[i].second;
+            add_entry(t->accessor_property_infos_[i].first, entry);
+        }
+        for (size_t i = 0; i < t->fields_.size(); i++) {
+            ObjectTemplateClass::Entry entry = {};
+            Data* field = *t->fields_[i].second;
+            entry.kind_ = dynamic_cast<FunctionTemplate*>(field)
+                ? ObjectTemplateClass::kFunctionField : ObjectTemplateClass::kObjectField;
+            entry.template_ = field;
+            add_entry(t->fields_[i].first, entry);
+        }
+        if (!t->fields_.empty()) {
+            info->field_templates_.insert(info->field_templates_.begin(), t);
+        }
+        info->internal_field_count_ = std::max(info->internal_field_count_, t->internal_field_count_);
+    }
+    return info;
 }
 
-Context::Context(Isolate* isolate, void* external_context) :isolate_(isolate) {
-    //todo rhythm
-    is_external_context_ = external_context != nullptr;
-    
-    
-    JSClassDefinition global = kJSClassDefinitionEmpty;
-    global.className = "JscEngine";
-    JSClassRef globalClass_ = JSClassCreate(&global);
+JSClassRef ObjectTemplate::GlobalClass_(Isolate* isolate) {
+    if (class_info_ == nullptr) {
+        isolate_ = isolate;
+        class_info_ = CompileObjectTemplate(isolate, this);
+    }
+    //每次Context::New都会走到这里，命中时不再逐个属性生成静态表
+    JSClassRef cached = isolate->FindTemplateClass_(class_info_);
+    if (V8_LIKELY(cached != nullptr)) {
+        return cached;
+    }
+    std::vector<std::string> names(class_info_->entries_.size());
+    std::vector<JSStaticValue> static_values;
+    static_values.reserve(class_info_->entries_.size() + 1);
+    for (size_t i = 0; i < class_info_->entries_.size(); i++) {
+        const ObjectTemplateClass::Entry& entry = class_info_->entries_[i];
+        names[i] = JSStringToUtf8(entry.name_);
+        static_values.push_back({names[i].c_str(), GetGlobalTemplateProperty, SetGlobalTemplateProperty,
+            GetTemplateEntryAttributes(entry)});
+    }
+    static_values.push_back({nullptr, nullptr, nullptr, 0});
     
-    context_ = JSGlobalContextCreateInGroup(isolate->virtualMachine_, globalClass_);
-    JSObjectSetPrivate(JSContextGetGlobalObject(context_), this);
-    global_ = JSContextGetGlobalObject(context_);
+    JSClassDefinition definition = kJSClassDefinitionEmpty;
+    definition.className = "JscEngine";
+    definition.parentClass = isolate->global_class_;
+    definition.staticValues = static_values.data();
+    definition.deleteProperty = DeleteGlobalTemplateProperty;
+    //jsc创建class时会复制静态表，names和static_values用完即可释放
+    return isolate->GetTemplateClass_(class_info_, definition);
 }
 
-Context::~Context() {
-    //todo rhythm
-//    JS_FreeValue(context_, global_);
-//    if (!is_external_context_) {
-//        JS_FreeContext(context_);
-//    }
+//实例上的accessor：object的private data一定是ObjectUserData，从里面记录的template找到表项
+static JSValueRef GetTemplateInstanceProperty(JSContextRef ctx, JSObjectRef object, JSStringRef name, JSValueRef* exception) {
+    ObjectUserData* object_udata = static_cast<ObjectUserData*>(JSObjectGetPrivate(object));
+    if (V8_UNLIKELY(object_udata == nullptr || object_udata->template_ == nullptr)) {
+        return nullptr;
+    }
+    ObjectTemplateClass* info = object_udata->template_->class_info_;
+    size_t index = FindTemplateEntry(info, name);
+    if (index == kTemplateEntryNotFound) {
+        return nullptr;
+    }
+    return CallTemplateGetter(ctx, object_udata->isolate_, info->entries_[index], object, exception);
 }
 
-MaybeLocal<Value> Function::Call(Local<Context> context,
-                             Local<Value> recv, int argc,
-                             Local<Value> argv[]) {
-    //rhythm todo
-//    Isolate *isolate = context->GetIsolate();
-//    JSValueRef js_this = recv.IsEmpty() ? isolate->Undefined() : (*recv);
-//    JSValueRef js_argv = (JSValueRef)alloca(argc * sizeof(JSValueRef));
-//    for(int i = 0 ; i < argc; i++) {
-//        //isolate->Escape(*argv[i]);
-//        js_argv[i] = argv[i]->value_;
-//    }
-//    JSValue ret = JS_Call(context->context_, value_, *js_this, argc, js_argv);
-//
-//    return ProcessResult(isolate, ret);
-//}
-//
-//MaybeLocal<Object> Function::NewInstance(Local<Context> context, int argc, Local<Value> argv[]) const {
-//    Isolate *isolate = context->GetIsolate();
-//    JSValue *js_argv = (JSValue*)alloca(argc * sizeof(JSValue));
-//    for(int i = 0 ; i < argc; i++) {
-//        //isolate->Escape(*argv[i]);
-//        js_argv[i] = argv[i]->value_;
-//    }
-//
-//    JSValue ret = JS_CallConstructor(context->context_, value_, argc, js_argv);
-//
-//    auto maybe_value = ProcessResult(isolate, ret);
-//    if (maybe_value.IsEmpty()) {
-//        return MaybeLocal<Object>();
-//    } else {
-//        return MaybeLocal<Object>(maybe_value.ToLocalChecked().As<Object>());
-//    }
+static bool SetTemplateInstanceProperty(JSContextRef ctx, JSObjectRef object, JSStringRef name, JSValueRef value, JSValueRef* exception) {
+    ObjectUserData* object_udata = static_cast<ObjectUserData*>(JSObjectGetPrivate(object));
+    if (V8_UNLIKELY(object_udata == nullptr || object_udata->template_ == nullptr)) {
+        return false;
+    }
+    ObjectTemplateClass* info = object_udata->template_->class_info_;
+    size_t index = FindTemplateEntry(info, name);
+    if (index == kTemplateEntryNotFound) {
+        return false;
+    }
+    CallTemplateSetter(ctx, object_udata->isolate_, info->entries_[index], object, value, exception);
+    return true;
 }
 
-void Template::Set(Isolate* isolate, const char* name, Local<Data> value) {
-    fields_[name] = value;
+JSClassRef ObjectTemplate::InstanceClass_(Isolate* isolate) {
+    if (V8_LIKELY(instance_class_ != nullptr)) {
+        return instance_class_;
+    }
+    isolate_ = isolate;
+    if (class_info_ == nullptr) {
+        class_info_ = CompileObjectTemplate(isolate, this);
+    }
+    //field是每个实例自己的属性，静态表里只放accessor
+    std::vector<std::string> names;
+    std::vector<JSStaticValue> static_values;
+    names.reserve(class_info_->entries_.size());
+    for (size_t i = 0; i < class_info_->entries_.size(); i++) {
+        const ObjectTemplateClass::Entry& entry = class_info_->entries_[i];
+        if (!IsTemplateAccessor(entry.kind_)) {
+            continue;
+        }
+        names.push_back(JSStringToUtf8(entry.name_));
+        static_values.push_back({names.back().c_str(), GetTemplateInstanceProperty, SetTemplateInstanceProperty,
+            GetTemplateEntryAttributes(entry)});
+    }
+    
+    JSClassDefinition definition = kJSClassDefinitionEmpty;
+    definition.className = "NativeObject";
+    //GetObjectUserData按object_class_判断，finalize也沿父class调用
+    definition.parentClass = isolate->object_class_;
+    if (!static_values.empty()) {
+        static_values.push_back({nullptr, nullptr, nullptr, 0});
+        definition.staticValues = static_values.data();
+        //实例的ObjectUserData只记裸指针，template要活得比实例久
+        AddRef_();
+        isolate->accessor_templates_.push_back(this);
+    }
+    instance_class_ = isolate->GetTemplateClass_(this, definition);
+    return instance_class_;
 }
 
-void Template::Set(Local<Name> name, Local<Data> value,
-                   PropertyAttribute attributes) {
-    Isolate* isolate = Isolate::current_;
-    Set(isolate, *String::Utf8Value(Isolate::current_, name), value);
-}
-    
-void Template::SetAccessorProperty(Local<Name> name,
-                                         Local<FunctionTemplate> getter,
-                                         Local<FunctionTemplate> setter,
-                                         PropertyAttribute attribute) {
-    
-    accessor_property_infos_[*String::Utf8Value(Isolate::current_, name)] = {getter, setter, attribute};
+JSObjectRef ObjectTemplate::NewInstance_(Context* context, JSObjectRef proto) {
+    Isolate* isolate = context->isolate_;
+    JSContextRef ctx = context->context_;
+    JSClassRef instance_class = InstanceClass_(isolate);
+    ObjectUserData* object_udata = isolate->NewObjectUserData(class_info_->internal_field_count_);
+    object_udata->template_ = this;
+    JSObjectRef obj = JSObjectMake(ctx, instance_class, object_udata);
+    if (proto == nullptr && constructor_) {
+        proto = constructor_->PrototypeObject_(context);
+    }
+    if (proto) {
+        JSObjectSetPrototype(ctx, obj, proto);
+    }
+    //field是每个实例自己的属性，只有自己或父类带field时才需要逐个设置
+    for (size_t i = 0; i < class_info_->field_templates_.size(); i++) {
+        class_info_->field_templates_[i]->InitPropertys(Local<Context>(context), obj);
+    }
+    return obj;
 }
 
-void Template::InitPropertys(Local<Context> context, JSValueRef obj) {
-    //rhythm todo
-//    for(auto it : fields_) {
-//        JSAtom atom = JS_NewAtom(context->context_, it.first.data());
-//        Local<FunctionTemplate> funcTpl = Local<FunctionTemplate>::Cast(it.second);
-//        Local<Function> lfunc = funcTpl->GetFunction(context).ToLocalChecked();
-//        context->GetIsolate()->Escape(*lfunc);
-//        JS_DefinePropertyValue(context->context_, obj, atom, lfunc->value_, JS_PROP_CONFIGURABLE | JS_PROP_ENUMERABLE | JS_PROP_WRITABLE);
-//        JS_FreeAtom(context->context_, atom);
-//    }
-//
-//    for (auto it : accessor_property_infos_) {
-//        JSValue getter = JS_Undefined();
-//        JSValue setter = JS_Undefined();
-//        int flag = 0;
-//        if (!(it.second.attribute_ & DontDelete)) {
-//            flag |= JS_PROP_CONFIGURABLE;
-//        }
-//        if (!(it.second.attribute_ & DontEnum)) {
-//            flag |= JS_PROP_ENUMERABLE;
-//        }
-//
-//        std::string name = it.first;
-//        if (!it.second.getter_.IsEmpty()) {
-//            flag |= JS_PROP_HAS_GET;
-//            Local<Function> gfunc = it.second.getter_->GetFunction(context).ToLocalChecked();
-//            context->GetIsolate()->Escape(*gfunc);
-//            getter = gfunc->value_;
-//        }
-//
-//        if (!(it.second.attribute_ & ReadOnly) && !it.second.setter_.IsEmpty()) {
-//            flag |= JS_PROP_HAS_SET;
-//            flag |= JS_PROP_WRITABLE;
-//            Local<Function> sfunc = it.second.setter_->GetFunction(context).ToLocalChecked();
-//            context->GetIsolate()->Escape(*sfunc);
-//            setter = sfunc->value_;
-//        }
-//        JSAtom atom = JS_NewAtom(context->context_, name.c_str());
-//        JS_DefineProperty(context->context_, obj, atom, JS_Undefined(), getter, setter, flag);
-//        JS_FreeAtom(context->context_, atom);
-//        JS_FreeValue(context->context_, getter);
-//        JS_FreeValue(context->context_, setter);
-//    }
+MaybeLocal<Object> ObjectTemplate::NewInstance(Local<Context> context) {
+    Isolate* isolate = context->GetIsolate();
+    JSObjectRef obj = NewInstance_(*context, nullptr);
+    return MaybeLocal<Object>(Local<Object>(isolate->Alloc<Object>(obj)));
 }
 
-void ObjectTemplate::SetAccessor(Local<Name> name, AccessorNameGetterCallback getter,
-                                 AccessorNameSetterCallback setter,
-                                 Local<Value> data, AccessControl settings,
-                                 PropertyAttribute attribute) {
-    //rhythm todo
-//    JSValue js_data = data.IsEmpty() ? JS_Undefined() : data->value_;
-//    accessor_infos_[*String::Utf8Value(Isolate::current_, name)] = {getter, setter, js_data, settings, attribute};
+ObjectTemplate::~ObjectTemplate() {
+    if (isolate_) {
+        isolate_->ReleaseTemplateClass_(this);
+        isolate_->ReleaseTemplateClass_(class_info_);
+        for (size_t i = 0; i < accessor_infos_.size(); i++) {
+            JSValueUnprotect(isolate_->isolate_context_, accessor_infos_[i].second.data_);
+        }
+    }
+    delete class_info_;
 }
 
-void ObjectTemplate::InitAccessors(Local<Context> context, JSValueRef obj) {
-    //rhythm todo
-//    for (auto it : accessor_infos_) {
-//        JSValue getter = JS_Undefined();
-//        JSValue setter = JS_Undefined();
-//        int flag = 0;
-//        if (!(it.second.attribute_ & DontDelete)) {
-//            flag |= JS_PROP_CONFIGURABLE;
-//        }
-//        if (!(it.second.attribute_ & DontEnum)) {
-//            flag |= JS_PROP_ENUMERABLE;
-//        }
-//
-//        std::string name = it.first;
-//
-//        auto name_val = String::NewFromUtf8(context->GetIsolate(), name.c_str()).ToLocalChecked();
-//
-//        JSValue func_data[] = {JS_Undefined(), name_val->value_, it.second.data_};
-//
-//        if (it.second.getter_) {
-//            flag |= JS_PROP_HAS_GET;
-//            JS_INITPTR(func_data[0], JS_TAG_EXTERNAL, (void*)it.second.getter_);
-//            getter = JS_NewCFunctionData(context->context_, [](JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *func_data) {
-//                Isolate* isolate = reinterpret_cast<Context*>(JS_GetContextOpaque(ctx))->GetIsolate();
-//
-//                PropertyCallbackInfo<Value> callbackInfo;
-//                callbackInfo.isolate_ = isolate;
-//                callbackInfo.context_ = ctx;
-//                callbackInfo.this_ = this_val;
-//                callbackInfo.data_ = func_data[2];
-//                callbackInfo.value_ = JS_Undefined();
-//
-//                String *key = reinterpret_cast<String*>(&func_data[1]);
-//                AccessorNameGetterCallback callback = (AccessorNameGetterCallback)(JS_VALUE_GET_PTR(func_data[0]));
-//                callback(Local<String>(key), callbackInfo);
-//
-//                if (!JS_IsUndefined(isolate->exception_)) {
-//                    JSValue ex = isolate->exception_;
-//                    isolate->exception_ = JS_Undefined();
-//                    return JS_Throw(ctx, ex);
-//                }
-//
-//                return callbackInfo.value_;
-//            }, 0, 0, 3, &func_data[0]);
-//        }
-//
-//        if (!(it.second.attribute_ & ReadOnly) && it.second.setter_) {
-//            flag |= JS_PROP_HAS_SET;
-//            flag |= JS_PROP_WRITABLE;
-//            JS_INITPTR(func_data[0], JS_TAG_EXTERNAL, (void*)it.second.setter_);
-//            setter = JS_NewCFunctionData(context->context_, [](JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *func_data) {
-//                Isolate* isolate = reinterpret_cast<Context*>(JS_GetContextOpaque(ctx))->GetIsolate();
-//
-//                PropertyCallbackInfo<void> callbackInfo;
-//                callbackInfo.isolate_ = isolate;
-//                callbackInfo.context_ = ctx;
-//                callbackInfo.this_ = this_val;
-//                callbackInfo.data_ = func_data[2];
-//                callbackInfo.value_ = JS_Undefined();
-//
-//                String *key = reinterpret_cast<String*>(&func_data[1]);
-//                Value *val = reinterpret_cast<Value*>(argv);
-//                AccessorNameSetterCallback callback = (AccessorNameSetterCallback)(JS_VALUE_GET_PTR(func_data[0]));
-//                callback(Local<String>(key), Local<Value>(val), callbackInfo);
-//
-//                if (!JS_IsUndefined(isolate->exception_)) {
-//                    JSValue ex = isolate->exception_;
-//                    isolate->exception_ = JS_Undefined();
-//                    return JS_Throw(ctx, ex);
-//                }
-//
-//                return callbackInfo.value_;
-//            }, 0, 0, 3, &func_data[0]);
-//        }
-//        JSAtom atom = JS_NewAtom(context->context_, name.c_str());
-//        JS_DefineProperty(context->context_, obj, atom, JS_Undefined(), getter, setter, flag);
-//        JS_FreeAtom(context->context_, atom);
-//        JS_FreeValue(context->context_, getter);
-//        JS_FreeValue(context->context_, setter);
-//    }
+Local<ObjectTemplate> ObjectTemplate::New(Isolate* isolate, Local<FunctionTemplate> constructor) {
+    Local<ObjectTemplate> ret(new ObjectTemplate());
+    ret->isolate_ = isolate;
+    if (!constructor.IsEmpty()) {
+        ret->constructor_template_ = constructor;
+        ret->constructor_ = *constructor;
+    }
+    return ret;
 }
 
 void ObjectTemplate::SetInternalFieldCount(int value) {
@@ -887,28 +5380,94 @@ void ObjectTemplate::SetInternalFieldCount(int value) {
 
 Local<FunctionTemplate> FunctionTemplate::New(Isolate* isolate, FunctionCallback callback,
                                               Local<Value> data) {
-    //rhythm todo
-//    Local<FunctionTemplate> functionTemplate(new FunctionTemplate());
-//    if (data.IsEmpty()) {
-//        functionTemplate->cfunction_data_.data_ = JS_Undefined();
-//    } else {
-//        functionTemplate->cfunction_data_.data_ = data->value_;
-//    }
-//    functionTemplate->cfunction_data_.callback_ = callback;
-//
-//    //isolate->RegFunctionTemplate(functionTemplate);
-//    functionTemplate->isolate_ = isolate;
-//    return functionTemplate;
+    Local<FunctionTemplate> functionTemplate(new FunctionTemplate());
+    functionTemplate->isolate_ = isolate;
+    //data在template析构时unprotect
+    functionTemplate->cfunction_data_.data_ = data.IsEmpty() ? isolate->literal_values_[kUndefinedValueIndex] : data->value_;
+    JSValueProtect(isolate->isolate_context_, functionTemplate->cfunction_data_.data_);
+    functionTemplate->cfunction_data_.callback_ = callback;
+    functionTemplate->cfunction_data_.internal_field_count_ = 0;
+    functionTemplate->cfunction_data_.is_construtor_ = false;
+    return functionTemplate;
+}
+
+//所有Context的global的private data都是Context*
+static V8_INLINE Context* GetContext(JSContextRef ctx) {
+    return static_cast<Context*>(JSObjectGetPrivate(JSContextGetGlobalObject(ctx)));
+}
+
+//js调用FunctionTemplate生成的函数：callback和data都从函数对象的private data里一次取到，参数直接指向jsc的arguments数组
+static JSValueRef CallFunctionTemplate(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                       size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception) {
+    FunctionTemplate* tpl = static_cast<FunctionTemplate*>(JSObjectGetPrivate(function));
+    Isolate* isolate = tpl->isolate_;
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    if (V8_UNLIKELY(tpl->cfunction_data_.callback_ == nullptr)) {
+        return undefined;
+    }
+    
+    HandleScope handle_scope(isolate);
+    FunctionCallbackInfo<Value> callbackInfo;
+    callbackInfo.isolate_ = isolate;
+    callbackInfo.argc_ = static_cast<int>(argumentCount);
+    callbackInfo.argv_ = const_cast<JSValueRef*>(arguments);
+    callbackInfo.context_ = ctx;
+    callbackInfo.this_ = thisObject ? thisObject : undefined;
+    callbackInfo.data_ = tpl->cfunction_data_.data_;
+    callbackInfo.value_ = undefined;
+    callbackInfo.isConstructCall = false;
+    
+    tpl->cfunction_data_.callback_(callbackInfo);
+    
+    if (TakeThrownException(isolate, exception)) {
+        return nullptr;
+    }
+    return callbackInfo.value_;
+}
+
+static JSObjectRef ConstructFunctionTemplate(JSContextRef ctx, JSObjectRef constructor,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception) {
+    FunctionTemplate* tpl = static_cast<FunctionTemplate*>(JSObjectGetPrivate(constructor));
+    Isolate* isolate = tpl->isolate_;
+    
+    //prototype可能被脚本改写，按ES的语义从constructor上取
+    JSValueRef proto = JSObjectGetProperty(ctx, constructor, isolate->prototype_string_, nullptr);
+    JSObjectRef self = tpl->InstanceTemplate()->NewInstance_(GetContext(ctx),
+        (proto && JSValueIsObject(ctx, proto)) ? JSValueToObject(ctx, proto, nullptr) : nullptr);
+    if (tpl->cfunction_data_.callback_ == nullptr) {
+        return self;
+    }
+    
+    HandleScope handle_scope(isolate);
+    FunctionCallbackInfo<Value> callbackInfo;
+    callbackInfo.isolate_ = isolate;
+    callbackInfo.argc_ = static_cast<int>(argumentCount);
+    callbackInfo.argv_ = const_cast<JSValueRef*>(arguments);
+    callbackInfo.context_ = ctx;
+    callbackInfo.this_ = self;
+    callbackInfo.data_ = tpl->cfunction_data_.data_;
+    callbackInfo.value_ = isolate->literal_values_[kUndefinedValueIndex];
+    callbackInfo.isConstructCall = true;
+    
+    tpl->cfunction_data_.callback_(callbackInfo);
+    
+    if (TakeThrownException(isolate, exception)) {
+        return nullptr;
+    }
+    return self;
 }
 
 Local<ObjectTemplate> FunctionTemplate::InstanceTemplate() {
     if (instance_template_.IsEmpty()) {
         instance_template_ = Local<ObjectTemplate>(new ObjectTemplate());
+        instance_template_->isolate_ = isolate_;
+        instance_template_->constructor_ = this;
     }
     return instance_template_;
 }
     
 void FunctionTemplate::Inherit(Local<FunctionTemplate> parent) {
+    //在第一次GetFunction时生效，之后再调用不会改变已经创建的prototype
     parent_ = parent;
 }
     
@@ -919,92 +5478,189 @@ Local<ObjectTemplate> FunctionTemplate::PrototypeTemplate() {
     return prototype_template_;
 }
 
+//prototype上的accessor：函数的private data是编译好的表项，this是实际访问的对象(实例)
+static JSValueRef CallTemplateAccessorGetter(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception) {
+    const ObjectTemplateClass::Entry* entry = static_cast<const ObjectTemplateClass::Entry*>(JSObjectGetPrivate(function));
+    return CallTemplateGetter(ctx, GetContext(ctx)->isolate_, *entry, thisObject, exception);
+}
+
+static JSValueRef CallTemplateAccessorSetter(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                             size_t argumentCount, const JSValueRef arguments[], JSValueRef* exception) {
+    const ObjectTemplateClass::Entry* entry = static_cast<const ObjectTemplateClass::Entry*>(JSObjectGetPrivate(function));
+    Isolate* isolate = GetContext(ctx)->isolate_;
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    CallTemplateSetter(ctx, isolate, *entry, thisObject, argumentCount > 0 ? arguments[0] : undefined, exception);
+    return undefined;
+}
+
+//Object.defineProperty在context创建后第一次用到时取好，之后脚本改写了也不影响
+static const char kDefineAccessorSource[] =
+    "(function (define) {\n"
+    "    return function (o, k, get, set, enumerable, configurable) {\n"
+    "        define(o, k, {get: get, set: set, enumerable: enumerable, configurable: configurable});\n"
+    "    };\n"
+    "})(Object.defineProperty)";
+
+static void DefineTemplateAccessor(Context* context, JSObjectRef object, const ObjectTemplateClass::Entry& entry) {
+    Isolate* isolate = context->isolate_;
+    JSContextRef ctx = context->context_;
+    if (V8_UNLIKELY(context->define_accessor_ == nullptr)) {
+        JSStringRef source = JSStringCreateWithUTF8CString(kDefineAccessorSource);
+        JSValueRef define = JSEvaluateScript(ctx, source, nullptr, nullptr, 1, nullptr);
+        JSStringRelease(source);
+        V8::Check(define && JSValueIsObject(ctx, define), "PrototypeTemplate, can not define accessor");
+        context->define_accessor_ = JSValueToObject(ctx, define, nullptr);
+        JSValueProtect(ctx, context->define_accessor_);
+    }
+    JSValueRef undefined = isolate->literal_values_[kUndefinedValueIndex];
+    void* data = const_cast<ObjectTemplateClass::Entry*>(&entry);
+    JSPropertyAttributes attributes = GetTemplateEntryAttributes(entry);
+    JSValueRef getter = undefined;
+    if (entry.kind_ == ObjectTemplateClass::kAccessor || !entry.property_.getter_.IsEmpty()) {
+        getter = JSObjectMake(ctx, isolate->accessor_getter_class_, data);
+        JSObjectSetPrototype(ctx, const_cast<JSObjectRef>(getter), context->FunctionPrototype_());
+    }
+    JSValueRef setter = undefined;
+    if (!(attributes & kJSPropertyAttributeReadOnly)) {
+        setter = JSObjectMake(ctx, isolate->accessor_setter_class_, data);
+        JSObjectSetPrototype(ctx, const_cast<JSObjectRef>(setter), context->FunctionPrototype_());
+    }
+    JSValueRef args[] = {
+        object,
+        entry.name_value_,
+        getter,
+        setter,
+        JSValueMakeBoolean(ctx, !(attributes & kJSPropertyAttributeDontEnum)),
+        JSValueMakeBoolean(ctx, !(attributes & kJSPropertyAttributeDontDelete)),
+    };
+    JSObjectCallAsFunction(ctx, context->define_accessor_, nullptr, sizeof(args) / sizeof(args[0]), args, nullptr);
+}
+
+JSObjectRef ObjectTemplate::NewPrototype_(Context* context, JSObjectRef parent) {
+    Isolate* isolate = context->isolate_;
+    JSContextRef ctx = context->context_;
+    if (class_info_ == nullptr) {
+        isolate_ = isolate;
+        class_info_ = CompileObjectTemplate(isolate, this);
+    }
+    //不用InstanceClass_：class上的静态accessor拿到的this是prototype自己，从实例上赋值也不会调setter
+    ObjectUserData* object_udata = isolate->NewObjectUserData(internal_field_count_);
+    JSObjectRef proto = JSObjectMake(ctx, isolate->object_class_, object_udata);
+    if (parent) {
+        JSObjectSetPrototype(ctx, proto, parent);
+    }
+    if (!fields_.empty()) {
+        InitPropertys(Local<Context>(context), proto);
+    }
+    //accessor在field之后定义，同名时accessor生效，和实例一致
+    for (size_t i = 0; i < class_info_->entries_.size(); i++) {
+        if (IsTemplateAccessor(class_info_->entries_[i].kind_)) {
+            DefineTemplateAccessor(context, proto, class_info_->entries_[i]);
+        }
+    }
+    return proto;
+}
+
 MaybeLocal<Function> FunctionTemplate::GetFunction(Local<Context> context) {
-    //rhythm todo
-//    auto iter = context_to_funtion_.find(context);
-//    if (iter != context_to_funtion_.end()) {
-//        Function* ret = isolate_->Alloc<Function>();
-//        ret->value_ = iter->second;
-//        JS_DupValueRT(isolate_->runtime_, ret->value_);
-//        return MaybeLocal<Function>(Local<Function>(ret));
-//    }
-//    cfunction_data_.is_construtor_ = !prototype_template_.IsEmpty() || !instance_template_.IsEmpty() || fields_.size() > 0 || accessor_property_infos_.size() > 0 || !parent_.IsEmpty();
-//    cfunction_data_.internal_field_count_ = instance_template_.IsEmpty() ? 0 : instance_template_->internal_field_count_;
-//
-//    JSValue func_data[4];
-//    JS_INITPTR(func_data[0], JS_TAG_EXTERNAL, (void*)cfunction_data_.callback_);
-//    func_data[1] = JS_NewInt32_(context->context_, cfunction_data_.internal_field_count_);
-//    func_data[2] = cfunction_data_.data_;
-//    func_data[3] = cfunction_data_.is_construtor_ ? JS_True() : JS_False();
-//
-//    JSValue func = JS_NewCFunctionData(context->context_, [](JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv, int magic, JSValue *func_data) {
-//        Isolate* isolate = reinterpret_cast<Context*>(JS_GetContextOpaque(ctx))->GetIsolate();
-//        FunctionCallback callback = (FunctionCallback)(JS_VALUE_GET_PTR(func_data[0]));
-//        int32_t internal_field_count;
-//        JS_ToInt32(ctx, &internal_field_count, func_data[1]);
-//        FunctionCallbackInfo<Value> callbackInfo;
-//        callbackInfo.isolate_ = isolate;
-//        callbackInfo.argc_ = argc;
-//        callbackInfo.argv_ = argv;
-//        callbackInfo.context_ = ctx;
-//        callbackInfo.this_ = this_val;
-//        callbackInfo.data_ = func_data[2];
-//        callbackInfo.value_ = JS_Undefined();
-//        //JS_IsConstructor(ctx, this_val)，静态方法的话，用JS_IsConstructor会返回true，其父节点对象是构造函数，这个就是构造函数？
-//        callbackInfo.isConstructCall = JS_ToBool(ctx, func_data[3]);
-//
-//        if (callbackInfo.isConstructCall && internal_field_count > 0) {
-//            JSValue proto = JS_GetProperty(ctx, this_val, JS_ATOM_prototype);
-//            callbackInfo.this_ = JS_NewObjectProtoClass(ctx, proto, isolate->class_id_);
-//            JS_FreeValue(ctx, proto);
-//            size_t size = sizeof(ObjectUserData) + sizeof(void*) * (internal_field_count - 1);
-//            ObjectUserData* object_udata = (ObjectUserData*)js_malloc(ctx, size);
-//            memset(object_udata, 0, size);
-//            object_udata->len_ = internal_field_count;
-//            JS_SetOpaque(callbackInfo.this_, object_udata);
-//        }
-//
-//        callback(callbackInfo);
-//
-//        if (!JS_IsUndefined(isolate->exception_)) {
-//            JSValue ex = isolate->exception_;
-//            isolate->exception_ = JS_Undefined();
-//            return JS_Throw(ctx, ex);
-//        }
-//
-//        return callbackInfo.isConstructCall ? callbackInfo.this_ : callbackInfo.value_;
-//    }, 0, 0, 4, &func_data[0]);
-//
-//    if (cfunction_data_.is_construtor_) {
-//        JS_SetConstructorBit(context->context_, func, 1);
-//        JSValue proto = JS_NewObject(context->context_);
-//        if (!prototype_template_.IsEmpty()) {
-//            prototype_template_->InitPropertys(context, proto);
-//            prototype_template_->InitAccessors(context, proto);
-//        }
-//        InitPropertys(context, func);
-//        JS_SetConstructor(context->context_, func, proto);
-//        JS_FreeValue(context->context_, proto);
-//
-//        if (!parent_.IsEmpty()) {
-//            Local<Function> parent_func = parent_->GetFunction(context).ToLocalChecked();
-//            JSValue parent_proto = JS_GetProperty(context->context_, parent_func->value_, JS_ATOM_prototype);
-//            JS_SetPrototype(context->context_, proto, parent_proto);
-//            JS_FreeValue(context->context_, parent_proto);
-//        }
-//    }
-//
-//    Function* function = context->GetIsolate()->Alloc<Function>();
-//    function->value_ = func;
-//
-//    Local<Function> ret(function);
-//
-//    context_to_funtion_[context] = func;
-//    JS_DupValueRT(isolate_->runtime_, func);
+    Isolate* isolate = context->GetIsolate();
+    JSContextRef ctx = context->context_;
+    if (!retained_by_isolate_) {
+        retained_by_isolate_ = true;
+        AddRef_();
+        function_index_ = isolate->function_templates_.size();
+        isolate->function_templates_.push_back(this);
+    }
+    
+    std::vector<JSValueRef>& cache = context->function_cache_;
+    if (V8_LIKELY(function_index_ < cache.size() && cache[function_index_] != nullptr)) {
+        return MaybeLocal<Function>(Local<Function>(isolate->Alloc<Function>(cache[function_index_])));
+    }
+    
+    JSObjectRef func = JSObjectMake(ctx, isolate->function_class_, this);
+    JSObjectSetPrototype(ctx, func, context->FunctionPrototype_());
+    //先放进缓存，field里引用回自己的template时拿到的是同一个函数
+    //只扩到自己的下标，context里没用过的template不占位置
+    if (cache.size() <= function_index_) {
+        cache.resize(function_index_ + 1, nullptr);
+    }
+    JSValueProtect(ctx, func);
+    cache[function_index_] = func;
+    
+    //prototype每个context只创建一次：方法定义在上面，实例通过原型链共用
+    JSObjectRef parent_proto = parent_.IsEmpty() ? nullptr : parent_->PrototypeObject_(*context);
+    JSObjectRef proto;
+    if (!prototype_template_.IsEmpty()) {
+        proto = prototype_template_->NewPrototype_(*context, parent_proto);
+    } else {
+        proto = JSObjectMake(ctx, nullptr, nullptr);
+        if (parent_proto) {
+            JSObjectSetPrototype(ctx, proto, parent_proto);
+        }
+    }
+    JSObjectSetProperty(ctx, func, isolate->prototype_string_, proto,
+                        kJSPropertyAttributeDontEnum | kJSPropertyAttributeDontDelete, nullptr);
+    JSObjectSetProperty(ctx, proto, isolate->constructor_string_, func, kJSPropertyAttributeDontEnum, nullptr);
+    std::vector<JSValueRef>& proto_cache = context->prototype_cache_;
+    if (proto_cache.size() <= function_index_) {
+        proto_cache.resize(function_index_ + 1, nullptr);
+    }
+    //func.prototype可以被脚本改写，这里单独持有
+    JSValueProtect(ctx, proto);
+    proto_cache[function_index_] = proto;
+    InitPropertys(context, func);
     
-    Function* function = context->GetIsolate()->Alloc<Function>();
-    Local<Function> ret(function);
-    return MaybeLocal<Function>(ret);
+    Function* function = isolate->Alloc<Function>(func);
+    return MaybeLocal<Function>(Local<Function>(function));
+}
+
+JSObjectRef FunctionTemplate::PrototypeObject_(Context* context) {
+    if (!retained_by_isolate_ || function_index_ >= context->prototype_cache_.size()
+        || context->prototype_cache_[function_index_] == nullptr) {
+        HandleScope handle_scope(context->isolate_);
+        if (GetFunction(Local<Context>(context)).IsEmpty()) {
+            return nullptr;
+        }
+    }
+    //GetFunction的递归调用里prototype可能还没创建好
+    if (function_index_ >= context->prototype_cache_.size()) {
+        return nullptr;
+    }
+    return const_cast<JSObjectRef>(context->prototype_cache_[function_index_]);
+}
+
+//jsc堆上对象的大小拿不到，按固定值估算
+static const size_t kEstimatedObjectBytes = 64;
+static const size_t kEstimatedPropertyBytes = 16;
+
+void Context::GetPrototypeStatistics(PrototypeStatistics* stats) {
+    *stats = PrototypeStatistics();
+    for (size_t i = 0; i < prototype_cache_.size(); i++) {
+        if (prototype_cache_[i] == nullptr) {
+            continue;
+        }
+        stats->prototypes_++;
+        //constructor
+        stats->properties_++;
+        stats->estimated_memory_bytes_ += kEstimatedObjectBytes + kEstimatedPropertyBytes;
+        ObjectTemplate* tpl = *isolate_->function_templates_[i]->prototype_template_;
+        if (tpl == nullptr) {
+            continue;
+        }
+        for (size_t j = 0; j < tpl->fields_.size(); j++) {
+            if (dynamic_cast<FunctionTemplate*>(*tpl->fields_[j].second)) {
+                stats->methods_++;
+            }
+        }
+        //accessor是prototype自己的getter/setter属性，每个最多两个函数对象
+        size_t accessors = tpl->accessor_infos_.size() + tpl->accessor_property_infos_.size();
+        size_t properties = tpl->fields_.size() + accessors;
+        stats->properties_ += properties;
+        stats->estimated_memory_bytes_ += properties * kEstimatedPropertyBytes + accessors * 2 * kEstimatedObjectBytes
+            + ObjectUserDataSize(tpl->internal_field_count_);
+    }
+    //方法的函数对象在function_cache_里，每个context一份
+    stats->estimated_memory_bytes_ += stats->methods_ * kEstimatedObjectBytes;
 }
 
 bool FunctionTemplate::HasInstance(Local<Value> object) {
@@ -1018,6 +5674,12 @@ bool FunctionTemplate::HasInstance(Local<Value> object) {
 }
 
 FunctionTemplate::~FunctionTemplate() {
+    if (!instance_template_.IsEmpty()) {
+        instance_template_->constructor_ = nullptr;
+    }
+    if (isolate_) {
+        JSValueUnprotect(isolate_->isolate_context_, cfunction_data_.data_);
+    }
     //rhythm todo
 //    for(auto it : context_to_funtion_) {
 //        JS_FreeValueRT(isolate_->runtime_, it.second);
@@ -1026,7 +5688,20 @@ FunctionTemplate::~FunctionTemplate() {
 
 Maybe<bool> Object::Set(Local<Context> context,
                         Local<Value> key, Local<Value> value) {
-    //rhythm todo
+    JSValueRef exception = nullptr;
+    JSObjectRef obj = const_cast<JSObjectRef>(value_);
+    //kInternalized创建的key直接用常驻的JSStringRef，其它key交给jsc自己转换
+    JSStringRef name = context->GetIsolate()->GetInternedName(key->value_);
+    if (name) {
+        JSObjectSetProperty(context->context_, obj, name, value->value_, kJSPropertyAttributeNone, &exception);
+    } else {
+        JSObjectSetPropertyForKey(context->context_, obj, key->value_, value->value_, kJSPropertyAttributeNone, &exception);
+    }
+    if (exception) {
+        context->GetIsolate()->handleException(exception);
+        return Maybe<bool>();
+    }
+    return Maybe<bool>(true);
 //    bool ok = false;
 //    context->GetIsolate()->Escape(*value);
 //    if (key->IsNumber()) {
@@ -1038,46 +5713,43 @@ Maybe<bool> Object::Set(Local<Context> context,
 //    }
 //
 //    return Maybe<bool>(ok);
-    return Maybe<bool>(false);
 }
 
 Maybe<bool> Object::Set(Local<Context> context,
                 uint32_t index, Local<Value> value) {
-    
-    //rhythm todo
-    return Maybe<bool>(false);
-//    bool ok = false;
-//    context->GetIsolate()->Escape(*value);
-//
-//    ok = JS_SetPropertyUint32(context->context_, value_, index, value->value_);
-//
-//    return Maybe<bool>(ok);
+    JSValueRef exception = nullptr;
+    JSObjectSetPropertyAtIndex(context->context_, const_cast<JSObjectRef>(value_), index, value->value_, &exception);
+    if (exception) {
+        context->GetIsolate()->handleException(exception);
+        return Maybe<bool>();
+    }
+    return Maybe<bool>(true);
 }
 
 MaybeLocal<Value> Object::Get(Local<Context> context,
                       Local<Value> key) {
-    Value* ret = context->GetIsolate()->Alloc<Value>();
-    
-    //rhythm todo
-//    if (key->IsNumber()) {
-//        ret->value_ = JS_GetPropertyUint32(context->context_, value_, key->Uint32Value(context).ToChecked());
-//    } else {
-//        JSAtom atom = JS_ValueToAtom(context->context_, key->value_);
-//        ret->value_ = JS_GetProperty(context->context_, value_, atom);
-//        JS_FreeAtom(context->context_, atom);
-//    }
-    
-    return MaybeLocal<Value>(Local<Value>(ret));
+    Isolate* isolate = context->GetIsolate();
+    JSValueRef exception = nullptr;
+    JSObjectRef obj = const_cast<JSObjectRef>(value_);
+    JSStringRef name = isolate->GetInternedName(key->value_);
+    JSValueRef val = name ? JSObjectGetProperty(context->context_, obj, name, &exception)
+        : JSObjectGetPropertyForKey(context->context_, obj, key->value_, &exception);
+    if (exception) {
+        isolate->handleException(exception);
+        return MaybeLocal<Value>();
+    }
+    return MaybeLocal<Value>(Local<Value>(isolate->Alloc<Value>(val)));
 }
 
 MaybeLocal<Value> Object::Get(Local<Context> context,
                               uint32_t index) {
-    Value* ret = context->GetIsolate()->Alloc<Value>();
-    
-    //rhythm todo
-//    ret->value_ = JS_GetPropertyUint32(context->context_, value_, index);
-    
-    return MaybeLocal<Value>(Local<Value>(ret));
+    JSValueRef exception = nullptr;
+    JSValueRef val = JSObjectGetPropertyAtIndex(context->context_, const_cast<JSObjectRef>(value_), index, &exception);
+    if (exception) {
+        context->GetIsolate()->handleException(exception);
+        return MaybeLocal<Value>();
+    }
+    return MaybeLocal<Value>(Local<Value>(context->GetIsolate()->Alloc<Value>(val)));
 }
 
 MaybeLocal<Array> Object::GetOwnPropertyNames(Local<Context> context) {
@@ -1127,64 +5799,36 @@ Maybe<bool> Object::SetPrototype(Local<Context> context,
 //    }
 }
 
+//ObjectTemplate/FunctionTemplate创建的对象，private data就是ObjectUserData，internal field直接按下标读写
 void Object::SetAlignedPointerInInternalField(int index, void* value) {
-    
-    //rhythm todo
-//    ObjectUserData* objectUdata = reinterpret_cast<ObjectUserData*>(JS_GetOpaque(value_, Isolate::current_->class_id_));
-//    //if (index == 0) std::cout << "SetAlignedPointerInInternalField, value:" << value << ", objptr:" << JS_VALUE_GET_PTR(value_) << std::endl;
-//    if (!objectUdata || index >= objectUdata->len_) {
-//        std::cerr << "SetAlignedPointerInInternalField";
-//        if (objectUdata) {
-//            std::cerr << ", index out of range, index = " << index << ", length=" << objectUdata->len_ << std::endl;
-//        }
-//        else {
-//            std::cerr << "internalFields is nullptr " << std::endl;
-//        }
-//
-//        abort();
-//    }
-//    objectUdata->ptrs_[index] = value;
+#ifdef V8_ENABLE_CHECKS
+    ObjectUserData* object_udata = Isolate::current_->GetObjectUserData(value_);
+#else
+    ObjectUserData* object_udata = static_cast<ObjectUserData*>(JSObjectGetPrivate(const_cast<JSObjectRef>(value_)));
+#endif
+    V8::Check(object_udata && index >= 0 && index < object_udata->len_, "SetAlignedPointerInInternalField, index out of range!");
+    object_udata->ptrs_[index] = value;
 }
     
 void* Object::GetAlignedPointerFromInternalField(int index) {
-    
-    //rhythm todo
-//    ObjectUserData* objectUdata = reinterpret_cast<ObjectUserData*>(JS_GetOpaque(value_, Isolate::current_->class_id_));
-//
-//    bool noObjectUdata = IsFunction() || objectUdata == nullptr;
-//
-//    if (noObjectUdata || index >= objectUdata->len_) {
-//        std::cerr << "GetAlignedPointerFromInternalField";
-//        if (!noObjectUdata) {
-//            std::cerr << ", index out of range, index = " << index << ", length=" << objectUdata->len_ << std::endl;
-//        }
-//        else {
-//            std::cerr << ", internalFields is nullptr " << std::endl;
-//        }
-//
-//        abort();
-//    }
-//    return objectUdata->ptrs_[index];
-    return nullptr;
+#ifdef V8_ENABLE_CHECKS
+    ObjectUserData* object_udata = Isolate::current_->GetObjectUserData(value_);
+#else
+    ObjectUserData* object_udata = static_cast<ObjectUserData*>(JSObjectGetPrivate(const_cast<JSObjectRef>(value_)));
+#endif
+    V8::Check(object_udata && index >= 0 && index < object_udata->len_, "GetAlignedPointerFromInternalField, index out of range!");
+    return object_udata->ptrs_[index];
 }
 
 int Object::InternalFieldCount() {
-    //rhythm todo
-//    ObjectUserData* objectUdata = reinterpret_cast<ObjectUserData*>(JS_GetOpaque(value_, Isolate::current_->class_id_));
-//
-//    bool noObjectUdata = IsFunction() || objectUdata == nullptr;
-//
-//    if (noObjectUdata) {
-//        return 0;
-//    }
-//    return objectUdata->len_;
-    return 0;
+    ObjectUserData* object_udata = Isolate::current_->GetObjectUserData(value_);
+    return object_udata ? object_udata->len_ : 0;
 }
 
 Local<Object> Object::New(Isolate* isolate) {
     //rhythm todo
     Object *object = isolate->Alloc<Object>();
-//    object->value_ = JS_NewObject(isolate->GetCurrentContext()->context_);
+//    object->value_ = JS_NewObject(isolate->current_js_context_);
     return Local<Object>(object);
 }
 
@@ -1203,63 +5847,62 @@ uint32_t Array::Length() const {
 
 TryCatch::TryCatch(Isolate* isolate) {
     isolate_ = isolate;
-    catched_ = JSValueMakeUndefined(isolate->current_context_->context_);
+    catched_ = nullptr;
     prev_ = isolate_->currentTryCatch_;
     isolate_->currentTryCatch_ = this;
 }
     
 TryCatch::~TryCatch() {
     isolate_->currentTryCatch_ = prev_;
-    //rhythm todo
-//    JS_FreeValue(isolate_->current_context_->context_, catched_);
+    Reset();
+}
+
+void TryCatch::Reset() {
+    if (catched_) {
+        JSValueUnprotect(isolate_->isolate_context_, catched_);
+        catched_ = nullptr;
+    }
 }
     
 bool TryCatch::HasCaught() const {
-    //rhythm todo
-//    return !JS_IsUndefined(catched_) && !JS_IsNull(catched_);
-    return false;
+    return catched_ != nullptr;
 }
     
 Local<Value> TryCatch::Exception() const {
-    //rhythm todo
-//    return Local<Value>(reinterpret_cast<Value*>(const_cast<JSValue*>(&catched_)));
-    
-    Value* ret = Isolate::current_->Alloc<Value>();
-    return Local<Value>(ret);
+    if (catched_ == nullptr) {
+        return Local<Value>();
+    }
+    return Local<Value>(isolate_->Alloc<Value>(catched_));
 }
 
 MaybeLocal<Value> TryCatch::StackTrace(Local<Context> context) const {
-    //rhythm todo
-    auto str = context->GetIsolate()->Alloc<String>();
-//    str->value_ = JS_GetProperty(isolate_->current_context_->context_, catched_, JS_ATOM_stack);;
-    return MaybeLocal<Value>(Local<String>(str));
+    if (catched_ == nullptr || !JSValueIsObject(context->context_, catched_)) {
+        return MaybeLocal<Value>();
+    }
+    JSValueRef stack = GetErrorProperty(context->context_, const_cast<JSObjectRef>(catched_), "stack");
+    if (stack == nullptr || JSValueIsUndefined(context->context_, stack)) {
+        return MaybeLocal<Value>();
+    }
+    return MaybeLocal<Value>(Local<Value>(isolate_->Alloc<Value>(stack)));
 }
     
 Local<v8::Message> TryCatch::Message() const {
-    //rhythm todo
-//    JSValue fileNameVal = JS_GetProperty(isolate_->current_context_->context_, catched_, JS_ATOM_fileName);
-//    JSValue lineNumVal = JS_GetProperty(isolate_->current_context_->context_, catched_, JS_ATOM_lineNumber);
-    
     Local<v8::Message> message(new v8::Message());
-    
-//    if (JS_IsUndefined(fileNameVal)) {
-//        message->resource_name_ = "<unknow>";
-//        message->line_number_ = - 1;
-//    } else {
-//        const char* fileName = JS_ToCString(isolate_->current_context_->context_, fileNameVal);
-//        message->resource_name_ = fileName;
-//        JS_FreeCString(isolate_->current_context_->context_, fileName);
-//        JS_ToInt32(isolate_->current_context_->context_, &message->line_number_, lineNumVal);
-//    }
-//
-//    JS_FreeValue(isolate_->current_context_->context_, lineNumVal);
-//    JS_FreeValue(isolate_->current_context_->context_, fileNameVal);
-    
+    ErrorLocation location;
+    if (catched_) {
+        GetErrorLocation(isolate_->current_js_context_, catched_, &location);
+    }
+    //非Error对象的异常拿不到位置
+    message->resource_name_ = location.resource_name_.empty() ? "<unknown>" : location.resource_name_;
+    message->line_number_ = location.line_;
+    message->start_column_ = location.column_ > 0 ? location.column_ - 1 : 0;
     return message;
 }
 
-void TryCatch::handleException() {
-//    catched_ = JS_GetException(isolate_->current_context_->context_);
+void TryCatch::handleException(JSValueRef exception) {
+    Reset();
+    catched_ = exception;
+    JSValueProtect(isolate_->isolate_context_, catched_);
 }
 
 }  // namespace v8
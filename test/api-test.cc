@@ -0,0 +1,1014 @@
+// jsc后端的api测试
+//
+// 用法：apitest [name ...]
+// 不带参数时运行全部测试，否则只运行名字以参数开头的测试。有失败时返回非0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libplatform/libplatform.h"
+#include "v8.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                          \
+        }                                                                        \
+    } while (0)
+
+static v8::Local<v8::String> NewString(v8::Isolate* isolate, const char* str) {
+    return v8::String::NewFromUtf8(isolate, str, v8::NewStringType::kNormal).ToLocalChecked();
+}
+
+static bool StringEquals(v8::Isolate* isolate, v8::Local<v8::Value> value, const char* expected) {
+    v8::String::Utf8Value utf8(isolate, value);
+    return *utf8 != nullptr && strcmp(*utf8, expected) == 0;
+}
+
+static void CollectGarbage(v8::Isolate* isolate) {
+    isolate->RequestGarbageCollectionForTesting(v8::Isolate::kFullGarbageCollection);
+}
+
+// HandleScope里的Local只靠handle块的根保持存活，每次分配之间都做gc
+
+static const int kStressCount = 3000;
+
+static v8::Local<v8::Object> NewTaggedObject(v8::Isolate* isolate, v8::Local<v8::Context> context, int tag) {
+    v8::Local<v8::Object> obj = v8::Object::New(isolate);
+    obj->Set(context, NewString(isolate, "tag"), v8::Integer::New(isolate, tag)).Check();
+    return obj;
+}
+
+static bool HasTag(v8::Isolate* isolate, v8::Local<v8::Context> context, v8::Local<v8::Object> obj, int tag) {
+    v8::Local<v8::Value> value;
+    if (!obj->Get(context, NewString(isolate, "tag")).ToLocal(&value)) {
+        return false;
+    }
+    return value->IsNumber() && value->Int32Value(context).ToChecked() == tag;
+}
+
+static void TestHandleScopeGCStress(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    std::vector<v8::Local<v8::String>> strings;
+    std::vector<v8::Local<v8::Object>> objects;
+    for (int i = 0; i < kStressCount; i++) {
+        std::string text = "string-" + std::to_string(i);
+        strings.push_back(NewString(isolate, text.c_str()));
+        objects.push_back(NewTaggedObject(isolate, context, i));
+        if (i % 100 == 0) {
+            CollectGarbage(isolate);
+        }
+    }
+    CollectGarbage(isolate);
+    for (int i = 0; i < kStressCount; i++) {
+        std::string text = "string-" + std::to_string(i);
+        CHECK(StringEquals(isolate, strings[i], text.c_str()));
+        CHECK(HasTag(isolate, context, objects[i], i));
+    }
+}
+
+static void TestNestedHandleScopeGC(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    //外层的值一部分已经成批挂到根上，一部分还在scope里暂存
+    const int kOuterCount = v8::Isolate::kHandleRootBatch + v8::Isolate::kHandleRootBatch / 2;
+    std::vector<v8::Local<v8::Object>> outer;
+    for (int i = 0; i < kOuterCount; i++) {
+        outer.push_back(NewTaggedObject(isolate, context, i));
+    }
+    v8::Local<v8::Object> escaped;
+    {
+        v8::EscapableHandleScope scope(isolate);
+        for (int i = 0; i < v8::Isolate::kHandleRootBatch * 3; i++) {
+            NewTaggedObject(isolate, context, -i);
+        }
+        CollectGarbage(isolate);
+        escaped = scope.Escape(NewTaggedObject(isolate, context, 12345));
+    }
+    //内层scope的批次被释放后，外层的批次必须还在
+    CollectGarbage(isolate);
+    for (int i = 0; i < kOuterCount; i++) {
+        CHECK(HasTag(isolate, context, outer[i], i));
+    }
+    CHECK(HasTag(isolate, context, escaped, 12345));
+    for (int i = kOuterCount; i < kOuterCount * 2; i++) {
+        outer.push_back(NewTaggedObject(isolate, context, i));
+        CollectGarbage(isolate);
+    }
+    for (int i = 0; i < kOuterCount * 2; i++) {
+        CHECK(HasTag(isolate, context, outer[i], i));
+    }
+}
+
+// 弱句柄：回调在安全点派发；对象已经被回收、回调还在队列里时Reset要能取消回调
+
+static const int kWeakCount = 500;
+
+static int weak_callback_calls = 0;
+
+struct WeakHolder {
+    v8::Global<v8::Object> handle_;
+    int id_;
+};
+
+static void OnWeakHolder(const v8::WeakCallbackInfo<WeakHolder>& info) {
+    weak_callback_calls++;
+    info.GetParameter()->handle_.Reset();
+}
+
+//在单独的栈帧里创建，返回后栈上不留对象的指针，保守扫描不会误把它们当成活的
+static V8_NOINLINE void NewWeakObjects(v8::Isolate* isolate, v8::Local<v8::Context> context,
+                                       std::vector<WeakHolder*>& holders) {
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::ObjectTemplate> tpl = v8::ObjectTemplate::New(isolate);
+    tpl->SetInternalFieldCount(1);
+    for (int i = 0; i < kWeakCount; i++) {
+        WeakHolder* holder = new WeakHolder();
+        holder->id_ = i;
+        holder->handle_.Reset(isolate, tpl->NewInstance(context).ToLocalChecked());
+        holder->handle_.SetWeak(holder, OnWeakHolder, v8::WeakCallbackType::kParameter);
+        holders.push_back(holder);
+    }
+}
+
+static void TestWeakCallbacks(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    std::vector<WeakHolder*> holders;
+    NewWeakObjects(isolate, context, holders);
+    weak_callback_calls = 0;
+    CollectGarbage(isolate);
+    //gc里只排队，不回调
+    CHECK(weak_callback_calls == 0);
+    v8::GlobalHandleStatistics stats;
+    isolate->GetGlobalHandleStatistics(&stats);
+    int pending = (int)stats.pending_weak_callbacks();
+    CHECK(pending > 0);
+    isolate->DispatchWeakCallbacks();
+    CHECK(weak_callback_calls == pending);
+    int reset = 0;
+    for (size_t i = 0; i < holders.size(); i++) {
+        if (holders[i]->handle_.IsEmpty()) {
+            reset++;
+        }
+        delete holders[i];
+    }
+    CHECK(reset == pending);
+}
+
+static void TestWeakResetAfterFinalize(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    std::vector<WeakHolder*> holders;
+    NewWeakObjects(isolate, context, holders);
+    weak_callback_calls = 0;
+    CollectGarbage(isolate);
+    v8::GlobalHandleStatistics stats;
+    isolate->GetGlobalHandleStatistics(&stats);
+    CHECK(stats.pending_weak_callbacks() > 0);
+    //回调派发之前embedder就释放了句柄和参数，之后不能再回调
+    for (size_t i = 0; i < holders.size(); i++) {
+        holders[i]->handle_.Reset();
+        delete holders[i];
+    }
+    holders.clear();
+    isolate->DispatchWeakCallbacks();
+    CHECK(weak_callback_calls == 0);
+    isolate->GetGlobalHandleStatistics(&stats);
+    CHECK(stats.pending_weak_callbacks() == 0);
+    CHECK(stats.weak_slots() == 0);
+}
+
+static void TestWeakPendingAtDispose(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    //isolate销毁时还在队列里的回调，以及vm释放时才被回收的对象，都不回调也不泄漏；
+    //之后再析构这些Global也是安全的
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    std::vector<WeakHolder*> holders;
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+        NewWeakObjects(isolate, context, holders);
+    }
+    weak_callback_calls = 0;
+    //scope都已经退出，排队的回调没有安全点派发
+    isolate->RequestGarbageCollectionForTesting(v8::Isolate::kFullGarbageCollection);
+    isolate->Dispose();
+    CHECK(weak_callback_calls == 0);
+    //isolate销毁之后析构Global只释放槽位，所在块在最后一个Global析构时释放
+    for (size_t i = 0; i < holders.size(); i++) {
+        delete holders[i];
+    }
+    delete create_params.array_buffer_allocator;
+}
+
+// NewFromUtf8：带长度的字符串中间可以有'\0'；intern表有上限
+
+static v8::Local<v8::Value> RunScript(v8::Isolate* isolate, v8::Local<v8::Context> context, const char* source) {
+    v8::Local<v8::Script> script = v8::Script::Compile(context, NewString(isolate, source)).ToLocalChecked();
+    return script->Run(context).ToLocalChecked();
+}
+
+static void TestStringEmbeddedNul(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    static const char kKey[] = {'a', '\0', 'b'};
+    v8::Local<v8::Object> global = context->Global();
+    v8::Local<v8::String> normal = v8::String::NewFromUtf8(isolate, kKey, v8::NewStringType::kNormal, 3).ToLocalChecked();
+    v8::Local<v8::String> interned =
+        v8::String::NewFromUtf8(isolate, kKey, v8::NewStringType::kInternalized, 3).ToLocalChecked();
+    CHECK(normal->Utf8Length(isolate) == 3);
+    CHECK(interned->Utf8Length(isolate) == 3);
+    global->Set(context, NewString(isolate, "normal"), normal).Check();
+    global->Set(context, NewString(isolate, "interned"), interned).Check();
+    CHECK(RunScript(isolate, context, "normal === 'a\\0b' && interned === normal")->BooleanValue(isolate));
+
+    //intern过的key和普通key指向同一个属性，不会被截断成"a"
+    v8::Local<v8::Object> obj = v8::Object::New(isolate);
+    obj->Set(context, interned, v8::Integer::New(isolate, 1)).Check();
+    CHECK(obj->Get(context, normal).ToLocalChecked()->Int32Value(context).ToChecked() == 1);
+    CHECK(obj->Get(context, NewString(isolate, "a")).ToLocalChecked()->IsUndefined());
+}
+
+static void TestInternTableLimit(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    const int count = (int)v8::Isolate::kInternTableLimit + 100;
+    for (int i = 0; i < count; i++) {
+        v8::HandleScope scope(isolate);
+        std::string name = "interned-" + std::to_string(i);
+        v8::Local<v8::String> str =
+            v8::String::NewFromUtf8(isolate, name.c_str(), v8::NewStringType::kInternalized).ToLocalChecked();
+        CHECK(StringEquals(isolate, str, name.c_str()));
+    }
+    v8::InternTableStatistics stats;
+    isolate->GetInternTableStatistics(&stats);
+    CHECK(stats.entries() <= v8::Isolate::kInternTableLimit);
+    CHECK(stats.rejected() > 0);
+    //已经在表里的名字仍然命中
+    size_t hits = stats.hits();
+    v8::String::NewFromUtf8(isolate, "interned-0", v8::NewStringType::kInternalized).ToLocalChecked();
+    isolate->GetInternTableStatistics(&stats);
+    CHECK(stats.hits() == hits + 1);
+}
+
+// Script::Compile时解析并报告语法错误，编译好的脚本可以重复Run
+
+static void TestScriptCompileRun(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    {
+        v8::TryCatch try_catch(isolate);
+        CHECK(v8::Script::Compile(context, NewString(isolate, "var = ;")).IsEmpty());
+        CHECK(try_catch.HasCaught());
+    }
+    v8::Local<v8::Script> script =
+        v8::Script::Compile(context, NewString(isolate, "this.counter = (this.counter || 0) + 1")).ToLocalChecked();
+    for (int i = 1; i <= 3; i++) {
+        v8::Local<v8::Value> result = script->Run(context).ToLocalChecked();
+        CHECK(result->Int32Value(context).ToChecked() == i);
+    }
+    {
+        //运行时的异常在Run里抛出
+        v8::TryCatch try_catch(isolate);
+        v8::Local<v8::Script> thrower = v8::Script::Compile(context, NewString(isolate, "undefinedFunction()")).ToLocalChecked();
+        CHECK(thrower->Run(context).IsEmpty());
+        CHECK(try_catch.HasCaught());
+    }
+}
+
+// ScriptCompiler的CachedData：同一份源码命中，源码变了要rejected并且照常编译
+
+static v8::Local<v8::Script> CompileWithCache(v8::Isolate* isolate, v8::Local<v8::Context> context, const char* source,
+                                              v8::ScriptCompiler::CompileOptions options,
+                                              v8::ScriptCompiler::CachedData* cached_data, bool* rejected) {
+    v8::ScriptOrigin origin(NewString(isolate, "cache.js"));
+    v8::ScriptCompiler::Source script_source(NewString(isolate, source), origin, cached_data);
+    v8::Local<v8::Script> script = v8::ScriptCompiler::Compile(context, &script_source, options).ToLocalChecked();
+    if (rejected) {
+        *rejected = script_source.GetCachedData()->rejected;
+    }
+    return script;
+}
+
+static void TestCodeCache(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    static const char kSource[] = "1 + 2";
+    v8::ScriptOrigin origin(NewString(isolate, "cache.js"));
+    v8::ScriptCompiler::Source produce_source(NewString(isolate, kSource), origin);
+    v8::Local<v8::Script> script =
+        v8::ScriptCompiler::Compile(context, &produce_source, v8::ScriptCompiler::kProduceCodeCache).ToLocalChecked();
+    CHECK(script->Run(context).ToLocalChecked()->Int32Value(context).ToChecked() == 3);
+    const v8::ScriptCompiler::CachedData* produced = produce_source.GetCachedData();
+    CHECK(produced != nullptr && produced->length > 0);
+    std::vector<uint8_t> data(produced->data, produced->data + produced->length);
+
+    bool rejected = true;
+    script = CompileWithCache(isolate, context, kSource, v8::ScriptCompiler::kConsumeCodeCache,
+                              new v8::ScriptCompiler::CachedData(data.data(), (int)data.size()), &rejected);
+    CHECK(!rejected);
+    CHECK(script->Run(context).ToLocalChecked()->Int32Value(context).ToChecked() == 3);
+
+    rejected = false;
+    script = CompileWithCache(isolate, context, "2 + 3", v8::ScriptCompiler::kConsumeCodeCache,
+                              new v8::ScriptCompiler::CachedData(data.data(), (int)data.size()), &rejected);
+    CHECK(rejected);
+    CHECK(script->Run(context).ToLocalChecked()->Int32Value(context).ToChecked() == 5);
+
+    //源码改了语法错误，缓存不能掩盖
+    v8::TryCatch try_catch(isolate);
+    v8::ScriptCompiler::Source bad_source(NewString(isolate, "1 +"), origin,
+                                          new v8::ScriptCompiler::CachedData(data.data(), (int)data.size()));
+    CHECK(v8::ScriptCompiler::Compile(context, &bad_source, v8::ScriptCompiler::kConsumeCodeCache).IsEmpty());
+    CHECK(try_catch.HasCaught());
+}
+
+// utf16转utf8：和逐个字符的标量实现逐字节比较。覆盖1、2、3、4字节的字符，
+// 跨8/16/32/64个单元的块边界的代理对，转成U+FFFD的孤立代理，以及Utf8Value栈上buffer的边界和intern过的名字
+
+static std::string EncodeUtf8(const std::vector<uint16_t>& units) {
+    std::string out;
+    for (size_t i = 0; i < units.size(); i++) {
+        uint32_t c = units[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < units.size() && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (units[++i] - 0xDC00);
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = 0xFFFD;
+        }
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        } else {
+            out += (char)(0xF0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3F));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return out;
+}
+
+//通过js字面量的\u转义创建，孤立代理也能原样放进字符串
+static v8::Local<v8::String> NewUtf16String(v8::Isolate* isolate, v8::Local<v8::Context> context,
+                                            const std::vector<uint16_t>& units) {
+    std::string source = "'";
+    char escape[8];
+    for (size_t i = 0; i < units.size(); i++) {
+        snprintf(escape, sizeof(escape), "\\u%04x", units[i]);
+        source += escape;
+    }
+    source += "'";
+    return RunScript(isolate, context, source.c_str()).As<v8::String>();
+}
+
+static bool Utf8Matches(v8::Isolate* isolate, v8::Local<v8::String> str, const std::string& expected) {
+    bool ok = str->Utf8Length(isolate) == (int)expected.size();
+    //多留几个字节检查没有写过界
+    std::vector<char> buffer(expected.size() + 8, '#');
+    ok = ok && str->WriteUtf8(isolate, buffer.data()) == (int)expected.size() + 1;
+    ok = ok && memcmp(buffer.data(), expected.data(), expected.size()) == 0 && buffer[expected.size()] == '\0'
+        && buffer[expected.size() + 1] == '#';
+    v8::String::Utf8Value value(isolate, str);
+    ok = ok && value.length() == (int)expected.size() && memcmp(*value, expected.data(), expected.size()) == 0
+        && (*value)[expected.size()] == '\0';
+    return ok;
+}
+
+static void CheckUtf8(v8::Isolate* isolate, v8::Local<v8::Context> context, const std::vector<uint16_t>& units) {
+    v8::HandleScope scope(isolate);
+    if (!Utf8Matches(isolate, NewUtf16String(isolate, context, units), EncodeUtf8(units))) {
+        fprintf(stderr, "utf8 mismatch, %d units:", (int)units.size());
+        for (size_t i = 0; i < units.size(); i++) {
+            fprintf(stderr, " %04x", units[i]);
+        }
+        fprintf(stderr, "\n");
+        CHECK(false);
+    }
+}
+
+static void TestUtf8Transcode(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    //latin1、中日韩、astral(代理对)和混合
+    static const uint16_t kLatin1[] = {'a', 0xE9, 'Z', 0xFF};
+    static const uint16_t kCjk[] = {0x4E2D, 0x6587, 0x3042, 0xFF21};
+    for (int length = 0; length <= 70; length++) {
+        for (int pattern = 0; pattern < 4; pattern++) {
+            std::vector<uint16_t> units;
+            while ((int)units.size() < length) {
+                size_t i = units.size();
+                if (pattern == 0) {
+                    units.push_back('a' + i % 26);
+                } else if (pattern == 1) {
+                    units.push_back(kLatin1[i % 4]);
+                } else if (pattern == 2) {
+                    units.push_back(kCjk[i % 4]);
+                } else if (i % 3 == 2 && (int)i + 2 <= length) {
+                    units.push_back(0xD83D);
+                    units.push_back(0xDE00);
+                } else {
+                    units.push_back(i % 3 ? kCjk[i % 4] : kLatin1[i % 4]);
+                }
+            }
+            CheckUtf8(isolate, context, units);
+        }
+    }
+    static const int kEdges[] = {8, 16, 32, 64};
+    for (int e = 0; e < 4; e++) {
+        int edge = kEdges[e];
+        for (int filler = 0; filler < 2; filler++) {
+            //前面的字符全是ascii或者全是2字节，代理对的高位在块的最后一个单元，低位在下一块的第一个
+            uint16_t fill = filler ? 0xE9 : 'x';
+            std::vector<uint16_t> pair(edge + 3, fill);
+            pair[edge - 1] = 0xD83D;
+            pair[edge] = 0xDE00;
+            CheckUtf8(isolate, context, pair);
+            //孤立的高位在块尾、孤立的低位在块首、高位在字符串结尾
+            std::vector<uint16_t> lone_high(edge + 3, fill);
+            lone_high[edge - 1] = 0xD83D;
+            CheckUtf8(isolate, context, lone_high);
+            std::vector<uint16_t> lone_low(edge + 3, fill);
+            lone_low[edge] = 0xDE00;
+            CheckUtf8(isolate, context, lone_low);
+            std::vector<uint16_t> trailing(edge, fill);
+            trailing[edge - 1] = 0xD83D;
+            CheckUtf8(isolate, context, trailing);
+            //两个高位相连：第一个是孤立的，第二个和后面的低位组成一对
+            std::vector<uint16_t> double_high(edge + 3, fill);
+            double_high[edge - 1] = 0xD83D;
+            double_high[edge] = 0xD83D;
+            double_high[edge + 1] = 0xDE00;
+            CheckUtf8(isolate, context, double_high);
+        }
+    }
+    //Utf8Value在64字节(63个字节加'\0')以内用栈上的buffer，超过时分配
+    for (int bytes = 62; bytes <= 65; bytes++) {
+        std::vector<uint16_t> ascii(bytes, 'y');
+        CheckUtf8(isolate, context, ascii);
+        //结尾是2字节字符，utf8长度相同但utf16单元少一个
+        std::vector<uint16_t> wide(bytes - 1, 'y');
+        wide[bytes - 2] = 0xE9;
+        CheckUtf8(isolate, context, wide);
+    }
+    //intern过的名字直接从表里取utf8，长度分别落在栈上buffer的两边
+    for (int bytes = 63; bytes <= 64; bytes++) {
+        v8::HandleScope scope(isolate);
+        std::string name = std::string(bytes - 2, 'n') + "\xc3\xa9";
+        v8::Local<v8::String> interned =
+            v8::String::NewFromUtf8(isolate, name.c_str(), v8::NewStringType::kInternalized).ToLocalChecked();
+        CHECK(Utf8Matches(isolate, interned, name));
+    }
+}
+
+// 外部字符串：小的拷贝后立即Dispose，大的最晚在isolate销毁时Dispose
+
+class TestTwoByteResource : public v8::String::ExternalStringResource {
+public:
+    TestTwoByteResource(const std::string& ascii, bool* disposed) : disposed_(disposed) {
+        data_.assign(ascii.begin(), ascii.end());
+    }
+
+    const uint16_t* data() const override { return data_.data(); }
+
+    size_t length() const override { return data_.size(); }
+
+protected:
+    void Dispose() override {
+        *disposed_ = true;
+        delete this;
+    }
+
+private:
+    std::vector<uint16_t> data_;
+    bool* disposed_;
+};
+
+class TestOneByteResource : public v8::String::ExternalOneByteStringResource {
+public:
+    TestOneByteResource(const std::string& latin1, bool* disposed) : data_(latin1), disposed_(disposed) {}
+
+    const char* data() const override { return data_.data(); }
+
+    size_t length() const override { return data_.size(); }
+
+protected:
+    void Dispose() override {
+        *disposed_ = true;
+        delete this;
+    }
+
+private:
+    std::string data_;
+    bool* disposed_;
+};
+
+static void TestExternalStrings(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    bool small_disposed = false;
+    bool one_byte_disposed = false;
+    bool large_disposed = false;
+    std::string large(v8::Isolate::kExternalNoCopyMinBytes, 'x');
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        v8::Local<v8::String> small =
+            v8::String::NewExternalTwoByte(isolate, new TestTwoByteResource("small", &small_disposed)).ToLocalChecked();
+        CHECK(small_disposed);
+        CHECK(StringEquals(isolate, small, "small"));
+
+        v8::Local<v8::String> one_byte =
+            v8::String::NewExternalOneByte(isolate, new TestOneByteResource("caf\xe9", &one_byte_disposed)).ToLocalChecked();
+        CHECK(one_byte_disposed);
+        CHECK(StringEquals(isolate, one_byte, "caf\xc3\xa9"));
+
+        v8::Local<v8::String> big =
+            v8::String::NewExternalTwoByte(isolate, new TestTwoByteResource(large, &large_disposed)).ToLocalChecked();
+        CHECK(big->Utf8Length(isolate) == (int)large.size());
+    }
+    isolate->Dispose();
+    CHECK(large_disposed);
+    delete create_params.array_buffer_allocator;
+}
+
+// 流式编译：task在后台线程执行时Compile要等它完成；没有执行过时Compile自己执行
+
+class ChunkedSourceStream : public v8::ScriptCompiler::ExternalSourceStream {
+public:
+    ChunkedSourceStream(const std::string& data, size_t chunk_size) : data_(data), chunk_size_(chunk_size) {}
+
+    size_t GetMoreData(const uint8_t** src) override {
+        size_t size = std::min(chunk_size_, data_.size() - pos_);
+        if (size == 0) {
+            *src = nullptr;
+            return 0;
+        }
+        uint8_t* chunk = new uint8_t[size];
+        memcpy(chunk, data_.data() + pos_, size);
+        pos_ += size;
+        *src = chunk;
+        return size;
+    }
+
+private:
+    std::string data_;
+    size_t chunk_size_;
+    size_t pos_ = 0;
+};
+
+static v8::MaybeLocal<v8::Script> CompileStreamed(v8::Isolate* isolate, v8::Local<v8::Context> context,
+                                                  const std::string& source, bool background) {
+    //3字节一块，utf8的多字节字符会被切开
+    v8::ScriptCompiler::StreamedSource streamed(
+        std::unique_ptr<v8::ScriptCompiler::ExternalSourceStream>(new ChunkedSourceStream(source, 3)),
+        v8::ScriptCompiler::StreamedSource::UTF8);
+    v8::ScriptOrigin origin(NewString(isolate, "streamed.js"));
+    std::unique_ptr<v8::ScriptCompiler::ScriptStreamingTask> task(v8::ScriptCompiler::StartStreaming(isolate, &streamed));
+    std::thread thread;
+    if (background) {
+        thread = std::thread([&task] { task->Run(); });
+    }
+    v8::MaybeLocal<v8::Script> ret = v8::ScriptCompiler::Compile(context, &streamed, v8::Local<v8::String>(), origin);
+    if (background) {
+        thread.join();
+    }
+    return ret;
+}
+
+static void TestStreamingCompile(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    std::string source = "'\xe4\xbd\xa0\xe5\xa5\xbd' + ";
+    for (int i = 0; i < 2000; i++) {
+        source += std::to_string(i) + " + ";
+    }
+    source += "''";
+    for (int background = 0; background < 2; background++) {
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Script> script;
+        CHECK(CompileStreamed(isolate, context, source, background != 0).ToLocal(&script));
+        if (!script.IsEmpty()) {
+            v8::Local<v8::Value> result = script->Run(context).ToLocalChecked();
+            CHECK(v8::String::Utf8Value(isolate, result).length() > 6);
+        }
+    }
+    v8::TryCatch try_catch(isolate);
+    CHECK(CompileStreamed(isolate, context, "var = ;", true).IsEmpty());
+    CHECK(try_catch.HasCaught());
+}
+
+// module：import是live binding，循环依赖只在真正读到未初始化的导出时出错
+
+struct TestModuleSource {
+    const char* name_;
+    const char* source_;
+};
+
+static const TestModuleSource kTestModules[] = {
+    //a和b互相依赖，b的函数在a执行时才读x
+    {"cycle-a.js", "import { getX } from 'cycle-b.js';\nexport let x = 1;\nexport const result = getX();\n"},
+    {"cycle-b.js", "import { x } from 'cycle-a.js';\nexport function getX() { return x; }\n"},
+    {"counter.js", "export let count = 0;\nexport function inc() { count++; }\n"},
+    {"live.js", "import { count, inc } from 'counter.js';\nimport * as ns from 'counter.js';\ninc();\n"
+                "const obj = { count, inc };\nexport const result = [count, ns.count, obj.count].join();\n"},
+    //条件之后的/是正则
+    {"lexer.js", "const x = 1;\nif (x) /[`]/.test('a');\nexport const result = `${x + 1}`;\n"},
+    //参数、局部变量、catch、成员名和import同名时不改写
+    {"shadow.js", "import { count as v, inc as f } from 'counter.js';\n"
+                  "function g(v) { return v * 2; }\nconst h = v => v + 1;\n"
+                  "function k() { let f = 10; { const v = 5; } return f; }\n"
+                  "class C { v() { return 3; } }\nconst o = { v: 7, f() { return 8; } };\n"
+                  "try { throw 9; } catch (v) { var caught = v; }\n"
+                  "export const result = [g(2), h(3), k(), new C().v(), o.v, o.f(), caught, v, typeof f].join();\n"},
+};
+
+static v8::MaybeLocal<v8::Module> CompileTestModule(v8::Isolate* isolate, const char* name) {
+    for (size_t i = 0; i < sizeof(kTestModules) / sizeof(kTestModules[0]); i++) {
+        if (strcmp(kTestModules[i].name_, name) == 0) {
+            v8::ScriptOrigin origin(NewString(isolate, name));
+            v8::ScriptCompiler::Source source(NewString(isolate, kTestModules[i].source_), origin);
+            return v8::ScriptCompiler::CompileModule(isolate, &source);
+        }
+    }
+    return v8::MaybeLocal<v8::Module>();
+}
+
+static v8::MaybeLocal<v8::Module> ResolveTestModule(v8::Local<v8::Context> context, v8::Local<v8::String> specifier,
+                                                   v8::Local<v8::Module> referrer) {
+    v8::String::Utf8Value name(context->GetIsolate(), specifier);
+    return CompileTestModule(context->GetIsolate(), *name);
+}
+
+static bool ModuleResultEquals(v8::Isolate* isolate, v8::Local<v8::Context> context, const char* name, const char* expected) {
+    v8::Local<v8::Module> module;
+    if (!CompileTestModule(isolate, name).ToLocal(&module) || !module->InstantiateModule(context, ResolveTestModule).FromMaybe(false)
+        || module->Evaluate(context).IsEmpty()) {
+        return false;
+    }
+    v8::Local<v8::Object> ns = module->GetModuleNamespace().As<v8::Object>();
+    v8::Local<v8::Value> result;
+    return ns->Get(context, NewString(isolate, "result")).ToLocal(&result) && StringEquals(isolate, result, expected);
+}
+
+static void TestModuleBindings(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::TryCatch try_catch(isolate);
+    CHECK(ModuleResultEquals(isolate, context, "cycle-a.js", "1"));
+    CHECK(ModuleResultEquals(isolate, context, "live.js", "1,1,1"));
+    CHECK(ModuleResultEquals(isolate, context, "lexer.js", "2"));
+    CHECK(ModuleResultEquals(isolate, context, "shadow.js", "4,4,10,3,7,8,9,1,function"));
+    CHECK(!try_catch.HasCaught());
+    //另一个context里重新解析依赖，有自己的一份实例
+    v8::Local<v8::Context> other = v8::Context::New(isolate);
+    v8::Context::Scope context_scope(other);
+    CHECK(ModuleResultEquals(isolate, other, "live.js", "1,1,1"));
+}
+
+// 启动快照：数据脚本的结果从JSON恢复，重放脚本对它的修改只发生一次；不能序列化的数据在生成时报错
+
+static void TestSnapshotRestore(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    v8::StartupData blob;
+    {
+        v8::SnapshotCreator creator;
+        v8::Isolate* isolate = creator.GetIsolate();
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+        CHECK(!creator.RunScript(context, NewString(isolate, "var items = [1];"), nullptr, false).IsEmpty());
+        CHECK(!creator.RunScript(context, NewString(isolate, "items.push(2); function count() { return items.length; }")).IsEmpty());
+        //源码中间的'\0'在恢复时不能截断后面的代码
+        static const char kNulSource[] = "var nul = 'a\0b'; var after = 1;";
+        v8::Local<v8::String> nul_source =
+            v8::String::NewFromUtf8(isolate, kNulSource, v8::NewStringType::kNormal, sizeof(kNulSource) - 1).ToLocalChecked();
+        CHECK(!creator.RunScript(context, nul_source).IsEmpty());
+        {
+            v8::TryCatch try_catch(isolate);
+            CHECK(creator.RunScript(context, NewString(isolate, "var handler = function () {};"), nullptr, false).IsEmpty());
+            CHECK(try_catch.HasCaught());
+        }
+        {
+            v8::TryCatch try_catch(isolate);
+            CHECK(creator.RunScript(context, NewString(isolate, "let hidden = 1;"), nullptr, false).IsEmpty());
+            CHECK(try_catch.HasCaught());
+        }
+        creator.SetDefaultContext(context);
+        blob = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kClear);
+    }
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    create_params.snapshot_blob = &blob;
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        for (int i = 0; i < 2; i++) {
+            v8::Local<v8::Context> context = v8::Context::New(isolate);
+            v8::Context::Scope context_scope(context);
+            CHECK(StringEquals(isolate, RunScript(isolate, context, "count() + ':' + items.join()"), "2:1,2"));
+            CHECK(StringEquals(isolate, RunScript(isolate, context, "nul.length + after"), "4"));
+        }
+    }
+    isolate->Dispose();
+    delete[] blob.data;
+    delete create_params.array_buffer_allocator;
+}
+
+// ContextPool：Checkin恢复global上的绑定和内置对象，执行过顶层let/const/class的context被换掉
+
+static void InstallPoolBinding(v8::Local<v8::Context> context, void* data) {
+    v8::Isolate* isolate = context->GetIsolate();
+    context->Global()->Set(context, NewString(isolate, "binding"), v8::Integer::New(isolate, 1)).Check();
+}
+
+static void TestContextPool(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    v8::ContextPool pool(isolate, 1, InstallPoolBinding);
+    v8::Context* first;
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        first = *context;
+        v8::Context::Scope context_scope(context);
+        RunScript(isolate, context, "binding = 2; var leaked = 3; globalThis.added = 4; delete globalThis.JSON;"
+                                    "Object.defineProperty(globalThis, 'hidden', {value: 5, configurable: true});");
+        pool.Checkin(context);
+    }
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        CHECK(*context == first);
+        v8::Context::Scope context_scope(context);
+        CHECK(StringEquals(isolate, RunScript(isolate, context,
+            "[binding, typeof leaked, 'added' in globalThis, 'hidden' in globalThis, typeof JSON].join()"),
+            "1,undefined,false,false,object"));
+        RunScript(isolate, context, "let counter = 1;");
+        pool.Checkin(context);
+    }
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        CHECK(*context != first);
+        v8::Context::Scope context_scope(context);
+        v8::TryCatch try_catch(isolate);
+        CHECK(StringEquals(isolate, RunScript(isolate, context, "let counter = 2; counter + binding"), "3"));
+        CHECK(!try_catch.HasCaught());
+        pool.Checkin(context);
+    }
+    //只通过Function::NewInstance执行的构造函数写进global的属性，Checkin时也要清掉
+    v8::Global<v8::Function> leaker;
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        v8::Context::Scope context_scope(context);
+        leaker.Reset(isolate, RunScript(isolate, context, "(function Leaker() { globalThis.leakedByNew = 1; })").As<v8::Function>());
+        pool.Checkin(context);
+    }
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        v8::Context::Scope context_scope(context);
+        CHECK(!leaker.Get(isolate)->NewInstance(context).IsEmpty());
+        pool.Checkin(context);
+    }
+    {
+        v8::Local<v8::Context> context = pool.Checkout();
+        v8::Context::Scope context_scope(context);
+        CHECK(StringEquals(isolate, RunScript(isolate, context, "typeof leakedByNew"), "undefined"));
+        pool.Checkin(context);
+    }
+    leaker.Reset();
+    CHECK(pool.IdleCount() == 1);
+}
+
+// FunctionTemplate::GetFunction：同一个context里返回同一个函数和prototype，context销毁后新context里重新创建
+
+static bool InstallTemplateFunction(v8::Local<v8::Context> context, v8::Local<v8::FunctionTemplate> tpl, const char* name) {
+    v8::Isolate* isolate = context->GetIsolate();
+    return context->Global()->Set(context, NewString(isolate, name), tpl->GetFunction(context).ToLocalChecked()).FromJust();
+}
+
+static void TestFunctionTemplateCache(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate);
+    CHECK(InstallTemplateFunction(context, tpl, "first"));
+    CHECK(InstallTemplateFunction(context, tpl, "second"));
+    CHECK(RunScript(isolate, context, "first.tag = 1; first === second && first.prototype.constructor === second")
+          ->BooleanValue(isolate));
+    for (int i = 0; i < 3; i++) {
+        //新context可能复用刚销毁的context的地址，缓存跟着context走，不能拿到旧的函数
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> other = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(other);
+        CHECK(InstallTemplateFunction(other, tpl, "fn"));
+        CHECK(InstallTemplateFunction(other, tpl, "again"));
+        CHECK(StringEquals(isolate, RunScript(isolate, other,
+            "var result = [typeof fn.tag, fn === again, fn.prototype.constructor === fn].join(); fn.tag = 2; result"),
+            "undefined,true,true"));
+    }
+    CollectGarbage(isolate);
+    CHECK(StringEquals(isolate, RunScript(isolate, context, "[first.tag, first === second].join()"), "1,true"));
+}
+
+// internal field：1、2个以及再大一个size class(3个)的field，逐个写入再读回；
+// 每轮之间gc，回收的ObjectUserData回到池里被下一轮复用，不能读到上一轮的指针
+
+static const int kInternalFieldObjects = 200;
+
+static int internal_field_targets[8];
+
+static V8_NOINLINE bool FillInternalFields(v8::Isolate* isolate, v8::Local<v8::Context> context,
+                                           v8::Local<v8::ObjectTemplate> tpl, int count, int round) {
+    v8::HandleScope scope(isolate);
+    bool ok = true;
+    std::vector<v8::Local<v8::Object>> objects;
+    for (int i = 0; i < kInternalFieldObjects; i++) {
+        v8::Local<v8::Object> obj = tpl->NewInstance(context).ToLocalChecked();
+        ok = ok && obj->InternalFieldCount() == count;
+        for (int j = 0; j < count; j++) {
+            ok = ok && obj->GetAlignedPointerFromInternalField(j) == nullptr;
+            obj->SetAlignedPointerInInternalField(j, &internal_field_targets[(i + j + round) % 8]);
+        }
+        objects.push_back(obj);
+    }
+    for (int i = 0; i < kInternalFieldObjects; i++) {
+        for (int j = 0; j < count; j++) {
+            ok = ok && objects[i]->GetAlignedPointerFromInternalField(j) == &internal_field_targets[(i + j + round) % 8];
+        }
+    }
+    return ok;
+}
+
+static void TestInternalFields(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    for (int count = 1; count <= 3; count++) {
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::ObjectTemplate> tpl = v8::ObjectTemplate::New(isolate);
+        tpl->SetInternalFieldCount(count);
+        for (int round = 0; round < 3; round++) {
+            CHECK(FillInternalFields(isolate, context, tpl, count, round));
+            CollectGarbage(isolate);
+        }
+    }
+    CHECK(RunScript(isolate, context, "({})").As<v8::Object>()->InternalFieldCount() == 0);
+}
+
+// PrototypeTemplate上的accessor：通过实例访问时This()是实例，从实例上赋值调setter而不是生成自己的属性
+
+static void GetTagAccessor(v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value>& info) {
+    v8::Isolate* isolate = info.GetIsolate();
+    info.GetReturnValue().Set(info.This()->Get(isolate->GetCurrentContext(), NewString(isolate, "tag")).ToLocalChecked());
+}
+
+static void SetStoredAccessor(v8::Local<v8::Name> name, v8::Local<v8::Value> value, const v8::PropertyCallbackInfo<void>& info) {
+    v8::Isolate* isolate = info.GetIsolate();
+    info.This()->Set(isolate->GetCurrentContext(), NewString(isolate, "stored"), value).Check();
+}
+
+static void GetSizeProperty(const v8::FunctionCallbackInfo<v8::Value>& info) {
+    v8::Isolate* isolate = info.GetIsolate();
+    info.GetReturnValue().Set(info.This()->Get(isolate->GetCurrentContext(), NewString(isolate, "tag")).ToLocalChecked());
+}
+
+static void SetSizeProperty(const v8::FunctionCallbackInfo<v8::Value>& info) {
+    v8::Isolate* isolate = info.GetIsolate();
+    info.This()->Set(isolate->GetCurrentContext(), NewString(isolate, "sized"), info[0]).Check();
+}
+
+static void TestPrototypeAccessors(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate);
+    v8::Local<v8::ObjectTemplate> proto = tpl->PrototypeTemplate();
+    proto->SetAccessor(NewString(isolate, "name"), GetTagAccessor, SetStoredAccessor);
+    proto->SetAccessorProperty(NewString(isolate, "size"), v8::FunctionTemplate::New(isolate, GetSizeProperty),
+                               v8::FunctionTemplate::New(isolate, SetSizeProperty));
+    proto->SetAccessorProperty(NewString(isolate, "readonly"), v8::FunctionTemplate::New(isolate, GetSizeProperty));
+    CHECK(InstallTemplateFunction(context, tpl, "Native"));
+    CHECK(StringEquals(isolate, RunScript(isolate, context,
+        "var a = new Native(), b = new Native(); a.tag = 'a'; b.tag = 'b';"
+        "[a.name, b.name, a.size, b.readonly].join()"), "a,b,a,b"));
+    CHECK(StringEquals(isolate, RunScript(isolate, context,
+        "a.name = 1; b.size = 2; b.readonly = 3;"
+        "[a.stored, b.sized, a.hasOwnProperty('name'), b.hasOwnProperty('size'), b.hasOwnProperty('readonly'),"
+        " 'stored' in Native.prototype, b.readonly].join()"), "1,2,false,false,false,false,b"));
+    //子类的实例沿原型链用到父类prototype上的accessor
+    v8::Local<v8::FunctionTemplate> derived = v8::FunctionTemplate::New(isolate);
+    derived->Inherit(tpl);
+    CHECK(InstallTemplateFunction(context, derived, "Derived"));
+    CHECK(StringEquals(isolate, RunScript(isolate, context,
+        "var d = new Derived(); d.tag = 'd'; d.size = 4; [d.name, d.sized, d instanceof Native].join()"), "d,4,true"));
+}
+
+// ObjectTemplate::New传入的constructor：实例以它的prototype为原型，prototype统计里算一份
+
+static void TestObjectTemplateConstructor(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate);
+    tpl->PrototypeTemplate()->Set(NewString(isolate, "method"), v8::FunctionTemplate::New(isolate));
+    v8::Local<v8::ObjectTemplate> instance_tpl = v8::ObjectTemplate::New(isolate, tpl);
+    v8::Local<v8::Context> context = v8::Context::New(isolate);
+    v8::Context::Scope context_scope(context);
+    CHECK(InstallTemplateFunction(context, tpl, "Native"));
+    v8::Local<v8::Object> instance = instance_tpl->NewInstance(context).ToLocalChecked();
+    CHECK(context->Global()->Set(context, NewString(isolate, "instance"), instance).FromJust());
+    CHECK(RunScript(isolate, context, "instance instanceof Native && typeof instance.method === 'function'")
+          ->BooleanValue(isolate));
+    v8::PrototypeStatistics stats;
+    context->GetPrototypeStatistics(&stats);
+    CHECK(stats.prototypes() == 1);
+    CHECK(stats.methods() == 1);
+    CHECK(stats.estimated_memory_bytes() > 0);
+}
+
+// Inherit：子类实例带上父类实例template的internal field和accessor，父类prototype上的native方法可以直接读子类实例的field
+
+static int inherit_marker = 0;
+
+static void ConstructLeaf(const v8::FunctionCallbackInfo<v8::Value>& info) {
+    //子类自己没有设置internal field数，用的是父类的
+    info.This()->SetAlignedPointerInInternalField(1, &inherit_marker);
+}
+
+static void ReadBaseField(const v8::FunctionCallbackInfo<v8::Value>& info) {
+    v8::Local<v8::Object> self = info.This();
+    info.GetReturnValue().Set(self->InternalFieldCount() == 2 && self->GetAlignedPointerFromInternalField(1) == &inherit_marker);
+}
+
+static void GetBaseKind(v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value>& info) {
+    info.GetReturnValue().Set(NewString(info.GetIsolate(), "base"));
+}
+
+static void TestInheritInstanceTemplate(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::FunctionTemplate> base = v8::FunctionTemplate::New(isolate);
+    base->InstanceTemplate()->SetInternalFieldCount(2);
+    base->InstanceTemplate()->SetAccessor(NewString(isolate, "kind"), GetBaseKind);
+    base->PrototypeTemplate()->Set(NewString(isolate, "read"), v8::FunctionTemplate::New(isolate, ReadBaseField));
+    //中间一层没有自己的实例template
+    v8::Local<v8::FunctionTemplate> middle = v8::FunctionTemplate::New(isolate);
+    middle->Inherit(base);
+    v8::Local<v8::FunctionTemplate> leaf = v8::FunctionTemplate::New(isolate, ConstructLeaf);
+    leaf->Inherit(middle);
+    leaf->InstanceTemplate()->SetInternalFieldCount(1);
+    CHECK(InstallTemplateFunction(context, base, "Base"));
+    CHECK(InstallTemplateFunction(context, middle, "Middle"));
+    CHECK(InstallTemplateFunction(context, leaf, "Leaf"));
+    CHECK(StringEquals(isolate, RunScript(isolate, context,
+        "var leaf = new Leaf(); [leaf.read(), leaf.kind, leaf instanceof Base, new Middle().kind].join()"),
+        "true,base,true,base"));
+}
+
+struct Test {
+    const char* name_;
+    void (*func_)(v8::Isolate* isolate, v8::Local<v8::Context> context);
+};
+
+static const Test kTests[] = {
+    {"handle-scope-gc-stress", TestHandleScopeGCStress},
+    {"handle-scope-nested-gc", TestNestedHandleScopeGC},
+    {"weak-callbacks", TestWeakCallbacks},
+    {"weak-reset-after-finalize", TestWeakResetAfterFinalize},
+    {"weak-pending-at-dispose", TestWeakPendingAtDispose},
+    {"string-embedded-nul", TestStringEmbeddedNul},
+    {"intern-table-limit", TestInternTableLimit},
+    {"script-compile-run", TestScriptCompileRun},
+    {"code-cache", TestCodeCache},
+    {"utf8-transcode", TestUtf8Transcode},
+    {"external-strings", TestExternalStrings},
+    {"streaming-compile", TestStreamingCompile},
+    {"module-bindings", TestModuleBindings},
+    {"snapshot-restore", TestSnapshotRestore},
+    {"context-pool", TestContextPool},
+    {"function-template-cache", TestFunctionTemplateCache},
+    {"internal-fields", TestInternalFields},
+    {"prototype-accessors", TestPrototypeAccessors},
+    {"object-template-constructor", TestObjectTemplateConstructor},
+    {"inherit-instance-template", TestInheritInstanceTemplate},
+};
+
+static bool Selected(const char* name, int argc, char* argv[]) {
+    if (argc < 2) {
+        return true;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    for (size_t i = 0; i < sizeof(kTests) / sizeof(kTests[0]); i++) {
+        if (!Selected(kTests[i].name_, argc, argv)) {
+            continue;
+        }
+        //每个测试一个新的isolate，互不影响
+        int before = failures;
+        v8::Isolate* isolate = v8::Isolate::New(create_params);
+        {
+            v8::Isolate::Scope isolate_scope(isolate);
+            v8::HandleScope handle_scope(isolate);
+            v8::Local<v8::Context> context = v8::Context::New(isolate);
+            v8::Context::Scope context_scope(context);
+            kTests[i].func_(isolate, context);
+        }
+        isolate->Dispose();
+        printf("%-40s %s\n", kTests[i].name_, failures == before ? "ok" : "FAILED");
+    }
+    delete create_params.array_buffer_allocator;
+    return failures == 0 ? 0 : 1;
+}
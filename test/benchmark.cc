@@ -0,0 +1,775 @@
+// jsc后端的微基准测试
+//
+// 用法：benchmark [name ...]
+// 不带参数时运行全部基准，否则只运行名字以参数开头的基准。结果是每秒操作数
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "libplatform/libplatform.h"
+#include "v8.h"
+
+class Timer {
+public:
+    Timer() : start_(std::chrono::steady_clock::now()) {}
+
+    double Elapsed() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+static void Report(const char* name, size_t ops, double seconds) {
+    printf("%-48s %12.0f ops/s %10.3f ms\n", name, seconds > 0 ? ops / seconds : 0.0, seconds * 1000);
+}
+
+// 1. HandleScope里的Local分配
+
+static const int kHandleRounds = 20000;
+static const int kHandlesPerScope = 256;
+
+static void BenchHandleAlloc(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    {
+        //立即数不需要根，只测块内bump pointer和scope回退
+        Timer timer;
+        for (int round = 0; round < kHandleRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kHandlesPerScope; i++) {
+                v8::Number::New(isolate, i);
+            }
+        }
+        Report("handle-alloc immediate", (size_t)kHandleRounds * kHandlesPerScope, timer.Elapsed());
+    }
+    {
+        //堆上的值要挂到块的根数组上
+        v8::Local<v8::String> str = v8::String::NewFromUtf8(isolate, "value").ToLocalChecked();
+        Timer timer;
+        for (int round = 0; round < kHandleRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kHandlesPerScope; i++) {
+                str.Clone(isolate);
+            }
+        }
+        Report("handle-alloc heap value", (size_t)kHandleRounds * kHandlesPerScope, timer.Elapsed());
+    }
+    {
+        //改动前的分配方式：每个新槽位单独new，通过指针数组间接访问
+        std::vector<JSValueRef*> values;
+        int alloc_pos = 0;
+        JSValueRef undefined = JSValueMakeUndefined(context->context_);
+        Timer timer;
+        for (int round = 0; round < kHandleRounds; round++) {
+            int prev_pos = alloc_pos;
+            for (int i = 0; i < kHandlesPerScope; i++) {
+                if (alloc_pos == (int)values.size()) {
+                    values.push_back(new JSValueRef());
+                }
+                *values[alloc_pos++] = undefined;
+            }
+            alloc_pos = prev_pos;
+        }
+        Report("handle-alloc per-slot heap node (before)", (size_t)kHandleRounds * kHandlesPerScope, timer.Elapsed());
+        for (size_t i = 0; i < values.size(); i++) {
+            delete values[i];
+        }
+    }
+}
+
+// 3. Global句柄的创建和Reset
+
+static const int kGlobalRounds = 200;
+static const int kGlobalsPerRound = 10000;
+
+static void BenchGlobalHandle(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::Object> obj = v8::Object::New(isolate);
+    std::vector<v8::Global<v8::Object>> globals(kGlobalsPerRound);
+    Timer timer;
+    for (int round = 0; round < kGlobalRounds; round++) {
+        for (int i = 0; i < kGlobalsPerRound; i++) {
+            globals[i].Reset(isolate, obj);
+        }
+        for (int i = 0; i < kGlobalsPerRound; i++) {
+            globals[i].Reset();
+        }
+    }
+    Report("global-handle create+reset", (size_t)kGlobalRounds * kGlobalsPerRound, timer.Elapsed());
+
+    v8::GlobalHandleStatistics stats;
+    isolate->GetGlobalHandleStatistics(&stats);
+    printf("    slots %zu, used %zu, created %zu, disposed %zu\n", stats.total_slots(), stats.used_slots(),
+           stats.created_count(), stats.disposed_count());
+}
+
+// 5. 原始值的创建
+
+static const int kPrimitiveRounds = 20000;
+static const int kPrimitivesPerScope = 256;
+
+static void BenchPrimitiveNew(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    const size_t ops = (size_t)kPrimitiveRounds * kPrimitivesPerScope;
+    {
+        Timer timer;
+        for (int round = 0; round < kPrimitiveRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kPrimitivesPerScope; i++) {
+                v8::Number::New(isolate, i + 0.5);
+            }
+        }
+        Report("primitive Number::New", ops, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int round = 0; round < kPrimitiveRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kPrimitivesPerScope; i++) {
+                v8::Integer::New(isolate, i);
+            }
+        }
+        Report("primitive Integer::New", ops, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int round = 0; round < kPrimitiveRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kPrimitivesPerScope; i++) {
+                v8::Boolean::New(isolate, (i & 1) != 0);
+            }
+        }
+        Report("primitive Boolean::New", ops, timer.Elapsed());
+    }
+    {
+        //改动前的取context方式：每次拷贝一个Local<Context>
+        Timer timer;
+        for (int round = 0; round < kPrimitiveRounds; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kPrimitivesPerScope; i++) {
+                isolate->Alloc<v8::Number>(JSValueMakeNumber(isolate->GetCurrentContext()->context_, i + 0.5));
+            }
+        }
+        Report("primitive via GetCurrentContext (before)", ops, timer.Elapsed());
+    }
+}
+
+// 9. utf16 -> utf8转换
+
+static const int kTranscodeRounds = 200;
+static const size_t kCorpusBytes = 64 * 1024;
+
+static std::string MakeCorpus(const char* unit) {
+    std::string ret;
+    while (ret.size() < kCorpusBytes) {
+        ret += unit;
+    }
+    return ret;
+}
+
+static void BenchTranscodeCorpus(v8::Isolate* isolate, v8::Local<v8::Context> context, const char* name, const std::string& corpus) {
+    v8::Local<v8::String> str =
+        v8::String::NewFromUtf8(isolate, corpus.data(), v8::NewStringType::kNormal, (int)corpus.size()).ToLocalChecked();
+    char label[64];
+    {
+        Timer timer;
+        for (int round = 0; round < kTranscodeRounds; round++) {
+            v8::String::Utf8Value utf8(isolate, str);
+        }
+        double seconds = timer.Elapsed();
+        snprintf(label, sizeof(label), "transcode %s Utf8Value", name);
+        Report(label, kTranscodeRounds, seconds);
+        printf("    %.1f MB/s\n", seconds > 0 ? corpus.size() * (double)kTranscodeRounds / seconds / (1024 * 1024) : 0.0);
+    }
+    {
+        std::vector<char> buffer(corpus.size() + 1);
+        Timer timer;
+        for (int round = 0; round < kTranscodeRounds; round++) {
+            str->WriteUtf8(isolate, buffer.data());
+        }
+        double seconds = timer.Elapsed();
+        snprintf(label, sizeof(label), "transcode %s WriteUtf8", name);
+        Report(label, kTranscodeRounds, seconds);
+        printf("    %.1f MB/s\n", seconds > 0 ? corpus.size() * (double)kTranscodeRounds / seconds / (1024 * 1024) : 0.0);
+    }
+    {
+        //改动前的转换方式：按最大长度分配，交给jsc转换
+        Timer timer;
+        for (int round = 0; round < kTranscodeRounds; round++) {
+            JSStringRef stringRef = JSValueToStringCopy(context->context_, str->value_, nullptr);
+            size_t size = JSStringGetMaximumUTF8CStringSize(stringRef);
+            char* buffer = new char[size];
+            JSStringGetUTF8CString(stringRef, buffer, size);
+            std::string copy(buffer);
+            delete[] buffer;
+            JSStringRelease(stringRef);
+        }
+        double seconds = timer.Elapsed();
+        snprintf(label, sizeof(label), "transcode %s jsc (before)", name);
+        Report(label, kTranscodeRounds, seconds);
+        printf("    %.1f MB/s\n", seconds > 0 ? corpus.size() * (double)kTranscodeRounds / seconds / (1024 * 1024) : 0.0);
+    }
+}
+
+static void BenchTranscode(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    BenchTranscodeCorpus(isolate, context, "ascii", MakeCorpus("The quick brown fox jumps over the lazy dog. "));
+    BenchTranscodeCorpus(isolate, context, "latin1", MakeCorpus("Français naïve café à la crème brûlée. "));
+    BenchTranscodeCorpus(isolate, context, "cjk", MakeCorpus("你好世界，こんにちは。"));
+}
+
+// 11. 编译好的脚本重复Run
+
+static const int kScriptRuns = 20000;
+
+static const char kRunSource[] =
+    "(function() { var sum = 0; for (var i = 0; i < 16; i++) { sum += i * i; } return sum; })()";
+
+static void BenchScriptRun(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::String> source = v8::String::NewFromUtf8(isolate, kRunSource).ToLocalChecked();
+    v8::ScriptOrigin origin(v8::String::NewFromUtf8(isolate, "bench.js").ToLocalChecked());
+    {
+        v8::Local<v8::Script> script = v8::Script::Compile(context, source, &origin).ToLocalChecked();
+        Timer timer;
+        for (int i = 0; i < kScriptRuns; i++) {
+            v8::HandleScope scope(isolate);
+            script->Run(context).ToLocalChecked();
+        }
+        Report("script-run prepared", kScriptRuns, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int i = 0; i < kScriptRuns; i++) {
+            v8::HandleScope scope(isolate);
+            v8::Script::Compile(context, source, &origin).ToLocalChecked()->Run(context).ToLocalChecked();
+        }
+        Report("script-run compile+run", kScriptRuns, timer.Elapsed());
+    }
+    {
+        //改动前的Run：每次把源码和文件名转回utf8再交给JSEvaluateScript
+        Timer timer;
+        for (int i = 0; i < kScriptRuns; i++) {
+            v8::String::Utf8Value source_utf8(isolate, source);
+            v8::String::Utf8Value name_utf8(isolate, origin.ResourceName());
+            JSStringRef source_ref = JSStringCreateWithUTF8CString(*source_utf8);
+            JSStringRef name_ref = JSStringCreateWithUTF8CString(*name_utf8);
+            JSEvaluateScript(context->context_, source_ref, nullptr, name_ref, 1, nullptr);
+            JSStringRelease(source_ref);
+            JSStringRelease(name_ref);
+        }
+        Report("script-run utf8 + JSEvaluateScript (before)", kScriptRuns, timer.Elapsed());
+    }
+}
+
+// 12. 启动时编译执行大bundle：冷启动、带CachedData的热启动、同一个isolate里的重复编译
+
+static const int kBundleFunctions = 20000;
+
+static std::string MakeBundle() {
+    std::string ret = "var bundle = {};\n";
+    for (int i = 0; i < kBundleFunctions; i++) {
+        std::string n = std::to_string(i);
+        ret += "bundle.f" + n + " = function(a, b) { var s = '" + n + "'; return a + b * " + n + " + s.length; };\n";
+    }
+    ret += "bundle.f0(1, 2);\n";
+    return ret;
+}
+
+static double CompileAndRunBundle(v8::Isolate* isolate, const std::string& bundle,
+                                  v8::ScriptCompiler::CompileOptions options, std::vector<uint8_t>* cache) {
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Context> context = v8::Context::New(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::String> source =
+        v8::String::NewFromUtf8(isolate, bundle.data(), v8::NewStringType::kNormal, (int)bundle.size()).ToLocalChecked();
+    v8::ScriptOrigin origin(v8::String::NewFromUtf8(isolate, "bundle.js").ToLocalChecked());
+    v8::ScriptCompiler::CachedData* cached_data = nullptr;
+    if (options == v8::ScriptCompiler::kConsumeCodeCache) {
+        cached_data = new v8::ScriptCompiler::CachedData(cache->data(), (int)cache->size());
+    }
+    v8::ScriptCompiler::Source script_source(source, origin, cached_data);
+    Timer timer;
+    v8::Local<v8::Script> script = v8::ScriptCompiler::Compile(context, &script_source, options).ToLocalChecked();
+    script->Run(context).ToLocalChecked();
+    double seconds = timer.Elapsed();
+    if (options == v8::ScriptCompiler::kProduceCodeCache) {
+        const v8::ScriptCompiler::CachedData* produced = script_source.GetCachedData();
+        cache->assign(produced->data, produced->data + produced->length);
+    }
+    return seconds;
+}
+
+static void BenchStartup(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    std::string bundle = MakeBundle();
+    std::vector<uint8_t> cache;
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    {
+        v8::Isolate* isolate = v8::Isolate::New(create_params);
+        {
+            v8::Isolate::Scope isolate_scope(isolate);
+            Report("startup cold (produce cache)", 1,
+                   CompileAndRunBundle(isolate, bundle, v8::ScriptCompiler::kProduceCodeCache, &cache));
+            //同一个isolate的新context，复用编译好的脚本
+            Report("startup warm (same isolate, new context)", 1,
+                   CompileAndRunBundle(isolate, bundle, v8::ScriptCompiler::kNoCompileOptions, &cache));
+        }
+        isolate->Dispose();
+    }
+    {
+        //模拟进程重启：新的isolate，只有上次产生的CachedData
+        v8::Isolate* isolate = v8::Isolate::New(create_params);
+        {
+            v8::Isolate::Scope isolate_scope(isolate);
+            Report("startup warm (consume cache)", 1,
+                   CompileAndRunBundle(isolate, bundle, v8::ScriptCompiler::kConsumeCodeCache, &cache));
+        }
+        isolate->Dispose();
+    }
+    printf("    bundle %zu bytes\n", bundle.size());
+    delete create_params.array_buffer_allocator;
+}
+
+// 16. 加载2000个module的依赖图：串行从磁盘加载、预取之后加载、同一个isolate里的新context
+
+static const int kGraphModules = 2000;
+
+//m0.js是入口，mi.js依赖m(2i+1).js和m(2i+2).js，每个文件带一些函数让解析有实际的工作量
+static std::string WriteModuleGraph() {
+    char dir[] = "/tmp/v8-bench-modules-XXXXXX";
+    if (!mkdtemp(dir)) {
+        return std::string();
+    }
+    for (int i = 0; i < kGraphModules; i++) {
+        std::string source;
+        std::string sum = std::to_string(i);
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < kGraphModules; child++) {
+            std::string name = "v" + std::to_string(child);
+            source += "import { value as " + name + " } from './m" + std::to_string(child) + ".js';\n";
+            sum += " + " + name;
+        }
+        for (int j = 0; j < 10; j++) {
+            source += "function f" + std::to_string(j) + "(a, b) { return a * " + std::to_string(j) + " + b; }\n";
+        }
+        source += "export const value = " + sum + ";\n";
+        std::string path = std::string(dir) + "/m" + std::to_string(i) + ".js";
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file) {
+            return std::string();
+        }
+        fwrite(source.data(), 1, source.size(), file);
+        fclose(file);
+    }
+    return dir;
+}
+
+static void RemoveModuleGraph(const std::string& dir) {
+    for (int i = 0; i < kGraphModules; i++) {
+        remove((dir + "/m" + std::to_string(i) + ".js").c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+static double LoadModuleGraph(v8::Isolate* isolate, const std::string& entry, bool prefetch) {
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = v8::Context::New(isolate);
+    v8::Context::Scope context_scope(context);
+    Timer timer;
+    if (prefetch) {
+        v8::ScriptCompiler::PrefetchModuleGraph(isolate, entry.c_str());
+    }
+    v8::Local<v8::Module> module = v8::ScriptCompiler::CompileModuleFromDisk(isolate, entry.c_str()).ToLocalChecked();
+    module->InstantiateModule(context, v8::ScriptCompiler::ResolveModuleFromDisk).Check();
+    module->Evaluate(context).ToLocalChecked();
+    return timer.Elapsed();
+}
+
+static void BenchModuleGraph(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    std::string dir = WriteModuleGraph();
+    if (dir.empty()) {
+        printf("module-graph: can not write modules\n");
+        return;
+    }
+    std::string entry = dir + "/m0.js";
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    for (int prefetch = 0; prefetch < 2; prefetch++) {
+        v8::Isolate* isolate = v8::Isolate::New(create_params);
+        {
+            v8::Isolate::Scope isolate_scope(isolate);
+            Report(prefetch ? "module-graph cold (prefetch)" : "module-graph cold (serial)", kGraphModules,
+                   LoadModuleGraph(isolate, entry, prefetch != 0));
+            if (prefetch) {
+                //编译好的module在isolate里复用，新context只需要实例化和求值
+                Report("module-graph new context", kGraphModules, LoadModuleGraph(isolate, entry, false));
+            }
+        }
+        isolate->Dispose();
+    }
+    delete create_params.array_buffer_allocator;
+    RemoveModuleGraph(dir);
+}
+
+// 17. 首帧时间：新isolate + 新context执行完启动脚本并画出第一帧，有启动快照时生成数据的脚本不再执行
+
+static const int kFirstFrameRounds = 20;
+
+//生成数据的启动脚本：计算量大，结果是纯数据
+static const char kBootstrapDataSource[] =
+    "var glyphs = {};\n"
+    "for (var c = 0; c < 256; c++) {\n"
+    "    var w = 0;\n"
+    "    for (var i = 0; i < 4000; i++) { w = (w * 31 + c * i) % 65521; }\n"
+    "    glyphs['g' + c] = w;\n"
+    "}\n";
+
+//需要重放的启动脚本：函数
+static const char kBootstrapCodeSource[] =
+    "function renderFrame() { var s = 0; for (var k in glyphs) s += glyphs[k]; return s; }\n";
+
+static void RunSource(v8::Isolate* isolate, v8::Local<v8::Context> context, const char* source) {
+    v8::Local<v8::String> code = v8::String::NewFromUtf8(isolate, source).ToLocalChecked();
+    v8::Script::Compile(context, code).ToLocalChecked()->Run(context).ToLocalChecked();
+}
+
+static double FirstFrame(v8::Isolate::CreateParams& create_params, bool bootstrap) {
+    Timer timer;
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+        if (bootstrap) {
+            RunSource(isolate, context, kBootstrapDataSource);
+            RunSource(isolate, context, kBootstrapCodeSource);
+        }
+        RunSource(isolate, context, "renderFrame()");
+    }
+    isolate->Dispose();
+    return timer.Elapsed();
+}
+
+static void BenchFirstFrame(v8::Isolate* main_isolate, v8::Local<v8::Context> main_context) {
+    v8::StartupData blob;
+    {
+        v8::SnapshotCreator creator;
+        v8::Isolate* isolate = creator.GetIsolate();
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+        creator.RunScript(context, v8::String::NewFromUtf8(isolate, kBootstrapDataSource).ToLocalChecked(), nullptr, false).ToLocalChecked();
+        creator.RunScript(context, v8::String::NewFromUtf8(isolate, kBootstrapCodeSource).ToLocalChecked()).ToLocalChecked();
+        creator.SetDefaultContext(context);
+        blob = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kClear);
+    }
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    double elapsed = 0;
+    for (int i = 0; i < kFirstFrameRounds; i++) {
+        elapsed += FirstFrame(create_params, true);
+    }
+    Report("first-frame bootstrap", kFirstFrameRounds, elapsed);
+    create_params.snapshot_blob = &blob;
+    elapsed = 0;
+    for (int i = 0; i < kFirstFrameRounds; i++) {
+        elapsed += FirstFrame(create_params, false);
+    }
+    Report("first-frame snapshot", kFirstFrameRounds, elapsed);
+    printf("    blob %d bytes\n", blob.raw_size);
+    delete[] blob.data;
+    delete create_params.array_buffer_allocator;
+}
+
+// 18. 每个请求一个干净的context：ContextPool和Context::New加安装绑定
+
+static const int kPoolRequests = 2000;
+static const int kPoolBindings = 200;
+
+static void InstallBindings(v8::Local<v8::Context> context, void* data) {
+    v8::Isolate* isolate = context->GetIsolate();
+    v8::Local<v8::Object> global = context->Global();
+    for (int i = 0; i < kPoolBindings; i++) {
+        std::string name = "binding" + std::to_string(i);
+        v8::Local<v8::Object> binding = v8::Object::New(isolate);
+        binding->Set(context, v8::String::NewFromUtf8(isolate, "id").ToLocalChecked(), v8::Integer::New(isolate, i)).Check();
+        global->Set(context, v8::String::NewFromUtf8(isolate, name.c_str()).ToLocalChecked(), binding).Check();
+    }
+}
+
+static const char kRequestSource[] = "var response = binding0.id + binding199.id; globalThis.session = {}; response";
+
+static void BenchContextPool(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    v8::Local<v8::String> source = v8::String::NewFromUtf8(isolate, kRequestSource).ToLocalChecked();
+    {
+        Timer timer;
+        for (int i = 0; i < kPoolRequests; i++) {
+            v8::HandleScope scope(isolate);
+            v8::Local<v8::Context> context = v8::Context::New(isolate);
+            v8::Context::Scope context_scope(context);
+            InstallBindings(context, nullptr);
+            v8::Script::Compile(context, source).ToLocalChecked()->Run(context).ToLocalChecked();
+        }
+        Report("context-pool Context::New + bindings", kPoolRequests, timer.Elapsed());
+    }
+    {
+        v8::ContextPool pool(isolate, 4, InstallBindings);
+        Timer timer;
+        for (int i = 0; i < kPoolRequests; i++) {
+            v8::HandleScope scope(isolate);
+            v8::Local<v8::Context> context = pool.Checkout();
+            {
+                v8::Context::Scope context_scope(context);
+                v8::Script::Compile(context, source).ToLocalChecked()->Run(context).ToLocalChecked();
+            }
+            pool.Checkin(context);
+        }
+        Report("context-pool checkout + checkin", kPoolRequests, timer.Elapsed());
+    }
+}
+
+// 20. 新建context并安装native函数：逐个Object::Set和global ObjectTemplate
+
+static const int kTemplateContexts = 500;
+static const int kGlobalFunctions = 400;
+
+static void NoopCallback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+}
+
+static void BenchGlobalTemplate(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    std::vector<v8::Local<v8::String>> names;
+    std::vector<v8::Local<v8::FunctionTemplate>> functions;
+    v8::Local<v8::ObjectTemplate> global_template = v8::ObjectTemplate::New(isolate);
+    for (int i = 0; i < kGlobalFunctions; i++) {
+        std::string name = "native" + std::to_string(i);
+        names.push_back(v8::String::NewFromUtf8(isolate, name.c_str()).ToLocalChecked());
+        functions.push_back(v8::FunctionTemplate::New(isolate, NoopCallback));
+        global_template->Set(names.back(), functions.back());
+    }
+    v8::Local<v8::String> source = v8::String::NewFromUtf8(isolate, "native0(); native399()").ToLocalChecked();
+    {
+        //改动前：每个context逐个Set
+        Timer timer;
+        for (int i = 0; i < kTemplateContexts; i++) {
+            v8::HandleScope scope(isolate);
+            v8::Local<v8::Context> context = v8::Context::New(isolate);
+            v8::Context::Scope context_scope(context);
+            v8::Local<v8::Object> global = context->Global();
+            for (int j = 0; j < kGlobalFunctions; j++) {
+                global->Set(context, names[j], functions[j]->GetFunction(context).ToLocalChecked()).Check();
+            }
+            v8::Script::Compile(context, source).ToLocalChecked()->Run(context).ToLocalChecked();
+        }
+        Report("global-template Object::Set (before)", kTemplateContexts, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int i = 0; i < kTemplateContexts; i++) {
+            v8::HandleScope scope(isolate);
+            v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, global_template);
+            v8::Context::Scope context_scope(context);
+            v8::Script::Compile(context, source).ToLocalChecked()->Run(context).ToLocalChecked();
+        }
+        Report("global-template ObjectTemplate", kTemplateContexts, timer.Elapsed());
+    }
+}
+
+// 21. js调用native函数：0、1、4、8个参数，和同样参数的js函数对比
+
+static const int kNativeCalls = 1000000;
+
+static void CountArgs(const v8::FunctionCallbackInfo<v8::Value>& info) {
+    info.GetReturnValue().Set(info.Length());
+}
+
+static void BenchNativeCall(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::ObjectTemplate> global_template = v8::ObjectTemplate::New(isolate);
+    global_template->Set(v8::String::NewFromUtf8(isolate, "native").ToLocalChecked(), v8::FunctionTemplate::New(isolate, CountArgs));
+    v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, global_template);
+    v8::Context::Scope context_scope(context);
+    static const char* const kArgs[] = {"", "1", "1, 2, 3, 4", "1, 2, 3, 4, 5, 6, 7, 8"};
+    static const int kArgCounts[] = {0, 1, 4, 8};
+    for (int i = 0; i < 4; i++) {
+        for (int js = 0; js < 2; js++) {
+            std::string source = std::string(js ? "var f = function () { return arguments.length; };" : "var f = native;")
+                + "for (var i = 0; i < " + std::to_string(kNativeCalls) + "; i++) f(" + kArgs[i] + ");";
+            v8::Local<v8::Script> script =
+                v8::Script::Compile(context, v8::String::NewFromUtf8(isolate, source.c_str()).ToLocalChecked()).ToLocalChecked();
+            Timer timer;
+            script->Run(context).ToLocalChecked();
+            std::string name = std::string("native-call ") + (js ? "js " : "native ") + std::to_string(kArgCounts[i]) + " args";
+            Report(name.c_str(), kNativeCalls, timer.Elapsed());
+        }
+    }
+}
+
+// 23. native对象包装：ObjectTemplate::NewInstance带internal field，和普通对象加属性对比；internal field读写
+
+static const int kWrapperScopes = 1000;
+static const int kWrappersPerScope = 200;
+static const int kFieldReads = 10000000;
+
+static void BenchWrapper(v8::Isolate* isolate, v8::Local<v8::Context> context) {
+    v8::Local<v8::ObjectTemplate> tpl = v8::ObjectTemplate::New(isolate);
+    tpl->SetInternalFieldCount(2);
+    static int native_objects[kWrappersPerScope];
+    v8::Local<v8::String> key = v8::String::NewFromUtf8(isolate, "native").ToLocalChecked();
+    {
+        //改动前的做法：普通对象，native指针放在External属性里
+        Timer timer;
+        for (int round = 0; round < kWrapperScopes; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kWrappersPerScope; i++) {
+                v8::Local<v8::Object> obj = v8::Object::New(isolate);
+                obj->Set(context, key, v8::External::New(isolate, &native_objects[i])).Check();
+            }
+        }
+        Report("wrapper Object::New + External", (size_t)kWrapperScopes * kWrappersPerScope, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int round = 0; round < kWrapperScopes; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kWrappersPerScope; i++) {
+                v8::Local<v8::Object> obj = tpl->NewInstance(context).ToLocalChecked();
+                obj->SetAlignedPointerInInternalField(0, &native_objects[i]);
+            }
+        }
+        Report("wrapper ObjectTemplate::NewInstance", (size_t)kWrapperScopes * kWrappersPerScope, timer.Elapsed());
+    }
+    v8::Local<v8::Object> plain = v8::Object::New(isolate);
+    plain->Set(context, key, v8::External::New(isolate, &native_objects[0])).Check();
+    v8::Local<v8::Object> wrapper = tpl->NewInstance(context).ToLocalChecked();
+    wrapper->SetAlignedPointerInInternalField(0, &native_objects[0]);
+    {
+        Timer timer;
+        size_t found = 0;
+        for (int round = 0; round < kFieldReads / kWrappersPerScope; round++) {
+            v8::HandleScope scope(isolate);
+            for (int i = 0; i < kWrappersPerScope; i++) {
+                found += plain->Get(context, key).ToLocalChecked().As<v8::External>()->Value() == &native_objects[0];
+            }
+        }
+        Report("wrapper read External property", found, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        size_t found = 0;
+        for (int i = 0; i < kFieldReads; i++) {
+            found += wrapper->GetAlignedPointerFromInternalField(0) == &native_objects[0];
+        }
+        Report("wrapper GetAlignedPointerFromInternalField", found, timer.Elapsed());
+    }
+    {
+        Timer timer;
+        for (int i = 0; i < kFieldReads; i++) {
+            wrapper->SetAlignedPointerInInternalField(1, &native_objects[i % kWrappersPerScope]);
+        }
+        Report("wrapper SetAlignedPointerInInternalField", kFieldReads, timer.Elapsed());
+    }
+}
+
+// 24. accessor的get/set：实例class静态表里的accessor、prototype上的accessor，和js的数据属性、getter/setter对比
+
+static const int kAccessorOps = 2000000;
+
+static void GetCountAccessor(v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value>& info) {
+    info.GetReturnValue().Set(1);
+}
+
+static void SetCountAccessor(v8::Local<v8::Name> name, v8::Local<v8::Value> value, const v8::PropertyCallbackInfo<void>& info) {
+}
+
+static void BenchAccessor(v8::Isolate* isolate, v8::Local<v8::Context> main_context) {
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::String> name = v8::String::NewFromUtf8(isolate, "count").ToLocalChecked();
+    v8::Local<v8::FunctionTemplate> instance_tpl = v8::FunctionTemplate::New(isolate);
+    instance_tpl->InstanceTemplate()->SetAccessor(name, GetCountAccessor, SetCountAccessor);
+    v8::Local<v8::FunctionTemplate> proto_tpl = v8::FunctionTemplate::New(isolate);
+    proto_tpl->PrototypeTemplate()->SetAccessor(name, GetCountAccessor, SetCountAccessor);
+    v8::Local<v8::Context> context = v8::Context::New(isolate);
+    v8::Context::Scope context_scope(context);
+    v8::Local<v8::Object> global = context->Global();
+    global->Set(context, v8::String::NewFromUtf8(isolate, "InstanceAccessor").ToLocalChecked(),
+                instance_tpl->GetFunction(context).ToLocalChecked()).Check();
+    global->Set(context, v8::String::NewFromUtf8(isolate, "ProtoAccessor").ToLocalChecked(),
+                proto_tpl->GetFunction(context).ToLocalChecked()).Check();
+    static const char* const kNames[] = {"instance", "prototype", "js data", "js getter"};
+    static const char* const kObjects[] = {
+        "new InstanceAccessor()",
+        "new ProtoAccessor()",
+        "{count: 1}",
+        "Object.create({get count() { return 1; }, set count(v) {}})",
+    };
+    for (int i = 0; i < 4; i++) {
+        for (int set = 0; set < 2; set++) {
+            std::string source = std::string("var o = ") + kObjects[i] + ", n = 0;"
+                + "for (var i = 0; i < " + std::to_string(kAccessorOps) + "; i++) " + (set ? "o.count = i;" : "n += o.count;");
+            v8::Local<v8::Script> script =
+                v8::Script::Compile(context, v8::String::NewFromUtf8(isolate, source.c_str()).ToLocalChecked()).ToLocalChecked();
+            Timer timer;
+            script->Run(context).ToLocalChecked();
+            std::string label = std::string("accessor ") + kNames[i] + (set ? " set" : " get");
+            Report(label.c_str(), kAccessorOps, timer.Elapsed());
+        }
+    }
+}
+
+struct Benchmark {
+    const char* name_;
+    void (*func_)(v8::Isolate* isolate, v8::Local<v8::Context> context);
+};
+
+static const Benchmark kBenchmarks[] = {
+    {"handle-alloc", BenchHandleAlloc},
+    {"global-handle", BenchGlobalHandle},
+    {"primitive-new", BenchPrimitiveNew},
+    {"transcode", BenchTranscode},
+    {"script-run", BenchScriptRun},
+    {"startup", BenchStartup},
+    {"module-graph", BenchModuleGraph},
+    {"first-frame", BenchFirstFrame},
+    {"context-pool", BenchContextPool},
+    {"global-template", BenchGlobalTemplate},
+    {"native-call", BenchNativeCall},
+    {"wrapper", BenchWrapper},
+    {"accessor", BenchAccessor},
+};
+
+static bool Selected(const char* name, int argc, char* argv[]) {
+    if (argc < 2) {
+        return true;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        for (size_t i = 0; i < sizeof(kBenchmarks) / sizeof(kBenchmarks[0]); i++) {
+            if (Selected(kBenchmarks[i].name_, argc, argv)) {
+                v8::HandleScope scope(isolate);
+                kBenchmarks[i].func_(isolate, context);
+            }
+        }
+    }
+    isolate->Dispose();
+    delete create_params.array_buffer_allocator;
+    return 0;
+}
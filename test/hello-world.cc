@@ -40,6 +40,10 @@ template <typename T> inline void __USE(T&&) {}
 
 int main(int argc, char* argv[]) {
     // Create a new Isolate and make it the current one.
+    // 由tools/mksnapshot生成，默认的空blob会被忽略
+    v8::StartupData snapshot_blob = {reinterpret_cast<const char*>(SnapshotBlobCode), (int)sizeof(SnapshotBlobCode)};
+    v8::V8::SetSnapshotDataBlob(&snapshot_blob);
+
     v8::Isolate::CreateParams create_params;
     create_params.array_buffer_allocator =
         v8::ArrayBuffer::Allocator::NewDefaultAllocator();
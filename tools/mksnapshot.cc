@@ -0,0 +1,92 @@
+// 生成启动快照，输出和include/Blob/*/SnapshotBlob.h一样格式的头文件
+//
+// 用法：mksnapshot <SnapshotBlob.h> [--data] script.js ...
+// 脚本按顺序在同一个context里执行，默认会记录下来在新context里重放；
+// 加了--data的脚本只执行一次，执行后global上新增的值直接序列化进blob，新context里不再执行。
+// 新增的值必须是纯数据，函数、顶层let/const/class等会报错退出，这些要放在重放的脚本里
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "libplatform/libplatform.h"
+#include "v8.h"
+
+static bool ReadFile(const char* path, std::string* content) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    *content = buffer.str();
+    return true;
+}
+
+static bool WriteBlobHeader(const char* path, const v8::StartupData& blob) {
+    FILE* out = fopen(path, "w");
+    if (out == nullptr) {
+        return false;
+    }
+    fprintf(out, "//generated by mksnapshot\n#pragma once\n\n#include <cstdint>\n\nstatic const uint8_t SnapshotBlobCode[] = {");
+    for (int i = 0; i < blob.raw_size; i++) {
+        fprintf(out, "%s0x%02x,", (i % 16) ? " " : "\n    ", (unsigned char)blob.data[i]);
+    }
+    fprintf(out, "\n};\n");
+    return fclose(out) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <SnapshotBlob.h> [--data] script.js ..." << std::endl;
+        return 1;
+    }
+
+    v8::StartupData blob = {nullptr, 0};
+    {
+        v8::SnapshotCreator creator;
+        v8::Isolate* isolate = creator.GetIsolate();
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        bool replay = true;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--data") == 0) {
+                replay = false;
+                continue;
+            }
+            std::string code;
+            if (!ReadFile(argv[i], &code)) {
+                std::cerr << "can not read " << argv[i] << std::endl;
+                return 1;
+            }
+            v8::TryCatch try_catch(isolate);
+            v8::Local<v8::String> source = v8::String::NewFromUtf8(isolate, code.c_str(), v8::NewStringType::kNormal,
+                                                                   (int)code.size()).ToLocalChecked();
+            v8::ScriptOrigin origin(v8::String::NewFromUtf8(isolate, argv[i]).ToLocalChecked());
+            if (creator.RunScript(context, source, &origin, replay).IsEmpty()) {
+                v8::String::Utf8Value error(isolate, try_catch.Exception());
+                std::cerr << argv[i] << ": " << *error << std::endl;
+                return 1;
+            }
+            replay = true;
+        }
+
+        creator.SetDefaultContext(context);
+        blob = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kClear);
+    }
+
+    bool ok = WriteBlobHeader(argv[1], blob);
+    delete[] blob.data;
+    if (!ok) {
+        std::cerr << "can not write " << argv[1] << std::endl;
+        return 1;
+    }
+    return 0;
+}